@@ -65,25 +65,36 @@ int F54Test::Prepare(f54_report_types reportType)
 	int retval;
 	unsigned char data;
 
-	retval = FindTestFunctions();
-	if (retval != TEST_SUCCESS)
-		return retval;
+	if (!LoadProfile()) {
+		std::vector<std::pair<void *, size_t> > regs;
 
-	retval = m_device.QueryBasicProperties();
-	if (retval < 0)
-		return TEST_FAIL_QUERY_BASIC_PROPERTIES;
+		// Registers the device does not have are decoded as zero
+		GetProfileRegisters(regs);
+		for (size_t i = 0; i < regs.size(); ++i)
+			memset(regs[i].first, 0, regs[i].second);
 
-	retval = ReadF54Queries();
-	if (retval != TEST_SUCCESS)
-		return retval;
+		retval = FindTestFunctions();
+		if (retval != TEST_SUCCESS)
+			return retval;
 
-	retval = SetupF54Controls();
-	if (retval != TEST_SUCCESS)
-		return retval;
+		retval = m_device.QueryBasicProperties();
+		if (retval < 0)
+			return TEST_FAIL_QUERY_BASIC_PROPERTIES;
 
-	retval = ReadF55Queries();
-	if (retval != TEST_SUCCESS)
-		return retval;
+		retval = ReadF54Queries();
+		if (retval != TEST_SUCCESS)
+			return retval;
+
+		retval = SetupF54Controls();
+		if (retval != TEST_SUCCESS)
+			return retval;
+
+		retval = ReadF55Queries();
+		if (retval != TEST_SUCCESS)
+			return retval;
+
+		SaveProfile();
+	}
 
 	retval = SetF54ReportType(reportType);
 	if (retval != TEST_SUCCESS)
@@ -246,6 +257,148 @@ int F54Test::SetF54ReportSize(f54_report_types report_type)
 	return TEST_SUCCESS;
 }
 
+#define F54_PROFILE_REGISTER(reg)	regs.push_back(std::make_pair((void *)&(reg), sizeof(reg)))
+
+/*
+ * The decoded F54 and F55 queries which are saved in the device profile. Of
+ * the control registers only the addresses are saved, their values can
+ * change and are always read from the device.
+ */
+void F54Test::GetProfileRegisters(std::vector<std::pair<void *, size_t> > &regs)
+{
+	regs.clear();
+	F54_PROFILE_REGISTER(m_f54Query);
+	F54_PROFILE_REGISTER(m_f54Query_13);
+	F54_PROFILE_REGISTER(m_f54Query_15);
+	F54_PROFILE_REGISTER(m_f54Query_16);
+	F54_PROFILE_REGISTER(m_f54Query_21);
+	F54_PROFILE_REGISTER(m_f54Query_22);
+	F54_PROFILE_REGISTER(m_f54Query_23);
+	F54_PROFILE_REGISTER(m_f54Query_25);
+	F54_PROFILE_REGISTER(m_f54Query_27);
+	F54_PROFILE_REGISTER(m_f54Query_29);
+	F54_PROFILE_REGISTER(m_f54Query_30);
+	F54_PROFILE_REGISTER(m_f54Query_32);
+	F54_PROFILE_REGISTER(m_f54Query_33);
+	F54_PROFILE_REGISTER(m_f54Query_35);
+	F54_PROFILE_REGISTER(m_f54Query_36);
+	F54_PROFILE_REGISTER(m_f54Query_38);
+	F54_PROFILE_REGISTER(m_f54Query_39);
+	F54_PROFILE_REGISTER(m_f54Query_40);
+	F54_PROFILE_REGISTER(m_f54Query_43);
+	F54_PROFILE_REGISTER(m_f54Query_46);
+	F54_PROFILE_REGISTER(m_f54Query_47);
+	F54_PROFILE_REGISTER(m_f54Query_49);
+	F54_PROFILE_REGISTER(m_f54Query_50);
+	F54_PROFILE_REGISTER(m_f54Query_51);
+	F54_PROFILE_REGISTER(m_f54Query_55);
+	F54_PROFILE_REGISTER(m_f54Query_57);
+	F54_PROFILE_REGISTER(m_f54Query_58);
+	F54_PROFILE_REGISTER(m_f54Query_61);
+	F54_PROFILE_REGISTER(m_f54Query_64);
+	F54_PROFILE_REGISTER(m_f54Query_65);
+	F54_PROFILE_REGISTER(m_f54Query_67);
+	F54_PROFILE_REGISTER(m_f54Query_68);
+	F54_PROFILE_REGISTER(m_f54Query_69);
+	F54_PROFILE_REGISTER(m_f54Control.reg_7.address);
+	F54_PROFILE_REGISTER(m_f54Control.reg_41.address);
+	F54_PROFILE_REGISTER(m_f54Control.reg_57.address);
+	F54_PROFILE_REGISTER(m_f54Control.reg_88.address);
+	F54_PROFILE_REGISTER(m_f54Control.reg_110.address);
+	F54_PROFILE_REGISTER(m_f54Control.reg_149.address);
+	F54_PROFILE_REGISTER(m_f54Control.reg_188.address);
+	F54_PROFILE_REGISTER(m_f55Query);
+	F54_PROFILE_REGISTER(m_txAssigned);
+	F54_PROFILE_REGISTER(m_rxAssigned);
+}
+
+bool F54Test::LoadProfile()
+{
+	std::vector<std::pair<void *, size_t> > regs;
+	std::vector<unsigned char> data;
+	std::vector<unsigned char> assignment;
+	size_t offset = 0;
+	unsigned char tx_electrodes;
+	unsigned char rx_electrodes;
+
+	if (m_profileDir.empty())
+		return false;
+
+	if (!m_device.LoadProfile(m_profileDir, m_profile, 0x00, 10))
+		return false;
+
+	if (!m_device.GetFunction(m_f01, 0x01)
+		|| !m_device.GetFunction(m_f54, 0x54)
+		|| !m_device.GetFunction(m_f55, 0x55))
+		return false;
+
+	if (!m_profile.GetSection("f54.registers", data)
+		|| !m_profile.GetSection("f55.assignment", assignment))
+		return false;
+
+	GetProfileRegisters(regs);
+	for (size_t i = 0; i < regs.size(); ++i)
+		offset += regs[i].second;
+	if (offset != data.size())
+		return false;
+
+	memset(&m_f54Control, 0, sizeof(m_f54Control));
+	offset = 0;
+	for (size_t i = 0; i < regs.size(); ++i) {
+		memcpy(regs[i].first, &data[offset], regs[i].second);
+		offset += regs[i].second;
+	}
+
+	if (m_txAssignment != NULL) delete [] m_txAssignment;
+	if (m_rxAssignment != NULL) delete [] m_rxAssignment;
+	m_txAssignment = NULL;
+	m_rxAssignment = NULL;
+
+	if (!m_f55Query.has_sensor_assignment)
+		return true;
+
+	tx_electrodes = m_f54Query.num_of_tx_electrodes;
+	rx_electrodes = m_f54Query.num_of_rx_electrodes;
+	if (assignment.size() != (size_t)tx_electrodes + rx_electrodes)
+		return false;
+
+	m_txAssignment = new unsigned char[tx_electrodes];
+	m_rxAssignment = new unsigned char[rx_electrodes];
+	memcpy(m_txAssignment, &assignment[0], tx_electrodes);
+	memcpy(m_rxAssignment, &assignment[tx_electrodes], rx_electrodes);
+
+	return true;
+}
+
+void F54Test::SaveProfile()
+{
+	std::vector<std::pair<void *, size_t> > regs;
+	std::vector<unsigned char> data;
+	std::vector<unsigned char> assignment;
+
+	if (m_profileDir.empty())
+		return;
+
+	GetProfileRegisters(regs);
+	for (size_t i = 0; i < regs.size(); ++i) {
+		unsigned char *reg = (unsigned char *)regs[i].first;
+		data.insert(data.end(), reg, reg + regs[i].second);
+	}
+
+	if (m_txAssignment && m_rxAssignment) {
+		assignment.insert(assignment.end(), m_txAssignment,
+				m_txAssignment + m_f54Query.num_of_tx_electrodes);
+		assignment.insert(assignment.end(), m_rxAssignment,
+				m_rxAssignment + m_f54Query.num_of_rx_electrodes);
+	}
+
+	m_profile.Clear();
+	m_profile.SetSection("f54.registers", &data[0], data.size());
+	m_profile.SetSection("f55.assignment", assignment.empty() ? NULL : &assignment[0],
+				assignment.size());
+	m_device.SaveProfile(m_profileDir, m_profile, 0x00, 10);
+}
+
 int F54Test::FindTestFunctions()
 {
 	if (0 > m_device.ScanPDT(0x00, 10))
@@ -1704,6 +1857,7 @@ int F54Test::ReadF54Report()
 {
 	int retval;
 	unsigned char report_index[2];
+	int bytesPerRequest = m_readRequestSize;
 
 	if (m_reportBufferSize < m_reportSize) {
 		if (m_reportData != NULL)
@@ -1727,9 +1881,17 @@ int F54Test::ReadF54Report()
 	if (retval < 0)
 		goto exit;
 
-	retval = m_device.Read(m_f54.GetDataBase() + REPORT_DATA_OFFSET,
+	// The report data register is a FIFO which returns the next bytes of
+	// the report on every read
+	if (!bytesPerRequest && m_readPipelineDepth > 1)
+		bytesPerRequest = 2 * m_rxAssigned;
+	m_device.SetBytesPerReadRequest(bytesPerRequest);
+	m_device.SetReadPipelineDepth(m_readPipelineDepth);
+	retval = m_device.ReadFifo(m_f54.GetDataBase() + REPORT_DATA_OFFSET,
 				m_reportData,
 				m_reportSize);
+	m_device.SetBytesPerReadRequest(0);
+	m_device.SetReadPipelineDepth(1);
 	if (retval < 0)
 		goto exit;
 
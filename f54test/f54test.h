@@ -959,11 +959,20 @@ public:
 		m_rxAssignment(NULL),
 		m_reportBufferSize(0),
 		m_reportData(NULL),
-		m_display(display)
+		m_display(display),
+		m_readPipelineDepth(1),
+		m_readRequestSize(0)
 	{}
 	~F54Test();
 	int Prepare(f54_report_types reportType);
 	int Run();
+	// Load and save the register map in a device profile in dir
+	void SetProfileDir(const std::string &dir) { m_profileDir = dir; }
+	// Split reads of the report data into requests of bytes and keep up
+	// to depth of them outstanding. bytes defaults to a row of 16 bit
+	// values when depth is more than 1.
+	void SetReadPipeline(int depth, int bytes)
+	{ m_readPipelineDepth = depth; m_readRequestSize = bytes; }
 
 private:
 	int FindTestFunctions();
@@ -978,6 +987,9 @@ private:
 	int ReadF54Report();
 	int ShowF54Report();
 	int DoPreparation();
+	void GetProfileRegisters(std::vector<std::pair<void *, size_t> > &regs);
+	bool LoadProfile();
+	void SaveProfile();
 
 private:
 	RMIDevice & m_device;
@@ -1036,6 +1048,12 @@ private:
 	unsigned char *m_reportData;
 
 	Display & m_display;
+
+	std::string m_profileDir;
+	DeviceProfile m_profile;
+
+	int m_readPipelineDepth;
+	int m_readRequestSize;
 };
 
 #endif // _F54TEST_H_
@@ -31,10 +31,13 @@
 #include <signal.h>
 
 #include "hiddevice.h"
+#include "simdevice.h"
+#include "tracedevice.h"
+#include "replaydevice.h"
 #include "f54test.h"
 #include "display.h"
 
-#define F54TEST_GETOPTS	"hd:r:cnt:"
+#define F54TEST_GETOPTS	"hd:r:cnt:ukos:R:P:TLq:"
 
 static bool stopRequested;
 
@@ -47,9 +50,32 @@ void printHelp(const char *prog_name)
 	fprintf(stdout, "\t-c, --continuous\tContinuous mode.\n");
 	fprintf(stdout, "\t-n, --no_reset\tDo not reset after the report.\n");
 	fprintf(stdout, "\t-t, --device-type\t\t\tFilter by device type [touchpad or touchscreen].\n");
+	fprintf(stdout, "\t-u, --io-uring\tSend and receive reports through io_uring.\n");
+	fprintf(stdout, "\t-k, --reg-cache\tCache query registers instead of reading them again.\n");
+	fprintf(stdout, "\t-o, --profile-cache\tReuse the register map saved by an earlier run.\n");
+	fprintf(stdout, "\t-s, --simulate\tTest a simulated device configured by a list of options.\n");
+	fprintf(stdout, "\t-R, --record-trace\tRecord every access to the device to a trace file.\n");
+	fprintf(stdout, "\t-P, --replay-trace\tPlay back a trace file instead of using a device.\n");
+	fprintf(stdout, "\t-T, --replay-timing\tPlay back the trace at the recorded timing.\n");
+	fprintf(stdout, "\t-L, --latency-stats\tPrint transport latency statistics on exit and on SIGUSR1.\n");
+	fprintf(stdout, "\t-q, --read-pipeline\tRead the report in requests of bytes, depth of them at once [depth[,bytes]].\n");
 }
 
-int RunF54Test(RMIDevice & rmidevice, f54_report_types reportType, bool continuousMode, bool noReset)
+// Parses depth[,bytes] for -q
+bool ParseReadPipeline(const char *arg, int *depth, int *bytes)
+{
+	char *end;
+
+	*depth = strtol(arg, &end, 0);
+	*bytes = 0;
+	if (*end == ',')
+		*bytes = strtol(end + 1, &end, 0);
+
+	return !*end && *depth > 0 && *bytes >= 0 && *bytes <= 0xFFFF;
+}
+
+int RunF54Test(RMIDevice & rmidevice, f54_report_types reportType, bool continuousMode, bool noReset,
+		const std::string & profileDir, int readPipelineDepth, int readRequestSize)
 {
 	int rc;
 	Display * display;
@@ -66,6 +92,8 @@ int RunF54Test(RMIDevice & rmidevice, f54_report_types reportType, bool continuo
 	display->Clear();
 
 	F54Test f54Test(rmidevice, *display);
+	f54Test.SetProfileDir(profileDir);
+	f54Test.SetReadPipeline(readPipelineDepth, readRequestSize);
 
 	rc = f54Test.Prepare(reportType);
 	if (rc)
@@ -104,13 +132,31 @@ int main(int argc, char **argv)
 		{"continuous", 0, NULL, 'c'},
 		{"no_reset", 0, NULL, 'n'},
 		{"device-type", 1, NULL, 't'},
+		{"io-uring", 0, NULL, 'u'},
+		{"reg-cache", 0, NULL, 'k'},
+		{"profile-cache", 0, NULL, 'o'},
+		{"simulate", 1, NULL, 's'},
+		{"record-trace", 1, NULL, 'R'},
+		{"replay-trace", 1, NULL, 'P'},
+		{"replay-timing", 0, NULL, 'T'},
+		{"latency-stats", 0, NULL, 'L'},
+		{"read-pipeline", 1, NULL, 'q'},
 		{0, 0, 0, 0},
 	};
 	f54_report_types reportType = F54_16BIT_IMAGE;
 	bool continuousMode = false;
 	bool noReset = false;
-	HIDDevice device;
+	HIDDevice hidDevice;
+	SimDevice simDevice;
+	ReplayDevice replayDevice;
+	RMIDevice *device = &hidDevice;
+	const char *traceName = NULL;
+	bool useRegisterCache = false;
+	bool printLatencyStats = false;
 	enum RMIDeviceType deviceType = RMI_DEVICE_TYPE_ANY;
+	std::string profileDir;
+	int readPipelineDepth = 1;
+	int readRequestSize = 0;
 
 	while ((opt = getopt_long(argc, argv, F54TEST_GETOPTS, long_options, &index)) != -1) {
 		switch (opt) {
@@ -135,6 +181,38 @@ int main(int argc, char **argv)
 				else if (!strcasecmp(optarg, "touchscreen"))
 					deviceType = RMI_DEVICE_TYPE_TOUCHSCREEN;
 				break;
+			case 'u':
+				hidDevice.EnableIoUring(true);
+				break;
+			case 'k':
+				useRegisterCache = true;
+				break;
+			case 'o':
+				profileDir = DeviceProfile::GetDefaultDir();
+				break;
+			case 's':
+				deviceName = optarg;
+				device = &simDevice;
+				break;
+			case 'R':
+				traceName = optarg;
+				break;
+			case 'P':
+				deviceName = optarg;
+				device = &replayDevice;
+				break;
+			case 'T':
+				replayDevice.SetRealTime(true);
+				break;
+			case 'L':
+				printLatencyStats = true;
+				break;
+			case 'q':
+				if (!ParseReadPipeline(optarg, &readPipelineDepth, &readRequestSize)) {
+					fprintf(stderr, "Invalid read pipeline: %s\n", optarg);
+					return 1;
+				}
+				break;
 			default:
 				break;
 
@@ -148,17 +226,38 @@ int main(int argc, char **argv)
 		signal(SIGTERM, SignalHandler);
 	}
 
+	TraceDevice traceDevice(*device);
+	if (traceName) {
+		if (traceDevice.StartTrace(traceName) < 0) {
+			fprintf(stderr, "Failed to create trace file %s: %s\n", traceName,
+				strerror(errno));
+			return 1;
+		}
+		device = &traceDevice;
+	}
+
+	device->EnableRegisterCache(useRegisterCache);
+	hidDevice.EnableLatencyStats(printLatencyStats);
+	if (printLatencyStats)
+		hidDevice.GetLatencyStats().PrintOnSignal(SIGUSR1);
+
 	if (deviceName) {
-		rc = device.Open(deviceName);
+		rc = device->Open(deviceName);
 		if (rc) {
 			fprintf(stderr, "%s: failed to initialize rmi device (%d): %s\n", argv[0], errno,
 				strerror(errno));
 			return 1;
 		}
 	} else {
-		if (!device.FindDevice(deviceType))
+		if (!device->FindDevice(deviceType))
 			return 1;
 	}
 
-	return RunF54Test(device, reportType, continuousMode, noReset);
+	rc = RunF54Test(*device, reportType, continuousMode, noReset, profileDir,
+			readPipelineDepth, readRequestSize);
+
+	if (printLatencyStats)
+		hidDevice.GetLatencyStats().Print(stdout);
+
+	return rc;
 }
@@ -3,7 +3,7 @@ include $(CLEAR_VARS)
 
 LOCAL_MODULE := rmi4update
 LOCAL_C_INCLUDES := rmidevice
-LOCAL_SRC_FILES := main.cpp rmi4update.cpp updateutil.cpp firmware_image.cpp
+LOCAL_SRC_FILES := main.cpp rmi4update.cpp updateutil.cpp firmware_image.cpp updatejournal.cpp fleetupdate.cpp updatetiming.cpp checksum.cpp imagevalidator.cpp imagecatalog.cpp
 LOCAL_CPPFLAGS := -Wall
 LOCAL_STATIC_LIBRARIES := rmidevice
 
@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/*
+ * Builds an ImageCatalog over hierarchical images written to a temporary
+ * directory and checks that the saved index is reused while an image's
+ * mtime and size stay the same, that a change to either loads the image
+ * again, and which image FindNewest() picks for each product and device.
+ *
+ * An image rewritten with its old size and mtime is how the test tells a
+ * reused entry from a reloaded one: only a reload sees the new build ID.
+ *
+ * Built and run by "make check".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+
+#include "firmware_image.h"
+#include "imagecatalog.h"
+
+#define CATALOGTEST_THREADS		4
+
+static unsigned int checks;
+static unsigned int failures;
+
+static void check(bool ok, const char *what)
+{
+	++checks;
+	if (ok)
+		return;
+
+	++failures;
+	fprintf(stderr, "failed: %s\n", what);
+}
+
+static std::string image_path(const std::string &dir, const char *name)
+{
+	return dir + "/" + name;
+}
+
+static bool write_image(const std::string &path, const char *productID, unsigned long buildID,
+			unsigned char bootloaderVersion, unsigned long firmwareSize,
+			unsigned long configSize)
+{
+	std::vector<struct image_container> containers;
+	struct image_container container;
+
+	container.id = BL_CONTAINER;
+	container.content.assign(1, bootloaderVersion);
+	containers.push_back(container);
+
+	container.id = GENERAL_INFORMATION_CONTAINER;
+	container.content.assign(RMI_IMG_GENERAL_INFO_SIZE, 0);
+	for (int i = 0; i < 4; ++i)
+		container.content[4 + i] = (buildID >> (i * 8)) & 0xFF;
+	memcpy(&container.content[RMI_IMG_GENERAL_INFO_PRODUCT_ID_OFFSET], productID,
+		strnlen(productID, RMI_PRODUCT_ID_LENGTH));
+	containers.push_back(container);
+
+	container.id = CORE_CODE_CONTAINER;
+	container.content.assign(firmwareSize, buildID & 0xFF);
+	containers.push_back(container);
+
+	container.id = CORE_CONFIG_CONTAINER;
+	container.content.assign(configSize, 0x5a);
+	containers.push_back(container);
+
+	return FirmwareImage::WriteHierarchicalImage(path.c_str(), containers) == UPDATE_SUCCESS;
+}
+
+// Give path the mtime of another file, so only its contents differ
+static bool copy_mtime(const std::string &from, const std::string &path)
+{
+	struct stat st;
+	struct timespec times[2];
+
+	if (stat(from.c_str(), &st) < 0)
+		return false;
+
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+	return utimensat(AT_FDCWD, path.c_str(), times, 0) == 0;
+}
+
+static bool set_mtime(const std::string &path, time_t sec)
+{
+	struct timespec times[2];
+
+	times[0].tv_sec = times[1].tv_sec = sec;
+	times[0].tv_nsec = times[1].tv_nsec = 0;
+	return utimensat(AT_FDCWD, path.c_str(), times, 0) == 0;
+}
+
+static const struct catalog_entry *find_entry(ImageCatalog &catalog, const char *name)
+{
+	const std::vector<struct catalog_entry> &entries = catalog.GetEntries();
+
+	for (size_t i = 0; i < entries.size(); ++i)
+		if (entries[i].name == name)
+			return &entries[i];
+
+	return NULL;
+}
+
+static bool is_entry(const struct catalog_entry *entry, const char *name)
+{
+	return entry && entry->name == name;
+}
+
+static unsigned long build_of(ImageCatalog &catalog, const char *name)
+{
+	const struct catalog_entry *entry = find_entry(catalog, name);
+
+	return entry ? entry->buildID : 0;
+}
+
+static struct catalog_device make_device(const char *productID, unsigned char bootloaderVersion,
+					unsigned long firmwareSize, unsigned long configSize)
+{
+	struct catalog_device device;
+
+	device.productID = productID;
+	device.bootloaderVersion = bootloaderVersion;
+	device.firmwareSize = firmwareSize;
+	device.configSize = configSize;
+
+	return device;
+}
+
+static void check_scan(const std::string &dir)
+{
+	ImageCatalog catalog(dir);
+	struct stat st;
+	FILE *fp;
+
+	check(write_image(image_path(dir, "a.img"), "PRODA", 10, 8, 1024, 256)
+		&& write_image(image_path(dir, "b.img"), "PRODA", 20, 8, 2048, 256)
+		&& write_image(image_path(dir, "c.img"), "PRODA", 30, 10, 1024, 256)
+		&& write_image(image_path(dir, "d.img"), "PRODB", 5, 8, 1024, 256),
+		"writing the images");
+
+	fp = fopen(image_path(dir, "bad.img").c_str(), "w");
+	if (fp) {
+		fputs("not an image", fp);
+		fclose(fp);
+	}
+	fp = fopen(image_path(dir, "notes.txt").c_str(), "w");
+	if (fp)
+		fclose(fp);
+
+	check(catalog.Scan(CATALOGTEST_THREADS) == 5, "first scan finds the five .img files");
+	check(stat(image_path(dir, IMAGE_CATALOG_INDEX_NAME).c_str(), &st) == 0,
+		"first scan saves the index");
+	check(find_entry(catalog, "bad.img") && find_entry(catalog, "bad.img")->rc != UPDATE_SUCCESS,
+		"an invalid image is listed with its error");
+	check(!find_entry(catalog, "notes.txt"), "files without the .img suffix are skipped");
+	check(build_of(catalog, "b.img") == 20, "build ID of b.img");
+	check(find_entry(catalog, "c.img") && find_entry(catalog, "c.img")->bootloaderVersion == 10,
+		"bootloader version of c.img");
+	check(find_entry(catalog, "a.img") && find_entry(catalog, "a.img")->firmwareSize == 1024
+		&& find_entry(catalog, "a.img")->configSize == 256, "partition sizes of a.img");
+
+	check(is_entry(catalog.FindNewest("PRODA"), "c.img"), "newest of PRODA");
+	check(is_entry(catalog.FindNewest("PRODB"), "d.img"), "newest of PRODB");
+	check(!catalog.FindNewest("PRODC"), "no image for PRODC");
+
+	check(is_entry(catalog.FindNewest(make_device("PRODA", 8, 1024, 256)), "a.img"),
+		"BL v8 device with a.img's partitions");
+	check(is_entry(catalog.FindNewest(make_device("PRODA", 8, 2048, 256)), "b.img"),
+		"BL v8 device with b.img's partitions");
+	check(!catalog.FindNewest(make_device("PRODA", 8, 4096, 256)),
+		"BL v8 device needs partitions of the same size");
+	check(is_entry(catalog.FindNewest(make_device("PRODA", 10, 4096, 512)), "c.img"),
+		"BL v10 device with larger partitions");
+	check(!catalog.FindNewest(make_device("PRODA", 10, 512, 256)),
+		"BL v10 device with a partition too small");
+	check(!catalog.FindNewest(make_device("PRODA", 7, 1024, 256)),
+		"BL v7 device has no image");
+	check(is_entry(catalog.FindNewest(make_device("PRODB", 8, 1024, 256)), "d.img"),
+		"BL v8 PRODB device");
+}
+
+static void check_rescan(const std::string &dir)
+{
+	std::string a = image_path(dir, "a.img");
+	std::string d = image_path(dir, "d.img");
+	std::string scratch = image_path(dir, "scratch");
+
+	// Same size and mtime: the saved entry is reused
+	rename(a.c_str(), scratch.c_str());
+	check(write_image(a, "PRODA", 11, 8, 1024, 256) && copy_mtime(scratch, a),
+		"rewriting a.img with its old size and mtime");
+	unlink(scratch.c_str());
+	{
+		ImageCatalog catalog(dir);
+
+		check(catalog.Scan(CATALOGTEST_THREADS) == 5, "second scan");
+		check(build_of(catalog, "a.img") == 10, "unchanged a.img comes from the index");
+	}
+
+	// A new mtime loads the image again
+	check(set_mtime(a, 1000000000), "changing the mtime of a.img");
+	{
+		ImageCatalog catalog(dir);
+
+		check(catalog.Scan(CATALOGTEST_THREADS) == 5, "scan after touching a.img");
+		check(build_of(catalog, "a.img") == 11, "a.img is loaded again after an mtime change");
+	}
+
+	// So does a new size with the old mtime
+	rename(d.c_str(), scratch.c_str());
+	check(write_image(d, "PRODB", 6, 8, 2048, 256) && copy_mtime(scratch, d),
+		"rewriting d.img with a new size and its old mtime");
+	unlink(scratch.c_str());
+	{
+		ImageCatalog catalog(dir);
+
+		check(catalog.Scan(CATALOGTEST_THREADS) == 5, "scan after resizing d.img");
+		check(build_of(catalog, "d.img") == 6, "d.img is loaded again after a size change");
+		check(build_of(catalog, "a.img") == 11, "a.img's new entry was saved to the index");
+		check(is_entry(catalog.FindNewest(make_device("PRODB", 8, 2048, 256)), "d.img"),
+			"resized d.img fits a device with its new size");
+		check(!catalog.FindNewest(make_device("PRODB", 8, 1024, 256)),
+			"resized d.img no longer fits the old size");
+	}
+}
+
+static void remove_dir(const std::string &dir)
+{
+	static const char *names[] = {
+		"a.img", "b.img", "c.img", "d.img", "bad.img", "notes.txt", "scratch",
+		IMAGE_CATALOG_INDEX_NAME,
+	};
+
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+		unlink(image_path(dir, names[i]).c_str());
+	rmdir(dir.c_str());
+}
+
+int main()
+{
+	const char *tmp = getenv("TMPDIR");
+	std::string templ = std::string(tmp && tmp[0] ? tmp : "/tmp") + "/catalogtest.XXXXXX";
+	std::vector<char> dir(templ.begin(), templ.end());
+
+	dir.push_back('\0');
+	if (!mkdtemp(&dir[0])) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	check_scan(&dir[0]);
+	check_rescan(&dir[0]);
+	remove_dir(&dir[0]);
+
+	fprintf(stdout, "%u checks, %u failed\n", checks, failures);
+
+	return failures ? 1 : 0;
+}
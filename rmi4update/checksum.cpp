@@ -0,0 +1,374 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define CHECKSUM_HAS_AVX2
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "checksum.h"
+
+/*
+ * Both halves of the checksum start at 0xFFFF and are folded back into 16
+ * bits after every word, which keeps lsw in 1..0xFFFF. That makes them the
+ * sums below modulo 65535, with 0 written as 0xFFFF:
+ *	lsw = sum of w[i]
+ *	msw = sum of (len - i) * w[i]
+ * msw has lsw added before lsw is folded, so it can end up as 0x10000 in
+ * place of 1, see checksum_wrap(). The vector versions add up blocks of
+ * words in 32 bit lanes and only reduce the totals once per block.
+ */
+#define CHECKSUM_MOD		65535
+
+/*
+ * Each block adds at most CHECKSUM_BLOCK_VECTORS * (CHECKSUM_BLOCK_VECTORS - 1) / 2
+ * times 0xFFFF to a lane of the weighted sum, which has to fit in 32 bits.
+ */
+#define CHECKSUM_BLOCK_VECTORS	256
+
+struct checksum_state {
+	uint64_t a;	// sum of the words so far
+	uint64_t b;	// sum of the running values of a
+	bool wrapped;	// msw is 0x10000 rather than 1
+};
+
+static unsigned long checksum_fold(uint64_t sum)
+{
+	return sum ? sum : 0xFFFF;
+}
+
+static unsigned long checksum_finish(const struct checksum_state *state)
+{
+	unsigned long lsw = checksum_fold(state->a % CHECKSUM_MOD);
+	unsigned long msw = checksum_fold(state->b % CHECKSUM_MOD);
+
+	if (state->wrapped)
+		msw = 0x10000;
+
+	return msw << 16 | lsw;
+}
+
+/*
+ * Works out whether the scalar version would leave msw as 0x10000 after
+ * the len words just added to the reduced sums in state. Adding a word
+ * folds msw + lsw + w, which gives 0x10000 whenever msw ends up 1 unless
+ * that total is exactly 0x10000. That happens only if msw was 1 before,
+ * so the words are walked back from the end while it does, falling back
+ * to state->wrapped from before the words.
+ */
+static void checksum_wrap(struct checksum_state *state, const unsigned short *data,
+				unsigned long len)
+{
+	uint64_t a = state->a;
+	uint64_t b = state->b;
+	uint64_t prevA;
+	uint64_t prevB;
+
+	while (len) {
+		if (b != 1) {
+			state->wrapped = false;
+			return;
+		}
+
+		prevA = (a + CHECKSUM_MOD - data[--len] % CHECKSUM_MOD) % CHECKSUM_MOD;
+		prevB = (b + CHECKSUM_MOD - a) % CHECKSUM_MOD;
+		if (checksum_fold(prevB) + checksum_fold(prevA) + data[len] != 0x10000) {
+			state->wrapped = true;
+			return;
+		}
+		a = prevA;
+		b = prevB;
+	}
+}
+
+static void checksum_words(struct checksum_state *state, const unsigned short *data,
+				unsigned long len)
+{
+	while (len--) {
+		state->a += *data++;
+		state->b += state->a;
+	}
+	state->a %= CHECKSUM_MOD;
+	state->b %= CHECKSUM_MOD;
+}
+
+/*
+ * Adds a block of words which the vector version has summed per lane:
+ * sums[l] is the total of the words in lane l and prefix[l] the total of
+ * lane l over the vectors before each vector of the block.
+ */
+static void checksum_block(struct checksum_state *state, const uint32_t *sums,
+				const uint32_t *prefix, unsigned int lanes, unsigned long words)
+{
+	uint64_t a = 0;
+	uint64_t b = 0;
+
+	for (unsigned int l = 0; l < lanes; ++l) {
+		a += sums[l];
+		b += (uint64_t)(lanes - l) * sums[l] + (uint64_t)lanes * prefix[l];
+	}
+
+	state->b = (state->b + (words % CHECKSUM_MOD) * state->a + b) % CHECKSUM_MOD;
+	state->a = (state->a + a) % CHECKSUM_MOD;
+}
+
+unsigned long image_checksum_scalar(const unsigned short *data, unsigned long len)
+{
+	unsigned long checksum = 0xFFFFFFFF;
+	unsigned long lsw = checksum & 0xFFFF;
+	unsigned long msw = checksum >> 16;
+
+	while (len--) {
+		lsw += *data++;
+		msw += lsw;
+		lsw = (lsw & 0xffff) + (lsw >> 16);
+		msw = (msw & 0xffff) + (msw >> 16);
+	}
+
+	checksum = msw << 16 | lsw;
+
+	return checksum;
+}
+
+#if defined(__SSE2__)
+static void checksum_sse2(struct checksum_state *state, const unsigned short *data,
+				unsigned long len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	uint32_t sums[8];
+	uint32_t prefix[8];
+
+	while (len >= 8) {
+		unsigned long vectors = len / 8;
+		__m128i sumLo = zero, sumHi = zero;
+		__m128i prefixLo = zero, prefixHi = zero;
+
+		if (vectors > CHECKSUM_BLOCK_VECTORS)
+			vectors = CHECKSUM_BLOCK_VECTORS;
+
+		for (unsigned long v = 0; v < vectors; ++v) {
+			__m128i words = _mm_loadu_si128((const __m128i *)(data + v * 8));
+
+			prefixLo = _mm_add_epi32(prefixLo, sumLo);
+			prefixHi = _mm_add_epi32(prefixHi, sumHi);
+			sumLo = _mm_add_epi32(sumLo, _mm_unpacklo_epi16(words, zero));
+			sumHi = _mm_add_epi32(sumHi, _mm_unpackhi_epi16(words, zero));
+		}
+
+		_mm_storeu_si128((__m128i *)&sums[0], sumLo);
+		_mm_storeu_si128((__m128i *)&sums[4], sumHi);
+		_mm_storeu_si128((__m128i *)&prefix[0], prefixLo);
+		_mm_storeu_si128((__m128i *)&prefix[4], prefixHi);
+		checksum_block(state, sums, prefix, 8, vectors * 8);
+
+		data += vectors * 8;
+		len -= vectors * 8;
+	}
+
+	checksum_words(state, data, len);
+}
+
+bool image_checksum_sse2(const unsigned short *data, unsigned long len, unsigned long *checksum)
+{
+	struct checksum_state state = { 0, 0, false };
+
+	checksum_sse2(&state, data, len);
+	checksum_wrap(&state, data, len);
+	*checksum = checksum_finish(&state);
+
+	return true;
+}
+#else
+bool image_checksum_sse2(const unsigned short *, unsigned long, unsigned long *)
+{
+	return false;
+}
+#endif
+
+#if defined(CHECKSUM_HAS_AVX2)
+__attribute__((target("avx2")))
+static void checksum_avx2(struct checksum_state *state, const unsigned short *data,
+				unsigned long len)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	uint32_t sums[16];
+	uint32_t prefix[16];
+
+	while (len >= 16) {
+		unsigned long vectors = len / 16;
+		__m256i sumLo = zero, sumHi = zero;
+		__m256i prefixLo = zero, prefixHi = zero;
+
+		if (vectors > CHECKSUM_BLOCK_VECTORS)
+			vectors = CHECKSUM_BLOCK_VECTORS;
+
+		for (unsigned long v = 0; v < vectors; ++v) {
+			const __m128i *words = (const __m128i *)(data + v * 16);
+
+			prefixLo = _mm256_add_epi32(prefixLo, sumLo);
+			prefixHi = _mm256_add_epi32(prefixHi, sumHi);
+			sumLo = _mm256_add_epi32(sumLo, _mm256_cvtepu16_epi32(_mm_loadu_si128(words)));
+			sumHi = _mm256_add_epi32(sumHi,
+						_mm256_cvtepu16_epi32(_mm_loadu_si128(words + 1)));
+		}
+
+		_mm256_storeu_si256((__m256i *)&sums[0], sumLo);
+		_mm256_storeu_si256((__m256i *)&sums[8], sumHi);
+		_mm256_storeu_si256((__m256i *)&prefix[0], prefixLo);
+		_mm256_storeu_si256((__m256i *)&prefix[8], prefixHi);
+		checksum_block(state, sums, prefix, 16, vectors * 16);
+
+		data += vectors * 16;
+		len -= vectors * 16;
+	}
+
+	checksum_words(state, data, len);
+}
+
+bool image_checksum_avx2(const unsigned short *data, unsigned long len, unsigned long *checksum)
+{
+	struct checksum_state state = { 0, 0, false };
+
+	if (!__builtin_cpu_supports("avx2"))
+		return false;
+
+	checksum_avx2(&state, data, len);
+	checksum_wrap(&state, data, len);
+	*checksum = checksum_finish(&state);
+
+	return true;
+}
+#else
+bool image_checksum_avx2(const unsigned short *, unsigned long, unsigned long *)
+{
+	return false;
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static void checksum_neon(struct checksum_state *state, const unsigned short *data,
+				unsigned long len)
+{
+	uint32_t sums[8];
+	uint32_t prefix[8];
+
+	while (len >= 8) {
+		unsigned long vectors = len / 8;
+		uint32x4_t sumLo = vdupq_n_u32(0), sumHi = vdupq_n_u32(0);
+		uint32x4_t prefixLo = vdupq_n_u32(0), prefixHi = vdupq_n_u32(0);
+
+		if (vectors > CHECKSUM_BLOCK_VECTORS)
+			vectors = CHECKSUM_BLOCK_VECTORS;
+
+		for (unsigned long v = 0; v < vectors; ++v) {
+			uint16x8_t words = vld1q_u16(data + v * 8);
+
+			prefixLo = vaddq_u32(prefixLo, sumLo);
+			prefixHi = vaddq_u32(prefixHi, sumHi);
+			sumLo = vaddw_u16(sumLo, vget_low_u16(words));
+			sumHi = vaddw_u16(sumHi, vget_high_u16(words));
+		}
+
+		vst1q_u32(&sums[0], sumLo);
+		vst1q_u32(&sums[4], sumHi);
+		vst1q_u32(&prefix[0], prefixLo);
+		vst1q_u32(&prefix[4], prefixHi);
+		checksum_block(state, sums, prefix, 8, vectors * 8);
+
+		data += vectors * 8;
+		len -= vectors * 8;
+	}
+
+	checksum_words(state, data, len);
+}
+
+bool image_checksum_neon(const unsigned short *data, unsigned long len, unsigned long *checksum)
+{
+	struct checksum_state state = { 0, 0, false };
+
+	checksum_neon(&state, data, len);
+	checksum_wrap(&state, data, len);
+	*checksum = checksum_finish(&state);
+
+	return true;
+}
+#else
+bool image_checksum_neon(const unsigned short *, unsigned long, unsigned long *)
+{
+	return false;
+}
+#endif
+
+// Adds len words to state with the widest vector unit the CPU has
+static void checksum_sums(struct checksum_state *state, const unsigned short *data,
+				unsigned long len)
+{
+#if defined(CHECKSUM_HAS_AVX2)
+	if (__builtin_cpu_supports("avx2")) {
+		checksum_avx2(state, data, len);
+		return;
+	}
+#endif
+#if defined(__SSE2__)
+	checksum_sse2(state, data, len);
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	checksum_neon(state, data, len);
+#else
+	checksum_words(state, data, len);
+#endif
+}
+
+static void checksum_update(struct checksum_state *state, const unsigned short *data,
+				unsigned long len)
+{
+	checksum_sums(state, data, len);
+	checksum_wrap(state, data, len);
+}
+
+unsigned long image_checksum(const unsigned short *data, unsigned long len)
+{
+	ImageChecksum checksum;
+
+	checksum.Update(data, len);
+
+	return checksum.Get();
+}
+
+void ImageChecksum::Update(const unsigned short *data, unsigned long len)
+{
+	struct checksum_state state = { m_a, m_b, m_wrapped };
+
+	checksum_update(&state, data, len);
+	m_a = state.a;
+	m_b = state.b;
+	m_wrapped = state.wrapped;
+}
+
+unsigned long ImageChecksum::Get() const
+{
+	struct checksum_state state = { m_a, m_b, m_wrapped };
+
+	return checksum_finish(&state);
+}
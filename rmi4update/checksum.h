@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CHECKSUM_H_
+#define _CHECKSUM_H_
+
+#include <stdint.h>
+
+/*
+ * The Fletcher-32 style checksum of an image, over len 16 bit words.
+ * image_checksum() uses the widest vector unit the CPU has, the other
+ * versions are exposed so they can be compared against each other.
+ */
+unsigned long image_checksum(const unsigned short *data, unsigned long len);
+
+// Folds after every word, the way the checksum has always been computed
+unsigned long image_checksum_scalar(const unsigned short *data, unsigned long len);
+// Vector versions, they return false if the CPU does not support them
+bool image_checksum_sse2(const unsigned short *data, unsigned long len, unsigned long *checksum);
+bool image_checksum_avx2(const unsigned short *data, unsigned long len, unsigned long *checksum);
+bool image_checksum_neon(const unsigned short *data, unsigned long len, unsigned long *checksum);
+
+/*
+ * Computes the same checksum a piece at a time, for images which are
+ * checked as they are read. Each piece has to be a whole number of words.
+ */
+class ImageChecksum
+{
+public:
+	ImageChecksum() : m_a(0), m_b(0), m_wrapped(false) {}
+
+	void Update(const unsigned short *data, unsigned long len);
+	unsigned long Get() const;
+
+private:
+	// The two sums reduced modulo 65535, see checksum.cpp
+	uint64_t m_a;
+	uint64_t m_b;
+	bool m_wrapped;
+};
+
+#endif // _CHECKSUM_H_
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/*
+ * Checks every vector version of the image checksum the CPU supports, and
+ * the piecewise ImageChecksum, against image_checksum_scalar(). The lengths
+ * cover either side of each vector width and of each block of
+ * CHECKSUM_BLOCK_VECTORS vectors, where the vector versions reduce their
+ * sums, and the patterns include all 0xFFFF, which makes the sums largest,
+ * and runs which leave the scalar msw at 0x10000.
+ *
+ * Built and run by "make check".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "checksum.h"
+
+#define CHECKSUMTEST_BLOCK_VECTORS	256
+#define CHECKSUMTEST_RANDOM_LENGTHS	200
+#define CHECKSUMTEST_MAX_LENGTH		(4 * CHECKSUMTEST_BLOCK_VECTORS * 16 + 64)
+
+enum checksumtest_pattern {
+	CHECKSUMTEST_RANDOM = 0,
+	CHECKSUMTEST_ONES,
+	CHECKSUMTEST_ZEROS,
+	CHECKSUMTEST_ALTERNATING,
+	CHECKSUMTEST_WRAPPED,
+	CHECKSUMTEST_PATTERNS,
+};
+
+static const char *pattern_names[CHECKSUMTEST_PATTERNS] = {
+	"random", "0xffff", "0x0000", "0xffff/0x0001", "0x0001 0xfffe 0x0000...",
+};
+
+typedef bool (*vector_checksum)(const unsigned short *, unsigned long, unsigned long *);
+
+static const struct {
+	const char *name;
+	vector_checksum checksum;
+} vector_versions[] = {
+	{ "sse2", image_checksum_sse2 },
+	{ "avx2", image_checksum_avx2 },
+	{ "neon", image_checksum_neon },
+};
+
+static unsigned int checks;
+static unsigned int failures;
+
+static void fill(std::vector<unsigned short> &buf, enum checksumtest_pattern pattern)
+{
+	for (size_t i = 0; i < buf.size(); ++i) {
+		switch (pattern) {
+			case CHECKSUMTEST_RANDOM:
+				buf[i] = rand() & 0xFFFF;
+				break;
+			case CHECKSUMTEST_ONES:
+				buf[i] = 0xFFFF;
+				break;
+			case CHECKSUMTEST_ZEROS:
+				buf[i] = 0;
+				break;
+			case CHECKSUMTEST_ALTERNATING:
+				buf[i] = i & 1 ? 0x0001 : 0xFFFF;
+				break;
+			default:
+				// Leaves msw at 1 and lsw at 0xFFFF, which zeros keep
+				buf[i] = i == 0 ? 0x0001 : i == 1 ? 0xFFFE : 0;
+				break;
+		}
+	}
+}
+
+static void check(const char *name, unsigned long len, int pattern, int offset,
+			unsigned long expected, unsigned long checksum)
+{
+	++checks;
+	if (checksum == expected)
+		return;
+
+	++failures;
+	fprintf(stderr, "%s: %lu words of %s at offset %d: 0x%08lx, expected 0x%08lx\n",
+		name, len, pattern_names[pattern], offset, checksum, expected);
+}
+
+static void check_length(const std::vector<unsigned short> &buf, unsigned long len,
+				int pattern, bool *supported)
+{
+	unsigned long expected;
+	unsigned long checksum;
+
+	// Starting a word in checks the vector versions with unaligned data
+	for (int offset = 0; offset < 2; ++offset) {
+		const unsigned short *data = &buf[offset];
+		ImageChecksum pieces;
+		unsigned long split = len / 3 | 1;
+
+		expected = image_checksum_scalar(data, len);
+
+		for (size_t i = 0; i < sizeof(vector_versions) / sizeof(vector_versions[0]); ++i) {
+			if (!vector_versions[i].checksum(data, len, &checksum))
+				continue;
+			supported[i] = true;
+			check(vector_versions[i].name, len, pattern, offset, expected, checksum);
+		}
+
+		check("image_checksum", len, pattern, offset, expected,
+			image_checksum(data, len));
+
+		// An odd first piece leaves the later pieces unaligned
+		if (split > len)
+			split = len;
+		pieces.Update(data, split);
+		pieces.Update(data + split, len - split);
+		check("ImageChecksum", len, pattern, offset, expected, pieces.Get());
+	}
+}
+
+int main()
+{
+	std::vector<unsigned short> buf(CHECKSUMTEST_MAX_LENGTH + 1);
+	std::vector<unsigned long> lengths;
+	bool supported[sizeof(vector_versions) / sizeof(vector_versions[0])] = { false };
+	static const unsigned long widths[] = { 8, 16 };
+
+	srand(1);
+
+	for (unsigned long len = 0; len <= 64; ++len)
+		lengths.push_back(len);
+
+	for (size_t i = 0; i < sizeof(widths) / sizeof(widths[0]); ++i) {
+		unsigned long block = widths[i] * CHECKSUMTEST_BLOCK_VECTORS;
+
+		for (unsigned long n = 1; n <= 4; ++n) {
+			lengths.push_back(n * block - 1);
+			lengths.push_back(n * block);
+			lengths.push_back(n * block + 1);
+			lengths.push_back(n * block + widths[i] - 1);
+			lengths.push_back(n * block + widths[i]);
+		}
+	}
+
+	for (int i = 0; i < CHECKSUMTEST_RANDOM_LENGTHS; ++i)
+		lengths.push_back(rand() % CHECKSUMTEST_MAX_LENGTH);
+
+	for (int pattern = 0; pattern < CHECKSUMTEST_PATTERNS; ++pattern) {
+		fill(buf, (enum checksumtest_pattern)pattern);
+		for (size_t i = 0; i < lengths.size(); ++i)
+			check_length(buf, lengths[i], pattern, supported);
+	}
+
+	for (size_t i = 0; i < sizeof(vector_versions) / sizeof(vector_versions[0]); ++i)
+		fprintf(stdout, "%s: %s\n", vector_versions[i].name,
+			supported[i] ? "checked" : "not supported");
+	fprintf(stdout, "%u checks, %u failed\n", checks, failures);
+
+	return failures ? 1 : 0;
+}
@@ -20,175 +20,291 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "rmidevice.h"
 #include "firmware_image.h"
+#include "checksum.h"
+#include "imagevalidator.h"
 
 using namespace std;
 
-unsigned long FirmwareImage::Checksum(unsigned short * data, unsigned long len)
+unsigned long FirmwareImage::Checksum(const unsigned short * data, unsigned long len)
 {
-	unsigned long checksum = 0xFFFFFFFF;
-	unsigned long lsw = checksum & 0xFFFF;
-	unsigned long msw = checksum >> 16;
-
-	while (len--) {
-		lsw += *data++;
-		msw += lsw;
-		lsw = (lsw & 0xffff) + (lsw >> 16);
-		msw = (msw & 0xffff) + (msw >> 16);
+	return image_checksum(data, len);
+}
+
+// Whether len bytes at addr lie inside an image of size bytes
+static bool image_range_valid(unsigned long addr, unsigned long len, unsigned long size)
+{
+	return addr <= size && len <= size - addr;
+}
+
+/*
+ * Reads the container directory into m_containers, checking that every
+ * descriptor, content and signature lies inside the image, so nothing
+ * reads past its end.
+ */
+int FirmwareImage::IndexContainers()
+{
+	const struct container_descriptor *descriptor;
+	struct container_entry entry;
+	unsigned long size = m_imageSize;
+	unsigned long listAddr;
+	unsigned long listLength;
+	unsigned long addr;
+
+	m_containers.clear();
+	m_containerIndex.clear();
+
+	m_cntrAddr = extract_long(&m_memBlock[RMI_IMG_V10_CNTR_ADDR_OFFSET]);
+	if (!image_range_valid(m_cntrAddr, sizeof(*descriptor), size))
+		return UPDATE_FAIL_VERIFY_IMAGE;
+	descriptor = (const struct container_descriptor *)(m_memBlock + m_cntrAddr);
+	listAddr = extract_long(descriptor->content_address);
+	listLength = extract_long(descriptor->content_length);
+	if (listLength % 4 || !image_range_valid(listAddr, listLength, size))
+		return UPDATE_FAIL_VERIFY_IMAGE;
+
+	m_containers.reserve(listLength / 4);
+	for (unsigned long offset = 0; offset < listLength; offset += 4) {
+		addr = extract_long(m_memBlock + listAddr + offset);
+		if (!image_range_valid(addr, sizeof(*descriptor), size))
+			return UPDATE_FAIL_VERIFY_IMAGE;
+		descriptor = (const struct container_descriptor *)(m_memBlock + addr);
+
+		entry.id = descriptor->container_id[0] | descriptor->container_id[1] << 8;
+		entry.majorVersion = descriptor->major_version;
+		entry.minorVersion = descriptor->minor_version;
+		entry.optionFlags = extract_long(descriptor->container_option_flags);
+		addr = extract_long(descriptor->content_address);
+		entry.length = extract_long(descriptor->content_length);
+		entry.signatureSize = extract_long(descriptor->signature_size);
+		if (!image_range_valid(addr, entry.length, size)
+			|| !image_range_valid(addr + entry.length, entry.signatureSize, size)) {
+			if (!m_quiet)
+				fprintf(stderr, "Container %u listed at 0x%lx lies outside the image\n",
+					entry.id, listAddr + offset);
+			return UPDATE_FAIL_VERIFY_IMAGE;
+		}
+		entry.content = m_memBlock + addr;
+
+		if (entry.id >= m_containerIndex.size())
+			m_containerIndex.resize(entry.id + 1, -1);
+		m_containerIndex[entry.id] = m_containers.size();
+		m_containers.push_back(entry);
 	}
 
-	checksum = msw << 16 | lsw;
+	return UPDATE_SUCCESS;
+}
+
+const struct container_entry *FirmwareImage::GetContainer(unsigned short id)
+{
+	if (id >= m_containerIndex.size() || m_containerIndex[id] < 0)
+		return NULL;
 
-	return checksum;
+	return &m_containers[m_containerIndex[id]];
 }
 
-void FirmwareImage::ParseHierarchicalImg()
+int FirmwareImage::ParseHierarchicalImg()
 {
-	struct container_descriptor *descriptor;
-	int numOfCntrs;
-	int ii;
-	unsigned int addr;
-	unsigned int offset;
-	unsigned int length;
-	unsigned char *content;
-	unsigned short container_id;
-	unsigned int sigature_size;
-	
-	for (ii = 0; ii < BLv7_MAX; ii++) {
-		m_signatureInfo[ii].bExisted = false;
-		m_signatureInfo[ii].size = 0;
-	}
+	const struct container_entry *container;
+	int rc;
 
-	if (m_bootloaderVersion == RMI_IMG_V10_SIGNATURE_VERSION_NUMBER) {
+	if (m_bootloaderVersion == RMI_IMG_V10_SIGNATURE_VERSION_NUMBER && !m_quiet) {
 		fprintf (stdout, "has signature\n");	
 	}
 
-	m_cntrAddr = extract_long(&m_memBlock[RMI_IMG_V10_CNTR_ADDR_OFFSET]);
-	descriptor = (struct container_descriptor *)(m_memBlock + m_cntrAddr);
-	offset = extract_long(descriptor->content_address);
-	numOfCntrs = extract_long(descriptor->content_length) / 4;
-
-	for (ii = 0; ii < numOfCntrs; ii++) {
-		addr = extract_long(m_memBlock + offset);
-		offset += 4;
-		descriptor = (struct container_descriptor *)(m_memBlock + addr);
-		container_id = descriptor->container_id[0] |
-				descriptor->container_id[1] << 8;
-		content = m_memBlock + extract_long(descriptor->content_address);
-		length = extract_long(descriptor->content_length);
-		sigature_size = extract_long(descriptor->signature_size);
-		switch (container_id) {
+	rc = IndexContainers();
+	if (rc != UPDATE_SUCCESS)
+		return rc;
+
+	for (size_t i = 0; i < m_containers.size(); i++) {
+		container = &m_containers[i];
+		switch (container->id) {
 		case BL_CONTAINER:
-			m_bootloaderVersion = *content;
+			if (!container->length)
+				return UPDATE_FAIL_VERIFY_IMAGE;
+			m_bootloaderVersion = *container->content;
 			break;
 		case UI_CONTAINER:
 		case CORE_CODE_CONTAINER:
-			if (sigature_size != 0) {
-				fprintf(stdout, "CORE CODE signature size : 0x%x\n", sigature_size);
+			if (container->signatureSize != 0) {
+				if (!m_quiet)
+					fprintf(stdout, "CORE CODE signature size : 0x%lx\n", container->signatureSize);
 				m_signatureInfo[BLv7_CORE_CODE].bExisted = true;
-				m_signatureInfo[BLv7_CORE_CODE].size = sigature_size;
+				m_signatureInfo[BLv7_CORE_CODE].size = container->signatureSize;
 			}
-			m_firmwareData = content;
-			m_firmwareSize = length;
+			m_firmwareData = container->content;
+			m_firmwareSize = container->length;
 			break;
 		case FLASH_CONFIG_CONTAINER:
-			if (sigature_size != 0) {
-				fprintf(stdout, "FLASH CONFIG signature size : 0x%x\n", sigature_size);
+			if (container->signatureSize != 0) {
+				if (!m_quiet)
+					fprintf(stdout, "FLASH CONFIG signature size : 0x%lx\n", container->signatureSize);
 				m_signatureInfo[BLv7_FLASH_CONFIG].bExisted = true;
-				m_signatureInfo[BLv7_FLASH_CONFIG].size = sigature_size;
+				m_signatureInfo[BLv7_FLASH_CONFIG].size = container->signatureSize;
 			}
-			m_flashConfigData = content;
-			m_flashConfigSize = length;
+			m_flashConfigData = container->content;
+			m_flashConfigSize = container->length;
 			break;
 		case UI_CONFIG_CONTAINER:
 		case CORE_CONFIG_CONTAINER:
-			if (sigature_size != 0) {
-				fprintf(stdout, "CORE CONFIG signature size : 0x%x\n", sigature_size);
+			if (container->signatureSize != 0) {
+				if (!m_quiet)
+					fprintf(stdout, "CORE CONFIG signature size : 0x%lx\n", container->signatureSize);
 				m_signatureInfo[BLv7_CORE_CONFIG].bExisted = true;
-				m_signatureInfo[BLv7_CORE_CONFIG].size = sigature_size;
+				m_signatureInfo[BLv7_CORE_CONFIG].size = container->signatureSize;
 			}
-			m_configData = content;
-			m_configSize = length;
+			m_configData = container->content;
+			m_configSize = container->length;
 			break;
 		case PERMANENT_CONFIG_CONTAINER:
 		case GUEST_SERIALIZATION_CONTAINER:
-			m_lockdownData = content;
-			m_lockdownSize = length;
+			m_lockdownData = container->content;
+			m_lockdownSize = container->length;
 			break;
 		case GENERAL_INFORMATION_CONTAINER:
+			if (container->length < RMI_IMG_GENERAL_INFO_PRODUCT_ID_OFFSET + RMI_PRODUCT_ID_LENGTH)
+				return UPDATE_FAIL_VERIFY_IMAGE;
 			m_io = true;
-			m_packageID = extract_long(content);
-			m_firmwareBuildID = extract_long(content + 4);
-			memcpy(m_productID, (content + 0x18), RMI_PRODUCT_ID_LENGTH);
+			m_packageID = extract_long(container->content);
+			m_firmwareBuildID = extract_long(container->content + 4);
+			memcpy(m_productID, container->content + RMI_IMG_GENERAL_INFO_PRODUCT_ID_OFFSET,
+				RMI_PRODUCT_ID_LENGTH);
 			m_productID[RMI_PRODUCT_ID_LENGTH] = 0;
-			if ((descriptor->major_version == 0) && 
-				(descriptor->minor_version > 0)) {
+			if ((container->majorVersion == 0) && 
+				(container->minorVersion > 0)) {
+				if (container->length < RMI_IMG_GENERAL_INFO_FW_VERSION_OFFSET + 2)
+					return UPDATE_FAIL_VERIFY_IMAGE;
 				m_hasFirmwareVersion = true;
-				fprintf(stdout, "General Information version : %d.%d\n", descriptor->major_version, descriptor->minor_version);
-				m_firmwareVersion = *(content + 0x26) << 8 | *(content + 0x27);
-				fprintf(stdout, "Firmware version : 0x%x\n", m_firmwareVersion);
+				m_firmwareVersion = container->content[RMI_IMG_GENERAL_INFO_FW_VERSION_OFFSET] << 8
+					| container->content[RMI_IMG_GENERAL_INFO_FW_VERSION_OFFSET + 1];
+				if (!m_quiet) {
+					fprintf(stdout, "General Information version : %d.%d\n", container->majorVersion, container->minorVersion);
+					fprintf(stdout, "Firmware version : 0x%x\n", m_firmwareVersion);
+				}
 			}
 			break;
 		case FIXED_LOCATION_DATA_CONTAINER:
-			if (sigature_size != 0) {
-				fprintf(stdout, "FLD signature size : 0x%x\n", sigature_size);
+			if (container->signatureSize != 0) {
+				if (!m_quiet)
+					fprintf(stdout, "FLD signature size : 0x%lx\n", container->signatureSize);
 				m_signatureInfo[BLv7_FLD].bExisted = true;
-				m_signatureInfo[BLv7_FLD].size = sigature_size;
+				m_signatureInfo[BLv7_FLD].size = container->signatureSize;
 			}
-			m_fldData = content;
-			m_fldSize = length;
+			m_fldData = container->content;
+			m_fldSize = container->length;
 			break;
 		case GLOBAL_PARAMETERS_CONTAINER:
-			m_globalparaData = content;
-			m_globalparaSize = length;
+			m_globalparaData = container->content;
+			m_globalparaSize = container->length;
 			break;
 		default:
 			break;
 		}
 	}
+
+	return UPDATE_SUCCESS;
 }
 
-int FirmwareImage::Initialize(const char * filename)
+/*
+ * Maps the image read only, so the data accessors are views of the page
+ * cache and threads updating several devices share one resident copy.
+ * Files which cannot be mapped, such as pipes, are read into m_buffer a
+ * chunk at a time and checked as they arrive, so a bad image is rejected
+ * without waiting for the rest of it. A filename of "-" reads stdin.
+ */
+int FirmwareImage::Load(const char * filename)
 {
-	if (!filename)
-		return UPDATE_FAIL_INVALID_PARAMETER;
+	ImageValidator validator(m_quiet);
+	struct stat st;
+	unsigned long size = 0;
+	ssize_t len;
+	void *map;
+	int flags = MAP_PRIVATE;
+	int fd;
+	int rc;
 
-	ifstream ifsFile(filename, ios::in|ios::binary|ios::ate);
-	if (!ifsFile)
+	if (!strcmp(filename, "-"))
+		fd = dup(STDIN_FILENO);
+	else
+		fd = open(filename, O_RDONLY);
+	if (fd < 0)
 		return UPDATE_FAIL_OPEN_FIRMWARE_IMAGE;
 
-	ifsFile.seekg(0, ios::end);
-	m_imageSize = ifsFile.tellg();
-	if (m_imageSize < 0)
+	if (fstat(fd, &st) < 0) {
+		close(fd);
 		return UPDATE_FAIL_OPEN_FIRMWARE_IMAGE;
+	}
 
-	m_memBlock = new unsigned char[m_imageSize];
-	ifsFile.seekg(0, ios::beg);
-	ifsFile.read((char*)m_memBlock, m_imageSize);
+	if (S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= RMI_IMG_MAX_SIZE) {
+#ifdef MAP_POPULATE
+		// The whole image is read for the checksum straight away
+		flags |= MAP_POPULATE;
+#endif
+		map = mmap(NULL, st.st_size, PROT_READ, flags, fd, 0);
+		if (map != MAP_FAILED) {
+			madvise(map, st.st_size, MADV_WILLNEED);
+			close(fd);
+			m_memBlock = (const unsigned char *)map;
+			m_imageSize = st.st_size;
+			m_mapped = true;
+			return validator.Finish(m_memBlock, m_imageSize);
+		}
+	}
 
-	if (m_imageSize < 0x100)
-		return UPDATE_FAIL_VERIFY_IMAGE;
+	for (;;) {
+		// Grow to what the header and directory say the image needs
+		if (m_buffer.capacity() < validator.GetExpectedSize())
+			m_buffer.reserve(validator.GetExpectedSize());
+		m_buffer.resize(size + RMI_IMG_READ_CHUNK_SIZE);
+		len = read(fd, &m_buffer[size], RMI_IMG_READ_CHUNK_SIZE);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			break;
 
-	m_checksum = extract_long(&m_memBlock[RMI_IMG_CHECKSUM_OFFSET]);
+		size += len;
+		rc = validator.Update(&m_buffer[0], size);
+		if (rc != UPDATE_SUCCESS) {
+			close(fd);
+			return rc;
+		}
+	}
+	close(fd);
+	m_buffer.resize(size);
+	if (len < 0)
+		return UPDATE_FAIL_OPEN_FIRMWARE_IMAGE;
 
-	unsigned long imageSizeMinusChecksum = m_imageSize - 4;
-	if ((imageSizeMinusChecksum % 2) != 0)
-		/*
-		 * Since the header size is fixed and the firmware is
-		 * in 16 byte blocks a valid image size should always be
-		 * divisible by 2.
-		 */
-		return UPDATE_FAIL_VERIFY_IMAGE;
+	m_memBlock = m_buffer.empty() ? NULL : &m_buffer[0];
+	m_imageSize = m_buffer.size();
+
+	return validator.Finish(m_memBlock, m_imageSize);
+}
+
+int FirmwareImage::Initialize(const char * filename)
+{
+	int rc;
+
+	if (!filename)
+		return UPDATE_FAIL_INVALID_PARAMETER;
 
-	unsigned long calculated_checksum = Checksum((uint16_t *)&(m_memBlock[4]),
-		imageSizeMinusChecksum >> 1);
+	// Checks the checksum and that the image is as long as its header says
+	rc = Load(filename);
+	if (rc != UPDATE_SUCCESS)
+		return rc;
 
-	if (m_checksum != calculated_checksum) {
-		fprintf(stderr, "Firmware image checksum verification failed, saw 0x%08lX, calculated 0x%08lX\n",
-			m_checksum, calculated_checksum);
-		return UPDATE_FAIL_VERIFY_CHECKSUM;
+	m_checksum = extract_long(&m_memBlock[RMI_IMG_CHECKSUM_OFFSET]);
+
+	// Only hierarchical images have signatures
+	for (int ii = 0; ii < BLv7_MAX; ii++) {
+		m_signatureInfo[ii].bExisted = false;
+		m_signatureInfo[ii].size = 0;
 	}
 
 	m_io = m_memBlock[RMI_IMG_IO_OFFSET];
@@ -221,16 +337,20 @@ int FirmwareImage::Initialize(const char * filename)
 			m_lockdownSize = RMI_IMG_LOCKDOWN_V5_SIZE;
 			m_lockdownData = &m_memBlock[RMI_IMG_LOCKDOWN_V5_OFFSET];
 			break;
-		case 16:
+		case RMI_IMG_HIERARCHICAL_VERSION:
 		case RMI_IMG_V10_SIGNATURE_VERSION_NUMBER:
-			ParseHierarchicalImg();
+			rc = ParseHierarchicalImg();
+			if (rc != UPDATE_SUCCESS)
+				return rc;
 			break;
 		default:
 			return UPDATE_FAIL_UNSUPPORTED_IMAGE_VERSION;
 	}
 
-	fprintf(stdout, "Firmware Header:\n");
-	PrintHeaderInfo();
+	if (!m_quiet) {
+		fprintf(stdout, "Firmware Header:\n");
+		PrintHeaderInfo();
+	}
 
 	return UPDATE_SUCCESS;
 }
@@ -267,6 +387,18 @@ int FirmwareImage::VerifyImageMatchesDevice(unsigned long deviceFirmwareSize,
 	return UPDATE_SUCCESS;
 }
 
+unsigned long long FirmwareImage::GetHash()
+{
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+
+	for (long i = 0; i < m_imageSize; ++i) {
+		hash ^= m_memBlock[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
 int FirmwareImage::VerifyImageProductID(char* deviceProductID)
 {
 	if (strcmp(m_productID, deviceProductID) == 0) {
@@ -278,8 +410,68 @@ int FirmwareImage::VerifyImageProductID(char* deviceProductID)
 	}
 }
 
+static void put_long(unsigned char *buf, unsigned long value)
+{
+	buf[0] = value & 0xFF;
+	buf[1] = (value >> 8) & 0xFF;
+	buf[2] = (value >> 16) & 0xFF;
+	buf[3] = (value >> 24) & 0xFF;
+}
+
+static unsigned long append_container(vector<unsigned char> &image, unsigned short id,
+					const vector<unsigned char> &content)
+{
+	struct container_descriptor descriptor;
+	unsigned long addr = image.size();
+
+	memset(&descriptor, 0, sizeof(descriptor));
+	descriptor.container_id[0] = id & 0xFF;
+	descriptor.container_id[1] = id >> 8;
+	put_long(descriptor.content_length, content.size());
+	put_long(descriptor.content_address, addr + sizeof(descriptor));
+
+	image.insert(image.end(), (unsigned char *)&descriptor,
+			(unsigned char *)&descriptor + sizeof(descriptor));
+	image.insert(image.end(), content.begin(), content.end());
+	// Keep the descriptors aligned and the image a whole number of words
+	image.resize((image.size() + 3) & ~3UL, 0);
+
+	return addr;
+}
+
+int FirmwareImage::WriteHierarchicalImage(const char * filename,
+					const vector<struct image_container> &containers)
+{
+	vector<unsigned char> image(RMI_IMG_FW_OFFSET, 0);
+	vector<unsigned char> list(containers.size() * 4);
+	unsigned long checksum;
+
+	for (size_t i = 0; i < containers.size(); ++i)
+		put_long(&list[i * 4], append_container(image, containers[i].id,
+							containers[i].content));
+
+	image[RMI_IMG_BOOTLOADER_VERSION_OFFSET] = RMI_IMG_HIERARCHICAL_VERSION;
+	put_long(&image[RMI_IMG_V10_CNTR_ADDR_OFFSET],
+		append_container(image, TOP_LEVEL_CONTAINER, list));
+
+	checksum = Checksum((uint16_t *)&image[4], (image.size() - 4) >> 1);
+	put_long(&image[RMI_IMG_CHECKSUM_OFFSET], checksum);
+
+	ofstream ofsFile(filename, ios::out|ios::binary|ios::trunc);
+	if (!ofsFile)
+		return UPDATE_FAIL_WRITE_FIRMWARE_IMAGE;
+
+	ofsFile.write((char *)&image[0], image.size());
+	ofsFile.close();
+	if (!ofsFile)
+		return UPDATE_FAIL_WRITE_FIRMWARE_IMAGE;
+
+	return UPDATE_SUCCESS;
+}
+
 FirmwareImage::~FirmwareImage()
 {
-	delete [] m_memBlock;
+	if (m_mapped)
+		munmap((void *)m_memBlock, m_imageSize);
 	m_memBlock = NULL;
 }
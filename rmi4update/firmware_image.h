@@ -18,6 +18,8 @@
 #ifndef _FIRMWAREIMAGE_H_
 #define _FIRMWAREIMAGE_H_
 
+#include <vector>
+
 #include "rmidevice.h"
 #include "updateutil.h"
 
@@ -34,6 +36,11 @@
 
 #define RMI_IMG_FW_OFFSET			0x100
 
+// Images are read into memory, anything larger is rejected
+#define RMI_IMG_MAX_SIZE			(16 * 1024 * 1024)
+// Images which cannot be mapped are read and checked this much at a time
+#define RMI_IMG_READ_CHUNK_SIZE			(64 * 1024)
+
 #define RMI_IMG_LOCKDOWN_V2_OFFSET		0xD0
 #define RMI_IMG_LOCKDOWN_V2_SIZE		0x30
 
@@ -48,6 +55,10 @@
 #define RMI_IMG_V10_SIGNATURE_VERSION_NUMBER 0x11
 #define RMI_IMG_V10_SIGNATURE_LENGTH_OFFSET 0x8
 #define RMI_IMG_V10_SIGNATURE_LENGTH_SIZE 4
+#define RMI_IMG_HIERARCHICAL_VERSION		0x10
+#define RMI_IMG_GENERAL_INFO_SIZE		0x30
+#define RMI_IMG_GENERAL_INFO_PRODUCT_ID_OFFSET	0x18
+#define RMI_IMG_GENERAL_INFO_FW_VERSION_OFFSET	0x26
 
 struct container_descriptor {
 	unsigned char content_checksum[4];
@@ -104,24 +115,47 @@ struct signature_info {
 	bool bExisted;
 	unsigned short size;
 };
+
+// A container to be written to a hierarchical image
+struct image_container {
+	unsigned short id;
+	std::vector<unsigned char> content;
+};
+
+// A container of a loaded hierarchical image, checked to lie inside it
+struct container_entry {
+	unsigned short id;
+	unsigned char majorVersion;
+	unsigned char minorVersion;
+	unsigned long optionFlags;
+	const unsigned char *content;
+	unsigned long length;
+	// The signature is stored after the content
+	unsigned long signatureSize;
+};
 // BL_V7 end
 
 class FirmwareImage
 {
 public:
-	FirmwareImage() : m_firmwareBuildID(0), m_packageID(0), m_firmwareData(NULL), m_configData(NULL), m_lockdownData(NULL),
-				m_memBlock(NULL), m_hasSignature(false), m_fldData(NULL), m_fldSize(0), m_globalparaData(NULL), m_globalparaSize(0),
-				m_firmwareVersion(0), m_hasFirmwareVersion(false)
+	FirmwareImage() : m_flashConfigSize(0), m_lockdownSize(0), m_firmwareBuildID(0), m_packageID(0), m_firmwareData(NULL), m_configData(NULL),
+				m_flashConfigData(NULL), m_lockdownData(NULL), m_memBlock(NULL), m_mapped(false), m_hasSignature(false), m_fldData(NULL),
+				m_fldSize(0), m_globalparaData(NULL), m_globalparaSize(0), m_firmwareVersion(0), m_hasFirmwareVersion(false),
+				m_quiet(false)
 	{}
+	// The data accessors point into the image, which stays mapped until
+	// the FirmwareImage is destroyed
 	int Initialize(const char * filename);
+	// Stop Initialize printing the header and why an image is invalid
+	void SetQuiet(bool quiet) { m_quiet = quiet; }
 	int VerifyImageMatchesDevice(unsigned long deviceFirmwareSize,
 					unsigned long deviceConfigSize);
-	unsigned char * GetFirmwareData() { return m_firmwareData; }
-	unsigned char * GetConfigData() { return m_configData; }
-	unsigned char * GetFlashConfigData() { return m_flashConfigData; }
-	unsigned char * GetLockdownData() { return m_lockdownData; }
-	unsigned char * GetFLDData() { return m_fldData; }
-	unsigned char * GetGlobalParametersData() { return m_globalparaData; }
+	const unsigned char * GetFirmwareData() { return m_firmwareData; }
+	const unsigned char * GetConfigData() { return m_configData; }
+	const unsigned char * GetFlashConfigData() { return m_flashConfigData; }
+	const unsigned char * GetLockdownData() { return m_lockdownData; }
+	const unsigned char * GetFLDData() { return m_fldData; }
+	const unsigned char * GetGlobalParametersData() { return m_globalparaData; }
 	unsigned long GetFirmwareSize() { return m_firmwareSize; }
 	unsigned long GetConfigSize() { return m_configSize; }
 	unsigned long GetFlashConfigSize() { return m_flashConfigSize; }
@@ -130,17 +164,33 @@ public:
 	unsigned long GetFLDSize() { return m_fldSize; }
 	unsigned long GetGlobalParametersSize() { return m_globalparaSize; }
 	unsigned short GetFirmwareVersion() { return m_firmwareVersion; }
+	const char * GetProductID() { return m_productID; }
+	unsigned char GetBootloaderVersion() { return m_bootloaderVersion; }
 	signature_info *GetSignatureInfo() { return m_signatureInfo; }
 	int VerifyImageProductID(char* deviceProductID);
 	bool IsImageHasFirmwareVersion() { return m_hasFirmwareVersion; }
+	// 64 bit FNV-1a hash of the whole image file
+	unsigned long long GetHash();
+	// Every container the top level container lists, in order. Empty for
+	// images older than v7.
+	const std::vector<struct container_entry> &GetContainers() { return m_containers; }
+	// The last container listed with id, which is the one that is used,
+	// or NULL if the image has none
+	const struct container_entry *GetContainer(unsigned short id);
 
 	bool HasIO() { return m_io; }
 	~FirmwareImage();
 
+	// Writes the containers listed by a top level container to filename
+	static int WriteHierarchicalImage(const char * filename,
+					const std::vector<struct image_container> &containers);
+
 private:
-	unsigned long Checksum(unsigned short * data, unsigned long len);
+	static unsigned long Checksum(const unsigned short * data, unsigned long len);
+	int Load(const char * filename);
 	void PrintHeaderInfo();
-	void ParseHierarchicalImg();	// BL_V7
+	int ParseHierarchicalImg();	// BL_V7
+	int IndexContainers();
 
 private:
 	unsigned long m_checksum;
@@ -156,21 +206,28 @@ private:
 	char m_productID[RMI_PRODUCT_ID_LENGTH + 1];
 	unsigned short m_productInfo;
 
-	unsigned char * m_firmwareData;
-	unsigned char * m_configData;
-	unsigned char * m_flashConfigData;
-	unsigned char * m_lockdownData;
-	unsigned char * m_memBlock;
+	const unsigned char * m_firmwareData;
+	const unsigned char * m_configData;
+	const unsigned char * m_flashConfigData;
+	const unsigned char * m_lockdownData;
+	const unsigned char * m_memBlock;
+	// Whether m_memBlock is a mapping of the file or points into m_buffer
+	bool m_mapped;
+	std::vector<unsigned char> m_buffer;
 	unsigned long m_cntrAddr;	// BL_V7
 	bool m_hasSignature;
-	unsigned char * m_fldData;
+	const unsigned char * m_fldData;
 	unsigned long m_fldSize;
-	unsigned char * m_globalparaData;
+	const unsigned char * m_globalparaData;
 	unsigned long m_globalparaSize;
 	unsigned short m_firmwareVersion;
 	bool m_hasFirmwareVersion;
+	bool m_quiet;
 
 	signature_info m_signatureInfo[BLv7_MAX];
+	std::vector<struct container_entry> m_containers;
+	// Index in m_containers of each container ID, -1 if it is not listed
+	std::vector<int> m_containerIndex;
 };
 
 #endif // _FIRMWAREIMAGE_H_
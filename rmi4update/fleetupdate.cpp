@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "fleetupdate.h"
+#include "rmi4update.h"
+#include "tracedevice.h"
+
+static const char *fleet_state_names[] = {
+	"waiting", "updating", "succeeded", "failed",
+};
+
+FleetUpdate::FleetUpdate(FirmwareImage & firmwareImage) : m_firmwareImage(firmwareImage)
+{
+	memset(&m_options, 0, sizeof(m_options));
+	pthread_mutex_init(&m_mutex, NULL);
+	pthread_cond_init(&m_stateChanged, NULL);
+}
+
+FleetUpdate::~FleetUpdate()
+{
+	pthread_cond_destroy(&m_stateChanged);
+	pthread_mutex_destroy(&m_mutex);
+}
+
+void FleetUpdate::AddDevice(const std::string &name, RMIDevice *device)
+{
+	struct fleet_device fleetDevice;
+
+	fleetDevice.name = name;
+	fleetDevice.device = device;
+	fleetDevice.state = FLEET_STATE_WAITING;
+	fleetDevice.rc = UPDATE_SUCCESS;
+	fleetDevice.durationUs = 0;
+	fleetDevice.fleet = this;
+	m_devices.push_back(fleetDevice);
+}
+
+void FleetUpdate::SetState(struct fleet_device *device, enum fleet_state state)
+{
+	pthread_mutex_lock(&m_mutex);
+	device->state = state;
+	pthread_cond_broadcast(&m_stateChanged);
+	pthread_mutex_unlock(&m_mutex);
+}
+
+void FleetUpdate::Update(struct fleet_device *device)
+{
+	struct timespec start;
+	struct timespec end;
+	size_t pos = device->name.rfind('/');
+	std::string baseName = device->name.substr(pos == std::string::npos ? 0 : pos + 1);
+	std::string journalName;
+	std::string timingName;
+	// Counts the transfers for the timing
+	TraceDevice traceDevice(*device->device);
+	RMIDevice *rmiDevice = m_options.timingName ? &traceDevice : device->device;
+	UpdateTiming timing(traceDevice);
+	int rc;
+
+	traceDevice.m_hasDebug = device->device->m_hasDebug;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	SetState(device, FLEET_STATE_UPDATING);
+
+	if (rmiDevice->Open(device->name.c_str())) {
+		fprintf(stderr, "%s: failed to open the device: %s\n", device->name.c_str(),
+			strerror(errno));
+		rc = UPDATE_FAIL;
+	} else {
+		RMI4Update update(*rmiDevice, m_firmwareImage);
+
+		update.SetDifferential(m_options.differential);
+		update.SetVerify(m_options.verify);
+		update.SetReadPipeline(m_options.readPipelineDepth, m_options.readRequestSize);
+		if (m_options.profileDir)
+			update.SetProfileDir(m_options.profileDir);
+		if (m_options.journalName) {
+			journalName = std::string(m_options.journalName) + "." + baseName;
+			update.SetJournal(journalName.c_str());
+		}
+		if (m_options.timingName)
+			update.SetTiming(&timing);
+
+		rc = update.UpdateFirmware(m_options.force, m_options.performLockdown);
+		if (m_options.timingName) {
+			timingName = std::string(m_options.timingName) + "." + baseName;
+			timing.Save(timingName.c_str(), rc);
+		}
+		if (rc != UPDATE_SUCCESS)
+			rmiDevice->Reset();
+		rmiDevice->Close();
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	device->rc = rc;
+	device->durationUs = diff_time(&start, &end);
+	SetState(device, rc == UPDATE_SUCCESS ? FLEET_STATE_SUCCEEDED : FLEET_STATE_FAILED);
+}
+
+void *FleetUpdate::UpdateThread(void *arg)
+{
+	struct fleet_device *device = (struct fleet_device *)arg;
+
+	device->fleet->Update(device);
+
+	return NULL;
+}
+
+void FleetUpdate::PrintSummary()
+{
+	fprintf(stdout, "\nFleet update results:\n");
+	for (size_t i = 0; i < m_devices.size(); ++i) {
+		struct fleet_device &device = m_devices[i];
+
+		fprintf(stdout, "%-24s %-10s %8lld ms  %s\n", device.name.c_str(),
+			fleet_state_names[device.state], device.durationUs / 1000,
+			device.state == FLEET_STATE_FAILED ? update_err_to_string(device.rc) : "");
+	}
+}
+
+int FleetUpdate::Run(const struct fleet_options &options)
+{
+	std::vector<enum fleet_state> reported(m_devices.size(), FLEET_STATE_WAITING);
+	size_t finished = 0;
+	int failed = 0;
+	int rc;
+
+	m_options = options;
+
+	for (size_t i = 0; i < m_devices.size(); ++i) {
+		rc = pthread_create(&m_devices[i].thread, NULL, UpdateThread, &m_devices[i]);
+		if (rc) {
+			fprintf(stderr, "%s: failed to start the update: %s\n",
+				m_devices[i].name.c_str(), strerror(rc));
+			m_devices[i].rc = UPDATE_FAIL;
+			m_devices[i].state = FLEET_STATE_FAILED;
+			m_devices[i].thread = pthread_self();
+		}
+	}
+
+	// Report each state change as it happens
+	pthread_mutex_lock(&m_mutex);
+	while (finished < m_devices.size()) {
+		bool changed = false;
+
+		for (size_t i = 0; i < m_devices.size(); ++i) {
+			struct fleet_device &device = m_devices[i];
+
+			if (device.state == reported[i])
+				continue;
+
+			changed = true;
+			reported[i] = device.state;
+			if (device.state == FLEET_STATE_SUCCEEDED || device.state == FLEET_STATE_FAILED)
+				++finished;
+			fprintf(stdout, "[%zu/%zu] %s: %s\n", finished, m_devices.size(),
+				device.name.c_str(), fleet_state_names[device.state]);
+		}
+
+		if (!changed)
+			pthread_cond_wait(&m_stateChanged, &m_mutex);
+	}
+	pthread_mutex_unlock(&m_mutex);
+
+	for (size_t i = 0; i < m_devices.size(); ++i) {
+		if (!pthread_equal(m_devices[i].thread, pthread_self()))
+			pthread_join(m_devices[i].thread, NULL);
+		if (m_devices[i].state != FLEET_STATE_SUCCEEDED)
+			++failed;
+	}
+
+	PrintSummary();
+
+	return failed;
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FLEETUPDATE_H_
+#define _FLEETUPDATE_H_
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#include "rmidevice.h"
+#include "firmware_image.h"
+
+enum fleet_state {
+	FLEET_STATE_WAITING = 0,
+	FLEET_STATE_UPDATING,
+	FLEET_STATE_SUCCEEDED,
+	FLEET_STATE_FAILED,
+};
+
+struct fleet_options {
+	bool force;
+	bool performLockdown;
+	bool differential;
+	bool verify;
+	// Each device gets its own journal, named after the device
+	const char *journalName;
+	// and its own timing profile
+	const char *timingName;
+	// Erase times are shared by devices of the same product
+	const char *profileDir;
+	int readPipelineDepth;
+	int readRequestSize;
+};
+
+struct fleet_device {
+	std::string name;
+	RMIDevice *device;
+	enum fleet_state state;
+	int rc;
+	long long durationUs;
+	pthread_t thread;
+	class FleetUpdate *fleet;
+};
+
+/*
+ * Updates several devices with the same image at once, with a thread per
+ * device. The image is only loaded once and shared by every thread. The
+ * calling thread prints each device's progress as its state changes and
+ * a summary once all of them have finished.
+ */
+class FleetUpdate
+{
+public:
+	FleetUpdate(FirmwareImage & firmwareImage);
+	~FleetUpdate();
+
+	// device is opened with name by its thread
+	void AddDevice(const std::string &name, RMIDevice *device);
+	// Returns the number of devices which failed to update
+	int Run(const struct fleet_options &options);
+
+private:
+	FirmwareImage & m_firmwareImage;
+	struct fleet_options m_options;
+	std::vector<struct fleet_device> m_devices;
+	pthread_mutex_t m_mutex;
+	pthread_cond_t m_stateChanged;
+
+	void SetState(struct fleet_device *device, enum fleet_state state);
+	void Update(struct fleet_device *device);
+	void PrintSummary();
+	static void *UpdateThread(void *arg);
+};
+
+#endif /* _FLEETUPDATE_H_ */
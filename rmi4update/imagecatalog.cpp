@@ -0,0 +1,322 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#include "imagecatalog.h"
+#include "firmware_image.h"
+
+// Bump when the layout of a saved entry changes
+#define IMAGE_CATALOG_VERSION		1
+#define IMAGE_CATALOG_ENTRY_SIZE	61
+
+static void put_value(std::vector<unsigned char> &buf, unsigned long long value, int bytes)
+{
+	for (int i = 0; i < bytes; ++i)
+		buf.push_back((value >> (i * 8)) & 0xFF);
+}
+
+static unsigned long long get_value(const unsigned char **p, int bytes)
+{
+	unsigned long long value = 0;
+
+	for (int i = bytes - 1; i >= 0; --i)
+		value = value << 8 | (*p)[i];
+	*p += bytes;
+
+	return value;
+}
+
+// Names are stored as section names, which cannot hold white space
+static bool name_can_be_saved(const std::string &name)
+{
+	for (size_t i = 0; i < name.size(); ++i)
+		if ((unsigned char)name[i] <= ' ')
+			return false;
+
+	return true;
+}
+
+/*
+ * The image has to be built for the device's bootloader. Before BL v10 its
+ * partitions have to be the size of the device's, as UpdateFirmware()
+ * checks, and from v10 on they only have to fit.
+ */
+static bool entry_fits_device(const struct catalog_entry &entry,
+				const struct catalog_device &device)
+{
+	if (entry.rc != UPDATE_SUCCESS || entry.productID != device.productID
+		|| entry.bootloaderVersion != device.bootloaderVersion)
+		return false;
+
+	if (device.bootloaderVersion < 10)
+		return entry.firmwareSize == device.firmwareSize
+			&& entry.configSize == device.configSize;
+
+	return entry.firmwareSize <= device.firmwareSize
+		&& entry.configSize <= device.configSize;
+}
+
+static bool entry_less(const struct catalog_entry &a, const struct catalog_entry &b)
+{
+	return a.name < b.name;
+}
+
+bool ImageCatalog::LoadEntry(DeviceProfile &index, struct catalog_entry *entry)
+{
+	std::vector<unsigned char> record;
+	const unsigned char *p;
+
+	if (!name_can_be_saved(entry->name)
+		|| !index.GetSection("image." + entry->name, record)
+		|| record.size() < IMAGE_CATALOG_ENTRY_SIZE)
+		return false;
+
+	p = &record[0];
+	if ((long long)get_value(&p, 8) != entry->mtimeNs
+		|| (long long)get_value(&p, 8) != entry->size)
+		return false;
+
+	entry->rc = get_value(&p, 4);
+	entry->buildID = get_value(&p, 4);
+	entry->firmwareVersion = get_value(&p, 2);
+	entry->hasFirmwareVersion = get_value(&p, 1);
+	entry->bootloaderVersion = get_value(&p, 1);
+	entry->signatures = get_value(&p, 1);
+	entry->firmwareSize = get_value(&p, 4);
+	entry->configSize = get_value(&p, 4);
+	entry->flashConfigSize = get_value(&p, 4);
+	entry->lockdownSize = get_value(&p, 4);
+	entry->fldSize = get_value(&p, 4);
+	entry->globalParametersSize = get_value(&p, 4);
+	entry->hash = get_value(&p, 8);
+	entry->productID.assign((const char *)p, record.size() - IMAGE_CATALOG_ENTRY_SIZE);
+
+	return true;
+}
+
+void ImageCatalog::SaveIndex()
+{
+	DeviceProfile index;
+	std::vector<unsigned char> record;
+	unsigned char version = IMAGE_CATALOG_VERSION;
+	std::string path = m_dir + "/" + IMAGE_CATALOG_INDEX_NAME;
+
+	index.SetSection("catalog.version", &version, sizeof(version));
+	for (size_t i = 0; i < m_entries.size(); ++i) {
+		const struct catalog_entry &entry = m_entries[i];
+
+		if (!name_can_be_saved(entry.name))
+			continue;
+
+		record.clear();
+		put_value(record, entry.mtimeNs, 8);
+		put_value(record, entry.size, 8);
+		put_value(record, entry.rc, 4);
+		put_value(record, entry.buildID, 4);
+		put_value(record, entry.firmwareVersion, 2);
+		put_value(record, entry.hasFirmwareVersion, 1);
+		put_value(record, entry.bootloaderVersion, 1);
+		put_value(record, entry.signatures, 1);
+		put_value(record, entry.firmwareSize, 4);
+		put_value(record, entry.configSize, 4);
+		put_value(record, entry.flashConfigSize, 4);
+		put_value(record, entry.lockdownSize, 4);
+		put_value(record, entry.fldSize, 4);
+		put_value(record, entry.globalParametersSize, 4);
+		put_value(record, entry.hash, 8);
+		record.insert(record.end(), entry.productID.begin(), entry.productID.end());
+		index.SetSection("image." + entry.name, &record[0], record.size());
+	}
+
+	// The catalog still works without it, it just loads every image again
+	if (!index.Save(path))
+		fprintf(stderr, "Failed to save the image catalog %s: %s\n", path.c_str(),
+			strerror(errno));
+}
+
+void ImageCatalog::IndexImage(struct catalog_entry *entry)
+{
+	FirmwareImage image;
+	signature_info *signatures;
+
+	image.SetQuiet(true);
+	entry->rc = image.Initialize(GetPath(*entry).c_str());
+	if (entry->rc != UPDATE_SUCCESS)
+		return;
+
+	entry->productID = image.GetProductID();
+	entry->buildID = image.GetFirmwareID();
+	entry->firmwareVersion = image.GetFirmwareVersion();
+	entry->hasFirmwareVersion = image.IsImageHasFirmwareVersion();
+	entry->bootloaderVersion = image.GetBootloaderVersion();
+	entry->firmwareSize = image.GetFirmwareSize();
+	entry->configSize = image.GetConfigSize();
+	entry->flashConfigSize = image.GetFlashConfigSize();
+	entry->lockdownSize = image.GetLockdownSize();
+	entry->fldSize = image.GetFLDSize();
+	entry->globalParametersSize = image.GetGlobalParametersSize();
+	signatures = image.GetSignatureInfo();
+	for (int i = 0; i < BLv7_MAX; ++i)
+		if (signatures[i].bExisted)
+			entry->signatures |= 1 << i;
+	entry->hash = image.GetHash();
+}
+
+void *ImageCatalog::ScanThread(void *arg)
+{
+	ImageCatalog *catalog = (ImageCatalog *)arg;
+	size_t i;
+
+	while ((i = catalog->m_next++) < catalog->m_pending.size())
+		catalog->IndexImage(catalog->m_pending[i]);
+
+	return NULL;
+}
+
+int ImageCatalog::Scan(unsigned int threads)
+{
+	DeviceProfile index;
+	std::vector<unsigned char> version;
+	std::vector<pthread_t> workers;
+	struct dirent *dirEntry;
+	struct stat st;
+	bool haveIndex;
+	DIR *d;
+
+	m_entries.clear();
+	m_pending.clear();
+	m_newest.clear();
+	m_next = 0;
+
+	d = opendir(m_dir.c_str());
+	if (!d)
+		return -1;
+
+	while ((dirEntry = readdir(d)) != NULL) {
+		struct catalog_entry entry = catalog_entry();
+		size_t len = strlen(dirEntry->d_name);
+		const size_t suffixLen = strlen(IMAGE_CATALOG_SUFFIX);
+
+		if (len <= suffixLen
+			|| strcmp(dirEntry->d_name + len - suffixLen, IMAGE_CATALOG_SUFFIX))
+			continue;
+
+		entry.name = dirEntry->d_name;
+		if (stat(GetPath(entry).c_str(), &st) < 0 || !S_ISREG(st.st_mode))
+			continue;
+		entry.mtimeNs = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+		entry.size = st.st_size;
+		m_entries.push_back(entry);
+	}
+	closedir(d);
+	std::sort(m_entries.begin(), m_entries.end(), entry_less);
+
+	haveIndex = index.Load(m_dir + "/" + IMAGE_CATALOG_INDEX_NAME)
+		&& index.GetSection("catalog.version", version)
+		&& version.size() == 1 && version[0] == IMAGE_CATALOG_VERSION;
+	for (size_t i = 0; i < m_entries.size(); ++i)
+		if (!haveIndex || !LoadEntry(index, &m_entries[i]))
+			m_pending.push_back(&m_entries[i]);
+
+	if (threads > m_pending.size())
+		threads = m_pending.size();
+	for (unsigned int i = 0; i < threads; ++i) {
+		pthread_t thread;
+
+		if (pthread_create(&thread, NULL, ScanThread, this))
+			break;
+		workers.push_back(thread);
+	}
+	// Whatever is left if no thread could be started
+	ScanThread(this);
+	for (size_t i = 0; i < workers.size(); ++i)
+		pthread_join(workers[i], NULL);
+
+	if (!m_pending.empty() || !haveIndex)
+		SaveIndex();
+
+	for (size_t i = 0; i < m_entries.size(); ++i) {
+		const struct catalog_entry &entry = m_entries[i];
+		std::unordered_map<std::string, size_t>::iterator it;
+
+		if (entry.rc != UPDATE_SUCCESS)
+			continue;
+
+		it = m_newest.find(entry.productID);
+		if (it == m_newest.end())
+			m_newest[entry.productID] = i;
+		else if (entry.buildID > m_entries[it->second].buildID)
+			it->second = i;
+	}
+
+	return m_entries.size();
+}
+
+const struct catalog_entry *ImageCatalog::FindNewest(const char *productID)
+{
+	std::unordered_map<std::string, size_t>::iterator it = m_newest.find(productID);
+
+	if (it == m_newest.end())
+		return NULL;
+
+	return &m_entries[it->second];
+}
+
+const struct catalog_entry *ImageCatalog::FindNewest(const struct catalog_device &device)
+{
+	const struct catalog_entry *newest = NULL;
+
+	for (size_t i = 0; i < m_entries.size(); ++i) {
+		const struct catalog_entry &entry = m_entries[i];
+
+		if (entry_fits_device(entry, device)
+			&& (!newest || entry.buildID > newest->buildID))
+			newest = &entry;
+	}
+
+	return newest;
+}
+
+void ImageCatalog::Print(FILE *fp)
+{
+	fprintf(fp, "%-32s %-10s %8s %7s %3s %9s %9s %4s\n", "Image", "Product", "Build",
+		"Version", "BL", "Firmware", "Config", "Sig");
+	for (size_t i = 0; i < m_entries.size(); ++i) {
+		const struct catalog_entry &entry = m_entries[i];
+		char version[8] = "-";
+
+		if (entry.rc != UPDATE_SUCCESS) {
+			fprintf(fp, "%-32s %s\n", entry.name.c_str(), update_err_to_string(entry.rc));
+			continue;
+		}
+
+		if (entry.hasFirmwareVersion)
+			snprintf(version, sizeof(version), "0x%04x", entry.firmwareVersion);
+		fprintf(fp, "%-32s %-10s %8lu %7s %3u %9lu %9lu %4s%s\n", entry.name.c_str(),
+			entry.productID.c_str(), entry.buildID, version, entry.bootloaderVersion,
+			entry.firmwareSize, entry.configSize, entry.signatures ? "yes" : "no",
+			FindNewest(entry.productID.c_str()) == &entry ? "  newest" : "");
+	}
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _IMAGECATALOG_H_
+#define _IMAGECATALOG_H_
+
+#include <stdio.h>
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "deviceprofile.h"
+
+// Saved in the image directory, next to the images it describes
+#define IMAGE_CATALOG_INDEX_NAME	".rmi4update-catalog"
+#define IMAGE_CATALOG_SUFFIX		".img"
+
+struct catalog_entry {
+	// File name within the catalog's directory
+	std::string name;
+	// The entry is reused until the file's mtime or size changes
+	long long mtimeNs;
+	long long size;
+	// UPDATE_SUCCESS or why the image cannot be used
+	int rc;
+	std::string productID;
+	unsigned long buildID;
+	unsigned short firmwareVersion;
+	bool hasFirmwareVersion;
+	unsigned char bootloaderVersion;
+	unsigned long firmwareSize;
+	unsigned long configSize;
+	unsigned long flashConfigSize;
+	unsigned long lockdownSize;
+	unsigned long fldSize;
+	unsigned long globalParametersSize;
+	// A bit for each signature_BLv7 the image carries
+	unsigned char signatures;
+	unsigned long long hash;
+};
+
+// What an image has to match to be written to a device
+struct catalog_device {
+	std::string productID;
+	unsigned char bootloaderVersion;
+	unsigned long firmwareSize;
+	unsigned long configSize;
+};
+
+/*
+ * Metadata of every image in a directory, so the image for a device can
+ * be found without opening each one. Scanning loads the images on several
+ * threads and saves what it learns to an index in the directory. Later
+ * scans only load images added or changed since.
+ */
+class ImageCatalog
+{
+public:
+	ImageCatalog(const std::string &dir) : m_dir(dir), m_next(0) {}
+
+	// Returns the number of images indexed, or -1 if dir cannot be read
+	int Scan(unsigned int threads);
+	const std::vector<struct catalog_entry> &GetEntries() { return m_entries; }
+	// The valid image with the highest build ID for productID, or NULL
+	const struct catalog_entry *FindNewest(const char *productID);
+	// The same, but only out of the images which fit device
+	const struct catalog_entry *FindNewest(const struct catalog_device &device);
+	std::string GetPath(const struct catalog_entry &entry) { return m_dir + "/" + entry.name; }
+	void Print(FILE *fp);
+
+private:
+	bool LoadEntry(DeviceProfile &index, struct catalog_entry *entry);
+	void SaveIndex();
+	void IndexImage(struct catalog_entry *entry);
+	static void *ScanThread(void *arg);
+
+	std::string m_dir;
+	std::vector<struct catalog_entry> m_entries;
+	// Entries which have to be loaded again, shared out between the threads
+	std::vector<struct catalog_entry *> m_pending;
+	std::atomic<size_t> m_next;
+	// Index in m_entries of the newest image of each product
+	std::unordered_map<std::string, size_t> m_newest;
+};
+
+#endif /* _IMAGECATALOG_H_ */
@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+
+#include "imagevalidator.h"
+
+// Whether len bytes at addr fit in the largest image which is accepted
+static bool image_range_valid(unsigned long addr, unsigned long len)
+{
+	return addr <= RMI_IMG_MAX_SIZE && len <= RMI_IMG_MAX_SIZE - addr;
+}
+
+void ImageValidator::Expect(unsigned long addr, unsigned long len)
+{
+	if (addr + len > m_expectedSize)
+		m_expectedSize = addr + len;
+}
+
+int ImageValidator::CheckHeader(const unsigned char *image)
+{
+	unsigned long firmwareSize;
+	unsigned long configSize;
+
+	switch (image[RMI_IMG_BOOTLOADER_VERSION_OFFSET]) {
+		case 2:
+		case 3:
+		case 4:
+		case 5:
+		case 6:
+			// The config follows the firmware
+			firmwareSize = extract_long(&image[RMI_IMG_IMAGE_SIZE_OFFSET]);
+			configSize = extract_long(&image[RMI_IMG_CONFIG_SIZE_OFFSET]);
+			if (!image_range_valid(RMI_IMG_FW_OFFSET, firmwareSize)
+				|| !image_range_valid(RMI_IMG_FW_OFFSET + firmwareSize, configSize))
+				return UPDATE_FAIL_VERIFY_IMAGE;
+			Expect(RMI_IMG_FW_OFFSET + firmwareSize, configSize);
+			m_state = IMAGE_CHECK_DONE;
+			break;
+		case RMI_IMG_HIERARCHICAL_VERSION:
+		case RMI_IMG_V10_SIGNATURE_VERSION_NUMBER:
+			m_cntrAddr = extract_long(&image[RMI_IMG_V10_CNTR_ADDR_OFFSET]);
+			if (!image_range_valid(m_cntrAddr, sizeof(struct container_descriptor)))
+				return UPDATE_FAIL_VERIFY_IMAGE;
+			Expect(m_cntrAddr, sizeof(struct container_descriptor));
+			m_state = IMAGE_CHECK_TOP_LEVEL;
+			break;
+		default:
+			return UPDATE_FAIL_UNSUPPORTED_IMAGE_VERSION;
+	}
+
+	return UPDATE_SUCCESS;
+}
+
+/*
+ * Each step needs the bytes the previous one expected. The top level
+ * container gives the list of container addresses, and every container's
+ * descriptor gives where its content and signature are.
+ */
+int ImageValidator::CheckDirectory(const unsigned char *image)
+{
+	const struct container_descriptor *descriptor;
+	unsigned long addr;
+	unsigned long length;
+
+	switch (m_state) {
+		case IMAGE_CHECK_TOP_LEVEL:
+			descriptor = (const struct container_descriptor *)&image[m_cntrAddr];
+			m_listAddr = extract_long(descriptor->content_address);
+			m_listLength = extract_long(descriptor->content_length);
+			if (m_listLength % 4 || !image_range_valid(m_listAddr, m_listLength))
+				return UPDATE_FAIL_VERIFY_IMAGE;
+			Expect(m_listAddr, m_listLength);
+			m_state = IMAGE_CHECK_CONTAINER_LIST;
+			break;
+		case IMAGE_CHECK_CONTAINER_LIST:
+			for (unsigned long offset = 0; offset < m_listLength; offset += 4) {
+				addr = extract_long(&image[m_listAddr + offset]);
+				if (!image_range_valid(addr, sizeof(struct container_descriptor)))
+					return UPDATE_FAIL_VERIFY_IMAGE;
+				Expect(addr, sizeof(struct container_descriptor));
+			}
+			m_state = IMAGE_CHECK_CONTAINERS;
+			break;
+		case IMAGE_CHECK_CONTAINERS:
+			for (unsigned long offset = 0; offset < m_listLength; offset += 4) {
+				addr = extract_long(&image[m_listAddr + offset]);
+				descriptor = (const struct container_descriptor *)&image[addr];
+				addr = extract_long(descriptor->content_address);
+				length = extract_long(descriptor->content_length);
+				// The signature is stored after the content
+				if (!image_range_valid(addr, length)
+					|| !image_range_valid(addr + length,
+						extract_long(descriptor->signature_size)))
+					return UPDATE_FAIL_VERIFY_IMAGE;
+				Expect(addr, length + extract_long(descriptor->signature_size));
+			}
+			m_state = IMAGE_CHECK_DONE;
+			break;
+		default:
+			break;
+	}
+
+	return UPDATE_SUCCESS;
+}
+
+int ImageValidator::Update(const unsigned char *image, unsigned long size)
+{
+	unsigned long words;
+	int rc;
+
+	if (size > RMI_IMG_MAX_SIZE) {
+		if (!m_quiet)
+			fprintf(stderr, "Firmware image is larger than %d bytes\n", RMI_IMG_MAX_SIZE);
+		return UPDATE_FAIL_VERIFY_IMAGE;
+	}
+
+	// Fold in the whole words which have arrived since the last call
+	if (size > m_summed + 1) {
+		words = (size - m_summed) / 2;
+		m_checksum.Update((const unsigned short *)&image[m_summed], words);
+		m_summed += words * 2;
+	}
+
+	while (m_state != IMAGE_CHECK_DONE && size >= m_expectedSize) {
+		if (m_state == IMAGE_CHECK_HEADER)
+			rc = CheckHeader(image);
+		else
+			rc = CheckDirectory(image);
+		if (rc != UPDATE_SUCCESS)
+			return rc;
+	}
+
+	return UPDATE_SUCCESS;
+}
+
+int ImageValidator::Finish(const unsigned char *image, unsigned long size)
+{
+	unsigned long checksum;
+	int rc;
+
+	rc = Update(image, size);
+	if (rc != UPDATE_SUCCESS)
+		return rc;
+
+	if (m_state != IMAGE_CHECK_DONE || size < m_expectedSize) {
+		if (!m_quiet)
+			fprintf(stderr, "Firmware image is truncated, read %lu of at least %lu bytes\n",
+				size, m_expectedSize);
+		return UPDATE_FAIL_IMAGE_TRUNCATED;
+	}
+
+	/*
+	 * Since the header size is fixed and the firmware is in 16 byte
+	 * blocks a valid image size should always be divisible by 2.
+	 */
+	if (size % 2)
+		return UPDATE_FAIL_VERIFY_IMAGE;
+
+	checksum = m_checksum.Get();
+	if (extract_long(&image[RMI_IMG_CHECKSUM_OFFSET]) != checksum) {
+		if (!m_quiet)
+			fprintf(stderr, "Firmware image checksum verification failed, saw 0x%08lX, calculated 0x%08lX\n",
+				extract_long(&image[RMI_IMG_CHECKSUM_OFFSET]), checksum);
+		return UPDATE_FAIL_VERIFY_CHECKSUM;
+	}
+
+	return UPDATE_SUCCESS;
+}
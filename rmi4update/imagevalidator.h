@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _IMAGEVALIDATOR_H_
+#define _IMAGEVALIDATOR_H_
+
+#include "checksum.h"
+#include "firmware_image.h"
+
+/*
+ * Checks an image while it is being read. The checksum is computed as each
+ * piece arrives and the header and container directory are checked as
+ * soon as the bytes they need have been read, so an image which cannot
+ * be valid is rejected without reading the rest of it. Addresses in the
+ * image are checked against RMI_IMG_MAX_SIZE, which bounds the memory a
+ * bad image can make the reader use.
+ */
+class ImageValidator
+{
+public:
+	// quiet leaves reporting why an image is bad to the caller
+	ImageValidator(bool quiet = false) : m_quiet(quiet), m_state(IMAGE_CHECK_HEADER), m_summed(4),
+				m_expectedSize(RMI_IMG_FW_OFFSET), m_cntrAddr(0),
+				m_listAddr(0), m_listLength(0) {}
+
+	// image holds the first size bytes read so far, size only grows between
+	// calls. Returns an UPDATE_FAIL code once the image is known to be bad.
+	int Update(const unsigned char *image, unsigned long size);
+	// Called when the whole image has been read
+	int Finish(const unsigned char *image, unsigned long size);
+	// The least the image can hold, given what has been read so far
+	unsigned long GetExpectedSize() { return m_expectedSize; }
+
+private:
+	enum image_check_state {
+		IMAGE_CHECK_HEADER = 0,
+		IMAGE_CHECK_TOP_LEVEL,
+		IMAGE_CHECK_CONTAINER_LIST,
+		IMAGE_CHECK_CONTAINERS,
+		IMAGE_CHECK_DONE,
+	};
+
+	int CheckHeader(const unsigned char *image);
+	int CheckDirectory(const unsigned char *image);
+	void Expect(unsigned long addr, unsigned long len);
+
+	bool m_quiet;
+	enum image_check_state m_state;
+	ImageChecksum m_checksum;
+	// Bytes of the image added to the checksum, which skips the first 4
+	unsigned long m_summed;
+	unsigned long m_expectedSize;
+	unsigned long m_cntrAddr;
+	unsigned long m_listAddr;
+	unsigned long m_listLength;
+};
+
+#endif // _IMAGEVALIDATOR_H_
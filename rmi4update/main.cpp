@@ -16,6 +16,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <getopt.h>
@@ -28,21 +29,27 @@
 #include <string>
 #include <sstream>
 #include <time.h>
+#include <signal.h>
 
 #include "hiddevice.h"
+#include "simdevice.h"
+#include "tracedevice.h"
+#include "replaydevice.h"
 #include "rmi4update.h"
+#include "fleetupdate.h"
+#include "imagecatalog.h"
 
 #define VERSION_MAJOR		1
 #define VERSION_MINOR		3
 #define VERSION_SUBMINOR	12
 
-#define RMI4UPDATE_GETOPTS	"hfd:t:pclvm"
+#define RMI4UPDATE_GETOPTS	"hfd:t:pclvmaukos:R:P:TLDVb:j:FJ:C:q:"
 
 bool needDebugMessage; 
 
 void printHelp(const char *prog_name)
 {
-	fprintf(stdout, "Usage: %s [OPTIONS] FIRMWAREFILE\n", prog_name);
+	fprintf(stdout, "Usage: %s [OPTIONS] FIRMWAREFILE (- for stdin)\n", prog_name);
 	fprintf(stdout, "\t-h, --help\t\tPrint this message\n");
 	fprintf(stdout, "\t-f, --force\t\tForce updating firmware even it the image provided is older\n\t\t\t\tthen the current firmware on the device.\n");
 	fprintf(stdout, "\t-d, --device\t\thidraw device file associated with the device being updated.\n");
@@ -51,6 +58,36 @@ void printHelp(const char *prog_name)
 	fprintf(stdout, "\t-l, --lockdown\t\tPerform lockdown.\n");
 	fprintf(stdout, "\t-v, --version\t\tPrint version number.\n");
 	fprintf(stdout, "\t-t, --device-type\tFilter by device type [touchpad or touchscreen].\n");
+	fprintf(stdout, "\t-a, --attn-reader\tQueue attention reports from a background reader thread.\n");
+	fprintf(stdout, "\t-u, --io-uring\t\tSend and receive reports through io_uring.\n");
+	fprintf(stdout, "\t-k, --reg-cache\t\tCache query registers instead of reading them again.\n");
+	fprintf(stdout, "\t-o, --profile-cache\tReuse the register map and erase times saved by earlier runs.\n");
+	fprintf(stdout, "\t-s, --simulate [opts]\tUpdate a simulated device configured by a list of options.\n");
+	fprintf(stdout, "\t-R, --record-trace [file]\tRecord every access to the device to a trace file.\n");
+	fprintf(stdout, "\t-P, --replay-trace [file]\tPlay back a trace file instead of using a device.\n");
+	fprintf(stdout, "\t-T, --replay-timing\tPlay back the trace at the recorded timing.\n");
+	fprintf(stdout, "\t-L, --latency-stats\tPrint transport latency statistics on exit and on SIGUSR1.\n");
+	fprintf(stdout, "\t-D, --differential\tSkip partitions which already match the image (v7 and later).\n");
+	fprintf(stdout, "\t-b, --backup [file]\tSave the device's firmware to an image file instead of updating (v7 and later).\n");
+	fprintf(stdout, "\t-j, --journal [file]\tRecord the update's progress to resume it if it is interrupted (v7 and later).\n");
+	fprintf(stdout, "\t-V, --verify\t\tRead back the written partitions and compare them with the image (v7 and later).\n");
+	fprintf(stdout, "\t-F, --fleet\t\tUpdate every matching hidraw device at once.\n");
+	fprintf(stdout, "\t-J, --timing [file]\tSave the time and transfers taken by each phase of the update as JSON.\n");
+	fprintf(stdout, "\t-C, --catalog [dir]\tList the images in dir, or with -d or -t update the device with its newest one.\n");
+	fprintf(stdout, "\t-q, --read-pipeline [depth[,bytes]]\tRead partitions in requests of bytes, depth of them at once (v7 and later).\n");
+}
+
+// Parses depth[,bytes] for -q
+bool ParseReadPipeline(const char *arg, int *depth, int *bytes)
+{
+	char *end;
+
+	*depth = strtol(arg, &end, 0);
+	*bytes = 0;
+	if (*end == ',')
+		*bytes = strtol(end + 1, &end, 0);
+
+	return !*end && *depth > 0 && *bytes >= 0 && *bytes <= 0xFFFF;
 }
 
 void printVersion()
@@ -59,9 +96,95 @@ void printVersion()
 		VERSION_MAJOR, VERSION_MINOR, VERSION_SUBMINOR);
 }
 
-int GetFirmwareProps(const char * deviceFile, std::string &props, bool configid)
+int UpdateFleet(FirmwareImage &image, enum RMIDeviceType deviceType,
+		const struct fleet_options &options, bool useAttnReader, bool useIoUring,
+		bool useRegisterCache, bool printLatencyStats)
+{
+	HIDDevice finder;
+	std::vector<std::string> deviceFiles;
+	std::vector<HIDDevice *> devices;
+	FleetUpdate fleet(image);
+	int failed;
+
+	if (finder.FindDevices(deviceType, deviceFiles) <= 0) {
+		fprintf(stderr, "No devices found\n");
+		return 1;
+	}
+
+	for (size_t i = 0; i < deviceFiles.size(); ++i) {
+		HIDDevice *device = new HIDDevice();
+
+		device->m_hasDebug = needDebugMessage;
+		device->EnableAttentionReader(useAttnReader);
+		device->EnableIoUring(useIoUring);
+		device->EnableLatencyStats(printLatencyStats);
+		device->EnableRegisterCache(useRegisterCache);
+		devices.push_back(device);
+		fleet.AddDevice(deviceFiles[i], device);
+	}
+
+	failed = fleet.Run(options);
+
+	for (size_t i = 0; i < devices.size(); ++i) {
+		if (printLatencyStats) {
+			fprintf(stdout, "\n%s:\n", deviceFiles[i].c_str());
+			devices[i]->GetLatencyStats().Print(stdout);
+		}
+		delete devices[i];
+	}
+
+	return failed ? 1 : 0;
+}
+
+// Picks the newest image in the catalog built for the device's product,
+// bootloader and partition sizes
+int FindCatalogImage(RMIDevice &rmidevice, const char *deviceFile, enum RMIDeviceType deviceType,
+			ImageCatalog &catalog, std::string &imagePath)
+{
+	const struct catalog_entry *entry;
+	struct catalog_device device;
+	FirmwareImage noImage;
+	RMI4Update update(rmidevice, noImage);
+	int rc;
+
+	if (deviceFile) {
+		if (rmidevice.Open(deviceFile))
+			return UPDATE_FAIL;
+	} else if (!rmidevice.FindDevice(deviceType)) {
+		return UPDATE_FAIL;
+	}
+
+	if (needDebugMessage)
+		rmidevice.m_hasDebug = true;
+
+	rc = update.ReadFlashLayout(&device.bootloaderVersion, &device.firmwareSize,
+					&device.configSize);
+	device.productID = rmidevice.GetProductID();
+	rmidevice.Close();
+	if (rc != UPDATE_SUCCESS)
+		return rc;
+
+	entry = catalog.FindNewest(device);
+	if (!entry) {
+		fprintf(stderr, "No image for %s with bootloader v%u, %lu byte firmware and %lu "
+			"byte config in the catalog\n", device.productID.c_str(),
+			device.bootloaderVersion, device.firmwareSize, device.configSize);
+		if (!catalog.FindNewest(device.productID.c_str()))
+			return UPDATE_FAIL_VERIFY_IMAGE_PRODUCTID_NOT_MATCH;
+		return UPDATE_FAIL_UNSUPPORTED_IMAGE_VERSION;
+	}
+
+	imagePath = catalog.GetPath(*entry);
+	fprintf(stdout, "Using %s, build %lu, for %s\n", entry->name.c_str(), entry->buildID,
+		device.productID.c_str());
+
+	return UPDATE_SUCCESS;
+}
+
+int GetFirmwareProps(RMIDevice &rmidevice, const char * deviceFile, std::string &props,
+			bool configid, const std::string &profileDir)
 {
-	HIDDevice rmidevice;
+	DeviceProfile profile;
 	int rc = UPDATE_SUCCESS;
 	std::stringstream ss;
 
@@ -75,8 +198,12 @@ int GetFirmwareProps(const char * deviceFile, std::string &props, bool configid)
 	// Clear all interrupts before parsing to avoid unexpected interrupts.
 	rmidevice.ToggleInterruptMask(false);
 
-	rmidevice.ScanPDT(0x1);
-	rmidevice.QueryBasicProperties();
+	if (profileDir.empty() || !rmidevice.LoadProfile(profileDir, profile, 0x1)) {
+		rmidevice.ScanPDT(0x1);
+		rmidevice.QueryBasicProperties();
+		if (!profileDir.empty())
+			rmidevice.SaveProfile(profileDir, profile, 0x1);
+	}
 
 	// Restore the interrupts
 	rmidevice.ToggleInterruptMask(true);
@@ -115,13 +242,49 @@ int main(int argc, char **argv)
 		{"lockdown", 0, NULL, 'l'},
 		{"version", 0, NULL, 'v'},
 		{"device-type", 1, NULL, 't'},
+		{"attn-reader", 0, NULL, 'a'},
+		{"io-uring", 0, NULL, 'u'},
+		{"reg-cache", 0, NULL, 'k'},
+		{"profile-cache", 0, NULL, 'o'},
+		{"simulate", 1, NULL, 's'},
+		{"record-trace", 1, NULL, 'R'},
+		{"replay-trace", 1, NULL, 'P'},
+		{"replay-timing", 0, NULL, 'T'},
+		{"latency-stats", 0, NULL, 'L'},
+		{"differential", 0, NULL, 'D'},
+		{"verify", 0, NULL, 'V'},
+		{"backup", 1, NULL, 'b'},
+		{"journal", 1, NULL, 'j'},
+		{"fleet", 0, NULL, 'F'},
+		{"timing", 1, NULL, 'J'},
+		{"catalog", 1, NULL, 'C'},
+		{"read-pipeline", 1, NULL, 'q'},
 		{0, 0, 0, 0},
 	};
 	bool printFirmwareProps = false;
 	bool printConfigid = false;
 	bool performLockdown = false;
+	bool useAttnReader = false;
+	bool useIoUring = false;
+	bool useRegisterCache = false;
+	bool printLatencyStats = false;
+	bool differential = false;
+	bool verify = false;
+	const char *backupName = NULL;
+	const char *journalName = NULL;
+	const char *timingName = NULL;
+	const char *catalogDir = NULL;
+	int readPipelineDepth = 1;
+	int readRequestSize = 0;
+	std::string catalogImage;
+	bool updateFleet = false;
+	std::string profileDir;
 	needDebugMessage = false;
-	HIDDevice device;
+	HIDDevice hidDevice;
+	SimDevice simDevice;
+	ReplayDevice replayDevice;
+	RMIDevice *device = &hidDevice;
+	const char *traceName = NULL;
 	enum RMIDeviceType deviceType = RMI_DEVICE_TYPE_ANY;
 
 	while ((opt = getopt_long(argc, argv, RMI4UPDATE_GETOPTS, long_options, &index)) != -1) {
@@ -157,12 +320,80 @@ int main(int argc, char **argv)
 			case 'm':
 				needDebugMessage = true;
 				break;
+			case 'a':
+				useAttnReader = true;
+				break;
+			case 'u':
+				useIoUring = true;
+				break;
+			case 'k':
+				useRegisterCache = true;
+				break;
+			case 'o':
+				profileDir = DeviceProfile::GetDefaultDir();
+				break;
+			case 's':
+				deviceName = optarg;
+				device = &simDevice;
+				break;
+			case 'R':
+				traceName = optarg;
+				break;
+			case 'P':
+				deviceName = optarg;
+				device = &replayDevice;
+				break;
+			case 'T':
+				replayDevice.SetRealTime(true);
+				break;
+			case 'L':
+				printLatencyStats = true;
+				break;
+			case 'D':
+				differential = true;
+				break;
+			case 'V':
+				verify = true;
+				break;
+			case 'b':
+				backupName = optarg;
+				break;
+			case 'j':
+				journalName = optarg;
+				break;
+			case 'F':
+				updateFleet = true;
+				break;
+			case 'J':
+				timingName = optarg;
+				break;
+			case 'C':
+				catalogDir = optarg;
+				break;
+			case 'q':
+				if (!ParseReadPipeline(optarg, &readPipelineDepth, &readRequestSize)) {
+					fprintf(stderr, "Invalid read pipeline: %s\n", optarg);
+					return 1;
+				}
+				break;
 			default:
 				break;
 
 		}
 	}
 
+	TraceDevice traceDevice(*device);
+	if (traceName) {
+		if (traceDevice.StartTrace(traceName) < 0) {
+			fprintf(stderr, "Failed to create trace file %s: %s\n", traceName,
+				strerror(errno));
+			return 1;
+		}
+	}
+	// The trace device counts the transfers for the timing
+	if (traceName || timingName)
+		device = &traceDevice;
+
 	if (printFirmwareProps) {
 		std::string props;
 		
@@ -170,7 +401,7 @@ int main(int argc, char **argv)
 			fprintf(stderr, "Specifiy which device to query\n");
 			return 1;
 		}
-		rc = GetFirmwareProps(deviceName, props, printConfigid);
+		rc = GetFirmwareProps(*device, deviceName, props, printConfigid, profileDir);
 		if (rc) {
 			fprintf(stderr, "Failed to read properties from device: %s\n", update_err_to_string(rc));
 			return 1;
@@ -179,41 +410,124 @@ int main(int argc, char **argv)
 		return 0;
 	}
 
+	if (catalogDir) {
+		ImageCatalog catalog(catalogDir);
+
+		if (optind < argc) {
+			fprintf(stderr, "-C picks the image itself, it cannot be given a firmware file\n");
+			return 1;
+		}
+
+		if (catalog.Scan(sysconf(_SC_NPROCESSORS_ONLN)) < 0) {
+			fprintf(stderr, "Failed to read the image directory %s: %s\n", catalogDir,
+				strerror(errno));
+			return 1;
+		}
+
+		if (!deviceName && deviceType == RMI_DEVICE_TYPE_ANY) {
+			catalog.Print(stdout);
+			return 0;
+		}
+
+		if (updateFleet) {
+			fprintf(stderr, "Fleet updates need an image file\n");
+			return 1;
+		}
+
+		rc = FindCatalogImage(*device, deviceName, deviceType, catalog, catalogImage);
+		if (rc != UPDATE_SUCCESS) {
+			fprintf(stderr, "Failed to find an image for the device: %s\n",
+				update_err_to_string(rc));
+			return 1;
+		}
+		firmwareName = catalogImage.c_str();
+	}
+
 	if (optind < argc) {
 		firmwareName = argv[optind];
-	} else {
+	} else if (!backupName && !firmwareName) {
 		printHelp(argv[0]);
 		return -1;
 	}
 
-	rc = image.Initialize(firmwareName);
-	if (rc != UPDATE_SUCCESS) {
-		fprintf(stderr, "Failed to initialize the firmware image: %s\n", update_err_to_string(rc));
-		return 1;
+	if (firmwareName) {
+		rc = image.Initialize(firmwareName);
+		if (rc != UPDATE_SUCCESS) {
+			fprintf(stderr, "Failed to initialize the firmware image: %s\n",
+				update_err_to_string(rc));
+			return 1;
+		}
 	}
 
+	if (updateFleet) {
+		struct fleet_options options;
+
+		if (deviceName || traceName || backupName) {
+			fprintf(stderr, "Fleet updates find their own hidraw devices\n");
+			return 1;
+		}
+
+		options.force = force;
+		options.performLockdown = performLockdown;
+		options.differential = differential;
+		options.verify = verify;
+		options.journalName = journalName;
+		options.timingName = timingName;
+		options.profileDir = profileDir.empty() ? NULL : profileDir.c_str();
+		options.readPipelineDepth = readPipelineDepth;
+		options.readRequestSize = readRequestSize;
+
+		return UpdateFleet(image, deviceType, options, useAttnReader, useIoUring,
+				useRegisterCache, printLatencyStats);
+	}
+
+	hidDevice.EnableAttentionReader(useAttnReader);
+	hidDevice.EnableIoUring(useIoUring);
+	hidDevice.EnableLatencyStats(printLatencyStats);
+	if (printLatencyStats)
+		hidDevice.GetLatencyStats().PrintOnSignal(SIGUSR1);
+	device->EnableRegisterCache(useRegisterCache);
+
 	if (deviceName) {
-		 rc = device.Open(deviceName);
+		 rc = device->Open(deviceName);
 		 if (rc) {
 			fprintf(stderr, "%s: failed to initialize rmi device (%d): %s\n", argv[0], errno,
 				strerror(errno));
 			return 1;
 		}
 	} else {
-		if (!device.FindDevice(deviceType))
+		if (!device->FindDevice(deviceType))
 			return 1;
 	}
 
 	if (needDebugMessage) {
-		device.m_hasDebug = true;
+		device->m_hasDebug = true;
 	}
 
-	RMI4Update update(device, image);
-	rc = update.UpdateFirmware(force, performLockdown);
+	UpdateTiming timing(traceDevice);
+	RMI4Update update(*device, image);
+	update.SetDifferential(differential);
+	update.SetVerify(verify);
+	update.SetProfileDir(profileDir);
+	update.SetReadPipeline(readPipelineDepth, readRequestSize);
+	if (journalName)
+		update.SetJournal(journalName);
+	if (timingName)
+		update.SetTiming(&timing);
+	if (backupName)
+		rc = update.BackupFirmware(backupName);
+	else
+		rc = update.UpdateFirmware(force, performLockdown);
+
+	if (timingName)
+		timing.Save(timingName, rc);
+
+	if (printLatencyStats)
+		hidDevice.GetLatencyStats().Print(stdout);
 
 	if (rc != UPDATE_SUCCESS)
 	{
-		device.Reset();
+		device->Reset();
 		return 1;
 	}
 
@@ -61,7 +61,15 @@
 #define RMI_F34_ERASE_WAIT_MS (5 * 1000)
 #define RMI_F34_ERASE_V8_WAIT_MS (10000)
 #define RMI_F34_IDLE_WAIT_MS 500
-#define RMI_F34_PARTITION_READ_WAIT_MS 20
+#define RMI_F34_COMPLETION_WAIT_MS 1000
+#define RMI_F34_ENTER_BL_WAIT_MS (2 * 1000)
+// Attention reports missed in a row before giving up on them
+#define RMI_F34_MAX_ATTENTION_MISSES 3
+#define RMI_REENUMERATE_WAIT_MS (30 * 1000)
+#define RMI_F34_POLL_MIN_US 1000
+#define RMI_F34_POLL_MAX_US (20 * 1000)
+#define RMI_F34_ERASE_POLL_MAX_US (100 * 1000)
+#define RMI_ERASE_TIMES_SUFFIX ".erase"
 
 /* Most recent device status event */
 #define RMI_F01_STATUS_CODE(status)		((status) & 0x0f)
@@ -96,8 +104,10 @@ int RMI4Update::UpdateFirmware(bool force, bool performLockdown)
 	struct timespec end;
 	long long int duration_us = 0;
 	int rc;
+	int updateRc;
 	const unsigned char eraseAll = RMI_F34_ERASE_ALL;
 
+	BeginPhase("query");
 	// Clear all interrupts before parsing to avoid unexpected interrupts.
 	m_device.ToggleInterruptMask(false);
 	rc = FindUpdateFunctions();
@@ -113,6 +123,7 @@ int RMI4Update::UpdateFirmware(bool force, bool performLockdown)
 	}
 	// Restore the interrupts
 	m_device.ToggleInterruptMask(true);
+	LoadEraseTimes();
 
 	if (!force && m_firmwareImage.HasIO()) {
 		if (m_firmwareImage.GetFirmwareID() <= m_device.GetFirmwareID()) {
@@ -150,12 +161,16 @@ int RMI4Update::UpdateFirmware(bool force, bool performLockdown)
 	} 
 
 	if (m_f34.GetFunctionVersion() == 0x02) {
+		OpenJournalV7();
+
 		fprintf(stdout, "Enable Flash V7+...\n");
+		BeginPhase("enter_bootloader");
 		rc = EnterFlashProgrammingV7();
 		if (rc != UPDATE_SUCCESS) {
 			fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
 			goto reset;
 		}
+		EndPhase(rc);
 		fprintf(stdout, "Enable Flash done V7+...\n");
 
 		if (IsBLv87()) {
@@ -177,6 +192,11 @@ int RMI4Update::UpdateFirmware(bool force, bool performLockdown)
 			}
 		}
 
+		if (m_differential && FindUnchangedPartitionsV7()) {
+			fprintf(stdout, "The device already matches the image\n");
+			goto reset;
+		}
+
 		if (m_bootloaderID[1] >= 10) {
 			fprintf(stdout, "Writing FLD V10...\n");
 			rc = WriteFLDV7();
@@ -186,13 +206,18 @@ int RMI4Update::UpdateFirmware(bool force, bool performLockdown)
 			}
 			fprintf(stdout, "Writing FLD done V10...\n");
 
-			fprintf(stdout, "Erasing Flash Config V10...\n");
-			rc = EraseFlashConfigV10();
-			if (rc != UPDATE_SUCCESS) {
-				fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
-				goto reset;
+			if (!m_partitionUnchanged[FLASH_CONFIG_PARTITION]
+				&& !m_journal.IsStepDone("erase_flash_config")) {
+				fprintf(stdout, "Erasing Flash Config V10...\n");
+				rc = EraseFlashConfigV10();
+				if (rc != UPDATE_SUCCESS) {
+					fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
+					goto reset;
+				}
+				EndPhase(rc);
+				m_journal.MarkStepDone("erase_flash_config");
+				fprintf(stdout, "Erasing Flash Config done V10...\n");
 			}
-			fprintf(stdout, "Erasing Flash Config done V10...\n");
 
 			if (m_firmwareImage.GetFlashConfigData()) {
 				fprintf(stdout, "Writing flash configuration V10...\n");
@@ -204,13 +229,18 @@ int RMI4Update::UpdateFirmware(bool force, bool performLockdown)
 				fprintf(stdout, "Writing flash config done V10...\n");
 			}
 
-			fprintf(stdout, "Erasing Core Code V10...\n");
-			rc = EraseCoreCodeV10();
-			if (rc != UPDATE_SUCCESS) {
-				fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
-				goto reset;
+			if (!m_partitionUnchanged[CORE_CODE_PARTITION]
+				&& !m_journal.IsStepDone("erase_core_code")) {
+				fprintf(stdout, "Erasing Core Code V10...\n");
+				rc = EraseCoreCodeV10();
+				if (rc != UPDATE_SUCCESS) {
+					fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
+					goto reset;
+				}
+				EndPhase(rc);
+				m_journal.MarkStepDone("erase_core_code");
+				fprintf(stdout, "Erasing Core Code done V10...\n");
 			}
-			fprintf(stdout, "Erasing Core Code done V10...\n");
 
 			if (m_firmwareImage.GetFirmwareData()) {
 				fprintf(stdout, "Writing Core Code V10...\n");
@@ -246,13 +276,17 @@ int RMI4Update::UpdateFirmware(bool force, bool performLockdown)
 
 
 		} else {
-			if (!m_IsErased){
+			if (!m_IsErased && !(m_partitionUnchanged[CORE_CODE_PARTITION]
+						&& m_partitionUnchanged[CORE_CONFIG_PARTITION])
+				&& !m_journal.IsStepDone("erase_firmware")) {
 				fprintf(stdout, "Erasing FW V7+...\n");
 				rc = EraseFirmwareV7();
 				if (rc != UPDATE_SUCCESS) {
 					fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
 					goto reset;
 				}
+				EndPhase(rc);
+				m_journal.MarkStepDone("erase_firmware");
 				fprintf(stdout, "Erasing FW done V7+...\n");
 			}
 			if(m_bootloaderID[1] == 8){
@@ -289,16 +323,19 @@ int RMI4Update::UpdateFirmware(bool force, bool performLockdown)
 		
 		
 	} else {
+		BeginPhase("enter_bootloader");
 		rc = EnterFlashProgramming();
 		if (rc != UPDATE_SUCCESS) {
 			fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
 			goto reset;
 		}
+		EndPhase(rc);
 	}
 
 	if (performLockdown && m_unlocked) {
 		if (m_firmwareImage.GetLockdownData()) {
 			fprintf(stdout, "Writing lockdown...\n");
+			BeginPhase("lockdown");
 			clock_gettime(CLOCK_MONOTONIC, &start);
 			rc = WriteBlocks(m_firmwareImage.GetLockdownData(),
 					m_firmwareImage.GetLockdownSize() / 0x10,
@@ -312,13 +349,17 @@ int RMI4Update::UpdateFirmware(bool force, bool performLockdown)
 			fprintf(stdout, "Done writing lockdown, time: %lld us.\n", duration_us);
 		}
 
+		BeginPhase("enter_bootloader");
 		rc = EnterFlashProgramming();
 		if (rc != UPDATE_SUCCESS) {
 			fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
 			goto reset;
 		}
+		EndPhase(rc);
 	}
 
+	// The bootloader ID unlocks the erase
+	BeginPhase("erase");
 	rc = WriteBootloaderID();
 	if (rc != UPDATE_SUCCESS) {
 		fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
@@ -334,7 +375,8 @@ int RMI4Update::UpdateFirmware(bool force, bool performLockdown)
 		goto reset;
 	}
 
-	rc = WaitForIdle(RMI_F34_ERASE_WAIT_MS);
+	// Erase all takes the code and the config
+	rc = WaitForEraseCompletion(CORE_CODE_PARTITION, RMI_F34_ERASE_WAIT_MS);
 	if (rc != UPDATE_SUCCESS) {
 		fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
 		goto reset;
@@ -345,6 +387,7 @@ int RMI4Update::UpdateFirmware(bool force, bool performLockdown)
 
 	if (m_firmwareImage.GetFirmwareData()) {
 		fprintf(stdout, "Writing firmware...\n");
+		BeginPhase("write", CORE_CODE_PARTITION);
 		clock_gettime(CLOCK_MONOTONIC, &start);
 		rc = WriteBlocks(m_firmwareImage.GetFirmwareData(), m_fwBlockCount,
 						RMI_F34_WRITE_FW_BLOCK);
@@ -359,6 +402,7 @@ int RMI4Update::UpdateFirmware(bool force, bool performLockdown)
 
 	if (m_firmwareImage.GetConfigData()) {
 		fprintf(stdout, "Writing configuration...\n");
+		BeginPhase("write", CORE_CONFIG_PARTITION);
 		clock_gettime(CLOCK_MONOTONIC, &start);
 		rc = WriteBlocks(m_firmwareImage.GetConfigData(), m_configBlockCount,
 				RMI_F34_WRITE_CONFIG_BLOCK);
@@ -372,30 +416,241 @@ int RMI4Update::UpdateFirmware(bool force, bool performLockdown)
 	}
 
 reset:
-	m_device.Reset();
-rebind:
-	if (m_bootloaderID[1] >= 10) {
-		Sleep(5000);
+	EndPhase(rc);
+	updateRc = rc;
+	if (m_verify && updateRc == UPDATE_SUCCESS) {
+		updateRc = VerifyWrittenPartitionsV7();
+		if (updateRc != UPDATE_SUCCESS)
+			fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(updateRc));
 	}
-	m_device.RebindDriver();
-	if(!m_device.CheckABSEvent())
-	{
-		goto rebind;
+
+	// A failed update is left in the journal to be resumed
+	if (updateRc == UPDATE_SUCCESS)
+		m_journal.Remove();
+
+	BeginPhase("reset");
+	m_device.Reset();
+	BeginPhase("reenumerate");
+	if (!m_device.Reenumerate(RMI_REENUMERATE_WAIT_MS)) {
+		fprintf(stderr, "%s: the device did not come back after the reset\n", __func__);
+		EndPhase(UPDATE_FAIL_TIMEOUT);
 	}
 
 	// In order to print out new PR
+	BeginPhase("query");
+	rc = FindUpdateFunctions();
+	if (rc == UPDATE_SUCCESS && m_device.QueryBasicProperties() < 0)
+		rc = UPDATE_FAIL_QUERY_BASIC_PROPERTIES;
+	EndPhase(rc);
+	if (rc != UPDATE_SUCCESS)
+		return rc;
+	fprintf(stdout, "Device Properties:\n");
+	m_device.PrintProperties();
+
+	// The device is back, but the update itself may have failed
+	if (updateRc != UPDATE_SUCCESS)
+		return updateRc;
+
+	return rc;
+
+}
+
+int RMI4Update::ReadFlashLayout(unsigned char *bootloaderVersion, unsigned long *firmwareSize,
+				unsigned long *configSize)
+{
+	int rc;
+
+	m_device.ToggleInterruptMask(false);
 	rc = FindUpdateFunctions();
+	if (rc != UPDATE_SUCCESS) {
+		m_device.ToggleInterruptMask(true);
+		return rc;
+	}
+
+	rc = m_device.QueryBasicProperties();
+	if (rc < 0) {
+		m_device.ToggleInterruptMask(true);
+		return UPDATE_FAIL_QUERY_BASIC_PROPERTIES;
+	}
+
+	rc = ReadF34Queries();
+	m_device.ToggleInterruptMask(true);
 	if (rc != UPDATE_SUCCESS)
 		return rc;
 
+	*bootloaderVersion = m_bootloaderID[1];
+	*firmwareSize = GetFirmwareSize();
+	*configSize = GetConfigSize();
+
+	return UPDATE_SUCCESS;
+}
+
+int RMI4Update::BackupFirmware(const char * filename)
+{
+	std::vector<struct image_container> containers;
+	struct timespec start;
+	struct timespec end;
+	int rc;
+
+	BeginPhase("query");
+	m_device.ToggleInterruptMask(false);
+	rc = FindUpdateFunctions();
+	if (rc != UPDATE_SUCCESS) {
+		m_device.ToggleInterruptMask(true);
+		return rc;
+	}
+
 	rc = m_device.QueryBasicProperties();
+	m_device.ToggleInterruptMask(true);
 	if (rc < 0)
 		return UPDATE_FAIL_QUERY_BASIC_PROPERTIES;
+
 	fprintf(stdout, "Device Properties:\n");
 	m_device.PrintProperties();
 
-	return rc;
+	if (m_f34.GetFunctionVersion() != 0x02) {
+		fprintf(stderr, "Backing up needs a v7 or later bootloader\n");
+		return UPDATE_FAIL_UNSUPPORTED_BOOTLOADER;
+	}
+
+	rc = DisableNonessentialInterupts();
+	if (rc != UPDATE_SUCCESS)
+		return rc;
+
+	rc = ReadF34Queries();
+	if (rc != UPDATE_SUCCESS)
+		return rc;
+
+	fprintf(stdout, "Enable Flash V7+...\n");
+	BeginPhase("enter_bootloader");
+	rc = EnterFlashProgrammingV7();
+	if (rc != UPDATE_SUCCESS) {
+		fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
+		goto reset;
+	}
+	EndPhase(rc);
+	fprintf(stdout, "Enable Flash done V7+...\n");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rc = BackupPartitionsV7(containers);
+	if (rc != UPDATE_SUCCESS) {
+		fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
+		goto reset;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	fprintf(stdout, "Done reading partitions, time: %lld us.\n", diff_time(&start, &end));
+
+reset:
+	EndPhase(rc);
+	BeginPhase("reset");
+	m_device.Reset();
+	BeginPhase("reenumerate");
+	if (!m_device.Reenumerate(RMI_REENUMERATE_WAIT_MS)) {
+		fprintf(stderr, "%s: the device did not come back after the reset\n", __func__);
+		EndPhase(UPDATE_FAIL_TIMEOUT);
+	}
+	EndPhase(UPDATE_SUCCESS);
+
+	if (rc != UPDATE_SUCCESS)
+		return rc;
+
+	rc = FirmwareImage::WriteHierarchicalImage(filename, containers);
+	if (rc != UPDATE_SUCCESS)
+		return rc;
+
+	fprintf(stdout, "Saved the firmware to %s\n", filename);
+
+	return UPDATE_SUCCESS;
+}
+
+/*
+ * Reads each partition in the partition table which an image can hold,
+ * along with the containers describing the device, so the image can be
+ * flashed back later. The partitions are read in transfers of the full
+ * payload length, through the read pipeline set by SetReadPipeline().
+ */
+int RMI4Update::BackupPartitionsV7(std::vector<struct image_container> &containers)
+{
+	static const struct {
+		unsigned short partitionID;
+		unsigned short containerID;
+	} backup_containers[] = {
+		{ CORE_CODE_PARTITION, CORE_CODE_CONTAINER },
+		{ CORE_CONFIG_PARTITION, CORE_CONFIG_CONTAINER },
+		{ FLASH_CONFIG_PARTITION, FLASH_CONFIG_CONTAINER },
+		{ FIXED_LOCATION_DATA_PARTITION, FIXED_LOCATION_DATA_CONTAINER },
+		{ GLOBAL_PARAMETERS_PARTITION, GLOBAL_PARAMETERS_CONTAINER },
+		{ GUEST_CODE_PARTITION, GUEST_CODE_CONTAINER },
+	};
+	struct image_container container;
+	const char *productID = m_device.GetProductID();
+	int rc;
+
+	// BL v10 touchpads do not read the partition table when querying F34
+	if (m_partitionTable.empty()) {
+		rc = ReadFlashConfig();
+		if (rc != UPDATE_SUCCESS)
+			return rc;
+	}
+
+	container.id = BL_CONTAINER;
+	container.content.assign(1, m_bootloaderID[1]);
+	containers.push_back(container);
+
+	container.id = GENERAL_INFORMATION_CONTAINER;
+	container.content.assign(RMI_IMG_GENERAL_INFO_SIZE, 0);
+	container.content[0] = m_device.GetPackageID() & 0xFF;
+	container.content[1] = m_device.GetPackageID() >> 8;
+	for (int i = 0; i < 4; ++i)
+		container.content[4 + i] = (m_device.GetFirmwareID() >> (i * 8)) & 0xFF;
+	memcpy(&container.content[RMI_IMG_GENERAL_INFO_PRODUCT_ID_OFFSET], productID,
+		strnlen(productID, RMI_PRODUCT_ID_LENGTH));
+	containers.push_back(container);
+
+	for (size_t i = 0; i < sizeof(backup_containers) / sizeof(backup_containers[0]); ++i) {
+		for (size_t j = 0; j < m_partitionTable.size(); ++j) {
+			if (m_partitionTable[j].partition_id != backup_containers[i].partitionID
+				|| !m_partitionTable[j].partition_len)
+				continue;
+
+			fprintf(stdout, "Reading partition %d, %d blocks...\n",
+				m_partitionTable[j].partition_id, m_partitionTable[j].partition_len);
+			container.id = backup_containers[i].containerID;
+			container.content.resize(m_partitionTable[j].partition_len * m_blockSize);
+			BeginPhase("read", m_partitionTable[j].partition_id);
+			rc = ReadPartitionV7(m_partitionTable[j].partition_id, &container.content[0],
+						m_partitionTable[j].partition_len);
+			EndPhase(rc);
+			if (rc != UPDATE_SUCCESS)
+				return rc;
+			containers.push_back(container);
+			break;
+		}
+	}
+
+	return UPDATE_SUCCESS;
+}
+
+/*
+ * An interrupted update is only resumed if the device is still in the
+ * bootloader, otherwise its flash may have changed since. Touchscreens are
+ * erased on entering the bootloader, so they always start again.
+ */
+void RMI4Update::OpenJournalV7()
+{
+	if (m_journalPath.empty())
+		return;
+
+	if (m_journal.Open(m_journalPath, m_firmwareImage.GetHash(), m_device.GetProductID())) {
+		if (rmi4update_poll() == 0 && m_inBLmode
+			&& m_device.GetDeviceType() == RMI_DEVICE_TYPE_TOUCHPAD) {
+			fprintf(stdout, "Resuming the update recorded in %s\n", m_journalPath.c_str());
+			return;
+		}
+		fprintf(stdout, "The device is not in the bootloader, not resuming the update\n");
+	}
 
+	m_journal.Restart();
 }
 
 int RMI4Update::DisableNonessentialInterupts()
@@ -430,6 +685,9 @@ int RMI4Update::rmi4update_poll()
 	unsigned short dataAddr = m_f34.GetDataBase();
 	int rc;
 
+	if (m_timing)
+		m_timing->CountPoll();
+
 	rc = m_device.Read(dataAddr, &f34_status, sizeof(unsigned char));
 	if (rc != sizeof(unsigned char))
 		return UPDATE_FAIL_WRITE_FLASH_COMMAND;
@@ -445,101 +703,35 @@ int RMI4Update::rmi4update_poll()
 int RMI4Update::ReadFlashConfig()
 {
 	int rc;
-	int transaction_count, remain_block;
 	unsigned char *flash_cfg;
-	int transfer_leng = 0;
-	int read_leng = 0;
-	int offset = 0;
-	unsigned char trans_leng_buf[2];
-	unsigned char cmd_buf[1];
-	unsigned char off[2] = {0, 0};
-	unsigned char partition_id = FLASH_CONFIG_PARTITION;
-	unsigned short dataAddr = m_f34.GetDataBase();
 	int i;
-	int retry = 0;
-	unsigned char *data_temp;
 	struct partition_tbl *partition_temp;
 
 	flash_cfg = (unsigned char *)malloc(m_blockSize * m_flashConfigLength);
 	memset(flash_cfg, 0, m_blockSize * m_flashConfigLength);
 	partition_temp = (partition_tbl *)malloc(sizeof(struct partition_tbl));
 	memset(partition_temp, 0, sizeof(struct partition_tbl));
-	/* calculate the count */
-	remain_block = (m_flashConfigLength % m_payloadLength);
-	transaction_count = (m_flashConfigLength / m_payloadLength);
-
-	if (remain_block > 0)
-		transaction_count++;
-
-	/* set partition id for bootloader 7 */
-	rc = m_device.Write(dataAddr + 1, &partition_id, sizeof(partition_id));
-	if (rc != sizeof(partition_id))
-		return UPDATE_FAIL_WRITE_FLASH_COMMAND;
-	rc = m_device.Write(dataAddr + 2, off, sizeof(off));
-	if (rc != sizeof(off))
-		return UPDATE_FAIL_WRITE_INITIAL_ZEROS;
-
-	for (i = 0; i < transaction_count; i++)
-	{
-		if ((i == (transaction_count -1)) && (remain_block > 0))
-			transfer_leng = remain_block;
-		else
-			transfer_leng = m_payloadLength;
-
-		// Set Transfer Length
-		trans_leng_buf[0] = (unsigned char)(transfer_leng & 0xFF);
-		trans_leng_buf[1] = (unsigned char)((transfer_leng & 0xFF00) >> 8);
-		rc = m_device.Write(dataAddr + 3, trans_leng_buf, sizeof(trans_leng_buf));
-		if (rc != sizeof(trans_leng_buf))
-			return UPDATE_FAIL_WRITE_FLASH_COMMAND;
-
-		// Set Command to Read
-		cmd_buf[0] = (unsigned char)CMD_V7_READ;
-		rc = m_device.Write(dataAddr + 4, cmd_buf, sizeof(cmd_buf));
-		if (rc != sizeof(cmd_buf))
-			return UPDATE_FAIL_WRITE_FLASH_COMMAND;
-
-		if(m_device.GetDeviceType() == RMI_DEVICE_TYPE_TOUCHPAD)  {
-			// Sleep 20 ms and wait for attention for touchpad only.
-			Sleep(20);
-			rc = WaitForIdle(RMI_F34_PARTITION_READ_WAIT_MS, false);
-			if (rc != UPDATE_SUCCESS) {
-				fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
-				return UPDATE_FAIL_TIMEOUT_WAITING_FOR_ATTN;
-			}
-			fprintf(stdout, "Got attention\n");
-		}
-
-		//Wait for completion
-		do {
-			Sleep(20);
-			rmi4update_poll();
-			if (m_flashStatus == SUCCESS){
-				break;
-			}
-			retry++;
-		} while(retry < 20);
 
-		read_leng = transfer_leng * m_blockSize;
-		data_temp = (unsigned char *) malloc(sizeof(char) * read_leng);
-		rc = m_device.Read(dataAddr + 5, data_temp, sizeof(char) * read_leng);
-		if (rc != ((ssize_t)sizeof(char) * read_leng))
-			return UPDATE_FAIL_READ_F34_QUERIES;
-
-		memcpy(flash_cfg + offset, data_temp, sizeof(char) * read_leng);
-		offset += read_leng;
-		free(data_temp);
+	rc = ReadPartitionV7(FLASH_CONFIG_PARTITION, flash_cfg, m_flashConfigLength);
+	if (rc != UPDATE_SUCCESS) {
+		fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
+		free(flash_cfg);
+		free(partition_temp);
+		return rc;
 	}
 
 	// Initialize as NULL here to avoid segmentation fault.
 	m_partitionConfig = NULL;
 	m_partitionCore = NULL;
 	m_partitionGuest = NULL;
+	m_partitionTable.clear();
 
 	/* parse the config length */
 	for (i = 2; i < m_blockSize * m_flashConfigLength; i = i + 8)
 	{
 		memcpy(partition_temp->data ,flash_cfg + i, sizeof(struct partition_tbl));
+		if (partition_temp->partition_id != NONE_PARTITION)
+			m_partitionTable.push_back(*partition_temp);
 		if (partition_temp->partition_id == CORE_CONFIG_PARTITION)
 		{
 			m_partitionConfig = (partition_tbl *) malloc(sizeof(struct partition_tbl));
@@ -777,583 +969,435 @@ int RMI4Update::WriteBootloaderID()
 	return UPDATE_SUCCESS;
 }
 
+/*
+ * How each partition is written. The data and its length come from the
+ * image, see GetPartitionDataV7().
+ */
+static const struct partition_write_v7 partition_writes_v7[] = {
+	{ CORE_CODE_PARTITION, BLv7_CORE_CODE, false },
+	{ CORE_CONFIG_PARTITION, BLv7_CORE_CONFIG, false },
+	{ FLASH_CONFIG_PARTITION, BLv7_FLASH_CONFIG, true },
+	{ FIXED_LOCATION_DATA_PARTITION, BLv7_FLD, true },
+	{ GLOBAL_PARAMETERS_PARTITION, -1, false },
+};
+
 int RMI4Update::WriteFirmwareV7()
 {
-	int transaction_count, remain_block;
-	int transfer_leng = 0;
-	int offset = 0;
-	unsigned char trans_leng_buf[2];
-	unsigned char cmd_buf[1];
-	unsigned char off[2] = {0, 0};
-	unsigned char partition_id;
-	int i;
-	int retry = 0;
-	unsigned char *data_temp;
-	int rc;
-	unsigned short left_bytes;
-	unsigned short write_size;
-	unsigned short max_write_size;
-	unsigned short dataAddr = m_f34.GetDataBase();
+	return WritePartitionV7(CORE_CODE_PARTITION);
+}
+
+int RMI4Update::WriteCoreConfigV7()
+{
+	return WritePartitionV7(CORE_CONFIG_PARTITION);
+}
+
+int RMI4Update::WriteFlashConfigV7()
+{
+	return WritePartitionV7(FLASH_CONFIG_PARTITION);
+}
 
-	if (m_bootloaderID[1] == 10) {
-		m_fwBlockCount = m_firmwareImage.GetFirmwareSize() / m_blockSize;
+int RMI4Update::WriteFLDV7()
+{
+	if (m_bootloaderID[1] < 10) {
+		// Not support writing FLD before bootloader v10
+		return UPDATE_SUCCESS;
 	}
 
-	/* calculate the count */
-	partition_id = CORE_CODE_PARTITION;
+	return WritePartitionV7(FIXED_LOCATION_DATA_PARTITION);
+}
+
+int RMI4Update::WriteGlobalParametersV7()
+{
+	return WritePartitionV7(GLOBAL_PARAMETERS_PARTITION);
+}
 
-	remain_block = (m_fwBlockCount % m_payloadLength);
-	transaction_count = (m_fwBlockCount / m_payloadLength);
-	
-	if (remain_block > 0)
-		transaction_count++;
+const unsigned char *RMI4Update::GetPartitionDataV7(unsigned char partitionID,
+						unsigned long *blockCount)
+{
+	switch (partitionID) {
+	case CORE_CODE_PARTITION:
+		if (m_bootloaderID[1] == 10)
+			m_fwBlockCount = m_firmwareImage.GetFirmwareSize() / m_blockSize;
+		*blockCount = m_fwBlockCount;
+		return m_firmwareImage.GetFirmwareData();
+	case CORE_CONFIG_PARTITION:
+		if (m_bootloaderID[1] == 10)
+			m_configBlockCount = m_firmwareImage.GetConfigSize() / m_blockSize;
+		*blockCount = m_configBlockCount;
+		return m_firmwareImage.GetConfigData();
+	case FLASH_CONFIG_PARTITION:
+		*blockCount = m_firmwareImage.GetFlashConfigSize() / m_blockSize;
+		return m_firmwareImage.GetFlashConfigData();
+	case FIXED_LOCATION_DATA_PARTITION:
+		*blockCount = m_firmwareImage.GetFLDSize() / m_blockSize;
+		return m_firmwareImage.GetFLDData();
+	case GLOBAL_PARAMETERS_PARTITION:
+		*blockCount = m_firmwareImage.GetGlobalParametersSize() / m_blockSize;
+		return m_firmwareImage.GetGlobalParametersData();
+	default:
+		*blockCount = 0;
+		return NULL;
+	}
+}
 
-	/* set partition id for bootloader 7 */
-	rc = m_device.Write(dataAddr + 1, &partition_id, sizeof(partition_id));
-	if (rc != sizeof(partition_id))
+// Selects the partition to read or write from block onwards
+int RMI4Update::SetPartitionV7(unsigned char partitionID, unsigned short block)
+{
+	unsigned char off[2] = {(unsigned char)(block & 0xFF), (unsigned char)(block >> 8)};
+	unsigned short dataAddr = m_f34.GetDataBase();
+	int rc;
+
+	rc = m_device.Write(dataAddr + 1, &partitionID, sizeof(partitionID));
+	if (rc != sizeof(partitionID))
 		return UPDATE_FAIL_WRITE_FLASH_COMMAND;
 
 	rc = m_device.Write(dataAddr + 2, off, sizeof(off));
 	if (rc != sizeof(off))
 		return UPDATE_FAIL_WRITE_INITIAL_ZEROS;
 
-	for (i = 0; i < transaction_count; i++)
-	{
-		if ((i == (transaction_count -1)) && (remain_block > 0))
-			transfer_leng = remain_block;
-		else
-			transfer_leng = m_payloadLength;
+	return UPDATE_SUCCESS;
+}
 
-		// Set Transfer Length
-		trans_leng_buf[0] = (unsigned char)(transfer_leng & 0xFF);
-		trans_leng_buf[1] = (unsigned char)((transfer_leng & 0xFF00) >> 8);
+// Starts reading the next transferLength blocks of the partition
+int RMI4Update::StartReadV7(unsigned long transferLength)
+{
+	unsigned char trans_leng_buf[2];
+	unsigned char cmd_buf[1];
+	unsigned short dataAddr = m_f34.GetDataBase();
+	int rc;
 
-		rc = m_device.Write(dataAddr + 3, trans_leng_buf, sizeof(trans_leng_buf));
-		if (rc != sizeof(trans_leng_buf))
-			return UPDATE_FAIL_WRITE_FLASH_COMMAND;
+	// Set Transfer Length
+	trans_leng_buf[0] = (unsigned char)(transferLength & 0xFF);
+	trans_leng_buf[1] = (unsigned char)((transferLength & 0xFF00) >> 8);
+	rc = m_device.Write(dataAddr + 3, trans_leng_buf, sizeof(trans_leng_buf));
+	if (rc != sizeof(trans_leng_buf))
+		return UPDATE_FAIL_WRITE_FLASH_COMMAND;
 
-		// Set Command to Write
-		cmd_buf[0] = (unsigned char)CMD_V7_WRITE;
-		rc = m_device.Write(dataAddr + 4, cmd_buf, sizeof(cmd_buf));
-		if (rc != sizeof(cmd_buf))
-			return UPDATE_FAIL_WRITE_FLASH_COMMAND;
+	// Set Command to Read
+	cmd_buf[0] = (unsigned char)CMD_V7_READ;
+	rc = m_device.Write(dataAddr + 4, cmd_buf, sizeof(cmd_buf));
+	if (rc != sizeof(cmd_buf))
+		return UPDATE_FAIL_WRITE_FLASH_COMMAND;
 
-		max_write_size = 16;
-		if (max_write_size >= transfer_leng * m_blockSize)
-			max_write_size = transfer_leng * m_blockSize;
-		else if (max_write_size > m_blockSize)
-			max_write_size -= max_write_size % m_blockSize;
-		else
-			max_write_size = m_blockSize;
-
-		left_bytes = transfer_leng * m_blockSize;
-		do {
-			if (left_bytes / max_write_size)
-				write_size = max_write_size;
-			else
-				write_size = left_bytes;
-
-			data_temp = (unsigned char *) malloc(sizeof(unsigned char) * write_size);
-			memcpy(data_temp, m_firmwareImage.GetFirmwareData() + offset, sizeof(char) * write_size);
-			rc = m_device.Write(dataAddr + 5, data_temp, sizeof(char) * write_size);
-			if (rc != ((ssize_t)sizeof(char) * write_size)) {
-				fprintf(stdout, "err write_size = %d; rc = %d\n", write_size, rc);
-				return UPDATE_FAIL_READ_F34_QUERIES;
-			}
+	return UPDATE_SUCCESS;
+}
 
-			offset += write_size;
-			left_bytes -= write_size;
-			free(data_temp);
-		} while (left_bytes);
+// Waits for the read started by StartReadV7 and fetches its blocks
+int RMI4Update::FinishReadV7(unsigned char *buf, unsigned long transferLength)
+{
+	unsigned long len = transferLength * m_blockSize;
+	int rc;
 
-		if(m_device.GetDeviceType() == RMI_DEVICE_TYPE_TOUCHPAD)  {
-			// Sleep 100 ms and wait for attention for touchpad only.
-			Sleep(100);
-			rc = WaitForIdle(RMI_F34_IDLE_WAIT_MS, false);
-			if (rc != UPDATE_SUCCESS) {
-				fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
-				return UPDATE_FAIL_TIMEOUT_WAITING_FOR_ATTN;
-			}
-		}
-		
+	rc = WaitForFlashCompletion(CMD_V7_READ);
+	if (rc != UPDATE_SUCCESS)
+		return rc;
 
-		//Wait for completion
-		do {
-			Sleep(20);
-			rmi4update_poll();
-			if (m_flashStatus == SUCCESS){
-				break;
+	return ReadPayloadV7(buf, len);
+}
 
-			}
-			retry++;
-		} while(retry < 20);
+/*
+ * The payload register is a FIFO, so a read split into several requests
+ * sends each of them to the payload address. The pipeline is set up around
+ * each read since re-enumerating the device resets it.
+ */
+int RMI4Update::ReadPayloadV7(unsigned char *buf, unsigned long len)
+{
+	int bytesPerRequest = m_readRequestSize;
+	int rc;
 
-		if (m_flashStatus != SUCCESS) {
-			fprintf(stdout, "err flash_status = %d\n", m_flashStatus);
-			return UPDATE_FAIL_WRITE_F01_CONTROL_0;
-		}
+	if (!bytesPerRequest && m_readPipelineDepth > 1)
+		bytesPerRequest = m_blockSize;
 
-	}
+	m_device.SetBytesPerReadRequest(bytesPerRequest);
+	m_device.SetReadPipelineDepth(m_readPipelineDepth);
+	rc = m_device.ReadFifo(m_f34.GetDataBase() + 5, buf, len);
+	m_device.SetBytesPerReadRequest(0);
+	m_device.SetReadPipelineDepth(1);
 
-	if(m_device.GetDeviceType() == RMI_DEVICE_TYPE_TOUCHPAD)  {
-		if (m_firmwareImage.GetSignatureInfo()[BLv7_CORE_CODE].bExisted) {
-			// Write signature.
-			rc = WriteSignatureV7(BLv7_CORE_CODE, m_firmwareImage.GetFirmwareData(), offset);
-			if (rc != UPDATE_SUCCESS) {
-				fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
-				return rc;	
-			}
-		}
-	}
+	if (rc != (int)len)
+		return UPDATE_FAIL_READ_F34_QUERIES;
 
 	return UPDATE_SUCCESS;
 }
 
-int RMI4Update::WriteCoreConfigV7()
+// Reads the first blockCount blocks of a partition into buf
+int RMI4Update::ReadPartitionV7(unsigned char partitionID, unsigned char *buf,
+				unsigned long blockCount)
 {
-	int transaction_count, remain_block;
-	int transfer_leng = 0;
-	int offset = 0;
-	unsigned char trans_leng_buf[2];
-	unsigned char cmd_buf[1];
-	unsigned char off[2] = {0, 0};
-	unsigned char partition_id;
-	unsigned short dataAddr = m_f34.GetDataBase();
-	unsigned short left_bytes;
-	unsigned short write_size;
-	unsigned short max_write_size;
+	unsigned long transferLength;
 	int rc;
-	int i;
-	int retry = 0;
-	unsigned char *data_temp;
-	if (m_bootloaderID[1] == 10) {
-		m_configBlockCount = m_firmwareImage.GetConfigSize() / m_blockSize;
-	}
-
-	/* calculate the count */
-	partition_id = CORE_CONFIG_PARTITION;
-	
-	remain_block = (m_configBlockCount % m_payloadLength);
-	transaction_count = (m_configBlockCount / m_payloadLength);
 
-	if (remain_block > 0)
-		transaction_count++;
+	rc = SetPartitionV7(partitionID);
+	if (rc != UPDATE_SUCCESS)
+		return rc;
 
-	/* set partition id for bootloader 7 */
-	rc = m_device.Write(dataAddr + 1, &partition_id, sizeof(partition_id));
-	if (rc != sizeof(partition_id))
-		return UPDATE_FAIL_WRITE_FLASH_COMMAND;
+	while (blockCount) {
+		transferLength = blockCount < m_payloadLength ? blockCount : m_payloadLength;
 
-	rc = m_device.Write(dataAddr + 2, off, sizeof(off));
-	if (rc != sizeof(off))
-		return UPDATE_FAIL_WRITE_INITIAL_ZEROS;
+		rc = StartReadV7(transferLength);
+		if (rc != UPDATE_SUCCESS)
+			return rc;
 
-	for (i = 0; i < transaction_count; i++)
-	{
-		if ((i == (transaction_count -1)) && (remain_block > 0))
-			transfer_leng = remain_block;
-		else
-			transfer_leng = m_payloadLength;
+		rc = FinishReadV7(buf, transferLength);
+		if (rc != UPDATE_SUCCESS)
+			return rc;
 
-		// Set Transfer Length
-		trans_leng_buf[0] = (unsigned char)(transfer_leng & 0xFF);
-		trans_leng_buf[1] = (unsigned char)((transfer_leng & 0xFF00) >> 8);
+		buf += transferLength * m_blockSize;
+		blockCount -= transferLength;
+	}
 
-		rc = m_device.Write(dataAddr + 3, trans_leng_buf, sizeof(trans_leng_buf));
-		if (rc != sizeof(trans_leng_buf))
-			return UPDATE_FAIL_WRITE_FLASH_COMMAND;
+	return UPDATE_SUCCESS;
+}
 
-		// Set Command to Write
-		cmd_buf[0] = (unsigned char)CMD_V7_WRITE;
-		rc = m_device.Write(dataAddr + 4, cmd_buf, sizeof(cmd_buf));
-		if (rc != sizeof(cmd_buf))
-			return UPDATE_FAIL_WRITE_FLASH_COMMAND;
+/*
+ * Reads a partition back in transfers of the full payload length and
+ * compares it with the image. The next transfer is started before the
+ * current one is compared, so the comparison overlaps the device reading
+ * its flash. FinishReadV7 fetches each transfer with the pipelined HID
+ * reads set by SetReadPipeline().
+ */
+int RMI4Update::VerifyPartitionV7(unsigned char partitionID)
+{
+	std::vector<unsigned char> chunk;
+	unsigned long blockCount;
+	unsigned long block = 0;
+	unsigned long transferLength;
+	unsigned long nextLength;
+	const unsigned char *data;
+	int rc;
 
-		max_write_size = 16;
-		if (max_write_size >= transfer_leng * m_blockSize)
-			max_write_size = transfer_leng * m_blockSize;
-		else if (max_write_size > m_blockSize)
-			max_write_size -= max_write_size % m_blockSize;
-		else
-			max_write_size = m_blockSize;
+	data = GetPartitionDataV7(partitionID, &blockCount);
+	if (!data || !blockCount)
+		return UPDATE_SUCCESS;
 
-		left_bytes = transfer_leng * m_blockSize;
+	chunk.resize(m_payloadLength * m_blockSize);
 
-		do {
-			if (left_bytes / max_write_size)
-				write_size = max_write_size;
-			else
-				write_size = left_bytes;
+	rc = SetPartitionV7(partitionID);
+	if (rc != UPDATE_SUCCESS)
+		return rc;
 
-			data_temp = (unsigned char *) malloc(sizeof(unsigned char) * write_size);
-			memcpy(data_temp, m_firmwareImage.GetConfigData() + offset, sizeof(char) * write_size);
-			rc = m_device.Write(dataAddr + 5, data_temp, sizeof(char) * write_size);
-			if (rc != ((ssize_t)sizeof(char) * write_size)) {
-				return UPDATE_FAIL_READ_F34_QUERIES;
-			}
+	transferLength = blockCount < m_payloadLength ? blockCount : m_payloadLength;
+	rc = StartReadV7(transferLength);
+	if (rc != UPDATE_SUCCESS)
+		return rc;
 
-			offset += write_size;
-			left_bytes -= write_size;
-			free(data_temp);
-		} while (left_bytes);
+	while (transferLength) {
+		rc = FinishReadV7(&chunk[0], transferLength);
+		if (rc != UPDATE_SUCCESS)
+			return rc;
 
-		if(m_device.GetDeviceType() == RMI_DEVICE_TYPE_TOUCHPAD)  {
-			// Wait for attention for touchpad only.
-			rc = WaitForIdle(RMI_F34_IDLE_WAIT_MS, false);
-			if (rc != UPDATE_SUCCESS) {
-				fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
-				return UPDATE_FAIL_TIMEOUT_WAITING_FOR_ATTN;
-			}
+		nextLength = blockCount - block - transferLength;
+		if (nextLength > m_payloadLength)
+			nextLength = m_payloadLength;
+		if (nextLength) {
+			rc = StartReadV7(nextLength);
+			if (rc != UPDATE_SUCCESS)
+				return rc;
 		}
 
-		//Wait for completion
-		do {
-			Sleep(20);
-			rmi4update_poll();
-			if (m_flashStatus == SUCCESS){
-				break;
-			}
-			retry++;
-		} while(retry < 20);
-
-		if (m_flashStatus != SUCCESS) {
-			fprintf(stdout, "err flash_status = %d\n", m_flashStatus);
-			return UPDATE_FAIL_WRITE_F01_CONTROL_0;
+		if (memcmp(&chunk[0], data + block * m_blockSize, transferLength * m_blockSize)) {
+			unsigned long i = 0;
+
+			while (!memcmp(&chunk[i * m_blockSize], data + (block + i) * m_blockSize,
+					m_blockSize))
+				++i;
+			fprintf(stderr, "Partition %d differs from the image at block %lu\n",
+				partitionID, block + i);
+			// Let a read which is still running finish before giving up
+			if (nextLength)
+				WaitForFlashCompletion(CMD_V7_READ);
+			return UPDATE_FAIL_VERIFY_READBACK;
 		}
 
-	}
-
-	if(m_device.GetDeviceType() == RMI_DEVICE_TYPE_TOUCHPAD)  {
-		if (m_firmwareImage.GetSignatureInfo()[BLv7_CORE_CONFIG].bExisted) {
-			// Write signature.
-			rc = WriteSignatureV7(BLv7_CORE_CONFIG, m_firmwareImage.GetConfigData(), offset);
-			if (rc != UPDATE_SUCCESS) {
-				fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
-				return rc;	
-			}
-		}
+		block += transferLength;
+		transferLength = nextLength;
 	}
 
 	return UPDATE_SUCCESS;
 }
 
-int RMI4Update::WriteFlashConfigV7()
+// Verifies each partition this update has written
+int RMI4Update::VerifyWrittenPartitionsV7()
 {
-	int transaction_count, remain_block;
-	int transfer_leng = 0;
-	int offset = 0;
-	unsigned char trans_leng_buf[2];
-	unsigned char cmd_buf[1];
-	unsigned char off[2] = {0, 0};
-	unsigned char partition_id;
-	unsigned short dataAddr = m_f34.GetDataBase();
-	unsigned short left_bytes;
-	unsigned short write_size;
-	unsigned short max_write_size;
+	struct timespec start;
+	struct timespec end;
 	int rc;
-	int i;
-	int retry = 0;
-	unsigned char *data_temp;
-	unsigned short FlashConfigBlockCount;
-
-	/* calculate the count */
-	partition_id = FLASH_CONFIG_PARTITION;
-
-	FlashConfigBlockCount = m_firmwareImage.GetFlashConfigSize() / m_blockSize;
-
-	remain_block = (FlashConfigBlockCount % m_payloadLength);
-	transaction_count = (FlashConfigBlockCount / m_payloadLength);
-	if (remain_block > 0)
-		transaction_count++;
-
-	/* set partition id for bootloader 7 */
-	rc = m_device.Write(dataAddr + 1, &partition_id, sizeof(partition_id));
-	if (rc != sizeof(partition_id))
-		return UPDATE_FAIL_WRITE_FLASH_COMMAND;
-
-	rc = m_device.Write(dataAddr + 2, off, sizeof(off));
-	if (rc != sizeof(off))
-		return UPDATE_FAIL_WRITE_INITIAL_ZEROS;
-
-	for (i = 0; i < transaction_count; i++)
-	{
-		if ((i == (transaction_count -1)) && (remain_block > 0))
-			transfer_leng = remain_block;
-		else
-			transfer_leng = m_payloadLength;
-
-		// Set Transfer Length
-		trans_leng_buf[0] = (unsigned char)(transfer_leng & 0xFF);
-		trans_leng_buf[1] = (unsigned char)((transfer_leng & 0xFF00) >> 8);
-
-		rc = m_device.Write(dataAddr + 3, trans_leng_buf, sizeof(trans_leng_buf));
-		if (rc != sizeof(trans_leng_buf))
-			return UPDATE_FAIL_WRITE_FLASH_COMMAND;
-
-		// Set Command to Write
-		cmd_buf[0] = (unsigned char)CMD_V7_WRITE;
-		rc = m_device.Write(dataAddr + 4, cmd_buf, sizeof(cmd_buf));
-		if (rc != sizeof(cmd_buf))
-			return UPDATE_FAIL_WRITE_FLASH_COMMAND;
 
-		max_write_size = 16;
-		if (max_write_size >= transfer_leng * m_blockSize)
-			max_write_size = transfer_leng * m_blockSize;
-		else if (max_write_size > m_blockSize)
-			max_write_size -= max_write_size % m_blockSize;
-		else
-			max_write_size = m_blockSize;
-
-		left_bytes = transfer_leng * m_blockSize;
-
-		do {
-			if (left_bytes / max_write_size)
-				write_size = max_write_size;
-			else
-				write_size = left_bytes;
-
-			data_temp = (unsigned char *) malloc(sizeof(unsigned char) * write_size);
-			memcpy(data_temp, m_firmwareImage.GetFlashConfigData() + offset, sizeof(char) * write_size);
-			rc = m_device.Write(dataAddr + 5, data_temp, sizeof(char) * write_size);
-			if (rc != ((ssize_t)sizeof(char) * write_size)) {
-				fprintf(stdout, "err write_size = %d; rc = %d\n", write_size, rc);
-				return UPDATE_FAIL_READ_F34_QUERIES;
-			}
-
-			offset += write_size;
-			left_bytes -= write_size;
-			free(data_temp);
-		} while (left_bytes);
-
-		if(m_device.GetDeviceType() == RMI_DEVICE_TYPE_TOUCHPAD)  {
-			// Wair for attention for touchpad only.
-			rc = WaitForIdle(RMI_F34_IDLE_WAIT_MS, false);
-			if (rc != UPDATE_SUCCESS) {
-				fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
-				return UPDATE_FAIL_TIMEOUT_WAITING_FOR_ATTN;
-			}
-		}
+	for (int id = 0; id <= FIXED_LOCATION_DATA_PARTITION; ++id) {
+		if (!m_partitionWritten[id])
+			continue;
 
-		//Wait for completion
-		do {
-			Sleep(20);
-			rmi4update_poll();
-			if (IsBLv87()) {
-				if (m_flashStatus == WRITE_PROTECTION)
-					return UPDATE_FAIL_WRITE_PROTECTED;
-			}
-			if (m_flashStatus == SUCCESS){
-				break;
-			}
-			retry++;
-		} while(retry < 20);
-
-		if (m_flashStatus != SUCCESS) {
-			fprintf(stdout, "err flash_status = %d\n", m_flashStatus);
-			return UPDATE_FAIL_WRITE_F01_CONTROL_0;
-		}
-
-	}
-
-	if(m_device.GetDeviceType() == RMI_DEVICE_TYPE_TOUCHPAD)  {
-		if (m_firmwareImage.GetSignatureInfo()[BLv7_FLASH_CONFIG].bExisted) {
-			// Write signature.
-			rc = WriteSignatureV7(BLv7_FLASH_CONFIG, m_firmwareImage.GetFlashConfigData(), offset);
-			if (rc != UPDATE_SUCCESS) {
-				fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
-				return rc;	
-			}
-		}
+		fprintf(stdout, "Verifying partition %d...\n", id);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		BeginPhase("verify", id);
+		rc = VerifyPartitionV7(id);
+		EndPhase(rc);
+		if (rc != UPDATE_SUCCESS)
+			return rc;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		fprintf(stdout, "Verifying partition %d done, time: %lld us.\n", id,
+			diff_time(&start, &end));
 	}
 
 	return UPDATE_SUCCESS;
 }
 
-int RMI4Update::WriteFLDV7()
+bool RMI4Update::PartitionMatchesImageV7(unsigned char partitionID)
 {
-	int transaction_count, remain_block;
-	int transfer_leng = 0;
-	int offset = 0;
-	unsigned char trans_leng_buf[2];
-	unsigned char cmd_buf[1];
-	unsigned char off[2] = {0, 0};
-	unsigned char partition_id;
-	int i;
-	int retry = 0;
-	unsigned char *data_temp;
+	std::vector<unsigned char> flash;
+	unsigned long blockCount;
+	const unsigned char *data;
 	int rc;
-	unsigned short left_bytes;
-	unsigned short write_size;
-	unsigned short max_write_size;
-	unsigned short dataAddr = m_f34.GetDataBase();
-	unsigned short fldBlockCount = m_firmwareImage.GetFLDSize() / m_blockSize;
-
-	if (m_bootloaderID[1] < 10) {
-		// Not support writing FLD before bootloader v10
-		return UPDATE_SUCCESS;
-	}
 
-	/* calculate the count */
-	partition_id = FIXED_LOCATION_DATA_PARTITION;
-	
-	remain_block = (fldBlockCount % m_payloadLength);
-	transaction_count = (fldBlockCount / m_payloadLength);
-	
-	if (remain_block > 0)
-		transaction_count++;
+	data = GetPartitionDataV7(partitionID, &blockCount);
+	if (!data || !blockCount)
+		return false;
 
-	/* set partition id for bootloader 7 */
-	rc = m_device.Write(dataAddr + 1, &partition_id, sizeof(partition_id));
-	if (rc != sizeof(partition_id))
-		return UPDATE_FAIL_WRITE_FLASH_COMMAND;
+	flash.resize(blockCount * m_blockSize);
+	BeginPhase("read", partitionID);
+	rc = ReadPartitionV7(partitionID, &flash[0], blockCount);
+	EndPhase(rc);
+	if (rc != UPDATE_SUCCESS)
+		return false;
 
-	rc = m_device.Write(dataAddr + 2, off, sizeof(off));
-	if (rc != sizeof(off))
-		return UPDATE_FAIL_WRITE_INITIAL_ZEROS;
+	return !memcmp(&flash[0], data, flash.size());
+}
 
-	for (i = 0; i < transaction_count; i++)
-	{
-		if ((i == (transaction_count -1)) && (remain_block > 0))
-			transfer_leng = remain_block;
-		else
-			transfer_leng = m_payloadLength;
+/*
+ * Reads back each partition the update would write and marks the ones which
+ * already hold the image's data, so they are neither erased nor written.
+ * Returns true if every one of them matches.
+ */
+bool RMI4Update::FindUnchangedPartitionsV7()
+{
+	std::vector<unsigned char> partitions;
+	bool allUnchanged = true;
+	unsigned char id;
 
-		// Set Transfer Length
-		trans_leng_buf[0] = (unsigned char)(transfer_leng & 0xFF);
-		trans_leng_buf[1] = (unsigned char)((transfer_leng & 0xFF00) >> 8);
+	partitions.push_back(CORE_CODE_PARTITION);
+	partitions.push_back(CORE_CONFIG_PARTITION);
+	if (m_bootloaderID[1] >= 10) {
+		partitions.push_back(FIXED_LOCATION_DATA_PARTITION);
+		partitions.push_back(FLASH_CONFIG_PARTITION);
+		if (m_hasGlobalParameters)
+			partitions.push_back(GLOBAL_PARAMETERS_PARTITION);
+	}
 
-		rc = m_device.Write(dataAddr + 3, trans_leng_buf, sizeof(trans_leng_buf));
-		if (rc != sizeof(trans_leng_buf))
-			return UPDATE_FAIL_WRITE_FLASH_COMMAND;
+	for (size_t i = 0; i < partitions.size(); ++i) {
+		id = partitions[i];
+		m_partitionUnchanged[id] = PartitionMatchesImageV7(id);
+	}
 
-		// Set Command to Write
-		cmd_buf[0] = (unsigned char)CMD_V7_WRITE;
-		rc = m_device.Write(dataAddr + 4, cmd_buf, sizeof(cmd_buf));
-		if (rc != sizeof(cmd_buf))
-			return UPDATE_FAIL_WRITE_FLASH_COMMAND;
+	// From BL v8 code and config are erased together by one ERASE_AP
+	if (m_bootloaderID[1] >= 8 && !(m_partitionUnchanged[CORE_CODE_PARTITION]
+				&& m_partitionUnchanged[CORE_CONFIG_PARTITION])) {
+		m_partitionUnchanged[CORE_CODE_PARTITION] = false;
+		m_partitionUnchanged[CORE_CONFIG_PARTITION] = false;
+	}
 
-		max_write_size = 16;
-		if (max_write_size >= transfer_leng * m_blockSize)
-			max_write_size = transfer_leng * m_blockSize;
-		else if (max_write_size > m_blockSize)
-			max_write_size -= max_write_size % m_blockSize;
+	for (size_t i = 0; i < partitions.size(); ++i) {
+		id = partitions[i];
+		if (m_partitionUnchanged[id])
+			fprintf(stdout, "Partition %d matches the image, skipping it\n", id);
 		else
-			max_write_size = m_blockSize;
-
-		left_bytes = transfer_leng * m_blockSize;
-		do {
-			if (left_bytes / max_write_size)
-				write_size = max_write_size;
-			else
-				write_size = left_bytes;
-
-			data_temp = (unsigned char *) malloc(sizeof(unsigned char) * write_size);
-			memcpy(data_temp, m_firmwareImage.GetFLDData() + offset, sizeof(char) * write_size);
-			rc = m_device.Write(dataAddr + 5, data_temp, sizeof(char) * write_size);
-			if (rc != ((ssize_t)sizeof(char) * write_size)) {
-				fprintf(stdout, "err write_size = %d; rc = %d\n", write_size, rc);
-				return UPDATE_FAIL_READ_F34_QUERIES;
-			}
+			allUnchanged = false;
+	}
 
-			offset += write_size;
-			left_bytes -= write_size;
-			free(data_temp);
-		} while (left_bytes);
+	return allUnchanged;
+}
 
-		if(m_device.GetDeviceType() == RMI_DEVICE_TYPE_TOUCHPAD)  {
-			// Sleep 100 ms and wait for attention for touchpad only.
-			Sleep(100);
-			rc = WaitForIdle(RMI_F34_IDLE_WAIT_MS, false);
-			if (rc != UPDATE_SUCCESS) {
-				fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
-				return UPDATE_FAIL_TIMEOUT_WAITING_FOR_ATTN;
-			}
-		}
-		
+/*
+ * Streams len bytes into the F34 payload register. Each write is as large
+ * as the transport allows, rounded down to whole blocks, and is sent
+ * straight from the image.
+ */
+int RMI4Update::WritePayloadV7(const unsigned char *data, unsigned long len)
+{
+	unsigned short dataAddr = m_f34.GetDataBase();
+	unsigned long maxWriteSize = m_device.GetMaxWriteSize();
+	unsigned long writeSize;
+	int rc;
 
-		//Wait for completion
-		do {
-			Sleep(20);
-			rmi4update_poll();
-			if (IsBLv87()) {
-				if (m_flashStatus == WRITE_PROTECTION)
-					return UPDATE_FAIL_WRITE_PROTECTED;
-			}
-			if (m_flashStatus == SUCCESS){
-				break;
+	if (!maxWriteSize || maxWriteSize > 0xFFFF)
+		maxWriteSize = 0xFFFF;
+	if (maxWriteSize > m_blockSize)
+		maxWriteSize -= maxWriteSize % m_blockSize;
 
-			}
-			retry++;
-		} while(retry < 20);
+	m_device.BeginWriteBatch();
+	while (len) {
+		writeSize = len < maxWriteSize ? len : maxWriteSize;
 
-		if (m_flashStatus != SUCCESS) {
-			fprintf(stdout, "err flash_status = %d\n", m_flashStatus);
-			return UPDATE_FAIL_WRITE_F01_CONTROL_0;
+		rc = m_device.Write(dataAddr + 5, data, writeSize);
+		if (rc != (int)writeSize) {
+			fprintf(stdout, "err write_size = %lu; rc = %d\n", writeSize, rc);
+			m_device.EndWriteBatch();
+			return UPDATE_FAIL_WRITE_BLOCK;
 		}
 
+		data += writeSize;
+		len -= writeSize;
 	}
 
-	if(m_device.GetDeviceType() == RMI_DEVICE_TYPE_TOUCHPAD)  {
-		if (m_firmwareImage.GetSignatureInfo()[BLv7_FLD].bExisted) {
-			// Write signature.
-			rc = WriteSignatureV7(BLv7_FLD, m_firmwareImage.GetFLDData(), offset);
-			if (rc != UPDATE_SUCCESS) {
-				fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
-				return rc;	
-			}
-		}
-	}
+	if (m_device.EndWriteBatch() < 0)
+		return UPDATE_FAIL_WRITE_BLOCK;
 
 	return UPDATE_SUCCESS;
 }
 
-int RMI4Update::WriteGlobalParametersV7()
+int RMI4Update::WritePartitionV7(unsigned char partitionID)
 {
-	int transaction_count, remain_block;
-	int transfer_leng = 0;
-	int offset = 0;
+	const struct partition_write_v7 *partition = NULL;
+	unsigned long blockCount;
+	unsigned long transferLength;
+	unsigned long startBlock;
+	unsigned long offset = 0;
 	unsigned char trans_leng_buf[2];
 	unsigned char cmd_buf[1];
-	unsigned char off[2] = {0, 0};
-	unsigned char partition_id;
-	int i;
-	int retry = 0;
-	unsigned char *data_temp;
-	int rc;
-	unsigned short left_bytes;
-	unsigned short write_size;
-	unsigned short max_write_size;
+	const unsigned char *data;
 	unsigned short dataAddr = m_f34.GetDataBase();
-	unsigned short glpBlockCount = m_firmwareImage.GetGlobalParametersSize() / m_blockSize;
+	int rc;
 
-	/* calculate the count */
-	partition_id = GLOBAL_PARAMETERS_PARTITION;
-	
-	remain_block = (glpBlockCount % m_payloadLength);
-	transaction_count = (glpBlockCount / m_payloadLength);
-	
-	if (remain_block > 0)
-		transaction_count++;
+	for (size_t i = 0; i < sizeof(partition_writes_v7) / sizeof(partition_writes_v7[0]); ++i) {
+		if (partition_writes_v7[i].partitionID == partitionID) {
+			partition = &partition_writes_v7[i];
+			break;
+		}
+	}
 
-	/* set partition id for bootloader 7 */
-	rc = m_device.Write(dataAddr + 1, &partition_id, sizeof(partition_id));
-	if (rc != sizeof(partition_id))
-		return UPDATE_FAIL_WRITE_FLASH_COMMAND;
+	data = GetPartitionDataV7(partitionID, &blockCount);
+	if (!partition || (!data && blockCount))
+		return UPDATE_FAIL_INVALID_PARAMETER;
 
-	rc = m_device.Write(dataAddr + 2, off, sizeof(off));
-	if (rc != sizeof(off))
-		return UPDATE_FAIL_WRITE_INITIAL_ZEROS;
+	if (m_partitionUnchanged[partitionID])
+		return UPDATE_SUCCESS;
 
-	for (i = 0; i < transaction_count; i++)
-	{
-		if ((i == (transaction_count -1)) && (remain_block > 0))
-			transfer_leng = remain_block;
-		else
-			transfer_leng = m_payloadLength;
+	if (m_journal.IsPartitionDone(partitionID)) {
+		fprintf(stdout, "Partition %d was written by the interrupted update\n", partitionID);
+		m_partitionWritten[partitionID] = blockCount != 0;
+		return UPDATE_SUCCESS;
+	}
+
+	// Carry on after the last block the interrupted update wrote
+	startBlock = m_journal.GetBlocksWritten(partitionID);
+	if (startBlock > blockCount)
+		startBlock = 0;
+	if (startBlock)
+		fprintf(stdout, "Resuming partition %d at block %lu\n", partitionID, startBlock);
+	offset = startBlock * m_blockSize;
+	blockCount -= startBlock;
+
+	BeginPhase("write", partitionID);
+	/* set partition id for bootloader 7 */
+	rc = SetPartitionV7(partitionID, startBlock);
+	if (rc != UPDATE_SUCCESS)
+		return rc;
+
+	while (blockCount) {
+		transferLength = blockCount < m_payloadLength ? blockCount : m_payloadLength;
 
 		// Set Transfer Length
-		trans_leng_buf[0] = (unsigned char)(transfer_leng & 0xFF);
-		trans_leng_buf[1] = (unsigned char)((transfer_leng & 0xFF00) >> 8);
+		trans_leng_buf[0] = (unsigned char)(transferLength & 0xFF);
+		trans_leng_buf[1] = (unsigned char)((transferLength & 0xFF00) >> 8);
 
 		rc = m_device.Write(dataAddr + 3, trans_leng_buf, sizeof(trans_leng_buf));
 		if (rc != sizeof(trans_leng_buf))
@@ -1365,72 +1409,50 @@ int RMI4Update::WriteGlobalParametersV7()
 		if (rc != sizeof(cmd_buf))
 			return UPDATE_FAIL_WRITE_FLASH_COMMAND;
 
-		max_write_size = 16;
-		if (max_write_size >= transfer_leng * m_blockSize)
-			max_write_size = transfer_leng * m_blockSize;
-		else if (max_write_size > m_blockSize)
-			max_write_size -= max_write_size % m_blockSize;
-		else
-			max_write_size = m_blockSize;
-
-		left_bytes = transfer_leng * m_blockSize;
-		do {
-			if (left_bytes / max_write_size)
-				write_size = max_write_size;
-			else
-				write_size = left_bytes;
-
-			data_temp = (unsigned char *) malloc(sizeof(unsigned char) * write_size);
-			memcpy(data_temp, m_firmwareImage.GetFLDData() + offset, sizeof(char) * write_size);
-			rc = m_device.Write(dataAddr + 5, data_temp, sizeof(char) * write_size);
-			if (rc != ((ssize_t)sizeof(char) * write_size)) {
-				fprintf(stdout, "err write_size = %d; rc = %d\n", write_size, rc);
-				return UPDATE_FAIL_READ_F34_QUERIES;
-			}
+		rc = WritePayloadV7(data + offset, transferLength * m_blockSize);
+		if (rc != UPDATE_SUCCESS)
+			return rc;
 
-			offset += write_size;
-			left_bytes -= write_size;
-			free(data_temp);
-		} while (left_bytes);
+		offset += transferLength * m_blockSize;
+		blockCount -= transferLength;
 
-		if(m_device.GetDeviceType() == RMI_DEVICE_TYPE_TOUCHPAD)  {
-			// Sleep 100 ms and wait for attention for touchpad only.
-			Sleep(100);
-			rc = WaitForIdle(RMI_F34_IDLE_WAIT_MS, false);
-			if (rc != UPDATE_SUCCESS) {
-				fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
-				return UPDATE_FAIL_TIMEOUT_WAITING_FOR_ATTN;
-			}
+		rc = WaitForFlashCompletion(CMD_V7_WRITE, partition->checkWriteProtect);
+		if (rc != UPDATE_SUCCESS) {
+			fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
+			return rc;
 		}
-		
 
-		//Wait for completion
-		do {
-			Sleep(20);
-			rmi4update_poll();
-			if (m_flashStatus == SUCCESS){
-				break;
+		m_journal.SetBlocksWritten(partitionID, offset / m_blockSize);
+	}
 
-			}
-			retry++;
-		} while(retry < 20);
+	if (partition->signature >= 0 && m_device.GetDeviceType() == RMI_DEVICE_TYPE_TOUCHPAD) {
+		enum signature_BLv7 signature = (enum signature_BLv7)partition->signature;
 
-		if (m_flashStatus != SUCCESS) {
-			fprintf(stdout, "err flash_status = %d\n", m_flashStatus);
-			return UPDATE_FAIL_WRITE_F01_CONTROL_0;
+		if (m_firmwareImage.GetSignatureInfo()[signature].bExisted) {
+			// Write signature.
+			BeginPhase("signature", partitionID);
+			rc = WriteSignatureV7(signature, data, offset);
+			if (rc != UPDATE_SUCCESS) {
+				fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
+				return rc;
+			}
 		}
-
 	}
 
+	EndPhase(UPDATE_SUCCESS);
+	if (offset)
+		m_partitionWritten[partitionID] = true;
+	m_journal.MarkPartitionDone(partitionID);
+
 	return UPDATE_SUCCESS;
 }
 
 int RMI4Update::EraseFlashConfigV10()
 {
 	unsigned char erase_cmd[8] = {0, 0, 0, 0, 0, 0, 0, 0};
-	int retry = 0;
 	int rc;
 
+	BeginPhase("erase", FLASH_CONFIG_PARTITION);
 	/* set partition id for bootloader 10 */
 	erase_cmd[0] = FLASH_CONFIG_PARTITION;
 	/* write bootloader id */
@@ -1447,52 +1469,20 @@ int RMI4Update::EraseFlashConfigV10()
 	rmi4update_poll();
 	if (!m_inBLmode)
 		return UPDATE_FAIL_DEVICE_NOT_IN_BOOTLOADER;
-	
-	// For BL8 device, we need hold 1 seconds after querying
-	// F34 status to avoid not get attention by following giving 
-	// erase command.
-	Sleep(1000);
 
 	rc = m_device.Write(m_f34.GetDataBase() + 1, erase_cmd, sizeof(erase_cmd));
 	if (rc != sizeof(erase_cmd))
 		return UPDATE_FAIL_WRITE_F01_CONTROL_0;
 
-	Sleep(100);
-
-	//Wait from ATTN
-	rc = WaitForIdle(RMI_F34_ERASE_V8_WAIT_MS, false);
-	if (rc != UPDATE_SUCCESS) {
-		fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
-		return UPDATE_FAIL_TIMEOUT_WAITING_FOR_ATTN;
-	}
-
-	do {
-		Sleep(20);
-		rmi4update_poll();
-		if (IsBLv87()) {
-			if (m_flashStatus == WRITE_PROTECTION)
-				return UPDATE_FAIL_WRITE_PROTECTED;
-		}
-		if (m_flashStatus == SUCCESS){
-			break;
-		}
-		retry++;
-	} while(retry < 20);
-
-	if (m_flashStatus != SUCCESS) {
-		fprintf(stdout, "err flash_status = %d\n", m_flashStatus);
-		return UPDATE_FAIL_WRITE_F01_CONTROL_0;
-	}
-
-	return UPDATE_SUCCESS;
+	return WaitForEraseCompletion(FLASH_CONFIG_PARTITION, RMI_F34_ERASE_V8_WAIT_MS, true);
 }
 
 int RMI4Update::EraseCoreCodeV10()
 {
 	unsigned char erase_cmd[8] = {0, 0, 0, 0, 0, 0, 0, 0};
-	int retry = 0;
 	int rc;
 
+	BeginPhase("erase", CORE_CODE_PARTITION);
 	/* set partition id for bootloader 10 */
 	erase_cmd[0] = CORE_CODE_PARTITION;
 	/* write bootloader id */
@@ -1509,46 +1499,17 @@ int RMI4Update::EraseCoreCodeV10()
 	rmi4update_poll();
 	if (!m_inBLmode)
 		return UPDATE_FAIL_DEVICE_NOT_IN_BOOTLOADER;
-	
-	// For BL8 device, we need hold 1 seconds after querying
-	// F34 status to avoid not get attention by following giving 
-	// erase command.
-	Sleep(1000);
 
 	rc = m_device.Write(m_f34.GetDataBase() + 1, erase_cmd, sizeof(erase_cmd));
 	if (rc != sizeof(erase_cmd))
 		return UPDATE_FAIL_WRITE_F01_CONTROL_0;
 
-	Sleep(100);
-
-	//Wait from ATTN
-	rc = WaitForIdle(RMI_F34_ERASE_V8_WAIT_MS, false);
-	if (rc != UPDATE_SUCCESS) {
-		fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
-		return UPDATE_FAIL_TIMEOUT_WAITING_FOR_ATTN;
-	}
-
-	do {
-		Sleep(20);
-		rmi4update_poll();
-		if (m_flashStatus == SUCCESS){
-			break;
-		}
-		retry++;
-	} while(retry < 20);
-
-	if (m_flashStatus != SUCCESS) {
-		fprintf(stdout, "err flash_status = %d\n", m_flashStatus);
-		return UPDATE_FAIL_WRITE_F01_CONTROL_0;
-	}
-
-	return UPDATE_SUCCESS;
+	return WaitForEraseCompletion(CORE_CODE_PARTITION, RMI_F34_ERASE_V8_WAIT_MS);
 }
 
 int RMI4Update::EraseFirmwareV7()
 {
 	unsigned char erase_cmd[8] = {0, 0, 0, 0, 0, 0, 0, 0};
-	int retry = 0;
 	int rc;
 
 	/* set partition id for bootloader 7 */
@@ -1570,60 +1531,33 @@ int RMI4Update::EraseFirmwareV7()
 	}
 	fprintf(stdout, "\n");
 
+	// BL7 erases the config separately, it may be the only change
+	if (m_bootloaderID[1] == 7 && m_partitionUnchanged[CORE_CODE_PARTITION])
+		goto erase_config;
+
+	BeginPhase("erase", CORE_CODE_PARTITION);
 	rmi4update_poll();
 	if (!m_inBLmode)
 		return UPDATE_FAIL_DEVICE_NOT_IN_BOOTLOADER;
-	if(m_bootloaderID[1] == 8){
-		// For BL8 device, we need hold 1 seconds after querying
-		// F34 status to avoid not get attention by following giving 
-		// erase command.
-		Sleep(1000);
-	}
 
 	rc = m_device.Write(m_f34.GetDataBase() + 1, erase_cmd, sizeof(erase_cmd));
 	if (rc != sizeof(erase_cmd))
 		return UPDATE_FAIL_WRITE_F01_CONTROL_0;
 
-	Sleep(100);
-
-	//Wait from ATTN
-	if(m_bootloaderID[1] == 8){
-		if(m_device.GetDeviceType() == RMI_DEVICE_TYPE_TOUCHPAD)  {
-			// Wait for attention for BL8 touchpad.
-			rc = WaitForIdle(RMI_F34_ERASE_V8_WAIT_MS, false);
-			if (rc != UPDATE_SUCCESS) {
-				fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
-				return UPDATE_FAIL_TIMEOUT_WAITING_FOR_ATTN;
-			}
-		}
-	}
-	do {
-		Sleep(20);
-		rmi4update_poll();
-		if (IsBLv87()) {
-			if (m_flashStatus == WRITE_PROTECTION)
-				return UPDATE_FAIL_WRITE_PROTECTED;
-		}
-		if (m_flashStatus == SUCCESS){
-			break;
-		}
-		retry++;
-	} while(retry < 20);
+	rc = WaitForEraseCompletion(CORE_CODE_PARTITION, RMI_F34_ERASE_V8_WAIT_MS, true);
+	if (rc != UPDATE_SUCCESS)
+		return rc;
 
-	if (m_flashStatus != SUCCESS) {
-		fprintf(stdout, "err flash_status = %d\n", m_flashStatus);
-		return UPDATE_FAIL_WRITE_F01_CONTROL_0;
-	}
- 
-	if(m_bootloaderID[1] == 7){
+erase_config:
+	if (m_bootloaderID[1] == 7 && !m_partitionUnchanged[CORE_CONFIG_PARTITION]) {
 		// For BL7, we need erase config partition.
 		fprintf(stdout, "Start to erase config\n");
+		BeginPhase("erase", CORE_CONFIG_PARTITION);
 		erase_cmd[0] = CORE_CONFIG_PARTITION;
 		erase_cmd[6] = m_bootloaderID[0];
 		erase_cmd[7] = m_bootloaderID[1];
 		erase_cmd[5] = (unsigned char)CMD_V7_ERASE;
 
-		Sleep(100);
 		rmi4update_poll();
 		if (!m_inBLmode)
 		  return UPDATE_FAIL_DEVICE_NOT_IN_BOOTLOADER;
@@ -1632,31 +1566,9 @@ int RMI4Update::EraseFirmwareV7()
 		if (rc != sizeof(erase_cmd))
 			return UPDATE_FAIL_WRITE_F01_CONTROL_0;
 
-		if(m_device.GetDeviceType() == RMI_DEVICE_TYPE_TOUCHPAD)  {
-			//Wait from ATTN for touchpad only.
-			Sleep(100);
-
-			rc = WaitForIdle(RMI_F34_ERASE_WAIT_MS, true);
-			if (rc != UPDATE_SUCCESS) {
-				fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
-				return UPDATE_FAIL_TIMEOUT_WAITING_FOR_ATTN;
-			}
-		}
-
-
-		do {
-			Sleep(20);
-			rmi4update_poll();
-			if (m_flashStatus == SUCCESS){
-				break;
-			}
-			retry++;
-		} while(retry < 20);
-
-		if (m_flashStatus != SUCCESS) {
-			fprintf(stdout, "err flash_status = %d\n", m_flashStatus);
-			return UPDATE_FAIL_WRITE_F01_CONTROL_0;
-		}
+		rc = WaitForEraseCompletion(CORE_CONFIG_PARTITION, RMI_F34_ERASE_WAIT_MS);
+		if (rc != UPDATE_SUCCESS)
+			return rc;
 	}
 
 	return UPDATE_SUCCESS;
@@ -1671,7 +1583,6 @@ int RMI4Update::EnterFlashProgrammingV7()
 	if(!m_inBLmode){
 		fprintf(stdout, "Not in BL mode, going to BL mode...\n");
 		unsigned char EnterCmd[8] = {0, 0, 0, 0, 0, 0, 0, 0};
-		int retry = 0;
 
 		/* set partition id for bootloader 7 */
 		EnterCmd[0] = BOOTLOADER_PARTITION;
@@ -1687,36 +1598,14 @@ int RMI4Update::EnterFlashProgrammingV7()
 		if (rc != sizeof(EnterCmd))
 			return UPDATE_FAIL_WRITE_F01_CONTROL_0;
 
-		if(m_device.GetDeviceType() == RMI_DEVICE_TYPE_TOUCHPAD)  {
-			rc = WaitForIdle(RMI_F34_ENABLE_WAIT_MS, false);
-			if (rc != UPDATE_SUCCESS) {
-				fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
-				return UPDATE_FAIL_TIMEOUT_WAITING_FOR_ATTN;
-			}
-		}
-
-		//Wait from ATTN
-		do {
-			Sleep(20);
-			rmi4update_poll();
-			if (m_flashStatus == SUCCESS){
-				break;
-			}
-			retry++;
-		} while(retry < 20);
-
-		if (m_flashStatus != SUCCESS) {
-			fprintf(stdout, "err flash_status = %d\n", m_flashStatus);
-			return UPDATE_FAIL_WRITE_F01_CONTROL_0;
-		}
+		// The bootloader may report different query values
+		m_device.FlushRegisterCache();
 
-		Sleep(RMI_F34_ENABLE_WAIT_MS);
+		rc = WaitForBootloaderV7();
+		if (rc != UPDATE_SUCCESS)
+			return rc;
 
 		fprintf(stdout, "%s\n", __func__);
-		rmi4update_poll();
-		if (!m_inBLmode)
-			return UPDATE_FAIL_DEVICE_NOT_IN_BOOTLOADER;
-			
 	} else
 		fprintf(stdout, "Already in BL mode, skip...\n");
 
@@ -1729,11 +1618,14 @@ int RMI4Update::EnterFlashProgrammingV7()
 			return UPDATE_FAIL_ERASE_ALL;
 		}
 		fprintf(stdout, "Erase in BL mode end\n");
-		m_device.RebindDriver();
+		BeginPhase("enter_bootloader");
+		if (!m_device.Reenumerate(RMI_REENUMERATE_WAIT_MS)) {
+			fprintf(stderr, "%s: the device did not come back in the bootloader\n",
+				__func__);
+			return UPDATE_FAIL_TIMEOUT;
+		}
 	}
 
-	Sleep(RMI_F34_ENABLE_WAIT_MS);
-
 	rc = FindUpdateFunctions();
 	if (rc != UPDATE_SUCCESS)
 		return rc;
@@ -1815,7 +1707,7 @@ int RMI4Update::EnterFlashProgramming()
 	return UPDATE_SUCCESS;
 }
 
-int RMI4Update::WriteBlocks(unsigned char *block, unsigned short count, unsigned char cmd)
+int RMI4Update::WriteBlocks(const unsigned char *block, unsigned short count, unsigned char cmd)
 {
 	int blockNum;
 	unsigned char zeros[] = { 0, 0 };
@@ -1868,7 +1760,7 @@ int RMI4Update::WriteBlocks(unsigned char *block, unsigned short count, unsigned
 	return UPDATE_SUCCESS;
 }
 
-int RMI4Update::WriteSignatureV7(enum signature_BLv7 signature_partition, unsigned char* data, int offset)
+int RMI4Update::WriteSignatureV7(enum signature_BLv7 signature_partition, const unsigned char* data, int offset)
 {
 	fprintf(stdout, "Write Signature...\n");
 	int rc;
@@ -1878,11 +1770,6 @@ int RMI4Update::WriteSignatureV7(enum signature_BLv7 signature_partition, unsign
 	int transfer_leng = 0;
 	signature_info signature = m_firmwareImage.GetSignatureInfo()[signature_partition];
 	unsigned char trans_leng_buf[2];
-	unsigned short left_bytes;
-	unsigned short write_size;
-	unsigned short max_write_size;
-	unsigned char *data_temp;
-	int retry = 0;
 	rc = m_device.Write(dataAddr + 2, off, sizeof(off));
 	if (rc != sizeof(off))
 		return UPDATE_FAIL_WRITE_INITIAL_ZEROS;
@@ -1902,56 +1789,16 @@ int RMI4Update::WriteSignatureV7(enum signature_BLv7 signature_partition, unsign
 	if (rc != sizeof(cmd_buf))
 		return UPDATE_FAIL_WRITE_FLASH_COMMAND;
 
-	max_write_size = 16;
-	if (max_write_size >= transfer_leng * m_blockSize)
-		max_write_size = transfer_leng * m_blockSize;
-	else if (max_write_size > m_blockSize)
-		max_write_size -= max_write_size % m_blockSize;
-	else
-		max_write_size = m_blockSize;
-
-	left_bytes = transfer_leng * m_blockSize;
-
-	do {
-		if (left_bytes / max_write_size)
-			write_size = max_write_size;
-		else
-			write_size = left_bytes;
-
-		data_temp = (unsigned char *) malloc(sizeof(unsigned char) * write_size);
-		memcpy(data_temp, data + offset, sizeof(char) * write_size);
-		rc = m_device.Write(dataAddr + 5, data_temp, sizeof(char) * write_size);
-		if (rc != ((ssize_t)sizeof(char) * write_size)) {
-			fprintf(stdout, "err write_size = %d; rc = %d\n", write_size, rc);
-			return UPDATE_FAIL_WRITE_BLOCK;
-		}
-
-		offset += write_size;
-		left_bytes -= write_size;
-		free(data_temp);
-	} while (left_bytes);
+	rc = WritePayloadV7(data + offset, transfer_leng * m_blockSize);
+	if (rc != UPDATE_SUCCESS)
+		return rc;
 
-	// Wair for attention for touchpad only.
-	rc = WaitForIdle(RMI_F34_IDLE_WAIT_MS, false);
+	rc = WaitForFlashCompletion(CMD_V7_SIGNATURE);
 	if (rc != UPDATE_SUCCESS) {
 		fprintf(stderr, "%s: %s\n", __func__, update_err_to_string(rc));
-		return UPDATE_FAIL_TIMEOUT_WAITING_FOR_ATTN;
+		return rc;
 	}
-	
-	//Wait for completion
-	do {
-		Sleep(20);
-		rmi4update_poll();
-		if (m_flashStatus == SUCCESS){
-			break;
-		}
-		retry++;
-	} while(retry < 20);
 
-	if (m_flashStatus != SUCCESS) {
-		fprintf(stdout, "err flash_status = %d\n", m_flashStatus);
-		return UPDATE_FAIL_WRITE_F01_CONTROL_0;
-	}
 	return UPDATE_SUCCESS;
 }
 
@@ -2008,6 +1855,316 @@ int RMI4Update::WaitForIdle(int timeout_ms, bool readF34OnSucess)
 	return UPDATE_SUCCESS;
 }
 
+/*
+ * Waits up to timeout_ms for the F34 attention report of a touchpad. A few
+ * reports missed in a row, rather than one, mean the device doesn't send
+ * them while flashing and the rest of the update polls instead.
+ */
+void RMI4Update::WaitForFlashAttention(int timeout_ms)
+{
+	struct timeval tv;
+	int rc;
+
+	if (!m_flashAttention || m_device.GetDeviceType() != RMI_DEVICE_TYPE_TOUCHPAD)
+		return;
+
+	tv.tv_sec = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+	rc = m_device.WaitForAttention(&tv, m_f34.GetInterruptMask());
+	if (rc != -ETIMEDOUT) {
+		m_flashAttentionMisses = 0;
+		return;
+	}
+
+	if (++m_flashAttentionMisses < RMI_F34_MAX_ATTENTION_MISSES) {
+		fprintf(stderr, "%s: no attention report\n", __func__);
+		return;
+	}
+
+	fprintf(stderr, "%s: no attention reports, polling instead\n", __func__);
+	m_flashAttention = false;
+}
+
+/*
+ * Waits for the device to switch to the bootloader after CMD_V7_ENTER_BL,
+ * the same way WaitForFlashCompletion waits for a command. The status may
+ * not read as success while the device switches, so only the timeout ends
+ * the wait early.
+ */
+int RMI4Update::WaitForBootloaderV7()
+{
+	struct timespec start;
+	struct timespec now;
+	unsigned long intervalUs = RMI_F34_POLL_MIN_US;
+	int rc;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	WaitForFlashAttention(RMI_F34_ENABLE_WAIT_MS);
+
+	for (;;) {
+		rc = rmi4update_poll();
+		if (rc == UPDATE_SUCCESS && m_flashStatus == SUCCESS && m_inBLmode)
+			return UPDATE_SUCCESS;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (diff_time(&start, &now) >= RMI_F34_ENTER_BL_WAIT_MS * 1000LL)
+			break;
+
+		usleep(intervalUs);
+		intervalUs *= 2;
+		if (intervalUs > RMI_F34_POLL_MAX_US)
+			intervalUs = RMI_F34_POLL_MAX_US;
+	}
+
+	if (m_timing)
+		m_timing->CountTimeout();
+	if (rc != UPDATE_SUCCESS)
+		return rc;
+	if (m_flashStatus != SUCCESS) {
+		fprintf(stdout, "err flash_status = %d\n", m_flashStatus);
+		return UPDATE_FAIL_WRITE_F01_CONTROL_0;
+	}
+
+	return UPDATE_FAIL_DEVICE_NOT_IN_BOOTLOADER;
+}
+
+/*
+ * Waits for the V7 command in flight to complete. The F34 attention report
+ * says when it has, and the status is read straight away. Without one the
+ * status is polled, sleeping for about as long as the command has taken
+ * before and then at a growing interval.
+ */
+int RMI4Update::WaitForFlashCompletion(enum v7_flash_command command, bool checkWriteProtect)
+{
+	struct timespec start;
+	struct timespec now;
+	unsigned long elapsedUs;
+	unsigned long expectedUs = m_flashCompletionUs[command];
+	unsigned long intervalUs = RMI_F34_POLL_MIN_US;
+	int rc;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	WaitForFlashAttention(RMI_F34_IDLE_WAIT_MS);
+
+	for (;;) {
+		rc = rmi4update_poll();
+		if (rc != UPDATE_SUCCESS)
+			return rc;
+
+		if (checkWriteProtect && IsBLv87() && m_flashStatus == WRITE_PROTECTION)
+			return UPDATE_FAIL_WRITE_PROTECTED;
+
+		if (m_flashStatus != SUCCESS) {
+			fprintf(stdout, "err flash_status = %d\n", m_flashStatus);
+			return UPDATE_FAIL_WRITE_F01_CONTROL_0;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsedUs = diff_time(&start, &now);
+
+		if (m_flashCmd == CMD_V7_IDLE)
+			break;
+
+		if (elapsedUs >= RMI_F34_COMPLETION_WAIT_MS * 1000UL) {
+			fprintf(stderr, "%s: command %#04x did not complete\n", __func__, command);
+			if (m_timing)
+				m_timing->CountTimeout();
+			return UPDATE_FAIL_TIMEOUT_WAITING_FOR_ATTN;
+		}
+
+		if (elapsedUs < expectedUs) {
+			usleep(expectedUs - elapsedUs);
+		} else {
+			usleep(intervalUs);
+			intervalUs *= 2;
+			if (intervalUs > RMI_F34_POLL_MAX_US)
+				intervalUs = RMI_F34_POLL_MAX_US;
+		}
+	}
+
+	// Moving average of the completion times
+	m_flashCompletionUs[command] = expectedUs ? (3 * expectedUs + elapsedUs) / 4 : elapsedUs;
+
+	return UPDATE_SUCCESS;
+}
+
+// Reads the F34 status once, done is set when the bootloader is idle again
+int RMI4Update::ReadEraseStatus(bool checkWriteProtect, bool *done)
+{
+	int rc;
+
+	if (m_f34.GetFunctionVersion() == 0x02) {
+		rc = rmi4update_poll();
+		if (rc != UPDATE_SUCCESS)
+			return rc;
+
+		if (checkWriteProtect && IsBLv87() && m_flashStatus == WRITE_PROTECTION)
+			return UPDATE_FAIL_WRITE_PROTECTED;
+
+		if (m_flashStatus != SUCCESS) {
+			fprintf(stdout, "err flash_status = %d\n", m_flashStatus);
+			return UPDATE_FAIL_WRITE_F01_CONTROL_0;
+		}
+
+		*done = m_flashCmd == CMD_V7_IDLE;
+		return UPDATE_SUCCESS;
+	}
+
+	if (m_timing)
+		m_timing->CountPoll();
+
+	rc = ReadF34Controls();
+	if (rc != UPDATE_SUCCESS)
+		return rc;
+
+	*done = !m_f34Command;
+	if (!*done)
+		return UPDATE_SUCCESS;
+
+	if (m_f34Status) {
+		fprintf(stderr, "%s: erase failed, status: %#04x\n", __func__, m_f34Status);
+		return UPDATE_FAIL_NOT_IN_IDLE_STATE;
+	}
+
+	if (!m_programEnabled)
+		return UPDATE_FAIL_PROGRAMMING_NOT_ENABLED;
+
+	return UPDATE_SUCCESS;
+}
+
+/*
+ * Waits for the erase of partitionID to complete. Until the erase has taken
+ * as long as it did before, only the attention report is waited for. After
+ * that the status is also polled at a growing interval, and it is read as
+ * soon as the attention report arrives. The time taken is remembered for
+ * the product.
+ */
+int RMI4Update::WaitForEraseCompletion(unsigned char partitionID, int timeout_ms,
+					bool checkWriteProtect)
+{
+	struct timespec start;
+	struct timespec now;
+	struct timeval tv;
+	unsigned long elapsedUs = 0;
+	unsigned long waitUs;
+	unsigned long expectedUs = m_eraseUs[partitionID];
+	unsigned long intervalUs = RMI_F34_POLL_MIN_US;
+	bool attention = m_flashAttention && (m_f34.GetFunctionVersion() != 0x02
+				|| m_device.GetDeviceType() == RMI_DEVICE_TYPE_TOUCHPAD);
+	bool done = false;
+	int rc;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (!done) {
+		if (elapsedUs >= (unsigned long)timeout_ms * 1000) {
+			fprintf(stderr, "%s: partition %d did not finish erasing\n", __func__,
+				partitionID);
+			if (m_timing)
+				m_timing->CountTimeout();
+			return UPDATE_FAIL_TIMEOUT_WAITING_FOR_ATTN;
+		}
+
+		if (elapsedUs < expectedUs) {
+			waitUs = expectedUs - elapsedUs;
+		} else {
+			waitUs = intervalUs;
+			intervalUs *= 2;
+			if (intervalUs > RMI_F34_ERASE_POLL_MAX_US)
+				intervalUs = RMI_F34_ERASE_POLL_MAX_US;
+		}
+
+		if (attention) {
+			tv.tv_sec = waitUs / 1000000;
+			tv.tv_usec = waitUs % 1000000;
+			m_device.WaitForAttention(&tv, m_f34.GetInterruptMask());
+		} else {
+			usleep(waitUs);
+		}
+
+		rc = ReadEraseStatus(checkWriteProtect, &done);
+		if (rc != UPDATE_SUCCESS)
+			return rc;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsedUs = diff_time(&start, &now);
+	}
+
+	SaveEraseTime(partitionID, elapsedUs);
+
+	return UPDATE_SUCCESS;
+}
+
+void RMI4Update::LoadEraseTimes()
+{
+	DeviceProfile profile;
+	unsigned char buf[4];
+	char name[16];
+
+	if (m_profileDir.empty() || !profile.Load(DeviceProfile::GetProductPath(m_profileDir,
+						m_device.GetProductID(), RMI_ERASE_TIMES_SUFFIX)))
+		return;
+
+	for (int id = 0; id <= FIXED_LOCATION_DATA_PARTITION; ++id) {
+		snprintf(name, sizeof(name), "erase.%d", id);
+		if (profile.GetSection(name, buf, sizeof(buf)))
+			m_eraseUs[id] = extract_long(buf);
+	}
+}
+
+/*
+ * Folds the time the erase of partitionID took into the one remembered for
+ * the product. Other updates of the same product, such as the rest of a
+ * fleet, may save the file at the same time, so it is locked and reloaded
+ * first and their times are kept.
+ */
+void RMI4Update::SaveEraseTime(unsigned char partitionID, unsigned long elapsedUs)
+{
+	unsigned long expectedUs;
+	std::string path;
+	int lockFd;
+
+	if (m_profileDir.empty()) {
+		expectedUs = m_eraseUs[partitionID];
+		m_eraseUs[partitionID] = expectedUs ? (3 * expectedUs + elapsedUs) / 4 : elapsedUs;
+		return;
+	}
+
+	path = DeviceProfile::GetProductPath(m_profileDir, m_device.GetProductID(),
+						RMI_ERASE_TIMES_SUFFIX);
+	lockFd = DeviceProfile::Lock(path);
+	LoadEraseTimes();
+
+	expectedUs = m_eraseUs[partitionID];
+	m_eraseUs[partitionID] = expectedUs ? (3 * expectedUs + elapsedUs) / 4 : elapsedUs;
+	SaveEraseTimes(path);
+
+	DeviceProfile::Unlock(lockFd);
+}
+
+void RMI4Update::SaveEraseTimes(const std::string &path)
+{
+	DeviceProfile profile;
+	unsigned char buf[4];
+	char name[16];
+
+	for (int id = 0; id <= FIXED_LOCATION_DATA_PARTITION; ++id) {
+		if (!m_eraseUs[id])
+			continue;
+
+		snprintf(name, sizeof(name), "erase.%d", id);
+		for (int i = 0; i < 4; ++i)
+			buf[i] = (m_eraseUs[id] >> (i * 8)) & 0xFF;
+		profile.SetSection(name, buf, sizeof(buf));
+	}
+
+	if (!profile.Save(path))
+		fprintf(stderr, "Failed to save the erase times to %s\n", path.c_str());
+}
+
 bool RMI4Update::IsBLv87()
 {
 	if ((m_bootloaderID[1] >= 10) ||
@@ -20,6 +20,8 @@
 
 #include "rmidevice.h"
 #include "firmware_image.h"
+#include "updatejournal.h"
+#include "updatetiming.h"
 
 #define RMI_BOOTLOADER_ID_SIZE		2
 
@@ -156,11 +158,18 @@ struct partition_tbl
 };
 // leon end
 
+struct partition_write_v7 {
+	unsigned char partitionID;
+	int signature;			// enum signature_BLv7, -1 if there is none
+	bool checkWriteProtect;		// Fail early on BL v8.7 write protection
+};
+
 class RMI4Update
 {
 public:
 	RMI4Update(RMIDevice & device, FirmwareImage & firmwareImage) : m_device(device), 
-			m_firmwareImage(firmwareImage), m_writeBlockWithCmd(true)
+			m_firmwareImage(firmwareImage), m_writeBlockWithCmd(true), m_flashCompletionUs(),
+			m_eraseUs(), m_partitionUnchanged(), m_partitionWritten()
 	{
 		m_IsErased = false;
 		m_hasCoreCode = false;
@@ -168,8 +177,39 @@ public:
 		m_hasFlashConfig = false;
 		m_hasFLD = false;
 		m_hasGlobalParameters = false;
+		m_flashAttention = true;
+		m_flashAttentionMisses = 0;
+		m_differential = false;
+		m_verify = false;
+		m_timing = NULL;
+		m_readPipelineDepth = 1;
+		m_readRequestSize = 0;
 	}
 	int UpdateFirmware(bool force = false, bool performLockdown = false);
+	// Save the partitions of a V7 or later device to a hierarchical image
+	int BackupFirmware(const char * filename);
+	// Read the bootloader version of the device and the size of its
+	// firmware and config partitions, which an image has to fit
+	int ReadFlashLayout(unsigned char *bootloaderVersion, unsigned long *firmwareSize,
+				unsigned long *configSize);
+	// Read back the V7 partitions first and skip the ones which already
+	// match the image
+	void SetDifferential(bool differential) { m_differential = differential; }
+	// Read back each V7 partition written and compare it with the image
+	void SetVerify(bool verify) { m_verify = verify; }
+	// Record the progress of a V7 update to a journal at path, and resume
+	// the update it records if it was interrupted
+	void SetJournal(const char * path) { m_journalPath = path; }
+	// Record each phase of the update or backup to timing
+	void SetTiming(UpdateTiming * timing) { m_timing = timing; }
+	// Keep how long each erase takes for the product in dir, so later
+	// updates know when to expect the erase to finish
+	void SetProfileDir(const std::string & dir) { m_profileDir = dir; }
+	// Split reads of the V7 payload into requests of bytes and keep up to
+	// depth of them outstanding. bytes defaults to a block when depth is
+	// more than 1.
+	void SetReadPipeline(int depth, int bytes)
+	{ m_readPipelineDepth = depth; m_readRequestSize = bytes; }
 
 private:
 	int DisableNonessentialInterupts();
@@ -189,14 +229,40 @@ private:
 	int WriteFlashConfigV7();
 	int WriteFLDV7();
 	int WriteGlobalParametersV7();
+	const unsigned char *GetPartitionDataV7(unsigned char partitionID, unsigned long *blockCount);
+	int WritePayloadV7(const unsigned char *data, unsigned long len);
+	int SetPartitionV7(unsigned char partitionID, unsigned short block = 0);
+	int StartReadV7(unsigned long transferLength);
+	int FinishReadV7(unsigned char *buf, unsigned long transferLength);
+	int ReadPayloadV7(unsigned char *buf, unsigned long len);
+	int ReadPartitionV7(unsigned char partitionID, unsigned char *buf, unsigned long blockCount);
+	int VerifyPartitionV7(unsigned char partitionID);
+	int VerifyWrittenPartitionsV7();
+	int BackupPartitionsV7(std::vector<struct image_container> &containers);
+	void OpenJournalV7();
+	bool PartitionMatchesImageV7(unsigned char partitionID);
+	bool FindUnchangedPartitionsV7();
+	int WritePartitionV7(unsigned char partitionID);
 	int EnterFlashProgramming();
-	int WriteBlocks(unsigned char *block, unsigned short count, unsigned char cmd);
+	int WriteBlocks(const unsigned char *block, unsigned short count, unsigned char cmd);
 	int WaitForIdle(int timeout_ms, bool readF34OnSucess = true);
+	void WaitForFlashAttention(int timeout_ms);
+	int WaitForBootloaderV7();
+	int WaitForFlashCompletion(enum v7_flash_command command, bool checkWriteProtect = false);
+	int WaitForEraseCompletion(unsigned char partitionID, int timeout_ms,
+					bool checkWriteProtect = false);
+	int ReadEraseStatus(bool checkWriteProtect, bool *done);
+	void LoadEraseTimes();
+	void SaveEraseTime(unsigned char partitionID, unsigned long elapsedUs);
+	void SaveEraseTimes(const std::string &path);
 	int GetFirmwareSize() { return m_blockSize * m_fwBlockCount; }
 	int GetConfigSize() { return m_blockSize * m_configBlockCount; }
-	int WriteSignatureV7(enum signature_BLv7 signature_partition, unsigned char* data, int offset);
+	int WriteSignatureV7(enum signature_BLv7 signature_partition, const unsigned char* data, int offset);
 	bool IsBLv87();
 	int ReadMSL();
+	void BeginPhase(const char *name, int partition = -1)
+	{ if (m_timing) m_timing->BeginPhase(name, partition); }
+	void EndPhase(int rc) { if (m_timing) m_timing->EndPhase(rc); }
 
 private:
 	RMIDevice & m_device;
@@ -228,6 +294,8 @@ private:
 	struct partition_tbl *m_partitionCore;
 	struct partition_tbl *m_partitionConfig;
 	struct partition_tbl *m_partitionGuest;
+	// Every entry of the partition table in the flash config
+	std::vector<struct partition_tbl> m_partitionTable;
 	unsigned char m_flashStatus;
 	unsigned char m_flashCmd;
 	unsigned char m_inBLmode;
@@ -237,6 +305,24 @@ private:
 	bool m_hasCoreConfig;
 	bool m_hasFlashConfig;
 	bool m_hasGlobalParameters;
+	// Whether F34 attention reports are received while flashing
+	bool m_flashAttention;
+	int m_flashAttentionMisses;
+	// Average time each command has taken to complete
+	unsigned long m_flashCompletionUs[CMD_V7_SIGNATURE + 1];
+	// Average time each partition has taken to erase
+	unsigned long m_eraseUs[FIXED_LOCATION_DATA_PARTITION + 1];
+	std::string m_profileDir;
+	bool m_differential;
+	// Partitions found to match the image, which are not erased or written
+	bool m_partitionUnchanged[FIXED_LOCATION_DATA_PARTITION + 1];
+	bool m_verify;
+	bool m_partitionWritten[FIXED_LOCATION_DATA_PARTITION + 1];
+	std::string m_journalPath;
+	UpdateJournal m_journal;
+	UpdateTiming *m_timing;
+	int m_readPipelineDepth;
+	int m_readRequestSize;
 	/* BL_V7 end */
 
 	/* BL v8.7 */
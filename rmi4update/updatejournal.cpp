@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <vector>
+
+#include "updatejournal.h"
+
+#define JOURNAL_IMAGE_HASH		"image.hash"
+#define JOURNAL_PRODUCT_ID		"product.id"
+#define JOURNAL_PROGRESS		"progress"
+
+static std::string section_name(const char *prefix, unsigned char partitionID)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "%s.%u", prefix, partitionID);
+	return name;
+}
+
+bool UpdateJournal::Open(const std::string &path, unsigned long long imageHash,
+			const char *productID)
+{
+	unsigned char hash[8];
+	std::vector<unsigned char> savedProductID;
+	unsigned long long savedHash = 0;
+
+	m_path = path;
+	m_imageHash = imageHash;
+	m_productID = productID;
+	m_saveFailed = false;
+
+	if (!m_profile.Load(path))
+		return false;
+
+	if (!m_profile.GetSection(JOURNAL_IMAGE_HASH, hash, sizeof(hash))
+		|| !m_profile.GetSection(JOURNAL_PRODUCT_ID, savedProductID))
+		return false;
+
+	for (int i = 7; i >= 0; --i)
+		savedHash = savedHash << 8 | hash[i];
+
+	if (savedHash != m_imageHash
+		|| std::string(savedProductID.begin(), savedProductID.end()) != m_productID)
+		return false;
+
+	return m_profile.GetSection(JOURNAL_PROGRESS, NULL, 0);
+}
+
+void UpdateJournal::SetIdentity()
+{
+	unsigned char hash[8];
+
+	for (int i = 0; i < 8; ++i)
+		hash[i] = (m_imageHash >> (i * 8)) & 0xFF;
+
+	m_profile.SetSection(JOURNAL_IMAGE_HASH, hash, sizeof(hash));
+	m_profile.SetSection(JOURNAL_PRODUCT_ID, m_productID.data(), m_productID.size());
+}
+
+void UpdateJournal::Restart()
+{
+	if (!IsOpen())
+		return;
+
+	m_profile.Clear();
+	SetIdentity();
+	Save();
+}
+
+void UpdateJournal::Remove()
+{
+	if (!IsOpen())
+		return;
+
+	if (unlink(m_path.c_str()) < 0 && errno != ENOENT)
+		fprintf(stderr, "Failed to remove the journal %s: %s\n", m_path.c_str(),
+			strerror(errno));
+	m_profile.Clear();
+	m_path.clear();
+}
+
+// A journal which cannot be saved only costs the ability to resume
+void UpdateJournal::Save()
+{
+	if (m_profile.Save(m_path) || m_saveFailed)
+		return;
+
+	fprintf(stderr, "Failed to save the journal %s, the update cannot be resumed\n",
+		m_path.c_str());
+	m_saveFailed = true;
+}
+
+bool UpdateJournal::IsStepDone(const char *step)
+{
+	if (!IsOpen())
+		return false;
+
+	return m_profile.GetSection(std::string("step.") + step, NULL, 0);
+}
+
+void UpdateJournal::MarkStepDone(const char *step)
+{
+	if (!IsOpen())
+		return;
+
+	m_profile.SetSection(std::string("step.") + step, NULL, 0);
+	m_profile.SetSection(JOURNAL_PROGRESS, NULL, 0);
+	Save();
+}
+
+unsigned long UpdateJournal::GetBlocksWritten(unsigned char partitionID)
+{
+	unsigned char blocks[4];
+
+	if (!IsOpen() || !m_profile.GetSection(section_name("blocks", partitionID), blocks,
+						sizeof(blocks)))
+		return 0;
+
+	return blocks[0] | blocks[1] << 8 | blocks[2] << 16 | (unsigned long)blocks[3] << 24;
+}
+
+void UpdateJournal::SetBlocksWritten(unsigned char partitionID, unsigned long blocks)
+{
+	unsigned char buf[4];
+
+	if (!IsOpen())
+		return;
+
+	for (int i = 0; i < 4; ++i)
+		buf[i] = (blocks >> (i * 8)) & 0xFF;
+
+	m_profile.SetSection(section_name("blocks", partitionID), buf, sizeof(buf));
+	m_profile.SetSection(JOURNAL_PROGRESS, NULL, 0);
+	Save();
+}
+
+bool UpdateJournal::IsPartitionDone(unsigned char partitionID)
+{
+	if (!IsOpen())
+		return false;
+
+	return m_profile.GetSection(section_name("done", partitionID), NULL, 0);
+}
+
+void UpdateJournal::MarkPartitionDone(unsigned char partitionID)
+{
+	if (!IsOpen())
+		return;
+
+	m_profile.SetSection(section_name("done", partitionID), NULL, 0);
+	m_profile.SetSection(JOURNAL_PROGRESS, NULL, 0);
+	Save();
+}
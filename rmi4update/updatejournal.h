@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATEJOURNAL_H_
+#define _UPDATEJOURNAL_H_
+
+#include <string>
+
+#include "deviceprofile.h"
+
+/*
+ * Progress of a V7 update saved to disk after every step, so an update
+ * which was interrupted can be resumed by a later run with the same image.
+ * Steps are named, such as an erase, and partitions record how many blocks
+ * the device has acknowledged. The journal is stored as a profile file.
+ */
+class UpdateJournal
+{
+public:
+	UpdateJournal() : m_imageHash(0), m_saveFailed(false) {}
+
+	// Loads the journal at path. Returns true if it was left by an update
+	// of the same image to the same product and recorded any progress.
+	bool Open(const std::string &path, unsigned long long imageHash, const char *productID);
+	bool IsOpen() { return !m_path.empty(); }
+	// Forget any progress, the update starts from the beginning
+	void Restart();
+	// The update completed, the journal is no longer needed
+	void Remove();
+
+	bool IsStepDone(const char *step);
+	void MarkStepDone(const char *step);
+
+	unsigned long GetBlocksWritten(unsigned char partitionID);
+	void SetBlocksWritten(unsigned char partitionID, unsigned long blocks);
+	bool IsPartitionDone(unsigned char partitionID);
+	void MarkPartitionDone(unsigned char partitionID);
+
+private:
+	void Save();
+	void SetIdentity();
+
+	std::string m_path;
+	DeviceProfile m_profile;
+	unsigned long long m_imageHash;
+	std::string m_productID;
+	bool m_saveFailed;
+};
+
+#endif /* _UPDATEJOURNAL_H_ */
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "updatetiming.h"
+#include "updateutil.h"
+
+static void print_json_string(FILE *fp, const char *str)
+{
+	fputc('"', fp);
+	for (; *str; ++str) {
+		if (*str == '"' || *str == '\\')
+			fprintf(fp, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			fprintf(fp, "\\u%04x", (unsigned char)*str);
+		else
+			fputc(*str, fp);
+	}
+	fputc('"', fp);
+}
+
+static void print_json_counters(FILE *fp, const struct trace_counters &counters,
+				unsigned long polls, unsigned long timeouts)
+{
+	fprintf(fp, "\"reads\": %lu, \"read_bytes\": %llu, \"writes\": %lu, \"write_bytes\": %llu, "
+		"\"attention_waits\": %lu, \"polls\": %lu, \"timeouts\": %lu, \"errors\": %lu",
+		counters.reads, counters.readBytes, counters.writes, counters.writeBytes,
+		counters.attentionWaits, polls, counters.attentionTimeouts + timeouts,
+		counters.errors);
+}
+
+UpdateTiming::UpdateTiming(TraceDevice &device) : m_device(device), m_inPhase(false),
+	m_polls(0), m_timeouts(0)
+{
+	clock_gettime(CLOCK_MONOTONIC, &m_startTime);
+}
+
+void UpdateTiming::BeginPhase(const char *name, int partition)
+{
+	struct update_phase phase;
+	struct timespec now;
+
+	EndPhase(UPDATE_SUCCESS);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	phase.name = name;
+	phase.partition = partition;
+	phase.startUs = diff_time(&m_startTime, &now);
+	phase.durationUs = 0;
+	// Hold the totals so far, EndPhase turns them into the phase's share
+	phase.counters = m_device.GetCounters();
+	phase.polls = m_polls;
+	phase.timeouts = m_timeouts;
+	phase.rc = UPDATE_SUCCESS;
+	m_phases.push_back(phase);
+	m_inPhase = true;
+}
+
+void UpdateTiming::EndPhase(int rc)
+{
+	const struct trace_counters &counters = m_device.GetCounters();
+	struct timespec now;
+
+	if (!m_inPhase)
+		return;
+
+	struct update_phase &phase = m_phases.back();
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	phase.durationUs = diff_time(&m_startTime, &now) - phase.startUs;
+	phase.counters.reads = counters.reads - phase.counters.reads;
+	phase.counters.readBytes = counters.readBytes - phase.counters.readBytes;
+	phase.counters.writes = counters.writes - phase.counters.writes;
+	phase.counters.writeBytes = counters.writeBytes - phase.counters.writeBytes;
+	phase.counters.attentionWaits = counters.attentionWaits - phase.counters.attentionWaits;
+	phase.counters.attentionTimeouts = counters.attentionTimeouts
+						- phase.counters.attentionTimeouts;
+	phase.counters.errors = counters.errors - phase.counters.errors;
+	phase.polls = m_polls - phase.polls;
+	phase.timeouts = m_timeouts - phase.timeouts;
+	phase.rc = rc;
+	m_inPhase = false;
+}
+
+bool UpdateTiming::Save(const char *filename, int rc)
+{
+	struct timespec now;
+	FILE *fp;
+
+	EndPhase(rc);
+
+	fp = fopen(filename, "w");
+	if (!fp) {
+		fprintf(stderr, "Failed to create %s: %s\n", filename, strerror(errno));
+		return false;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	fprintf(fp, "{\n  \"product_id\": ");
+	print_json_string(fp, m_device.GetProductID());
+	fprintf(fp, ",\n  \"result\": ");
+	print_json_string(fp, update_err_to_string(rc));
+	fprintf(fp, ",\n  \"duration_us\": %lld,\n  \"totals\": { ", diff_time(&m_startTime, &now));
+	print_json_counters(fp, m_device.GetCounters(), m_polls, m_timeouts);
+	fprintf(fp, " },\n  \"phases\": [");
+
+	for (size_t i = 0; i < m_phases.size(); ++i) {
+		const struct update_phase &phase = m_phases[i];
+
+		fprintf(fp, "%s\n    { \"name\": ", i ? "," : "");
+		print_json_string(fp, phase.name.c_str());
+		if (phase.partition >= 0)
+			fprintf(fp, ", \"partition\": %d", phase.partition);
+		fprintf(fp, ", \"start_us\": %lld, \"duration_us\": %lld, ", phase.startUs,
+			phase.durationUs);
+		print_json_counters(fp, phase.counters, phase.polls, phase.timeouts);
+		fprintf(fp, ", \"result\": ");
+		print_json_string(fp, update_err_to_string(phase.rc));
+		fprintf(fp, " }");
+	}
+	fprintf(fp, "\n  ]\n}\n");
+
+	if (fclose(fp)) {
+		fprintf(stderr, "Failed to write %s: %s\n", filename, strerror(errno));
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATETIMING_H_
+#define _UPDATETIMING_H_
+
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "tracedevice.h"
+
+struct update_phase {
+	std::string name;
+	int partition;			// -1 when the phase is not for one partition
+	long long startUs;		// since the timing started
+	long long durationUs;
+	struct trace_counters counters;
+	unsigned long polls;
+	unsigned long timeouts;
+	int rc;
+};
+
+/*
+ * Splits an update into named phases and records how long each one took
+ * and what it cost: the transactions and bytes counted by a TraceDevice
+ * wrapping the device, attention waits, F34 status polls and timeouts.
+ * Starting a phase ends the one before it. The phases are saved as JSON.
+ */
+class UpdateTiming
+{
+public:
+	UpdateTiming(TraceDevice &device);
+
+	void BeginPhase(const char *name, int partition = -1);
+	void EndPhase(int rc);
+	void CountPoll() { ++m_polls; }
+	void CountTimeout() { ++m_timeouts; }
+
+	// Ends any phase still running with rc, which is also the update's result
+	bool Save(const char *filename, int rc);
+
+private:
+	TraceDevice &m_device;
+	struct timespec m_startTime;
+	std::vector<struct update_phase> m_phases;
+	bool m_inPhase;
+	unsigned long m_polls;
+	unsigned long m_timeouts;
+};
+
+#endif /* _UPDATETIMING_H_ */
@@ -53,6 +53,11 @@ const char *update_error_str[] = {
 	"invalid parameter",						// UPDATE_FAIL_INVALID_PARAMETER
 	"failed to open firmware image file",				// UPDATE_FAIL_OPEN_FIRMWARE_IMAGE
 	"write protection is activated",			// UPDATE_FAIL_WRITE_PROTECTED
+	"the device is older than its minimum secure level",		// UPDATE_FAIL_MSL_CHECKING
+	"flash read back does not match the image",			// UPDATE_FAIL_VERIFY_READBACK
+	"the device's bootloader version is unsupported",		// UPDATE_FAIL_UNSUPPORTED_BOOTLOADER
+	"failed to write firmware image file",				// UPDATE_FAIL_WRITE_FIRMWARE_IMAGE
+	"firmware image is truncated",					// UPDATE_FAIL_IMAGE_TRUNCATED
 };
 
 const char * update_err_to_string(int err)
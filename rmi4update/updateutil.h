@@ -53,6 +53,10 @@ enum update_error {
 	UPDATE_FAIL_OPEN_FIRMWARE_IMAGE,
 	UPDATE_FAIL_WRITE_PROTECTED,
 	UPDATE_FAIL_MSL_CHECKING,
+	UPDATE_FAIL_VERIFY_READBACK,
+	UPDATE_FAIL_UNSUPPORTED_BOOTLOADER,
+	UPDATE_FAIL_WRITE_FIRMWARE_IMAGE,
+	UPDATE_FAIL_IMAGE_TRUNCATED,
 };
 
 const char * update_err_to_string(int err);
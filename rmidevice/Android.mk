@@ -2,7 +2,7 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_MODULE := rmidevice
-LOCAL_SRC_FILES := rmifunction.cpp rmidevice.cpp hiddevice.cpp util.cpp
+LOCAL_SRC_FILES := rmifunction.cpp rmidevice.cpp hiddevice.cpp util.cpp reportqueue.cpp waitengine.cpp uringtransport.cpp registercache.cpp deviceprofile.cpp simdevice.cpp tracedevice.cpp replaydevice.cpp latencystats.cpp
 LOCAL_CPPFLAGS := -Wall
 
 include $(BUILD_STATIC_LIBRARY)
@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <sstream>
+
+#include "deviceprofile.h"
+
+#define DEVICE_PROFILE_HEADER		"rmi4utils-profile 1"
+#define DEVICE_PROFILE_SUFFIX		".profile"
+
+/*
+ * The file starts with DEVICE_PROFILE_HEADER followed by one line per
+ * section holding the section name and its contents in hex.
+ */
+bool DeviceProfile::Load(const std::string &path)
+{
+	std::ifstream file(path.c_str());
+	std::string line;
+
+	m_sections.clear();
+
+	if (!file.is_open())
+		return false;
+
+	if (!std::getline(file, line) || line != DEVICE_PROFILE_HEADER)
+		return false;
+
+	while (std::getline(file, line)) {
+		std::istringstream ss(line);
+		std::string name;
+		std::string hex;
+		std::vector<unsigned char> data;
+
+		if (!(ss >> name))
+			continue;
+		ss >> hex;
+
+		if (hex.size() % 2) {
+			m_sections.clear();
+			return false;
+		}
+
+		for (size_t i = 0; i < hex.size(); i += 2) {
+			char byte[3] = { hex[i], hex[i + 1], '\0' };
+			char *end;
+
+			data.push_back(strtoul(byte, &end, 16));
+			if (*end != '\0') {
+				m_sections.clear();
+				return false;
+			}
+		}
+		m_sections[name] = data;
+	}
+
+	return true;
+}
+
+// Create every missing directory leading up to path
+static bool MakeParentDirs(const std::string &path)
+{
+	size_t pos = 0;
+
+	while ((pos = path.find('/', pos + 1)) != std::string::npos) {
+		std::string dir = path.substr(0, pos);
+
+		if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+			return false;
+	}
+
+	return true;
+}
+
+bool DeviceProfile::Save(const std::string &path)
+{
+	std::map<std::string, std::vector<unsigned char> >::iterator it;
+	std::vector<char> tmpPath(path.begin(), path.end());
+	const char *suffix = ".XXXXXX";
+	FILE *fp;
+	int fd;
+
+	if (!MakeParentDirs(path))
+		return false;
+
+	// Threads saving the same profile each write their own temporary file
+	tmpPath.insert(tmpPath.end(), suffix, suffix + strlen(suffix) + 1);
+	fd = mkstemp(&tmpPath[0]);
+	if (fd < 0)
+		return false;
+
+	fp = fdopen(fd, "w");
+	if (!fp || fchmod(fd, 0644) < 0) {
+		if (fp)
+			fclose(fp);
+		else
+			close(fd);
+		unlink(&tmpPath[0]);
+		return false;
+	}
+
+	fprintf(fp, "%s\n", DEVICE_PROFILE_HEADER);
+	for (it = m_sections.begin(); it != m_sections.end(); ++it) {
+		fprintf(fp, "%s ", it->first.c_str());
+		for (size_t i = 0; i < it->second.size(); ++i)
+			fprintf(fp, "%02x", it->second[i]);
+		fprintf(fp, "\n");
+	}
+
+	if (fclose(fp)) {
+		unlink(&tmpPath[0]);
+		return false;
+	}
+
+	// Readers never see a partly written profile
+	if (rename(&tmpPath[0], path.c_str()) < 0) {
+		unlink(&tmpPath[0]);
+		return false;
+	}
+
+	return true;
+}
+
+int DeviceProfile::Lock(const std::string &path)
+{
+	std::string lockPath = path + ".lock";
+	int fd;
+
+	if (!MakeParentDirs(path))
+		return -1;
+
+	fd = open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+
+	while (flock(fd, LOCK_EX) < 0) {
+		if (errno != EINTR) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	return fd;
+}
+
+void DeviceProfile::Unlock(int fd)
+{
+	if (fd < 0)
+		return;
+
+	flock(fd, LOCK_UN);
+	close(fd);
+}
+
+void DeviceProfile::Merge(const DeviceProfile &profile)
+{
+	std::map<std::string, std::vector<unsigned char> >::const_iterator it;
+
+	for (it = profile.m_sections.begin(); it != profile.m_sections.end(); ++it)
+		m_sections[it->first] = it->second;
+}
+
+void DeviceProfile::SetSection(const std::string &name, const void *data, size_t len)
+{
+	const unsigned char *bytes = (const unsigned char *)data;
+
+	m_sections[name].assign(bytes, bytes + len);
+}
+
+bool DeviceProfile::GetSection(const std::string &name, std::vector<unsigned char> &data)
+{
+	std::map<std::string, std::vector<unsigned char> >::iterator it = m_sections.find(name);
+
+	if (it == m_sections.end())
+		return false;
+
+	data = it->second;
+	return true;
+}
+
+bool DeviceProfile::GetSection(const std::string &name, void *data, size_t len)
+{
+	std::map<std::string, std::vector<unsigned char> >::iterator it = m_sections.find(name);
+
+	if (it == m_sections.end() || it->second.size() != len)
+		return false;
+
+	if (len)
+		memcpy(data, &it->second[0], len);
+	return true;
+}
+
+std::string DeviceProfile::GetDefaultDir()
+{
+	const char *dir;
+
+	dir = getenv("RMI4UTILS_PROFILE_DIR");
+	if (dir && dir[0])
+		return dir;
+
+	dir = getenv("XDG_CACHE_HOME");
+	if (dir && dir[0])
+		return std::string(dir) + "/rmi4utils";
+
+	dir = getenv("HOME");
+	if (dir && dir[0])
+		return std::string(dir) + "/.cache/rmi4utils";
+
+	return "/tmp/rmi4utils";
+}
+
+// Product IDs are free form, only keep characters safe in a file name
+static std::string SafeFileName(const char *productID)
+{
+	std::string name;
+
+	for (const char *c = productID; *c; ++c)
+		name += (isalnum((unsigned char)*c) || *c == '-' || *c == '_') ? *c : '_';
+
+	return name;
+}
+
+std::string DeviceProfile::GetPath(const std::string &dir, const char *productID,
+					unsigned long buildID, unsigned long configID)
+{
+	char ids[32];
+
+	snprintf(ids, sizeof(ids), "-%lu-%08lx", buildID, configID);
+
+	return dir + "/" + SafeFileName(productID) + ids + DEVICE_PROFILE_SUFFIX;
+}
+
+std::string DeviceProfile::GetProductPath(const std::string &dir, const char *productID,
+						const char *suffix)
+{
+	return dir + "/" + SafeFileName(productID) + suffix;
+}
+
+void DeviceProfile::ListProfiles(const std::string &dir, std::vector<std::string> &paths)
+{
+	DIR *d;
+	struct dirent *entry;
+	const size_t suffixLen = strlen(DEVICE_PROFILE_SUFFIX);
+
+	paths.clear();
+
+	d = opendir(dir.c_str());
+	if (!d)
+		return;
+
+	while ((entry = readdir(d)) != NULL) {
+		size_t len = strlen(entry->d_name);
+
+		if (len > suffixLen
+			&& !strcmp(entry->d_name + len - suffixLen, DEVICE_PROFILE_SUFFIX))
+			paths.push_back(dir + "/" + entry->d_name);
+	}
+
+	closedir(d);
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _DEVICEPROFILE_H_
+#define _DEVICEPROFILE_H_
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ * Named binary sections describing a device which are saved to disk so
+ * later runs can skip walking the register map. Each profile is stored in
+ * its own file named after the product ID, build ID and config ID.
+ */
+class DeviceProfile
+{
+public:
+	DeviceProfile() {}
+
+	bool Load(const std::string &path);
+	bool Save(const std::string &path);
+	void Clear() { m_sections.clear(); }
+	void Merge(const DeviceProfile &profile);
+
+	void SetSection(const std::string &name, const void *data, size_t len);
+	bool GetSection(const std::string &name, std::vector<unsigned char> &data);
+	// Only succeeds if the saved section is exactly len bytes long
+	bool GetSection(const std::string &name, void *data, size_t len);
+
+	// $RMI4UTILS_PROFILE_DIR, otherwise rmi4utils in the user's cache directory
+	static std::string GetDefaultDir();
+	static std::string GetPath(const std::string &dir, const char *productID,
+					unsigned long buildID, unsigned long configID);
+	// For what is kept per product, whichever firmware it runs
+	static std::string GetProductPath(const std::string &dir, const char *productID,
+					const char *suffix);
+	static void ListProfiles(const std::string &dir, std::vector<std::string> &paths);
+
+	// Take an exclusive lock on path + ".lock" to load, change and save
+	// the profile at path without losing another thread or process's
+	// changes. Returns the descriptor to pass to Unlock() or -1.
+	static int Lock(const std::string &path);
+	static void Unlock(int fd);
+
+private:
+	std::map<std::string, std::vector<unsigned char> > m_sections;
+};
+
+#endif /* _DEVICEPROFILE_H_ */
@@ -24,7 +24,6 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
 
 #include <linux/types.h>
 #include <linux/input.h>
@@ -32,8 +31,11 @@
 #include <signal.h>
 #include <stdlib.h>
 #include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <algorithm>
 
 #include "hiddevice.h"
+#include "waitengine.h"
 
 #define RMI_WRITE_REPORT_ID                 0x9 // Output Report
 #define RMI_READ_ADDR_REPORT_ID             0xa // Output Report
@@ -64,6 +66,16 @@ enum hid_report_type {
 
 #define SYNAPTICS_VENDOR_ID			0x06cb
 
+#define HID_HIDRAW_WAIT_MS			(20 * 1000)
+// How long the input device may take to appear after the hidraw device
+#define HID_INPUT_WAIT_MS			(2 * 1000)
+// Retry binding a device which is still booting
+#define HID_BIND_RETRY_MIN_MS			10
+#define HID_BIND_RETRY_MAX_MS			500
+
+#define HID_ATTN_QUEUE_DEPTH			64
+#define HID_READ_DATA_QUEUE_DEPTH		64
+
 int HIDDevice::Open(const char * filename)
 {
 	int rc;
@@ -130,6 +142,14 @@ int HIDDevice::Open(const char * filename)
 		goto error;
 	}
 
+	rc = m_waitEngine.Open();
+	if (rc)
+		goto error;
+
+	rc = m_waitEngine.AddFd(m_fd);
+	if (rc)
+		goto error;
+
 	m_deviceOpen = true;
 
 	// Determine which mode the device is currently running in based on the current HID driver
@@ -149,6 +169,14 @@ int HIDDevice::Open(const char * filename)
 		}
 	}
 
+	if (m_useAttnReader) {
+		rc = StartAttentionReader();
+		if (rc)
+			goto error;
+	} else if (m_useIoUring) {
+		StartIoUring();
+	}
+
 	return 0;
 
 error:
@@ -286,25 +314,133 @@ void HIDDevice::ParseReportDescriptor()
 	}
 }
 
+// Send the output report. Inside a write batch the io_uring transport only
+// queues the report, EndWriteBatch() sends it.
+int HIDDevice::WriteReport()
+{
+	ssize_t rc;
+	size_t bytesWritten;
+
+	if (m_ioUringActive) {
+		rc = m_uring.QueueWrite(m_outputReport, m_outputReportSize);
+		if (!rc && !m_writeBatchDepth)
+			rc = m_uring.Submit(true);
+		return rc;
+	}
+
+	for (bytesWritten = 0; bytesWritten < m_outputReportSize; bytesWritten += rc) {
+		m_bCancel = false;
+		rc = write(m_fd, m_outputReport + bytesWritten,
+				m_outputReportSize - bytesWritten);
+		if (rc < 0) {
+			if (errno == EINTR && m_deviceOpen && !m_bCancel)
+				continue;
+			else
+				return rc;
+		}
+		break;
+	}
+
+	return 0;
+}
+
+int HIDDevice::EndWriteBatch()
+{
+	int rc;
+
+	if (m_writeBatchDepth > 0 && --m_writeBatchDepth == 0 && m_ioUringActive) {
+		rc = m_uring.Submit(true);
+		// Writes which were cached may not have reached the device
+		if (rc < 0)
+			m_registerCache.Flush();
+		return rc;
+	}
+
+	return 0;
+}
+
+int HIDDevice::WriteReadRequest(unsigned short addr, size_t count)
+{
+	if (m_outputReportSize < HID_RMI4_READ_OUTPUT_COUNT + 2)
+		return -1;
+
+	m_outputReport[HID_RMI4_REPORT_ID] = RMI_READ_ADDR_REPORT_ID;
+	m_outputReport[1] = 0; /* old 1 byte read count */
+	m_outputReport[HID_RMI4_READ_OUTPUT_ADDR] = addr & 0xFF;
+	m_outputReport[HID_RMI4_READ_OUTPUT_ADDR + 1] = (addr >> 8) & 0xFF;
+	m_outputReport[HID_RMI4_READ_OUTPUT_COUNT] = count  & 0xFF;
+	m_outputReport[HID_RMI4_READ_OUTPUT_COUNT + 1] = (count >> 8) & 0xFF;
+
+	return WriteReport();
+}
+
+// Discard any input reports still queued from requests which are being
+// abandoned so that they are not mistaken for the data of a new request.
+void HIDDevice::FlushInputReports()
+{
+	struct timeval tv;
+	int reportId;
+
+	do {
+		tv.tv_sec = 0;
+		tv.tv_usec = 10 * 1000;
+	} while (GetReport(&reportId, &tv, true) > 0);
+	m_dataBytesRead = 0;
+}
+
 int HIDDevice::Read(unsigned short addr, unsigned char *buf, unsigned short len)
 {
-	ssize_t count;
+	if (!m_deviceOpen)
+		return -1;
+
+	if (m_registerCache.Lookup(addr, buf, len))
+		return len;
+
+	return ReadTimed(addr, buf, len, false);
+}
+
+int HIDDevice::ReadFifo(unsigned short addr, unsigned char *buf, unsigned short len)
+{
+	if (!m_deviceOpen)
+		return -1;
+
+	return ReadTimed(addr, buf, len, true);
+}
+
+int HIDDevice::ReadTimed(unsigned short addr, unsigned char *buf, unsigned short len, bool fifo)
+{
+	struct timespec start;
+	int rc;
+
+	if (!m_latencyStatsEnabled)
+		return ReadRegisters(addr, buf, len, fifo);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rc = ReadRegisters(addr, buf, len, fifo);
+	if (rc < 0)
+		m_latencyStats.RecordEvent(LATENCY_EVENT_ERROR);
+	else
+		m_latencyStats.Record(LATENCY_OP_READ, len, &start);
+
+	return rc;
+}
+
+int HIDDevice::ReadRegisters(unsigned short addr, unsigned char *buf, unsigned short len,
+				bool fifo)
+{
 	size_t bytesReadPerRequest;
 	size_t bytesInDataReport;
 	size_t totalBytesRead;
 	size_t bytesPerRequest;
-	size_t bytesWritten;
 	size_t bytesToRequest;
 	int reportId;
 	int rc;
 	struct timeval tv;
 	int resendCount = 0;
+	unsigned short startAddr = addr;
 
 	tv.tv_sec = 10 / 1000;
 	tv.tv_usec = (10 % 1000) * 1000;
-	
-	if (!m_deviceOpen)
-		return -1;
 
 	if (m_hasDebug) {
 		fprintf(stdout, "R %02x : ", addr);
@@ -315,6 +451,14 @@ int HIDDevice::Read(unsigned short addr, unsigned char *buf, unsigned short len)
 	else
 		bytesPerRequest = len;
 
+	if (m_readPipelineDepth > 1 && len > bytesPerRequest) {
+		rc = ReadPipelined(addr, buf, len, bytesPerRequest, fifo);
+		if (rc < 0)
+			return rc;
+		totalBytesRead = rc;
+		goto done;
+	}
+
 	for (totalBytesRead = 0; totalBytesRead < len; totalBytesRead += bytesReadPerRequest) {
 Resend:
 		if (GetDeviceType() == RMI_DEVICE_TYPE_TOUCHPAD) {
@@ -323,45 +467,25 @@ Resend:
 				return -1;
 			}
 		}
-		count = 0;
 		if ((len - totalBytesRead) < bytesPerRequest)
 			bytesToRequest = len % bytesPerRequest;
 		else
 			bytesToRequest = bytesPerRequest;
 
-		if (m_outputReportSize < HID_RMI4_READ_OUTPUT_COUNT + 2) {
-			return -1;
-		}
-		m_outputReport[HID_RMI4_REPORT_ID] = RMI_READ_ADDR_REPORT_ID;
-		m_outputReport[1] = 0; /* old 1 byte read count */
-		m_outputReport[HID_RMI4_READ_OUTPUT_ADDR] = addr & 0xFF;
-		m_outputReport[HID_RMI4_READ_OUTPUT_ADDR + 1] = (addr >> 8) & 0xFF;
-		m_outputReport[HID_RMI4_READ_OUTPUT_COUNT] = bytesToRequest  & 0xFF;
-		m_outputReport[HID_RMI4_READ_OUTPUT_COUNT + 1] = (bytesToRequest >> 8) & 0xFF;
-
 		m_dataBytesRead = 0;
 
-		for (bytesWritten = 0; bytesWritten < m_outputReportSize; bytesWritten += count) {
-			m_bCancel = false;
-			count = write(m_fd, m_outputReport + bytesWritten,
-					m_outputReportSize - bytesWritten);
-			if (count < 0) {
-				if (errno == EINTR && m_deviceOpen && !m_bCancel)
-					continue;
-				else
-					return count;
-			}
-			break;
-		}
+		rc = WriteReadRequest(addr, bytesToRequest);
+		if (rc < 0)
+			return rc;
 
 		bytesReadPerRequest = 0;
 		while (bytesReadPerRequest < bytesToRequest) {
 			if (GetDeviceType() == RMI_DEVICE_TYPE_TOUCHPAD) {
 				// Add timeout 10 ms for select() called in GetReport().
-				rc = GetReport(&reportId, &tv);
+				rc = GetReadDataReport(&reportId, &tv);
 			} else {
 				// Touch Screen
-				rc = GetReport(&reportId);
+				rc = GetReadDataReport(&reportId, NULL);
 			}
 			if (rc > 0 && reportId == RMI_READ_DATA_REPORT_ID) {
 				if (static_cast<ssize_t>(m_inputReportSize) <
@@ -385,11 +509,19 @@ Resend:
 			} else if (GetDeviceType() == RMI_DEVICE_TYPE_TOUCHPAD) {
 				fprintf(stderr, "Some error with GetReport : rc(%d), reportID(0x%x)\n", rc, reportId);
 				resendCount += 1;
+				if (m_latencyStatsEnabled)
+					m_latencyStats.RecordEvent(LATENCY_EVENT_RESEND);
 				goto Resend;
 			}
 		}
-		addr += bytesPerRequest;
+		if (!fifo)
+			addr += bytesPerRequest;
 	}
+
+done:
+	if (!fifo)
+		m_registerCache.Update(startAddr, buf, len, false);
+
 	if (m_hasDebug) {
 		for (int i=0 ; i<len ; i++) {
 			fprintf(stdout, "%02x ", buf[i]);
@@ -400,13 +532,128 @@ Resend:
 	return totalBytesRead;
 }
 
+/*
+ * Keep up to m_readPipelineDepth read requests outstanding instead of waiting
+ * for each request to complete before sending the next one. The device answers
+ * read requests in the order they were sent so the data reports are assembled
+ * into the buffer at the offset of the oldest outstanding request. A FIFO
+ * register is read with every request going to the same address.
+ */
+int HIDDevice::ReadPipelined(unsigned short addr, unsigned char *buf, unsigned short len,
+				size_t bytesPerRequest, bool fifo)
+{
+	size_t requestCount = (len + bytesPerRequest - 1) / bytesPerRequest;
+	size_t nextRequest = 0;
+	size_t currentRequest = 0;
+	size_t bytesInCurrentRequest = 0;
+	size_t currentRequestSize;
+	size_t requestSize;
+	size_t bytesInDataReport;
+	int reportId = 0;
+	int rc;
+	int batchRc;
+	struct timeval tv;
+	int resendCount = 0;
+
+	if (static_cast<ssize_t>(m_inputReportSize) <
+	    std::max(HID_RMI4_READ_INPUT_COUNT, HID_RMI4_READ_INPUT_DATA))
+		return -1;
+
+	m_dataBytesRead = 0;
+
+	while (currentRequest < requestCount) {
+		rc = 0;
+		BeginWriteBatch();
+		while (nextRequest < requestCount
+			&& nextRequest - currentRequest < (size_t)m_readPipelineDepth)
+		{
+			requestSize = std::min(bytesPerRequest, len - nextRequest * bytesPerRequest);
+			rc = WriteReadRequest(fifo ? addr : addr + nextRequest * bytesPerRequest,
+						requestSize);
+			if (rc < 0)
+				break;
+			++nextRequest;
+		}
+		batchRc = EndWriteBatch();
+		if (rc < 0)
+			return rc;
+		if (batchRc < 0)
+			return batchRc;
+
+		currentRequestSize = std::min(bytesPerRequest, len - currentRequest * bytesPerRequest);
+
+		if (GetDeviceType() == RMI_DEVICE_TYPE_TOUCHPAD) {
+			tv.tv_sec = 10 / 1000;
+			tv.tv_usec = (10 % 1000) * 1000;
+			rc = GetReadDataReport(&reportId, &tv);
+		} else {
+			rc = GetReadDataReport(&reportId, NULL);
+		}
+
+		if (rc > 0 && reportId == RMI_READ_DATA_REPORT_ID) {
+			bytesInDataReport = m_readData[HID_RMI4_READ_INPUT_COUNT];
+			if (bytesInCurrentRequest + bytesInDataReport > currentRequestSize)
+				return -1;
+
+			memcpy(buf + currentRequest * bytesPerRequest + bytesInCurrentRequest,
+				&m_readData[HID_RMI4_READ_INPUT_DATA], bytesInDataReport);
+			bytesInCurrentRequest += bytesInDataReport;
+			m_dataBytesRead = 0;
+			resendCount = 0;
+
+			if (bytesInCurrentRequest == currentRequestSize) {
+				++currentRequest;
+				bytesInCurrentRequest = 0;
+			}
+		} else if (GetDeviceType() == RMI_DEVICE_TYPE_TOUCHPAD) {
+			fprintf(stderr, "Some error with GetReport : rc(%d), reportID(0x%x)\n", rc, reportId);
+			if (++resendCount == 3) {
+				fprintf(stderr, "resend count exceed, return as failure\n");
+				return -1;
+			}
+			if (m_latencyStatsEnabled)
+				m_latencyStats.RecordEvent(LATENCY_EVENT_RESEND);
+
+			// Responses to the abandoned requests may still arrive, drop them
+			// and restart from the oldest request which has not completed.
+			// A FIFO has already moved past any data which was sent for
+			// the abandoned requests so they can't be sent again.
+			FlushInputReports();
+			if (fifo && (nextRequest > currentRequest + 1 || bytesInCurrentRequest))
+				return -1;
+			nextRequest = currentRequest;
+			bytesInCurrentRequest = 0;
+		} else if (rc < 0) {
+			return rc;
+		}
+	}
+
+	return len;
+}
+
+// A write has to fit in one output report and its length in one byte
+unsigned short HIDDevice::GetMaxWriteSize()
+{
+	size_t size;
+
+	if (m_outputReportSize <= HID_RMI4_WRITE_OUTPUT_DATA)
+		return 0;
+
+	size = m_outputReportSize - HID_RMI4_WRITE_OUTPUT_DATA;
+	return size > 0xFF ? 0xFF : size;
+}
+
 int HIDDevice::Write(unsigned short addr, const unsigned char *buf, unsigned short len)
 {
-	ssize_t count;
+	struct timespec start;
+	int rc;
 
 	if (!m_deviceOpen)
 		return -1;
 
+	if (m_latencyStatsEnabled)
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
 	if (static_cast<ssize_t>(m_outputReportSize) <
 	    HID_RMI4_WRITE_OUTPUT_DATA + len)
 		return -1;
@@ -424,17 +671,20 @@ int HIDDevice::Write(unsigned short addr, const unsigned char *buf, unsigned sho
 		fprintf(stdout, "\n");
 	}
 
-	for (;;) {
-		m_bCancel = false;
-		count = write(m_fd, m_outputReport, m_outputReportSize);
-		if (count < 0) {
-			if (errno == EINTR && m_deviceOpen && !m_bCancel)
-				continue;
-			else
-				return count;
-		}
-		return len;
+	rc = WriteReport();
+	if (rc < 0) {
+		if (m_latencyStatsEnabled)
+			m_latencyStats.RecordEvent(LATENCY_EVENT_ERROR);
+		return rc;
 	}
+
+	// Batched writes are counted when they are queued
+	if (m_latencyStatsEnabled)
+		m_latencyStats.Record(LATENCY_OP_WRITE, len, &start);
+
+	m_registerCache.Update(addr, buf, len, true);
+
+	return len;
 }
 
 int HIDDevice::SetMode(int mode)
@@ -453,6 +703,8 @@ int HIDDevice::SetMode(int mode)
 		return rc;
 	}
 
+	m_registerCache.Flush();
+
 	return 0;
 }
 
@@ -501,10 +753,14 @@ void HIDDevice::Close()
 	if (!m_deviceOpen)
 		return;
 
+	StopIoUring();
+	StopAttentionReader();
+
 	if (m_initialMode != m_mode)
 		SetMode(m_initialMode);
 
 	m_deviceOpen = false;
+	m_waitEngine.Close();
 	close(m_fd);
 	m_fd = -1;
 
@@ -528,11 +784,19 @@ int HIDDevice::GetAttentionReport(struct timeval * timeout, unsigned int source_
 {
 	int rc = 0;
 	int reportId;
+	struct timespec deadline;
+	struct timespec start;
+
+	if (timeout)
+		deadline_from_timeval(timeout, &deadline);
 
-	// Assume the Linux implementation of select with timeout set to the
-	// time remaining.
-	while (!timeout || (timeout->tv_sec != 0 || timeout->tv_usec != 0)) {
-		rc = GetReport(&reportId, timeout);
+	if (m_latencyStatsEnabled)
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (;;) {
+		rc = WaitForReport(&reportId, timeout ? &deadline : NULL, false);
+		if (timeout)
+			deadline_remaining(&deadline, timeout);
 		if (rc > 0) {
 			if (reportId == RMI_ATTN_REPORT_ID) {
 				// If a valid buffer is passed in then copy the data from
@@ -553,21 +817,56 @@ int HIDDevice::GetAttentionReport(struct timeval * timeout, unsigned int source_
 				if (m_inputReportSize < HID_RMI4_ATTN_INTERUPT_SOURCES + 1)
 					return -1;
 
-				if (source_mask & m_attnData[HID_RMI4_ATTN_INTERUPT_SOURCES])
+				if (source_mask & m_attnData[HID_RMI4_ATTN_INTERUPT_SOURCES]) {
+					if (m_latencyStatsEnabled)
+						m_latencyStats.Record(LATENCY_OP_ATTENTION,
+							m_inputReportSize, &start);
 					return rc;
+				}
 			}
 		} else {
+			if (rc == -ETIMEDOUT && m_latencyStatsEnabled)
+				m_latencyStats.RecordEvent(LATENCY_EVENT_TIMEOUT);
 			return rc;
 		}
 	}
+}
+
+int HIDDevice::GetReport(int *reportId, struct timeval * timeout, bool readDataOnly)
+{
+	struct timespec deadline;
+
+	if (!timeout)
+		return WaitForReport(reportId, NULL, readDataOnly);
+
+	deadline_from_timeval(timeout, &deadline);
+	return WaitForReport(reportId, &deadline, readDataOnly);
+}
+
+int HIDDevice::GetReadDataReport(int *reportId, struct timeval * timeout)
+{
+	struct timespec start;
+	int rc;
+
+	if (!m_latencyStatsEnabled)
+		return GetReport(reportId, timeout, true);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rc = GetReport(reportId, timeout, true);
+	if (rc == -ETIMEDOUT)
+		m_latencyStats.RecordEvent(LATENCY_EVENT_TIMEOUT);
+	else if (rc > 0 && *reportId == RMI_READ_DATA_REPORT_ID)
+		m_latencyStats.Record(LATENCY_OP_GET_REPORT, m_readData[HID_RMI4_READ_INPUT_COUNT],
+					&start);
 
 	return rc;
 }
 
-int HIDDevice::GetReport(int *reportId, struct timeval * timeout)
+int HIDDevice::WaitForReport(int *reportId, const struct timespec * deadline, bool readDataOnly)
 {
 	ssize_t count = 0;
-	fd_set fds;
+	size_t offset = 0;
+	int readyFd;
 	int rc;
 
 	if (!m_deviceOpen)
@@ -576,36 +875,46 @@ int HIDDevice::GetReport(int *reportId, struct timeval * timeout)
 	if (m_inputReportSize < HID_RMI4_REPORT_ID + 1)
 		return -1;
 
-	for (;;) {
-		FD_ZERO(&fds);
-		FD_SET(m_fd, &fds);
+	if (m_attnReaderRunning)
+		return GetQueuedReport(reportId, deadline, readDataOnly);
 
-		rc = select(m_fd + 1, &fds, NULL, NULL, timeout);
-		if (rc == 0) {
-			return -ETIMEDOUT;
-		} else if (rc < 0) {
-			if (errno == EINTR && m_deviceOpen && !m_bCancel)
-				continue;
-			else
+	if (m_ioUringActive) {
+		// Reads are already posted, wait for one of them to complete
+		for (;;) {
+			rc = m_uring.Submit(false);
+			if (rc < 0)
 				return rc;
-		} else if (rc > 0 && FD_ISSET(m_fd, &fds)) {
-			size_t offset = 0;
-			for (;;) {
-				m_bCancel = false;
-				count = read(m_fd, m_inputReport + offset, m_inputReportSize - offset);
-				if (count < 0) {
-					if (errno == EINTR && m_deviceOpen && !m_bCancel)
-						continue;
-					else
-						return count;
-				}
-				offset += count;
-				if (offset == m_inputReportSize)
-					break;
+
+			count = m_uring.PopReport(m_inputReport, m_inputReportSize);
+			if (count < 0)
+				return count;
+			if (count > 0)
+				break;
+
+			rc = m_waitEngine.Wait(deadline, &readyFd, 1);
+			if (rc < 0)
+				return rc;
+		}
+		m_bCancel = false;
+	} else {
+		rc = m_waitEngine.Wait(deadline, &readyFd, 1);
+		if (rc < 0)
+			return rc;
+
+		for (;;) {
+			m_bCancel = false;
+			count = read(m_fd, m_inputReport + offset, m_inputReportSize - offset);
+			if (count < 0) {
+				if (errno == EINTR && m_deviceOpen && !m_bCancel)
+					continue;
+				else
+					return count;
 			}
-			count = offset;
+			offset += count;
+			if (offset == m_inputReportSize)
+				break;
 		}
-		break;
+		count = offset;
 	}
 
 	if (reportId)
@@ -615,6 +924,7 @@ int HIDDevice::GetReport(int *reportId, struct timeval * timeout)
 		if (static_cast<ssize_t>(m_inputReportSize) < count)
 			return -1;
 		memcpy(m_attnData, m_inputReport, count);
+		clock_gettime(CLOCK_MONOTONIC, &m_attnTimestamp);
 	} else if (m_inputReport[HID_RMI4_REPORT_ID] == RMI_READ_DATA_REPORT_ID) {
 		if (static_cast<ssize_t>(m_inputReportSize) < count)
 			return -1;
@@ -624,6 +934,267 @@ int HIDDevice::GetReport(int *reportId, struct timeval * timeout)
 	return 1;
 }
 
+/*
+ * Return the next report queued by the attention reader thread. Read data
+ * reports are returned first. Attention reports stay queued while a read is
+ * waiting for its data so that they are not lost.
+ */
+int HIDDevice::GetQueuedReport(int *reportId, const struct timespec * deadline, bool readDataOnly)
+{
+	int readyFd;
+	int rc;
+	size_t len;
+	uint64_t events;
+
+	for (;;) {
+		if (m_readDataQueue.Pop(m_inputReport, &len, NULL)) {
+			memcpy(m_readData, m_inputReport, len);
+			m_dataBytesRead = len;
+			break;
+		}
+
+		if (!readDataOnly && m_attnQueue.Pop(m_inputReport, &len, &m_attnTimestamp)) {
+			memcpy(m_attnData, m_inputReport, len);
+			break;
+		}
+
+		if (m_attnReaderError)
+			return -1;
+
+		rc = m_waitEngine.Wait(deadline, &readyFd, 1);
+		if (rc < 0)
+			return rc;
+
+		if (read(m_attnReaderEventFd, &events, sizeof(events)) < 0 && errno != EAGAIN)
+			return -1;
+	}
+
+	m_bCancel = false;
+
+	if (reportId)
+		*reportId = m_inputReport[HID_RMI4_REPORT_ID];
+
+	return 1;
+}
+
+int HIDDevice::EnableAttentionReader(bool enable)
+{
+	m_useAttnReader = enable;
+
+	if (!m_deviceOpen)
+		return 0;
+
+	if (enable)
+		return StartAttentionReader();
+
+	StopAttentionReader();
+	return 0;
+}
+
+int HIDDevice::EnableIoUring(bool enable)
+{
+	m_useIoUring = enable;
+
+	if (!m_deviceOpen)
+		return 0;
+
+	if (!enable) {
+		StopIoUring();
+		return 0;
+	}
+
+	if (m_attnReaderRunning)
+		return -EBUSY;
+
+	return StartIoUring();
+}
+
+int HIDDevice::StartIoUring()
+{
+	int rc;
+
+	if (m_ioUringActive)
+		return 0;
+
+	rc = m_uring.Open(m_fd, m_inputReportSize, m_outputReportSize);
+	if (rc) {
+		fprintf(stderr, "io_uring is not available (%s), using read and write\n",
+			strerror(-rc));
+		return rc;
+	}
+
+	// Completions are signaled on the ring, reads from the hidraw
+	// device would steal reports from the posted reads.
+	m_waitEngine.RemoveFd(m_fd);
+	rc = m_waitEngine.AddFd(m_uring.GetFd());
+	if (rc) {
+		m_waitEngine.AddFd(m_fd);
+		m_uring.Close();
+		return rc;
+	}
+
+	m_ioUringActive = true;
+
+	return 0;
+}
+
+void HIDDevice::StopIoUring()
+{
+	if (!m_ioUringActive)
+		return;
+
+	m_uring.Submit(true);
+	m_waitEngine.RemoveFd(m_uring.GetFd());
+	m_uring.Close();
+	m_waitEngine.AddFd(m_fd);
+	m_ioUringActive = false;
+	m_writeBatchDepth = 0;
+}
+
+int HIDDevice::StartAttentionReader()
+{
+	sigset_t allSignals;
+	sigset_t oldSignals;
+	int rc;
+
+	if (m_attnReaderRunning)
+		return 0;
+
+	// The reader thread and the posted reads cannot share the device
+	StopIoUring();
+
+	if (!m_attnQueue.Allocate(HID_ATTN_QUEUE_DEPTH, m_inputReportSize)
+		|| !m_readDataQueue.Allocate(HID_READ_DATA_QUEUE_DEPTH, m_inputReportSize))
+	{
+		rc = -ENOMEM;
+		goto error;
+	}
+
+	m_attnReaderEventFd = eventfd(0, EFD_NONBLOCK);
+	if (m_attnReaderEventFd < 0) {
+		rc = -errno;
+		goto error;
+	}
+
+	rc = m_attnReaderEngine.Open();
+	if (rc)
+		goto error;
+
+	rc = m_attnReaderEngine.AddFd(m_fd);
+	if (rc)
+		goto error;
+
+	// The reader thread now owns the hidraw device, callers wait for it to
+	// signal that reports have been queued.
+	m_waitEngine.RemoveFd(m_fd);
+	rc = m_waitEngine.AddFd(m_attnReaderEventFd);
+	if (rc) {
+		m_waitEngine.AddFd(m_fd);
+		goto error;
+	}
+
+	m_attnReaderError = false;
+
+	// Signals such as SIGINT must interrupt the caller's wait, not the reader.
+	sigfillset(&allSignals);
+	pthread_sigmask(SIG_SETMASK, &allSignals, &oldSignals);
+	rc = pthread_create(&m_attnReaderThread, NULL, AttentionReaderThread, this);
+	pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+	if (rc) {
+		fprintf(stderr, "Failed to start the attention reader: %s\n", strerror(rc));
+		rc = -rc;
+		m_waitEngine.RemoveFd(m_attnReaderEventFd);
+		m_waitEngine.AddFd(m_fd);
+		goto error;
+	}
+
+	m_attnReaderRunning = true;
+
+	return 0;
+
+error:
+	m_attnReaderEngine.Close();
+	if (m_attnReaderEventFd >= 0)
+		close(m_attnReaderEventFd);
+	m_attnReaderEventFd = -1;
+	m_attnQueue.Free();
+	m_readDataQueue.Free();
+	return rc;
+}
+
+void HIDDevice::StopAttentionReader()
+{
+	if (!m_attnReaderRunning)
+		return;
+
+	m_attnReaderEngine.Cancel();
+	pthread_join(m_attnReaderThread, NULL);
+	m_attnReaderRunning = false;
+
+	m_waitEngine.RemoveFd(m_attnReaderEventFd);
+	m_waitEngine.AddFd(m_fd);
+
+	m_attnReaderEngine.Close();
+	close(m_attnReaderEventFd);
+	m_attnReaderEventFd = -1;
+	m_attnQueue.Free();
+	m_readDataQueue.Free();
+}
+
+void *HIDDevice::AttentionReaderThread(void *arg)
+{
+	static_cast<HIDDevice *>(arg)->AttentionReaderLoop();
+	return NULL;
+}
+
+void HIDDevice::AttentionReaderLoop()
+{
+	unsigned char *report = new unsigned char[m_inputReportSize]();
+	struct timespec ts;
+	ssize_t count;
+	uint64_t event = 1;
+	int readyFd;
+	int rc;
+
+	for (;;) {
+		rc = m_attnReaderEngine.Wait(NULL, &readyFd, 1);
+		if (rc == -ECANCELED) {
+			break;
+		} else if (rc < 0) {
+			m_attnReaderError = true;
+			break;
+		}
+
+		count = read(m_fd, report, m_inputReportSize);
+		if (count < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			m_attnReaderError = true;
+			break;
+		} else if (count == 0) {
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+
+		if (report[HID_RMI4_REPORT_ID] == RMI_ATTN_REPORT_ID)
+			m_attnQueue.Push(report, count, &ts);
+		else if (report[HID_RMI4_REPORT_ID] == RMI_READ_DATA_REPORT_ID)
+			m_readDataQueue.Push(report, count, &ts);
+		else
+			continue;
+
+		if (write(m_attnReaderEventFd, &event, sizeof(event)) < 0 && errno != EAGAIN)
+			m_attnReaderError = true;
+	}
+
+	// Wake up the consumer so that it sees the error instead of timing out.
+	if (m_attnReaderError && write(m_attnReaderEventFd, &event, sizeof(event)) < 0)
+		perror("attention reader");
+
+	delete[] report;
+}
+
 void HIDDevice::PrintReport(const unsigned char *report)
 {
 	int i;
@@ -726,6 +1297,10 @@ static const char * const absval[6] = { "Value", "Min  ", "Max  ", "Fuzz ", "Fla
 #define test_bit(bit, array)	((array[LONG(bit)] >> OFF(bit)) & 1)
 #define DEV_INPUT_EVENT "/dev/input"
 #define EVENT_DEV_NAME "event"
+static int is_event_device_name(const char *name) {
+	return strncmp(EVENT_DEV_NAME, name, 5) == 0;
+}
+
 /**
  * Filter for the AutoDevProbe scandir on /dev/input.
  *
@@ -735,20 +1310,57 @@ static const char * const absval[6] = { "Value", "Min  ", "Max  ", "Fuzz ", "Fla
  * otherwise.
  */
 static int is_event_device(const struct dirent *dir) {
-	return strncmp(EVENT_DEV_NAME, dir->d_name, 5) == 0;
+	return is_event_device_name(dir->d_name);
 }
 
-bool HIDDevice::CheckABSEvent()
+/*
+ * Returns 1 if the event device belongs to this device and has a range for
+ * ABS_X, or does not report ABS_X at all, 0 if its ABS_X range is still
+ * empty and -1 if it is not this device's.
+ */
+int HIDDevice::CheckInputDevice(const char *path)
 {
-	int fd=-1;
-	unsigned int type;
+	int fd;
 	int abs[6] = {0};
-	struct dirent **namelist;
-	int i, ndev;
-
-    char input_event_name[PATH_MAX];
+	char name[256] = "???";
 	unsigned long bit[EV_MAX][NBITS(KEY_MAX)];
+	int rc = 1;
+
+	if (m_transportDeviceName.size() <= 4)
+		return -1;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	ioctl(fd, EVIOCGNAME(sizeof(name)), name);
+	if (!strstr(name, m_transportDeviceName.c_str() + 4)) {
+		close(fd);
+		return -1;
+	}
+
+	memset(bit, 0, sizeof(bit));
+	ioctl(fd, EVIOCGBIT(0, EV_MAX), bit[0]);
+	if (test_bit(EV_ABS, bit[0])) {
+		ioctl(fd, EVIOCGBIT(EV_ABS, KEY_MAX), bit[EV_ABS]);
+		if (test_bit(ABS_X, bit[EV_ABS])) {
+			ioctl(fd, EVIOCGABS(ABS_X), abs);
+			if (abs[2] == 0) //maximum
+				rc = 0;
+		}
+	}
+	close(fd);
 
+	return rc;
+}
+
+// Checks each event device, returns -1 if none of them is this device's
+int HIDDevice::FindInputDevice()
+{
+	struct dirent **namelist;
+	int i, ndev;
+	int found = -1;
+	int rc;
 
 #ifdef __BIONIC__
 	// Android's libc doesn't have the GNU versionsort extension.
@@ -757,51 +1369,88 @@ bool HIDDevice::CheckABSEvent()
 	ndev = scandir(DEV_INPUT_EVENT, &namelist, is_event_device, versionsort);
 #endif
 	if (ndev <= 0)
-		return false;
+		return -1;
 	for (i = 0; i < ndev; i++)
 	{
 		char fname[64];
-		int fd = -1;
-		char name[256] = "???";
 
 		snprintf(fname, sizeof(fname),
 			 "%s/%s", DEV_INPUT_EVENT, namelist[i]->d_name);
-		fd = open(fname, O_RDONLY);
-		if (fd < 0)
+		rc = CheckInputDevice(fname);
+		if (rc >= 0)
+			found = rc;
+		free(namelist[i]);
+	}
+	free(namelist);
+
+	return found;
+}
+
+bool HIDDevice::CheckABSEvent()
+{
+	return FindInputDevice() != 0;
+}
+
+/*
+ * Waits for this device's event device to be created, watching /dev/input
+ * through notifyFd. Returns like CheckInputDevice(), or -ETIMEDOUT.
+ */
+int HIDDevice::WaitForInputDevice(int notifyFd, const struct timespec *deadline)
+{
+	WaitEngine waitEngine;
+	int readyFd;
+	int rc;
+	ssize_t eventBytesRead;
+	int eventBytesAvailable;
+	int offset;
+
+	rc = FindInputDevice();
+	if (rc >= 0)
+		return rc;
+
+	if (waitEngine.Open() || waitEngine.AddFd(notifyFd))
+		return -1;
+
+	for (;;) {
+		rc = waitEngine.Wait(deadline, &readyFd, 1);
+		if (rc < 0)
+			return rc;
+
+		struct inotify_event * event;
+
+		rc = ioctl(notifyFd, FIONREAD, &eventBytesAvailable);
+		if (rc < 0)
 			continue;
-		ioctl(fd, EVIOCGNAME(sizeof(name)), name);
-		//fprintf(stderr, "%s:	%s\n", fname, name);
-		close(fd);
 
-		if(strstr(name, m_transportDeviceName.c_str()+4))
+		char buf[eventBytesAvailable];
+
+		eventBytesRead = read(notifyFd, buf, eventBytesAvailable);
+		if (eventBytesRead < 0)
+			continue;
+
+		for (offset = 0; offset < eventBytesRead;
+			offset += sizeof(struct inotify_event) + event->len)
 		{
-			snprintf(input_event_name, sizeof(fname), "%s", fname);
-		}
-		free(namelist[i]);
-	}
-	
-	if ((fd = open(input_event_name, O_RDONLY)) < 0) {
-		if (errno == EACCES && getuid() != 0)
-			fprintf(stderr, "No access right \n");
-	}
-	memset(bit, 0, sizeof(bit));
-	ioctl(fd, EVIOCGBIT(0, EV_MAX), bit[0]);
-	for (type = 0; type < EV_MAX; type++) {
-		if (test_bit(type, bit[0]) && type == EV_ABS) {
-			ioctl(fd, EVIOCGBIT(type, KEY_MAX), bit[type]);
-			if (test_bit(ABS_X, bit[type])) {
-				ioctl(fd, EVIOCGABS(ABS_X), abs);
-				if(abs[2] == 0) //maximum
-				{
-					Sleep(1000);
-					return false;
-				}
+			event = (struct inotify_event *)&buf[offset];
+
+			if (event->len && is_event_device_name(event->name)) {
+				std::string path = std::string(DEV_INPUT_EVENT) + "/" + event->name;
+
+				rc = CheckInputDevice(path.c_str());
+				if (rc >= 0)
+					return rc;
 			}
 		}
 	}
-	return true;
 }
-void HIDDevice::RebindDriver()
+
+/*
+ * Unbinds and binds the driver, then opens the new hidraw device. Binding
+ * is retried while the device is still booting. With waitForInput it also
+ * waits for the input device, returning 0 if it came up without an ABS_X
+ * range. Returns 1 once the device is back and a negative value on failure.
+ */
+int HIDDevice::Rebind(const struct timespec *deadline, bool waitForInput)
 {
 	int bus = m_info.bustype;
 	int vendor = m_info.vendor;
@@ -810,33 +1459,46 @@ void HIDDevice::RebindDriver()
 	std::string bindFile;
 	std::string unbindFile;
 	std::string hidrawFile;
+	struct timespec inputDeadline;
+	struct timeval remaining;
+	int retryMs = HID_BIND_RETRY_MIN_MS;
 	int notifyFd;
+	int inputNotifyFd = -1;
 	int wd;
-	int rc;
+	int rc = -1;
 	Close();
 
-	notifyFd = inotify_init();
+	notifyFd = inotify_init1(IN_CLOEXEC);
 	if (notifyFd < 0) {
 		fprintf(stderr, "Failed to initialize inotify\n");
-		return;
+		return -1;
 	}
 
 	wd = inotify_add_watch(notifyFd, "/dev", IN_CREATE);
 	if (wd < 0) {
 		fprintf(stderr, "Failed to add watcher for /dev\n");
-		return;
+		goto out;
+	}
+
+	if (waitForInput) {
+		inputNotifyFd = inotify_init1(IN_CLOEXEC);
+		if (inputNotifyFd < 0
+			|| inotify_add_watch(inputNotifyFd, DEV_INPUT_EVENT, IN_CREATE | IN_ATTRIB) < 0) {
+			fprintf(stderr, "Failed to add watcher for %s\n", DEV_INPUT_EVENT);
+			goto out;
+		}
 	}
 
 	if (m_transportDeviceName == "") {
 		if (!LookupHidDeviceName(bus, vendor, product, hidDeviceName)) {
 			fprintf(stderr, "Failed to find HID device name for the specified device: bus (0x%x) vendor: (0x%x) product: (0x%x)\n",
 				bus, vendor, product);
-			return;
+			goto out;
 		}
 
 		if (!FindTransportDevice(bus, hidDeviceName, m_transportDeviceName, m_driverPath)) {
 			fprintf(stderr, "Failed to find the transport device / driver for %s\n", hidDeviceName.c_str());
-			return;
+			goto out;
 		}
 
 	}
@@ -844,25 +1506,78 @@ void HIDDevice::RebindDriver()
 	bindFile = m_driverPath + "bind";
 	unbindFile = m_driverPath + "unbind";
 
-	Sleep(500);
 	if (!WriteDeviceNameToFile(unbindFile.c_str(), m_transportDeviceName.c_str())) {
 		fprintf(stderr, "Failed to unbind HID device %s: %s\n",
 			m_transportDeviceName.c_str(), strerror(errno));
-		return;
+		goto out;
 	}
-	Sleep(500);
-	if (!WriteDeviceNameToFile(bindFile.c_str(), m_transportDeviceName.c_str())) {
-		fprintf(stderr, "Failed to bind HID device %s: %s\n",
-			m_transportDeviceName.c_str(), strerror(errno));
-		return;
+
+	// Probing fails until the device responds after a reset
+	while (!WriteDeviceNameToFile(bindFile.c_str(), m_transportDeviceName.c_str())) {
+		deadline_remaining(deadline, &remaining);
+		if (!remaining.tv_sec && remaining.tv_usec < retryMs * 1000) {
+			fprintf(stderr, "Failed to bind HID device %s: %s\n",
+				m_transportDeviceName.c_str(), strerror(errno));
+			goto out;
+		}
+		Sleep(retryMs);
+		retryMs = std::min(retryMs * 2, HID_BIND_RETRY_MAX_MS);
 	}
 
-	if (WaitForHidRawDevice(notifyFd, hidrawFile)) {
-		rc = Open(hidrawFile.c_str());
-		if (rc)
-			fprintf(stderr, "Failed to open device (%s) during rebind: %d: errno: %s (%d)\n",
-					hidrawFile.c_str(), rc, strerror(errno), errno);
+	if (!WaitForHidRawDevice(notifyFd, hidrawFile, deadline))
+		goto out;
+
+	rc = Open(hidrawFile.c_str());
+	if (rc) {
+		fprintf(stderr, "Failed to open device (%s) during rebind: %d: errno: %s (%d)\n",
+				hidrawFile.c_str(), rc, strerror(errno), errno);
+		rc = -1;
+		goto out;
 	}
+
+	rc = 1;
+	if (waitForInput) {
+		// Not every device has an input device, give up on it sooner
+		deadline_from_ms(HID_INPUT_WAIT_MS, &inputDeadline);
+		if (inputDeadline.tv_sec > deadline->tv_sec
+			|| (inputDeadline.tv_sec == deadline->tv_sec
+				&& inputDeadline.tv_nsec > deadline->tv_nsec))
+			inputDeadline = *deadline;
+
+		rc = WaitForInputDevice(inputNotifyFd, &inputDeadline);
+		if (rc < 0)
+			rc = 1;
+	}
+
+out:
+	if (inputNotifyFd >= 0)
+		close(inputNotifyFd);
+	close(notifyFd);
+
+	return rc;
+}
+
+void HIDDevice::RebindDriver()
+{
+	struct timespec deadline;
+
+	deadline_from_ms(HID_HIDRAW_WAIT_MS, &deadline);
+	Rebind(&deadline, false);
+}
+
+bool HIDDevice::Reenumerate(int timeout_ms)
+{
+	struct timespec deadline;
+	int rc;
+
+	deadline_from_ms(timeout_ms, &deadline);
+
+	// A driver bound before the firmware is ready sets up the input device
+	// without a range, bind it again
+	while ((rc = Rebind(&deadline, true)) == 0)
+		;
+
+	return rc > 0;
 }
 
 bool HIDDevice::FindTransportDevice(uint32_t bus, std::string & hidDeviceName,
@@ -987,77 +1702,67 @@ bool HIDDevice::LookupHidDriverName(std::string &deviceName, std::string &driver
 	return true;
 }
 
-bool HIDDevice::WaitForHidRawDevice(int notifyFd, std::string & hidrawFile)
+bool HIDDevice::WaitForHidRawDevice(int notifyFd, std::string & hidrawFile,
+					const struct timespec *deadline)
 {
-	struct timeval timeout;
-	fd_set fds;
+	WaitEngine waitEngine;
+	int readyFd;
 	int rc;
 	ssize_t eventBytesRead;
 	int eventBytesAvailable;
-	size_t sz;
+	ssize_t sz;
 	char link[PATH_MAX];
 	std::string transportDeviceName;
 	std::string driverPath;
 	std::string hidDeviceName;
-	int offset = 0;
+	int offset;
+
+	if (waitEngine.Open() || waitEngine.AddFd(notifyFd))
+		return false;
 
 	for (;;) {
-		FD_ZERO(&fds);
-		FD_SET(notifyFd, &fds);
+		rc = waitEngine.Wait(deadline, &readyFd, 1);
+		if (rc < 0)
+			return false;
 
-		timeout.tv_sec = 20;
-		timeout.tv_usec = 0;
+		struct inotify_event * event;
 
-		rc = select(notifyFd + 1, &fds, NULL, NULL, &timeout);
+		rc = ioctl(notifyFd, FIONREAD, &eventBytesAvailable);
 		if (rc < 0) {
-			if (errno == -EINTR)
-				continue;
-
-			return false;
-		}
-
-		if (rc == 0) {
-			return false;
+			continue;
 		}
 
-		if (FD_ISSET(notifyFd, &fds)) {
-			struct inotify_event * event;
-
-			rc = ioctl(notifyFd, FIONREAD, &eventBytesAvailable);
-			if (rc < 0) {
-				continue;
-			}
-
-			char buf[eventBytesAvailable];
-
-			eventBytesRead = read(notifyFd, buf, eventBytesAvailable);
-			if (eventBytesRead < 0) {
-				continue;
-			}
+		char buf[eventBytesAvailable];
 
-			while (offset < eventBytesRead) {
-				event = (struct inotify_event *)&buf[offset];
+		eventBytesRead = read(notifyFd, buf, eventBytesAvailable);
+		if (eventBytesRead < 0) {
+			continue;
+		}
 
-				if (!strncmp(event->name, "hidraw", 6)) {
-					std::string classPath = std::string("/sys/class/hidraw/")
-												+ event->name + "/device";
-					sz = readlink(classPath.c_str(), link, PATH_MAX);
-					link[sz] = 0;
+		for (offset = 0; offset < eventBytesRead;
+			offset += sizeof(struct inotify_event) + event->len)
+		{
+			event = (struct inotify_event *)&buf[offset];
 
-					hidDeviceName = std::string(link).substr(9, 19);
+			if (!strncmp(event->name, "hidraw", 6)) {
+				std::string classPath = std::string("/sys/class/hidraw/")
+											+ event->name + "/device";
+				sz = readlink(classPath.c_str(), link, PATH_MAX - 1);
+				if (sz < 0)
+					continue;
+				link[sz] = 0;
 
-					if (!FindTransportDevice(m_info.bustype, hidDeviceName, transportDeviceName, driverPath)) {
-						fprintf(stderr, "Failed to find the transport device / driver for %s\n", hidDeviceName.c_str());
-						continue;
-					}
+				hidDeviceName = std::string(link).substr(9, 19);
 
-					if (transportDeviceName == m_transportDeviceName) {
-						hidrawFile = std::string("/dev/") + event->name;
-						return true;
-					}
+				if (!FindTransportDevice(m_info.bustype, hidDeviceName, transportDeviceName, driverPath)) {
+					fprintf(stderr, "Failed to find the transport device / driver for %s\n", hidDeviceName.c_str());
+					continue;
 				}
 
-				offset += sizeof(struct inotify_event) + event->len;
+				if (transportDeviceName == m_transportDeviceName) {
+					hidrawFile = std::string("/dev/") + event->name;
+					return true;
+				}
 			}
 		}
 	}
@@ -1094,3 +1799,35 @@ bool HIDDevice::FindDevice(enum RMIDeviceType type)
 	
 	return found;
 }
+
+int HIDDevice::FindDevices(enum RMIDeviceType type, std::vector<std::string> &deviceFiles)
+{
+	DIR * devDir;
+	struct dirent * devDirEntry;
+	char deviceFile[PATH_MAX];
+	bool match;
+
+	deviceFiles.clear();
+	devDir = opendir("/dev");
+	if (!devDir)
+		return -1;
+
+	while ((devDirEntry = readdir(devDir)) != NULL) {
+		if (!strstr(devDirEntry->d_name, "hidraw"))
+			continue;
+
+		snprintf(deviceFile, PATH_MAX, "/dev/%s", devDirEntry->d_name);
+		if (Open(deviceFile))
+			continue;
+
+		match = type == RMI_DEVICE_TYPE_ANY || GetDeviceType() == type;
+		Close();
+		if (match)
+			deviceFiles.push_back(deviceFile);
+	}
+	closedir(devDir);
+
+	std::sort(deviceFiles.begin(), deviceFiles.end());
+
+	return deviceFiles.size();
+}
@@ -19,10 +19,18 @@
 #define _HIDDEVICE_H_
 
 #include <linux/hidraw.h>
+#include <pthread.h>
+#include <time.h>
 #include <string>
+#include <vector>
 #include <fstream>
+#include <atomic>
 #include <stdint.h>
 #include "rmidevice.h"
+#include "reportqueue.h"
+#include "waitengine.h"
+#include "uringtransport.h"
+#include "latencystats.h"
 
 enum rmi_hid_mode_type {
 	HID_RMI4_MODE_MOUSE                     = 0,
@@ -43,11 +51,21 @@ public:
 		      m_initialMode(HID_RMI4_MODE_MOUSE),
 		      m_transportDeviceName(""),
 		      m_driverPath(""),
-		      hasVendorDefineLIDMode(false)
-	{}
+		      hasVendorDefineLIDMode(false),
+		      m_useAttnReader(false),
+		      m_attnReaderRunning(false),
+		      m_attnReaderEventFd(-1),
+		      m_attnReaderError(false),
+		      m_useIoUring(false),
+		      m_ioUringActive(false),
+		      m_writeBatchDepth(0),
+		      m_latencyStatsEnabled(false)
+	{ m_attnTimestamp.tv_sec = 0; m_attnTimestamp.tv_nsec = 0; }
 	virtual int Open(const char * filename);
 	virtual int Read(unsigned short addr, unsigned char *buf,
 				unsigned short len);
+	virtual int ReadFifo(unsigned short addr, unsigned char *buf,
+				unsigned short len);
 	virtual int Write(unsigned short addr, const unsigned char *buf,
 				 unsigned short len);
 	virtual int SetMode(int mode);
@@ -57,14 +75,37 @@ public:
 	virtual int GetAttentionReport(struct timeval * timeout, unsigned int source_mask,
 					unsigned char *buf, unsigned int *len);
 	virtual void Close();
+	virtual void Cancel() { m_bCancel = true; m_waitEngine.Cancel(); }
+	virtual void BeginWriteBatch() { ++m_writeBatchDepth; }
+	virtual int EndWriteBatch();
+	virtual unsigned short GetMaxWriteSize();
 	virtual void RebindDriver();
+	virtual bool Reenumerate(int timeout_ms);
 	~HIDDevice() { Close(); }
 
 	virtual void PrintDeviceInfo();
 
 	virtual bool FindDevice(enum RMIDeviceType type = RMI_DEVICE_TYPE_ANY);
+	// Lists every hidraw device of type, sorted by name. Leaves the device
+	// closed.
+	int FindDevices(enum RMIDeviceType type, std::vector<std::string> &deviceFiles);
 	virtual bool CheckABSEvent();
 
+	// Drain the hidraw device from a background thread so that attention
+	// reports are queued instead of overwritten while waiting for read data.
+	int EnableAttentionReader(bool enable);
+	void GetAttentionTimestamp(struct timespec *ts) { *ts = m_attnTimestamp; }
+	unsigned long GetDroppedAttentionReports() { return m_attnQueue.GetDroppedCount(); }
+
+	// Send and receive reports through io_uring. Falls back to read() and
+	// write() if io_uring is unavailable. Not used with the attention reader.
+	int EnableIoUring(bool enable);
+
+	// Collect counts and latency histograms of reads, writes and report
+	// waits. Off by default, it costs two clock_gettime() calls per operation.
+	void EnableLatencyStats(bool enable) { m_latencyStatsEnabled = enable; }
+	LatencyStats & GetLatencyStats() { return m_latencyStats; }
+
 private:
 	int m_fd;
 
@@ -92,11 +133,52 @@ private:
 
 	bool hasVendorDefineLIDMode;
 
-	int GetReport(int *reportId, struct timeval * timeout = NULL);
+	WaitEngine m_waitEngine;
+
+	bool m_useAttnReader;
+	bool m_attnReaderRunning;
+	pthread_t m_attnReaderThread;
+	int m_attnReaderEventFd;
+	WaitEngine m_attnReaderEngine;
+	std::atomic<bool> m_attnReaderError;
+	ReportQueue m_attnQueue;
+	ReportQueue m_readDataQueue;
+	struct timespec m_attnTimestamp;
+
+	bool m_useIoUring;
+	bool m_ioUringActive;
+	UringTransport m_uring;
+	int m_writeBatchDepth;
+
+	bool m_latencyStatsEnabled;
+	LatencyStats m_latencyStats;
+
+	int GetReport(int *reportId, struct timeval * timeout = NULL, bool readDataOnly = false);
+	int GetReadDataReport(int *reportId, struct timeval * timeout);
+	int ReadTimed(unsigned short addr, unsigned char *buf, unsigned short len, bool fifo);
+	int ReadRegisters(unsigned short addr, unsigned char *buf, unsigned short len, bool fifo);
+	int WaitForReport(int *reportId, const struct timespec * deadline, bool readDataOnly);
+	int GetQueuedReport(int *reportId, const struct timespec * deadline, bool readDataOnly);
+	int StartAttentionReader();
+	void StopAttentionReader();
+	void AttentionReaderLoop();
+	static void *AttentionReaderThread(void *arg);
+	int StartIoUring();
+	void StopIoUring();
+	int WriteReport();
+	int WriteReadRequest(unsigned short addr, size_t count);
+	int ReadPipelined(unsigned short addr, unsigned char *buf, unsigned short len,
+				size_t bytesPerRequest, bool fifo);
+	void FlushInputReports();
 	void PrintReport(const unsigned char *report);
 	void ParseReportDescriptor();
 
-	bool WaitForHidRawDevice(int notifyFd, std::string & hidraw);
+	int Rebind(const struct timespec *deadline, bool waitForInput);
+	bool WaitForHidRawDevice(int notifyFd, std::string & hidraw,
+					const struct timespec *deadline);
+	int CheckInputDevice(const char *path);
+	int FindInputDevice();
+	int WaitForInputDevice(int notifyFd, const struct timespec *deadline);
 
 	// static HID utility functions
 	static bool LookupHidDeviceName(uint32_t bus, int16_t vendorId, int16_t productId, std::string &deviceName);
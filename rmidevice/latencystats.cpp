@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "rmidevice.h"
+#include "latencystats.h"
+
+static const char *latency_op_names[LATENCY_OP_COUNT] = {
+	"read", "write", "get report", "attention",
+};
+
+static const char *latency_event_names[LATENCY_EVENT_COUNT] = {
+	"resends", "timeouts", "errors",
+};
+
+static const char *latency_size_names[LATENCY_SIZE_CLASSES] = {
+	"<=16", "<=64", "<=256", ">256",
+};
+
+void LatencyStats::Reset()
+{
+	for (int op = 0; op < LATENCY_OP_COUNT; ++op) {
+		for (int size = 0; size < LATENCY_SIZE_CLASSES; ++size) {
+			struct latency_histogram &h = m_histograms[op][size];
+
+			h.count = 0;
+			h.bytes = 0;
+			h.totalUs = 0;
+			h.maxUs = 0;
+			for (int i = 0; i < LATENCY_BUCKETS; ++i)
+				h.buckets[i] = 0;
+		}
+	}
+
+	for (int i = 0; i < LATENCY_EVENT_COUNT; ++i)
+		m_events[i] = 0;
+}
+
+int LatencyStats::GetSizeClass(size_t bytes)
+{
+	if (bytes <= 16)
+		return 0;
+	if (bytes <= 64)
+		return 1;
+	if (bytes <= 256)
+		return 2;
+	return 3;
+}
+
+unsigned int LatencyStats::GetBucket(unsigned long us)
+{
+	unsigned int shift;
+
+	if (us > 0xFFFFFFFFUL)
+		us = 0xFFFFFFFFUL;
+	if (us < LATENCY_SUB_BUCKETS)
+		return us;
+
+	shift = (31 - __builtin_clz(us)) - LATENCY_SUB_BUCKET_BITS;
+	return shift * LATENCY_SUB_BUCKETS + (us >> shift);
+}
+
+unsigned long LatencyStats::GetBucketLimit(unsigned int bucket)
+{
+	unsigned int shift;
+	unsigned long subBucket;
+
+	if (bucket < LATENCY_SUB_BUCKETS)
+		return bucket;
+
+	shift = bucket / LATENCY_SUB_BUCKETS - 1;
+	subBucket = bucket - shift * LATENCY_SUB_BUCKETS;
+	return ((subBucket + 1) << shift) - 1;
+}
+
+void LatencyStats::Record(enum latency_op op, size_t bytes, const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	Record(op, bytes, diff_time((struct timespec *)start, &end));
+}
+
+void LatencyStats::Record(enum latency_op op, size_t bytes, unsigned long us)
+{
+	struct latency_histogram &h = m_histograms[op][GetSizeClass(bytes)];
+	unsigned long max = h.maxUs.load(std::memory_order_relaxed);
+
+	h.count.fetch_add(1, std::memory_order_relaxed);
+	h.bytes.fetch_add(bytes, std::memory_order_relaxed);
+	h.totalUs.fetch_add(us, std::memory_order_relaxed);
+	h.buckets[GetBucket(us)].fetch_add(1, std::memory_order_relaxed);
+	while (us > max && !h.maxUs.compare_exchange_weak(max, us, std::memory_order_relaxed))
+		;
+}
+
+void LatencyStats::RecordEvent(enum latency_event event)
+{
+	m_events[event].fetch_add(1, std::memory_order_relaxed);
+}
+
+unsigned long LatencyStats::GetCount(enum latency_op op, int sizeClass)
+{
+	unsigned long count = 0;
+
+	for (int size = 0; size < LATENCY_SIZE_CLASSES; ++size)
+		if (sizeClass < 0 || size == sizeClass)
+			count += m_histograms[op][size].count;
+
+	return count;
+}
+
+unsigned long long LatencyStats::GetBytes(enum latency_op op, int sizeClass)
+{
+	unsigned long long bytes = 0;
+
+	for (int size = 0; size < LATENCY_SIZE_CLASSES; ++size)
+		if (sizeClass < 0 || size == sizeClass)
+			bytes += m_histograms[op][size].bytes;
+
+	return bytes;
+}
+
+unsigned long LatencyStats::GetMax(enum latency_op op, int sizeClass)
+{
+	unsigned long max = 0;
+
+	for (int size = 0; size < LATENCY_SIZE_CLASSES; ++size)
+		if ((sizeClass < 0 || size == sizeClass) && m_histograms[op][size].maxUs > max)
+			max = m_histograms[op][size].maxUs;
+
+	return max;
+}
+
+unsigned long LatencyStats::GetPercentile(enum latency_op op, double percentile, int sizeClass)
+{
+	unsigned long counts[LATENCY_BUCKETS] = { 0 };
+	unsigned long total = 0;
+	unsigned long seen = 0;
+	double target;
+
+	// Counts may change while they are summed, use a snapshot
+	for (int size = 0; size < LATENCY_SIZE_CLASSES; ++size) {
+		if (sizeClass >= 0 && size != sizeClass)
+			continue;
+		for (int i = 0; i < LATENCY_BUCKETS; ++i)
+			counts[i] += m_histograms[op][size].buckets[i];
+	}
+
+	for (int i = 0; i < LATENCY_BUCKETS; ++i)
+		total += counts[i];
+	if (!total)
+		return 0;
+
+	target = total * percentile / 100.0;
+	for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+		seen += counts[i];
+		if (seen > 0 && seen >= target)
+			return GetBucketLimit(i);
+	}
+
+	return GetBucketLimit(LATENCY_BUCKETS - 1);
+}
+
+void LatencyStats::Print(FILE *fp)
+{
+	fprintf(fp, "%-10s %-5s %9s %11s %9s %9s %9s %9s %9s\n", "op", "size", "count", "bytes",
+		"mean us", "p50 us", "p90 us", "p99 us", "max us");
+
+	for (int op = 0; op < LATENCY_OP_COUNT; ++op) {
+		for (int size = 0; size < LATENCY_SIZE_CLASSES; ++size) {
+			struct latency_histogram &h = m_histograms[op][size];
+			unsigned long count = h.count;
+
+			if (!count)
+				continue;
+
+			fprintf(fp, "%-10s %-5s %9lu %11llu %9llu %9lu %9lu %9lu %9lu\n",
+				latency_op_names[op], latency_size_names[size], count,
+				(unsigned long long)h.bytes, (unsigned long long)h.totalUs / count,
+				GetPercentile((enum latency_op)op, 50, size),
+				GetPercentile((enum latency_op)op, 90, size),
+				GetPercentile((enum latency_op)op, 99, size),
+				(unsigned long)h.maxUs);
+		}
+	}
+
+	for (int i = 0; i < LATENCY_EVENT_COUNT; ++i)
+		fprintf(fp, "%s: %lu\n", latency_event_names[i], (unsigned long)m_events[i]);
+	fflush(fp);
+}
+
+void *LatencyStats::SignalThread(void *arg)
+{
+	LatencyStats *stats = (LatencyStats *)arg;
+	sigset_t set;
+	int signum;
+
+	sigemptyset(&set);
+	sigaddset(&set, stats->m_signal);
+
+	while (!sigwait(&set, &signum))
+		stats->Print(stderr);
+
+	return NULL;
+}
+
+/*
+ * The signal is blocked and waited for by a thread of its own, so the
+ * statistics are not printed from a signal handler. Threads started later
+ * inherit the blocked signal.
+ */
+int LatencyStats::PrintOnSignal(int signum)
+{
+	pthread_t thread;
+	sigset_t set;
+	int rc;
+
+	m_signal = signum;
+
+	sigemptyset(&set);
+	sigaddset(&set, signum);
+	rc = pthread_sigmask(SIG_BLOCK, &set, NULL);
+	if (rc)
+		return -rc;
+
+	rc = pthread_create(&thread, NULL, SignalThread, this);
+	if (rc)
+		return -rc;
+
+	pthread_detach(thread);
+
+	return 0;
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LATENCYSTATS_H_
+#define _LATENCYSTATS_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <time.h>
+#include <atomic>
+
+enum latency_op {
+	LATENCY_OP_READ = 0,		// Read() from request to data
+	LATENCY_OP_WRITE,		// Write()
+	LATENCY_OP_GET_REPORT,		// Each wait for a read data report
+	LATENCY_OP_ATTENTION,		// Each wait for an attention report
+	LATENCY_OP_COUNT,
+};
+
+enum latency_event {
+	LATENCY_EVENT_RESEND = 0,	// Read request sent again after an error
+	LATENCY_EVENT_TIMEOUT,		// Wait for a report timed out
+	LATENCY_EVENT_ERROR,		// Read or write failed
+	LATENCY_EVENT_COUNT,
+};
+
+// Transfers are split into up to 16, 64, 256 and more bytes
+#define LATENCY_SIZE_CLASSES		4
+
+/*
+ * Latencies are kept to within 1/16th of their value in log linear buckets
+ * like an HDR histogram. Below 32 us every microsecond has a bucket, then
+ * each power of two range is split into 16 buckets, up to about 70
+ * minutes.
+ */
+#define LATENCY_SUB_BUCKET_BITS		4
+#define LATENCY_SUB_BUCKETS		(1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_MAX_SHIFT		(32 - LATENCY_SUB_BUCKET_BITS - 1)
+#define LATENCY_BUCKETS			((LATENCY_MAX_SHIFT + 2) * LATENCY_SUB_BUCKETS)
+
+struct latency_histogram {
+	std::atomic<unsigned long> count;
+	std::atomic<unsigned long long> bytes;
+	std::atomic<unsigned long long> totalUs;
+	std::atomic<unsigned long> maxUs;
+	std::atomic<unsigned long> buckets[LATENCY_BUCKETS];
+};
+
+/*
+ * Counts, bytes and latency histograms of transport operations, split by
+ * operation and transfer size. Recording only uses relaxed atomic adds, so
+ * the statistics can be read or printed from another thread, such as one
+ * handling SIGUSR1, while they are being recorded.
+ */
+class LatencyStats
+{
+public:
+	LatencyStats() : m_signal(0) { Reset(); }
+
+	void Reset();
+	void Record(enum latency_op op, size_t bytes, const struct timespec *start);
+	void Record(enum latency_op op, size_t bytes, unsigned long us);
+	void RecordEvent(enum latency_event event);
+
+	// sizeClass of -1 combines all of the transfer sizes
+	unsigned long GetCount(enum latency_op op, int sizeClass = -1);
+	unsigned long long GetBytes(enum latency_op op, int sizeClass = -1);
+	// Upper bound of the latency below which percentile % of operations completed
+	unsigned long GetPercentile(enum latency_op op, double percentile, int sizeClass = -1);
+	unsigned long GetMax(enum latency_op op, int sizeClass = -1);
+	unsigned long GetEventCount(enum latency_event event) { return m_events[event]; }
+
+	void Print(FILE *fp);
+
+	// Print the statistics to stderr each time signum is received. Has to
+	// be called before any other threads are started.
+	int PrintOnSignal(int signum);
+
+	static int GetSizeClass(size_t bytes);
+	static unsigned int GetBucket(unsigned long us);
+	static unsigned long GetBucketLimit(unsigned int bucket);
+
+private:
+	struct latency_histogram m_histograms[LATENCY_OP_COUNT][LATENCY_SIZE_CLASSES];
+	std::atomic<unsigned long> m_events[LATENCY_EVENT_COUNT];
+	int m_signal;
+
+	static void *SignalThread(void *arg);
+};
+
+#endif /* _LATENCYSTATS_H_ */
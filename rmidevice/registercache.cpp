@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <algorithm>
+
+#include "registercache.h"
+
+#define REGISTER_CACHE_SIZE		0x10000
+// Widest register which may start below an address and still cover it
+#define REGISTER_CACHE_MAX_OVERLAP	0x100
+
+void RegisterCache::Enable(bool enable)
+{
+	if (enable == IsEnabled())
+		return;
+
+	if (enable)
+		m_types.assign(REGISTER_CACHE_SIZE, REGISTER_CACHE_NONE);
+	else
+		std::vector<unsigned char>().swap(m_types);
+	m_values.clear();
+	m_hits = 0;
+	m_misses = 0;
+}
+
+void RegisterCache::Flush()
+{
+	m_values.clear();
+}
+
+void RegisterCache::Clear()
+{
+	std::fill(m_types.begin(), m_types.end(), REGISTER_CACHE_NONE);
+	m_values.clear();
+}
+
+void RegisterCache::AddRange(unsigned short addr, unsigned int len, enum register_cache_type type)
+{
+	if (!IsEnabled())
+		return;
+
+	for (unsigned int i = addr; i < addr + len && i < REGISTER_CACHE_SIZE; ++i)
+		m_types[i] = type;
+}
+
+bool RegisterCache::Lookup(unsigned short addr, unsigned char *buf, unsigned short len)
+{
+	std::map<unsigned short, std::vector<unsigned char> >::iterator it;
+
+	if (!IsEnabled() || !len)
+		return false;
+
+	it = m_values.find(addr);
+	if (it == m_values.end() || it->second.size() < len) {
+		++m_misses;
+		return false;
+	}
+
+	memcpy(buf, &it->second[0], len);
+	++m_hits;
+
+	return true;
+}
+
+// Drop every cached value which may share bytes with [addr, addr + len)
+void RegisterCache::Invalidate(unsigned short addr, unsigned short len)
+{
+	std::map<unsigned short, std::vector<unsigned char> >::iterator it;
+	unsigned int start = addr > REGISTER_CACHE_MAX_OVERLAP ? addr - REGISTER_CACHE_MAX_OVERLAP : 0;
+
+	it = m_values.lower_bound(start);
+	while (it != m_values.end() && it->first < (unsigned int)addr + len) {
+		if (it->first + it->second.size() > addr)
+			m_values.erase(it++);
+		else
+			++it;
+	}
+}
+
+void RegisterCache::Update(unsigned short addr, const unsigned char *buf, unsigned short len,
+				bool write)
+{
+	enum register_cache_type type;
+
+	if (!IsEnabled() || !len)
+		return;
+
+	type = (enum register_cache_type)m_types[addr];
+
+	if (write) {
+		Invalidate(addr, len);
+		if (type == REGISTER_CACHE_CONTROL)
+			m_values[addr].assign(buf, buf + len);
+	} else if (type == REGISTER_CACHE_QUERY) {
+		std::vector<unsigned char> &value = m_values[addr];
+		if (value.size() < len)
+			value.assign(buf, buf + len);
+	}
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _REGISTERCACHE_H_
+#define _REGISTERCACHE_H_
+
+#include <vector>
+#include <map>
+
+enum register_cache_type {
+	REGISTER_CACHE_NONE	= 0,
+	REGISTER_CACHE_QUERY,	// Filled by reads, static until the PDT is scanned again
+	REGISTER_CACHE_CONTROL,	// Filled by writes only
+};
+
+/*
+ * Shadow copy of RMI registers keyed by the 16 bit address, which holds the
+ * page in the upper byte. Registers may be wider than one address, so the
+ * bytes are kept per start address and a lookup only succeeds for a read
+ * starting at the same address which is no longer than the cached value.
+ * Only addresses inside ranges added with AddRange() are cached.
+ */
+class RegisterCache
+{
+public:
+	RegisterCache() : m_hits(0), m_misses(0) {}
+
+	void Enable(bool enable);
+	bool IsEnabled() { return !m_types.empty(); }
+
+	// Forget cached values but keep the ranges
+	void Flush();
+	// Forget cached values and ranges
+	void Clear();
+
+	void AddRange(unsigned short addr, unsigned int len, enum register_cache_type type);
+	bool Lookup(unsigned short addr, unsigned char *buf, unsigned short len);
+	void Update(unsigned short addr, const unsigned char *buf, unsigned short len, bool write);
+
+	unsigned long GetHits() { return m_hits; }
+	unsigned long GetMisses() { return m_misses; }
+
+private:
+	std::vector<unsigned char> m_types;
+	std::map<unsigned short, std::vector<unsigned char> > m_values;
+	unsigned long m_hits;
+	unsigned long m_misses;
+
+	void Invalidate(unsigned short addr, unsigned short len);
+};
+
+#endif /* _REGISTERCACHE_H_ */
@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "replaydevice.h"
+
+#define REPLAY_MAX_DATA_SIZE		0xFFFF
+
+static const char *trace_event_names[] = {
+	"none", "open", "close", "read", "write", "set mode", "toggle interrupt",
+	"attention", "end batch", "rebind", "check abs",
+};
+
+static const char *trace_event_name(unsigned char type)
+{
+	if (type >= sizeof(trace_event_names) / sizeof(trace_event_names[0]))
+		return "unknown";
+	return trace_event_names[type];
+}
+
+int ReplayDevice::Open(const char * filename)
+{
+	char magic[TRACE_MAGIC_SIZE];
+	std::vector<unsigned char> data(REPLAY_MAX_DATA_SIZE);
+	struct replay_event event;
+	FILE *fp;
+	int rc;
+
+	if (m_deviceOpen)
+		Close();
+
+	fp = fopen(filename, "rb");
+	if (!fp)
+		return -1;
+
+	if (fread(magic, sizeof(magic), 1, fp) != 1
+		|| memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_SIZE)) {
+		fprintf(stderr, "%s is not a trace file\n", filename);
+		fclose(fp);
+		errno = EINVAL;
+		return -1;
+	}
+
+	m_events.clear();
+	while ((rc = trace_read_record(fp, &event.record, &data[0], data.size())) > 0) {
+		event.data.assign(data.begin(), data.begin() + event.record.len);
+		m_events.push_back(event);
+	}
+	fclose(fp);
+
+	if (rc < 0) {
+		fprintf(stderr, "%s is truncated after %zu events\n", filename, m_events.size());
+		m_events.clear();
+		errno = EINVAL;
+		return -1;
+	}
+
+	m_next = 0;
+	m_diverged = false;
+	m_deviceOpen = true;
+
+	// The trace starts by opening the recorded device
+	if (m_events.empty() || !NextEvent(TRACE_EVENT_OPEN, m_events[0].record.arg, 0)) {
+		fprintf(stderr, "%s does not start by opening a device\n", filename);
+		m_deviceOpen = false;
+		errno = EINVAL;
+		return -1;
+	}
+	m_deviceType = (enum RMIDeviceType)m_events[0].record.arg;
+	m_maxWriteSize = 0;
+	if (m_events[0].record.len >= 2)
+		m_maxWriteSize = extract_short(&m_events[0].data[0]);
+
+	return m_events[0].record.rc;
+}
+
+void ReplayDevice::Close()
+{
+	if (m_deviceOpen && m_next < m_events.size()
+		&& m_events[m_next].record.type == TRACE_EVENT_CLOSE)
+		NextEvent(TRACE_EVENT_CLOSE, 0, 0);
+
+	RMIDevice::Close();
+	m_deviceOpen = false;
+}
+
+/*
+ * Consumes the next event, which has to match the call being made. In
+ * real time mode it also waits for as long as the recorded call took.
+ */
+struct replay_event *ReplayDevice::NextEvent(enum trace_event_type type, unsigned short arg,
+						unsigned short len)
+{
+	struct replay_event *event;
+
+	if (!m_deviceOpen || m_diverged)
+		return NULL;
+
+	if (m_next >= m_events.size()) {
+		fprintf(stderr, "Replay: %s after the end of the trace\n", trace_event_name(type));
+		m_diverged = true;
+		return NULL;
+	}
+
+	event = &m_events[m_next];
+	if (event->record.type != type || event->record.arg != arg
+		|| (type == TRACE_EVENT_READ && event->record.rc > 0 && event->record.len != len)
+		|| (type == TRACE_EVENT_WRITE && event->record.rc > 0 && event->record.len != len)) {
+		fprintf(stderr, "Replay: event %zu diverged, traced %s 0x%x (%u bytes), "
+			"called %s 0x%x (%u bytes)\n", m_next,
+			trace_event_name(event->record.type), event->record.arg, event->record.len,
+			trace_event_name(type), arg, len);
+		m_diverged = true;
+		return NULL;
+	}
+
+	++m_next;
+
+	if (m_realTime && event->record.duration) {
+		struct timespec ts;
+
+		ts.tv_sec = event->record.duration / 1000000;
+		ts.tv_nsec = (event->record.duration % 1000000) * 1000;
+		while (nanosleep(&ts, &ts) < 0 && errno == EINTR && !m_bCancel)
+			;
+	}
+
+	return event;
+}
+
+int ReplayDevice::Read(unsigned short addr, unsigned char *buf, unsigned short len)
+{
+	struct replay_event *event;
+
+	if (m_registerCache.Lookup(addr, buf, len))
+		return len;
+
+	event = NextEvent(TRACE_EVENT_READ, addr, len);
+	if (!event)
+		return -1;
+
+	if (event->record.len)
+		memcpy(buf, &event->data[0], event->record.len);
+
+	if (m_hasDebug) {
+		fprintf(stdout, "R %04x : ", addr);
+		print_buffer(buf, len);
+	}
+
+	if (event->record.rc == len)
+		m_registerCache.Update(addr, buf, len, false);
+
+	return event->record.rc;
+}
+
+int ReplayDevice::Write(unsigned short addr, const unsigned char *buf, unsigned short len)
+{
+	struct replay_event *event;
+
+	if (m_hasDebug) {
+		fprintf(stdout, "W %04x : ", addr);
+		print_buffer(buf, len);
+	}
+
+	event = NextEvent(TRACE_EVENT_WRITE, addr, len);
+	if (!event)
+		return -1;
+
+	// The data is allowed to differ, e.g. when replaying with another image
+	if (m_hasDebug && event->record.len && memcmp(buf, &event->data[0], len))
+		fprintf(stdout, "Replay: write to 0x%04x differs from the trace\n", addr);
+
+	if (event->record.rc == len)
+		m_registerCache.Update(addr, buf, len, true);
+
+	return event->record.rc;
+}
+
+int ReplayDevice::SetMode(int mode)
+{
+	struct replay_event *event = NextEvent(TRACE_EVENT_SET_MODE, mode, 0);
+
+	m_registerCache.Flush();
+
+	return event ? event->record.rc : -1;
+}
+
+int ReplayDevice::ToggleInterruptMask(bool enable)
+{
+	struct replay_event *event = NextEvent(TRACE_EVENT_TOGGLE_INTERRUPT, enable, 0);
+
+	return event ? event->record.rc : -1;
+}
+
+int ReplayDevice::WaitForAttention(struct timeval * timeout, unsigned int source_mask)
+{
+	return GetAttentionReport(timeout, source_mask, NULL, NULL);
+}
+
+int ReplayDevice::GetAttentionReport(struct timeval * timeout, unsigned int source_mask,
+					unsigned char *buf, unsigned int *len)
+{
+	struct replay_event *event;
+	unsigned long remaining;
+
+	if (m_bCancel)
+		return -ECANCELED;
+
+	event = NextEvent(TRACE_EVENT_ATTENTION, source_mask & 0xFFFF, 0);
+	if (!event)
+		return -1;
+
+	if (buf && len) {
+		if (*len >= event->record.len) {
+			*len = event->record.len;
+			if (event->record.len)
+				memcpy(buf, &event->data[0], event->record.len);
+		} else {
+			*len = 0;
+		}
+	}
+
+	if (timeout) {
+		remaining = timeout->tv_sec * 1000000 + timeout->tv_usec;
+		remaining = event->record.rc > 0 && remaining > event->record.duration ?
+				remaining - event->record.duration : 0;
+		timeout->tv_sec = remaining / 1000000;
+		timeout->tv_usec = remaining % 1000000;
+	}
+
+	return event->record.rc;
+}
+
+int ReplayDevice::EndWriteBatch()
+{
+	struct replay_event *event = NextEvent(TRACE_EVENT_END_BATCH, 0, 0);
+
+	if (!event || event->record.rc < 0)
+		m_registerCache.Flush();
+
+	return event ? event->record.rc : -1;
+}
+
+void ReplayDevice::RebindDriver()
+{
+	struct replay_event *event;
+
+	if (!m_deviceOpen || m_diverged || m_next >= m_events.size())
+		return;
+
+	// The device type is not known before the rebind completes
+	event = &m_events[m_next];
+	if (!NextEvent(TRACE_EVENT_REBIND, event->record.arg, 0))
+		return;
+
+	RMIDevice::Close();
+	m_deviceType = (enum RMIDeviceType)event->record.arg;
+}
+
+bool ReplayDevice::CheckABSEvent()
+{
+	struct replay_event *event = NextEvent(TRACE_EVENT_CHECK_ABS, 0, 0);
+
+	return event ? event->record.rc : false;
+}
+
+void ReplayDevice::PrintDeviceInfo()
+{
+	unsigned long duration = 0;
+
+	if (!m_events.empty())
+		duration = m_events.back().record.start + m_events.back().record.duration;
+
+	fprintf(stdout, "Replay device info:\nEvents: %zu Duration: %lu us Real time: %s\n",
+		m_events.size(), duration, m_realTime ? "yes" : "no");
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _REPLAYDEVICE_H_
+#define _REPLAYDEVICE_H_
+
+#include <vector>
+
+#include "rmidevice.h"
+#include "tracedevice.h"
+
+struct replay_event {
+	struct trace_record record;
+	std::vector<unsigned char> data;
+};
+
+/*
+ * Plays back a trace recorded by TraceDevice. Each call returns what the
+ * recorded call returned, as fast as possible or, in real time mode,
+ * after taking as long as the recorded call did. The tool has to make the
+ * same calls in the same order as when the trace was recorded; once it
+ * does not every call fails.
+ */
+class ReplayDevice : public RMIDevice
+{
+public:
+	ReplayDevice() : RMIDevice(), m_deviceOpen(false), m_realTime(false), m_next(0),
+			 m_diverged(false), m_maxWriteSize(0)
+	{}
+	void SetRealTime(bool realTime) { m_realTime = realTime; }
+
+	// Opens a trace file
+	virtual int Open(const char * filename);
+	virtual int Read(unsigned short addr, unsigned char *buf,
+				unsigned short len);
+	virtual int Write(unsigned short addr, const unsigned char *buf,
+				 unsigned short len);
+	virtual int SetMode(int mode);
+	virtual int ToggleInterruptMask(bool enable);
+	virtual int WaitForAttention(struct timeval * timeout = NULL,
+					unsigned int source_mask = RMI_INTERUPT_SOURCES_ALL_MASK);
+	virtual int GetAttentionReport(struct timeval * timeout, unsigned int source_mask,
+					unsigned char *buf, unsigned int *len);
+	virtual void Close();
+	virtual int EndWriteBatch();
+	virtual void RebindDriver();
+	virtual bool CheckABSEvent();
+	virtual unsigned short GetMaxWriteSize() { return m_maxWriteSize; }
+	~ReplayDevice() { Close(); }
+
+	virtual void PrintDeviceInfo();
+
+	// A trace has to be opened by name
+	virtual bool FindDevice(enum RMIDeviceType type = RMI_DEVICE_TYPE_ANY) { return false; }
+
+private:
+	bool m_deviceOpen;
+	bool m_realTime;
+	std::vector<struct replay_event> m_events;
+	size_t m_next;
+	bool m_diverged;
+	unsigned short m_maxWriteSize;
+
+	struct replay_event *NextEvent(enum trace_event_type type, unsigned short arg,
+					unsigned short len);
+};
+
+#endif /* _REPLAYDEVICE_H_ */
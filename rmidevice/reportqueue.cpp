@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "reportqueue.h"
+
+bool ReportQueue::Allocate(unsigned int slotCount, size_t reportSize)
+{
+	Free();
+
+	// One slot is left empty to tell a full queue from an empty one.
+	m_slots = new Slot[slotCount + 1]();
+	if (!m_slots)
+		return false;
+
+	for (unsigned int i = 0; i < slotCount + 1; ++i) {
+		m_slots[i].data = new unsigned char[reportSize]();
+		if (!m_slots[i].data) {
+			m_slotCount = i;
+			Free();
+			return false;
+		}
+	}
+
+	m_slotCount = slotCount + 1;
+	m_reportSize = reportSize;
+	m_head.store(0);
+	m_tail.store(0);
+	m_dropped.store(0);
+
+	return true;
+}
+
+void ReportQueue::Free()
+{
+	if (m_slots) {
+		for (unsigned int i = 0; i < m_slotCount; ++i)
+			delete[] m_slots[i].data;
+		delete[] m_slots;
+	}
+	m_slots = NULL;
+	m_slotCount = 0;
+	m_reportSize = 0;
+}
+
+bool ReportQueue::Push(const unsigned char *report, size_t len, const struct timespec *ts)
+{
+	unsigned int head = m_head.load(std::memory_order_relaxed);
+	unsigned int next = (head + 1) % m_slotCount;
+
+	if (next == m_tail.load(std::memory_order_acquire)) {
+		m_dropped.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	if (len > m_reportSize)
+		len = m_reportSize;
+
+	memcpy(m_slots[head].data, report, len);
+	m_slots[head].len = len;
+	if (ts)
+		m_slots[head].timestamp = *ts;
+
+	m_head.store(next, std::memory_order_release);
+
+	return true;
+}
+
+bool ReportQueue::Pop(unsigned char *report, size_t *len, struct timespec *ts)
+{
+	unsigned int tail = m_tail.load(std::memory_order_relaxed);
+
+	if (tail == m_head.load(std::memory_order_acquire))
+		return false;
+
+	memcpy(report, m_slots[tail].data, m_slots[tail].len);
+	if (len)
+		*len = m_slots[tail].len;
+	if (ts)
+		*ts = m_slots[tail].timestamp;
+
+	m_tail.store((tail + 1) % m_slotCount, std::memory_order_release);
+
+	return true;
+}
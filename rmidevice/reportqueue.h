@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _REPORTQUEUE_H_
+#define _REPORTQUEUE_H_
+
+#include <cstddef>
+#include <atomic>
+#include <time.h>
+
+/*
+ * Bounded single producer / single consumer queue of fixed size reports.
+ * Push() may only be called from one thread and Pop() from one other thread.
+ * Neither call blocks, a full queue rejects new reports.
+ */
+class ReportQueue
+{
+public:
+	ReportQueue() : m_slots(NULL), m_slotCount(0), m_reportSize(0), m_head(0), m_tail(0),
+			m_dropped(0)
+	{}
+	~ReportQueue() { Free(); }
+
+	bool Allocate(unsigned int slotCount, size_t reportSize);
+	void Free();
+	void Clear() { m_tail.store(m_head.load(std::memory_order_acquire), std::memory_order_release); }
+
+	bool Push(const unsigned char *report, size_t len, const struct timespec *ts);
+	bool Pop(unsigned char *report, size_t *len, struct timespec *ts);
+	bool IsEmpty() { return m_head.load(std::memory_order_acquire)
+				== m_tail.load(std::memory_order_acquire); }
+	unsigned long GetDroppedCount() { return m_dropped.load(std::memory_order_relaxed); }
+
+private:
+	struct Slot {
+		struct timespec timestamp;
+		size_t len;
+		unsigned char *data;
+	};
+
+	Slot *m_slots;
+	unsigned int m_slotCount;
+	size_t m_reportSize;
+
+	std::atomic<unsigned int> m_head;
+	std::atomic<unsigned int> m_tail;
+	std::atomic<unsigned long> m_dropped;
+};
+
+#endif /* _REPORTQUEUE_H_ */
@@ -20,6 +20,8 @@
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <algorithm>
 
 #include "rmidevice.h"
 
@@ -83,6 +85,9 @@ int RMIDevice::QueryBasicProperties()
 	RMIFunction f01;
 	RMIFunction f34;
 
+	m_buildIDAddr = 0;
+	m_configIDAddr = 0;
+
 	SetRMIPage(0x00);
 
 	if (GetFunction(f01, 1)) {
@@ -187,6 +192,7 @@ int RMIDevice::QueryBasicProperties()
 				unsigned short *val = (unsigned short *)infoBuf;
 				m_buildID = *val;
 				m_buildID += infoBuf[2] * 65536;
+				m_buildIDAddr = prodInfoAddr;
 			}
 		}
 	}
@@ -200,6 +206,7 @@ int RMIDevice::QueryBasicProperties()
 		}
 		m_configID = (configid[0] << 24 | configid[1] << 16
 				| configid[2] << 8 | configid[3]) & 0xFFFFFFFF;
+		m_configIDAddr = controlAddr;
 	}
 
 	return 0;
@@ -210,8 +217,17 @@ void RMIDevice::Close()
 	m_functionList.clear();
 	m_bCancel = false;
 	m_bytesPerReadRequest = 0;
+	m_readPipelineDepth = 1;
 	m_page = -1;
 	m_deviceType = RMI_DEVICE_TYPE_ANY;
+	m_registerCache.Clear();
+}
+
+// Transports without a way to wait for the device rebind it once
+bool RMIDevice::Reenumerate(int timeout_ms)
+{
+	RebindDriver();
+	return CheckABSEvent();
 }
 
 void RMIDevice::PrintProperties()
@@ -247,6 +263,8 @@ int RMIDevice::Reset()
 	if (rc < 0 || rc < 1)
 		return rc;
 
+	m_registerCache.Flush();
+
 	rc = Sleep(RMI_F01_DEFAULT_RESET_DELAY_MS);
 	if (rc < 0)
 		return -1;
@@ -287,29 +305,41 @@ int RMIDevice::ScanPDT(int endFunc, int endPage)
 	unsigned int page;
 	unsigned int maxPage;
 	unsigned int addr;
-	unsigned char entry[RMI_DEVICE_PDT_ENTRY_SIZE];
+	unsigned char pdtEntry[RMI_DEVICE_PDT_ENTRY_SIZE];
+	unsigned int entry;
 	unsigned int interruptCount = 0;
+	const unsigned int maxEntries = (RMI_DEVICE_PAGE_SCAN_START - RMI_DEVICE_PAGE_SCAN_END)
+					/ RMI_DEVICE_PDT_ENTRY_SIZE + 1;
 
 	maxPage = (unsigned int)((endPage < 0) ? RMI_DEVICE_MAX_PAGE : endPage);
 
 	m_functionList.clear();
+	m_firstPagePDT.clear();
+	m_registerCache.Clear();
 
 	for (page = 0; page < maxPage; ++page) {
 		unsigned int page_start = RMI_DEVICE_PAGE_SIZE * page;
 		unsigned int pdt_start = page_start + RMI_DEVICE_PAGE_SCAN_START;
-		unsigned int pdt_end = page_start + RMI_DEVICE_PAGE_SCAN_END;
 		bool found = false;
 
 		SetRMIPage(page);
 
-		for (addr = pdt_start; addr >= pdt_end; addr -= RMI_DEVICE_PDT_ENTRY_SIZE) {
-			rc = Read(addr, entry, RMI_DEVICE_PDT_ENTRY_SIZE);
+		// Read one entry at a time. Only the table's own entries say where
+		// it ends, and the registers below it may clear on read.
+		for (entry = 0; entry < maxEntries; ++entry) {
+			addr = pdt_start - entry * RMI_DEVICE_PDT_ENTRY_SIZE;
+
+			rc = Read(addr, pdtEntry, RMI_DEVICE_PDT_ENTRY_SIZE);
 			if (rc < 0 || rc < RMI_DEVICE_PDT_ENTRY_SIZE) {
 				fprintf(stderr, "Failed to read PDT entry at address (0x%04x)\n", addr);
 				return rc;
 			}
-			
-			RMIFunction func(entry, page_start, interruptCount);
+
+			if (page == 0)
+				m_firstPagePDT.insert(m_firstPagePDT.end(), pdtEntry,
+							pdtEntry + RMI_DEVICE_PDT_ENTRY_SIZE);
+
+			RMIFunction func(pdtEntry, page_start, interruptCount);
 			if (func.GetFunctionNumber() == 0)
 				break;
 
@@ -317,8 +347,10 @@ int RMIDevice::ScanPDT(int endFunc, int endPage)
 			interruptCount += func.GetInterruptSourceCount();
 			found = true;
 
-			if (func.GetFunctionNumber() == endFunc)
+			if (func.GetFunctionNumber() == endFunc) {
+				UpdateRegisterCacheRanges();
 				return 0;
+			}
 		}
 
 		if (!found && (endPage < 0))
@@ -326,10 +358,327 @@ int RMIDevice::ScanPDT(int endFunc, int endPage)
 	}
 
 	m_numInterruptRegs = (interruptCount + 7) / 8;
+	UpdateRegisterCacheRanges();
 	
 	return 0;
 }
 
+void RMIDevice::EnableRegisterCache(bool enable)
+{
+	m_registerCache.Enable(enable);
+	UpdateRegisterCacheRanges();
+}
+
+// A register block runs from its base up to the next base on the page. A
+// base shared with another block belongs to a function without that block.
+static void AddRegisterCacheRange(RegisterCache &cache, const std::vector<unsigned short> &bases,
+					unsigned short base, enum register_cache_type type)
+{
+	std::vector<unsigned short>::const_iterator next;
+	unsigned short end = (base & ~(RMI_DEVICE_PAGE_SIZE - 1)) + RMI_DEVICE_PAGE_SCAN_START;
+
+	if (std::count(bases.begin(), bases.end(), base) > 1)
+		return;
+
+	next = std::upper_bound(bases.begin(), bases.end(), base);
+	if (next != bases.end() && *next < end)
+		end = *next;
+
+	if (end > base)
+		cache.AddRange(base, end - base, type);
+}
+
+void RMIDevice::UpdateRegisterCacheRanges()
+{
+	std::vector<RMIFunction>::iterator funcIter;
+	std::vector<unsigned short> bases;
+
+	m_registerCache.Clear();
+	if (!m_registerCache.IsEnabled())
+		return;
+
+	for (funcIter = m_functionList.begin(); funcIter != m_functionList.end(); ++funcIter) {
+		bases.push_back(funcIter->GetQueryBase());
+		bases.push_back(funcIter->GetCommandBase());
+		bases.push_back(funcIter->GetControlBase());
+		bases.push_back(funcIter->GetDataBase());
+	}
+	std::sort(bases.begin(), bases.end());
+
+	for (funcIter = m_functionList.begin(); funcIter != m_functionList.end(); ++funcIter) {
+		AddRegisterCacheRange(m_registerCache, bases, funcIter->GetQueryBase(),
+					REGISTER_CACHE_QUERY);
+		AddRegisterCacheRange(m_registerCache, bases, funcIter->GetControlBase(),
+					REGISTER_CACHE_CONTROL);
+	}
+}
+
+/*
+ * Basic properties as saved in a device profile. The profile is rejected if
+ * the size of the saved section does not match.
+ */
+struct rmi_profile_properties {
+	uint8_t manufacturerID;
+	uint8_t hasLTS;
+	uint8_t hasSensorID;
+	uint8_t hasAdjustableDoze;
+	uint8_t hasAdjustableDozeHoldoff;
+	uint8_t hasQuery42;
+	char dom[11];
+	uint8_t productID[RMI_PRODUCT_ID_LENGTH + 1];
+	uint16_t packageID;
+	uint16_t packageRev;
+	uint32_t buildID;
+	uint32_t configID;
+	uint8_t sensorID;
+	int32_t firmwareVersionMajor;
+	int32_t firmwareVersionMinor;
+	uint8_t hasDS4Queries;
+	uint8_t hasMultiPhysical;
+	uint8_t ds4QueryLength;
+	uint8_t hasPackageIDQuery;
+	uint8_t hasBuildIDQuery;
+	uint16_t buildIDAddr;
+	uint16_t configIDAddr;
+} __attribute__((packed));
+
+#define RMI_PROFILE_FUNCTION_SIZE	(RMI_DEVICE_PDT_ENTRY_SIZE + 1)
+
+static void ProfileFunctionSection(char *name, size_t len, int endFunc, int endPage)
+{
+	snprintf(name, len, "rmi.functions.%d.%d", endFunc, endPage);
+}
+
+// Each record is the register address, the length and the expected value
+static void AddVerifyRegister(std::vector<unsigned char> &verify, unsigned short addr,
+				const unsigned char *value, unsigned char len)
+{
+	verify.push_back(addr & 0xFF);
+	verify.push_back((addr >> 8) & 0xFF);
+	verify.push_back(len);
+	verify.insert(verify.end(), value, value + len);
+}
+
+/*
+ * Compares the page 0 PDT entries saved in a profile with the device's,
+ * reading the device's entries one at a time as they are needed. devicePDT
+ * keeps the entries read so far for the next profile. Reading stops at the
+ * first entry which differs, so no more than the device's own table, up to
+ * its empty entry, is ever read.
+ */
+bool RMIDevice::MatchProfilePDT(const std::vector<unsigned char> &savedPDT,
+				std::vector<unsigned char> &devicePDT)
+{
+	unsigned char pdtEntry[RMI_DEVICE_PDT_ENTRY_SIZE];
+	size_t offset;
+	int rc;
+
+	if (savedPDT.empty() || savedPDT.size() % RMI_DEVICE_PDT_ENTRY_SIZE
+		|| savedPDT.size() > RMI_DEVICE_PAGE_SCAN_START - RMI_DEVICE_PAGE_SCAN_END
+					+ RMI_DEVICE_PDT_ENTRY_SIZE)
+		return false;
+
+	for (offset = 0; offset < savedPDT.size(); offset += RMI_DEVICE_PDT_ENTRY_SIZE) {
+		if (offset == devicePDT.size()) {
+			// The device's table ended with the entry before
+			if (offset && RMIFunction(&devicePDT[offset - RMI_DEVICE_PDT_ENTRY_SIZE], 0, 0)
+					.GetFunctionNumber() == 0)
+				return false;
+			SetRMIPage(0x00);
+			rc = Read(RMI_DEVICE_PAGE_SCAN_START - offset, pdtEntry, sizeof(pdtEntry));
+			if (rc < 0 || rc < (int)sizeof(pdtEntry))
+				return false;
+			devicePDT.insert(devicePDT.end(), pdtEntry, pdtEntry + sizeof(pdtEntry));
+		}
+
+		if (memcmp(&devicePDT[offset], &savedPDT[offset], RMI_DEVICE_PDT_ENTRY_SIZE))
+			return false;
+	}
+
+	return true;
+}
+
+bool RMIDevice::LoadProfile(const std::string &dir, DeviceProfile &profile, int endFunc, int endPage)
+{
+	std::vector<std::string> paths;
+	std::vector<std::string>::iterator pathIter;
+	std::vector<unsigned char> devicePDT;
+	char functionSection[32];
+	int rc;
+
+	DeviceProfile::ListProfiles(dir, paths);
+	if (paths.empty())
+		return false;
+
+	ProfileFunctionSection(functionSection, sizeof(functionSection), endFunc, endPage);
+
+	for (pathIter = paths.begin(); pathIter != paths.end(); ++pathIter) {
+		std::vector<unsigned char> pdt;
+		std::vector<unsigned char> functions;
+		std::vector<unsigned char> verify;
+		struct rmi_profile_properties props;
+		bool match = true;
+		unsigned int interruptCount = 0;
+
+		if (!profile.Load(*pathIter)
+			|| !profile.GetSection("rmi.pdt", pdt) || !MatchProfilePDT(pdt, devicePDT)
+			|| !profile.GetSection(functionSection, functions)
+			|| functions.size() < 2
+			|| (functions.size() - 2) % RMI_PROFILE_FUNCTION_SIZE
+			|| !profile.GetSection("rmi.properties", &props, sizeof(props))
+			|| !profile.GetSection("rmi.verify", verify) || verify.empty())
+			continue;
+
+		// Identification registers which change with a firmware or config update
+		for (size_t i = 0; match && i + 3 <= verify.size(); i += 3 + verify[i + 2]) {
+			unsigned short addr = verify[i] | (verify[i + 1] << 8);
+			unsigned char len = verify[i + 2];
+			unsigned char value[256];
+
+			if (i + 3 + len > verify.size()) {
+				match = false;
+				break;
+			}
+
+			SetRMIPage(addr >> 8);
+			rc = Read(addr, value, len);
+			if (rc < 0 || rc < len || memcmp(value, &verify[i + 3], len))
+				match = false;
+		}
+		if (!match)
+			continue;
+
+		m_functionList.clear();
+		m_numInterruptRegs = functions[0] | (functions[1] << 8);
+		for (size_t i = 2; i < functions.size(); i += RMI_PROFILE_FUNCTION_SIZE) {
+			RMIFunction func(&functions[i + 1], functions[i] * RMI_DEVICE_PAGE_SIZE,
+					interruptCount);
+
+			m_functionList.push_back(func);
+			interruptCount += func.GetInterruptSourceCount();
+		}
+		m_firstPagePDT = pdt;
+
+		m_manufacturerID = props.manufacturerID;
+		m_hasLTS = props.hasLTS;
+		m_hasSensorID = props.hasSensorID;
+		m_hasAdjustableDoze = props.hasAdjustableDoze;
+		m_hasAdjustableDozeHoldoff = props.hasAdjustableDozeHoldoff;
+		m_hasQuery42 = props.hasQuery42;
+		memcpy(m_dom, props.dom, sizeof(m_dom));
+		m_dom[sizeof(m_dom) - 1] = '\0';
+		memcpy(m_productID, props.productID, sizeof(m_productID));
+		m_productID[RMI_PRODUCT_ID_LENGTH] = '\0';
+		m_packageID = props.packageID;
+		m_packageRev = props.packageRev;
+		m_buildID = props.buildID;
+		m_configID = props.configID;
+		m_sensorID = props.sensorID;
+		m_firmwareVersionMajor = props.firmwareVersionMajor;
+		m_firmwareVersionMinor = props.firmwareVersionMinor;
+		m_hasDS4Queries = props.hasDS4Queries;
+		m_hasMultiPhysical = props.hasMultiPhysical;
+		m_ds4QueryLength = props.ds4QueryLength;
+		m_hasPackageIDQuery = props.hasPackageIDQuery;
+		m_hasBuildIDQuery = props.hasBuildIDQuery;
+		m_buildIDAddr = props.buildIDAddr;
+		m_configIDAddr = props.configIDAddr;
+
+		UpdateRegisterCacheRanges();
+
+		return true;
+	}
+
+	profile.Clear();
+	return false;
+}
+
+int RMIDevice::SaveProfile(const std::string &dir, DeviceProfile &profile, int endFunc, int endPage)
+{
+	std::vector<RMIFunction>::iterator funcIter;
+	std::vector<unsigned char> functions;
+	std::vector<unsigned char> verify;
+	struct rmi_profile_properties props;
+	unsigned char value[4];
+	char functionSection[32];
+	DeviceProfile saved;
+	std::string path;
+
+	// Without an identifying register a stale profile could not be detected
+	if (m_firstPagePDT.empty() || (!m_buildIDAddr && !m_configIDAddr))
+		return -1;
+
+	functions.push_back(m_numInterruptRegs & 0xFF);
+	functions.push_back((m_numInterruptRegs >> 8) & 0xFF);
+	for (funcIter = m_functionList.begin(); funcIter != m_functionList.end(); ++funcIter) {
+		functions.push_back(funcIter->GetQueryBase() / RMI_DEVICE_PAGE_SIZE);
+		functions.push_back(funcIter->GetQueryBase() & 0xFF);
+		functions.push_back(funcIter->GetCommandBase() & 0xFF);
+		functions.push_back(funcIter->GetControlBase() & 0xFF);
+		functions.push_back(funcIter->GetDataBase() & 0xFF);
+		functions.push_back((funcIter->GetFunctionVersion() << 5)
+					| funcIter->GetInterruptSourceCount());
+		functions.push_back(funcIter->GetFunctionNumber());
+	}
+
+	if (m_buildIDAddr) {
+		value[0] = m_buildID & 0xFF;
+		value[1] = (m_buildID >> 8) & 0xFF;
+		value[2] = (m_buildID >> 16) & 0xFF;
+		AddVerifyRegister(verify, m_buildIDAddr, value, BUILD_ID_BYTES);
+	}
+
+	if (m_configIDAddr) {
+		value[0] = (m_configID >> 24) & 0xFF;
+		value[1] = (m_configID >> 16) & 0xFF;
+		value[2] = (m_configID >> 8) & 0xFF;
+		value[3] = m_configID & 0xFF;
+		AddVerifyRegister(verify, m_configIDAddr, value, CONFIG_ID_BYTES);
+	}
+
+	memset(&props, 0, sizeof(props));
+	props.manufacturerID = m_manufacturerID;
+	props.hasLTS = m_hasLTS;
+	props.hasSensorID = m_hasSensorID;
+	props.hasAdjustableDoze = m_hasAdjustableDoze;
+	props.hasAdjustableDozeHoldoff = m_hasAdjustableDozeHoldoff;
+	props.hasQuery42 = m_hasQuery42;
+	memcpy(props.dom, m_dom, sizeof(props.dom));
+	memcpy(props.productID, m_productID, sizeof(props.productID));
+	props.packageID = m_packageID;
+	props.packageRev = m_packageRev;
+	props.buildID = m_buildID;
+	props.configID = m_configIDAddr ? m_configID : 0;
+	props.sensorID = m_sensorID;
+	props.firmwareVersionMajor = m_firmwareVersionMajor;
+	props.firmwareVersionMinor = m_firmwareVersionMinor;
+	props.hasDS4Queries = m_hasDS4Queries;
+	props.hasMultiPhysical = m_hasMultiPhysical;
+	props.ds4QueryLength = m_ds4QueryLength;
+	props.hasPackageIDQuery = m_hasPackageIDQuery;
+	props.hasBuildIDQuery = m_hasBuildIDQuery;
+	props.buildIDAddr = m_buildIDAddr;
+	props.configIDAddr = m_configIDAddr;
+
+	ProfileFunctionSection(functionSection, sizeof(functionSection), endFunc, endPage);
+	profile.SetSection("rmi.pdt", &m_firstPagePDT[0], m_firstPagePDT.size());
+	profile.SetSection(functionSection, &functions[0], functions.size());
+	profile.SetSection("rmi.properties", &props, sizeof(props));
+	profile.SetSection("rmi.verify", &verify[0], verify.size());
+
+	// Keep the sections saved by other tools for the same device
+	path = DeviceProfile::GetPath(dir, (const char *)m_productID, m_buildID, props.configID);
+	saved.Load(path);
+	saved.Merge(profile);
+	if (!saved.Save(path)) {
+		fprintf(stderr, "Failed to save the device profile %s: %s\n", path.c_str(),
+			strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
 bool RMIDevice::InBootloader()
 {
 	RMIFunction f01;
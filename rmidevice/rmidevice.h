@@ -20,8 +20,11 @@
 
 #include <cstddef>
 #include <vector>
+#include <string>
 
 #include "rmifunction.h"
+#include "registercache.h"
+#include "deviceprofile.h"
 
 #define RMI_PRODUCT_ID_LENGTH		10
 
@@ -36,8 +39,9 @@ enum RMIDeviceType {
 class RMIDevice
 {
 public:
-	RMIDevice() : m_functionList(), m_sensorID(0), m_bCancel(false), m_bytesPerReadRequest(0), m_page(-1),
-		      m_deviceType(RMI_DEVICE_TYPE_ANY)
+	RMIDevice() : m_functionList(), m_sensorID(0), m_bCancel(false), m_bytesPerReadRequest(0),
+		      m_readPipelineDepth(1), m_page(-1), m_deviceType(RMI_DEVICE_TYPE_ANY),
+		      m_buildIDAddr(0), m_configIDAddr(0)
 	{ m_hasDebug = false; }
 	virtual ~RMIDevice() {}
 	virtual int Open(const char * filename) = 0;
@@ -56,9 +60,13 @@ public:
 	virtual void Cancel() { m_bCancel = true; }
 	virtual void RebindDriver() = 0;
 	virtual bool CheckABSEvent() = 0;
+	// Rebind the driver after a reset and wait up to timeout_ms for the
+	// device and its input device to come back
+	virtual bool Reenumerate(int timeout_ms);
 
 	unsigned long GetFirmwareID() { return m_buildID; }
 	unsigned long GetConfigID() { return m_configID; }
+	unsigned short GetPackageID() { return m_packageID; }
 	int GetFirmwareVersionMajor() { return m_firmwareVersionMajor; }
 	int GetFirmwareVersionMinor() { return m_firmwareVersionMinor; }
 	virtual int QueryBasicProperties();
@@ -76,7 +84,46 @@ public:
 	bool GetFunction(RMIFunction &func, int functionNumber);
 	void PrintFunctions();
 
-	void SetBytesPerReadRequest(int bytes) { m_bytesPerReadRequest = bytes; }
+	virtual void SetBytesPerReadRequest(int bytes) { m_bytesPerReadRequest = bytes; }
+	// Number of read requests which may be outstanding at once when a read
+	// is split into multiple requests. A depth of 1 disables pipelining.
+	virtual void SetReadPipelineDepth(int depth) { m_readPipelineDepth = depth > 0 ? depth : 1; }
+	int GetBytesPerReadRequest() { return m_bytesPerReadRequest; }
+	int GetReadPipelineDepth() { return m_readPipelineDepth; }
+
+	// Read len bytes from a data register which returns the next bytes of
+	// a stream on every access, like the F34 payload or the F54 report
+	// data. Every request of a split read goes to addr and nothing is
+	// cached.
+	virtual int ReadFifo(unsigned short addr, unsigned char *buf, unsigned short len)
+	{ return Read(addr, buf, len); }
+
+	// Writes between BeginWriteBatch() and EndWriteBatch() may be queued by
+	// the transport and sent together. EndWriteBatch() returns once they
+	// have completed and reports the first write which failed.
+	virtual void BeginWriteBatch() {}
+	virtual int EndWriteBatch() { return 0; }
+
+	// Largest number of bytes a single Write() can carry, 0 if the
+	// transport does not limit it
+	virtual unsigned short GetMaxWriteSize() { return 0; }
+
+	// Serve repeated reads of query registers, and reads of control registers
+	// which have been written, from memory. ScanPDT(), Reset() and mode
+	// changes flush the cache.
+	void EnableRegisterCache(bool enable);
+	void FlushRegisterCache() { m_registerCache.Flush(); }
+	unsigned long GetRegisterCacheHits() { return m_registerCache.GetHits(); }
+
+	// Restore the function list and basic properties saved by an earlier
+	// run from a profile in dir, after checking the device still matches
+	// it. Returns false if the device has to be scanned. The scan
+	// parameters must match the ones passed to SaveProfile().
+	bool LoadProfile(const std::string &dir, DeviceProfile &profile,
+				int endFunc = 0, int endPage = -1);
+	// Add the function list and basic properties to profile and save it
+	int SaveProfile(const std::string &dir, DeviceProfile &profile,
+				int endFunc = 0, int endPage = -1);
 
 	unsigned int GetNumInterruptRegs() { return m_numInterruptRegs; }
 
@@ -115,11 +162,24 @@ protected:
 
 	bool m_bCancel;
 	int m_bytesPerReadRequest;
+	int m_readPipelineDepth;
 	int m_page;
 
 	unsigned int m_numInterruptRegs;
 
 	enum RMIDeviceType m_deviceType;
+
+	RegisterCache m_registerCache;
+
+	// The page 0 PDT entries read by the last scan, in the order they were
+	// read, which identify the device when loading a profile
+	std::vector<unsigned char> m_firstPagePDT;
+	unsigned short m_buildIDAddr;
+	unsigned short m_configIDAddr;
+
+	void UpdateRegisterCacheRanges();
+	bool MatchProfilePDT(const std::vector<unsigned char> &savedPDT,
+				std::vector<unsigned char> &devicePDT);
 };
 
 /* Utility Functions */
@@ -0,0 +1,1236 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <algorithm>
+#include <sstream>
+
+#include "simdevice.h"
+#include "waitengine.h"
+
+#define SIM_ATTN_REPORT_ID		0x0c
+#define SIM_INPUT_REPORT_SIZE		30
+#define SIM_IDLE_WAIT_MS		100
+
+#define SIM_PDT_START			0xE9
+#define SIM_PDT_ENTRY_SIZE		6
+#define SIM_PAGE_SIZE			0x100
+
+#define SIM_F01_QUERY_BASE		0x00
+#define SIM_F01_CONTROL_BASE		0x20
+#define SIM_F01_COMMAND_BASE		0x28
+#define SIM_F01_DATA_BASE		0x2C
+#define SIM_F34_QUERY_BASE		0x30
+#define SIM_F34_CONTROL_BASE		0x40
+#define SIM_F34_COMMAND_BASE		0x48
+#define SIM_F34_DATA_BASE		0x50
+#define SIM_F54_QUERY_BASE		0x100
+#define SIM_F54_CONTROL_BASE		0x110
+#define SIM_F54_COMMAND_BASE		0x140
+#define SIM_F54_DATA_BASE		0x150
+#define SIM_F55_QUERY_BASE		0x160
+#define SIM_F55_CONTROL_BASE		0x170
+#define SIM_F55_DATA_BASE		0x180
+
+#define SIM_F01_IRQ			0x01
+#define SIM_F34_IRQ			0x02
+#define SIM_F54_IRQ			0x04
+
+#define SIM_F01_STATUS_BOOTLOADER	0x40
+#define SIM_F01_CMD_RESET		0x01
+#define SIM_F01_QRY1_HAS_PROPS_2	0x80
+#define SIM_F01_QRY42_DS4_QUERIES	0x01
+#define SIM_F01_QRY43_PACKAGE_BUILD_ID	0x03
+
+/* F34 v5 and v6 */
+#define SIM_F34_V5_HAS_CONFIG_ID	0x04
+#define SIM_F34_V5_ENABLED		0x80
+#define SIM_F34_V5_CMD_WRITE_FW		0x02
+#define SIM_F34_V5_CMD_ERASE_ALL	0x03
+#define SIM_F34_V5_CMD_WRITE_LOCKDOWN	0x04
+#define SIM_F34_V5_CMD_WRITE_CONFIG	0x06
+#define SIM_F34_V5_CMD_ENABLE_PROG	0x0f
+#define SIM_F34_V5_STATUS_INVALID_CMD	0x02
+#define SIM_F34_V5_STATUS_INVALID_BLOCK	0x03
+#define SIM_F34_V5_STATUS_BAD_KEY	0x05
+
+/* F34 v7 data registers */
+#define SIM_F34_V7_STATUS		(SIM_F34_DATA_BASE + 0)
+#define SIM_F34_V7_PARTITION		(SIM_F34_DATA_BASE + 1)
+#define SIM_F34_V7_BLOCK_OFFSET		(SIM_F34_DATA_BASE + 2)
+#define SIM_F34_V7_TRANSFER_LENGTH	(SIM_F34_DATA_BASE + 3)
+#define SIM_F34_V7_COMMAND		(SIM_F34_DATA_BASE + 4)
+#define SIM_F34_V7_PAYLOAD		(SIM_F34_DATA_BASE + 5)
+#define SIM_F34_V7_IN_BOOTLOADER	0x80
+#define SIM_F34_V7_HAS_CONFIG_ID	0x08
+
+#define SIM_F34_V7_CMD_IDLE		0x00
+#define SIM_F34_V7_CMD_ENTER_BL		0x01
+#define SIM_F34_V7_CMD_READ		0x02
+#define SIM_F34_V7_CMD_WRITE		0x03
+#define SIM_F34_V7_CMD_ERASE		0x04
+#define SIM_F34_V7_CMD_ERASE_AP		0x05
+#define SIM_F34_V7_CMD_SENSOR_ID	0x06
+#define SIM_F34_V7_CMD_SIGNATURE	0x07
+
+#define SIM_F34_V7_SUCCESS		0x00
+#define SIM_F34_V7_NOT_IN_BOOTLOADER	0x01
+#define SIM_F34_V7_INVALID_PARTITION	0x02
+#define SIM_F34_V7_INVALID_COMMAND	0x03
+#define SIM_F34_V7_INVALID_OFFSET	0x04
+#define SIM_F34_V7_INVALID_TRANSFER	0x05
+#define SIM_F34_V7_BAD_KEY		0x07
+
+#define SIM_PARTITION_BOOTLOADER	0x01
+#define SIM_PARTITION_FLASH_CONFIG	0x03
+#define SIM_PARTITION_CORE_CODE		0x07
+#define SIM_PARTITION_CORE_CONFIG	0x08
+#define SIM_PARTITION_FLD		0x0E
+#define SIM_PARTITION_ENTRY_SIZE	8
+#define SIM_PARTITION_TABLE_OFFSET	2
+#define SIM_PARTITION_START_BLOCK	0x40
+
+#define SIM_F34_V7_HAS_BOOTLOADER	(1 << 1)
+#define SIM_F34_V7_HAS_FLASH_CONFIG	(1 << 3)
+#define SIM_F34_V7_HAS_CORE_CODE	(1 << 7)
+#define SIM_F34_V7_HAS_CORE_CONFIG	(1 << 8)
+#define SIM_F34_V7_HAS_FLD		(1 << 14)
+
+/* F54 */
+#define SIM_F54_CMD_GET_REPORT		0x01
+#define SIM_F54_REPORT_INDEX		(SIM_F54_DATA_BASE + 1)
+#define SIM_F54_REPORT_DATA		(SIM_F54_DATA_BASE + 3)
+#define SIM_F54_HAS_IMAGES		0x4C
+#define SIM_F54_BASELINE		1000
+#define SIM_F54_NOISE			16
+#define SIM_F55_HAS_SENSOR_ASSIGNMENT	0x01
+
+static const struct {
+	const char *name;
+	unsigned int sim_device_config::*field;
+} sim_options[] = {
+	{ "bl", &sim_device_config::blVersion },
+	{ "bl_minor", &sim_device_config::blMinor },
+	{ "build_id", &sim_device_config::buildID },
+	{ "config_id", &sim_device_config::configID },
+	{ "block_size", &sim_device_config::blockSize },
+	{ "fw_blocks", &sim_device_config::fwBlocks },
+	{ "config_blocks", &sim_device_config::configBlocks },
+	{ "flash_config_blocks", &sim_device_config::flashConfigBlocks },
+	{ "fld_blocks", &sim_device_config::fldBlocks },
+	{ "payload", &sim_device_config::payloadBlocks },
+	{ "tx", &sim_device_config::txElectrodes },
+	{ "rx", &sim_device_config::rxElectrodes },
+	{ "latency_us", &sim_device_config::latencyUs },
+	{ "jitter_us", &sim_device_config::jitterUs },
+	{ "byte_ns", &sim_device_config::byteNs },
+	{ "max_write", &sim_device_config::maxWrite },
+	{ "attn", &sim_device_config::attention },
+	{ "attn_delay_us", &sim_device_config::attnDelayUs },
+	{ "enter_bl_ms", &sim_device_config::enterBLMs },
+	{ "erase_ms", &sim_device_config::eraseMs },
+	{ "block_us", &sim_device_config::blockUs },
+	{ "frame_ms", &sim_device_config::frameMs },
+	{ "seed", &sim_device_config::seed },
+	{ "stats", &sim_device_config::stats },
+};
+
+static void timespec_add_us(struct timespec *ts, unsigned long us)
+{
+	ts->tv_sec += us / 1000000;
+	ts->tv_nsec += (us % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_nsec -= 1000000000;
+		++ts->tv_sec;
+	}
+}
+
+static bool timespec_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+void SimDevice::SetDefaultConfig(struct sim_device_config &config)
+{
+	config.blVersion = 7;
+	config.blMinor = 0;
+	config.type = RMI_DEVICE_TYPE_TOUCHPAD;
+	config.productID = "SIMRMI4";
+	config.buildID = 1;
+	config.configID = 0;
+	config.blockSize = 16;
+	config.fwBlocks = 1024;
+	config.configBlocks = 64;
+	config.flashConfigBlocks = 0;
+	config.fldBlocks = 8;
+	config.payloadBlocks = 16;
+	config.txElectrodes = 16;
+	config.rxElectrodes = 28;
+	config.latencyUs = 0;
+	config.jitterUs = 0;
+	config.byteNs = 0;
+	config.maxWrite = 0;
+	config.attention = 1;
+	config.attnDelayUs = 0;
+	config.enterBLMs = 0;
+	config.eraseMs = 0;
+	config.blockUs = 0;
+	config.frameMs = 0;
+	config.seed = 1;
+	config.stats = 0;
+}
+
+int SimDevice::ParseSpec(const char *spec, struct sim_device_config &config)
+{
+	std::stringstream ss(spec);
+	std::string option;
+
+	while (std::getline(ss, option, ',')) {
+		size_t pos = option.find('=');
+		std::string key = option.substr(0, pos);
+		std::string value = (pos == std::string::npos) ? "" : option.substr(pos + 1);
+		unsigned long number;
+		char *end;
+		size_t i;
+
+		if (option.empty())
+			continue;
+
+		if (key == "type") {
+			if (value == "touchpad")
+				config.type = RMI_DEVICE_TYPE_TOUCHPAD;
+			else if (value == "touchscreen")
+				config.type = RMI_DEVICE_TYPE_TOUCHSCREEN;
+			else
+				goto invalid;
+			continue;
+		}
+
+		if (key == "product") {
+			if (value.empty() || value.size() > RMI_PRODUCT_ID_LENGTH)
+				goto invalid;
+			config.productID = value;
+			continue;
+		}
+
+		for (i = 0; i < sizeof(sim_options) / sizeof(sim_options[0]); ++i)
+			if (key == sim_options[i].name)
+				break;
+		if (i == sizeof(sim_options) / sizeof(sim_options[0]))
+			goto invalid;
+
+		number = strtoul(value.c_str(), &end, 0);
+		if (value.empty() || *end != '\0' || number > 0xFFFFFFFFUL)
+			goto invalid;
+		config.*sim_options[i].field = number;
+		continue;
+
+invalid:
+		fprintf(stderr, "Invalid simulated device option: %s\n", option.c_str());
+		return -EINVAL;
+	}
+
+	if (config.blVersion != 5 && config.blVersion != 6 && config.blVersion != 7
+		&& config.blVersion != 8 && config.blVersion != 10) {
+		fprintf(stderr, "Unsupported simulated bootloader version: %u\n", config.blVersion);
+		return -EINVAL;
+	}
+
+	// v5 block data registers sit below the PDT on page 0
+	if (!config.blockSize || config.blockSize > (config.blVersion == 5 ? 64U : 1024U)
+		|| config.fwBlocks > 0xFFFF || config.configBlocks > 0xFFFF
+		|| config.flashConfigBlocks > 0xFFFF || config.fldBlocks > 0xFFFF
+		|| !config.payloadBlocks || config.payloadBlocks > 0xFFFF
+		|| !config.txElectrodes || config.txElectrodes > 0xFF
+		|| !config.rxElectrodes || config.rxElectrodes > 0xFF) {
+		fprintf(stderr, "Invalid simulated device geometry\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+int SimDevice::Open(const char * filename)
+{
+	int rc;
+
+	if (m_deviceOpen)
+		Close();
+
+	SetDefaultConfig(m_config);
+	rc = ParseSpec(filename ? filename : "", m_config);
+	if (rc < 0) {
+		errno = -rc;
+		return -1;
+	}
+
+	m_seed = m_config.seed;
+	m_roundTrips = 0;
+	PowerOn(true);
+
+	m_deviceType = m_config.type;
+	m_deviceOpen = true;
+
+	return 0;
+}
+
+bool SimDevice::FindDevice(enum RMIDeviceType type)
+{
+	if (Open(NULL) < 0)
+		return false;
+
+	if (type != RMI_DEVICE_TYPE_ANY) {
+		m_config.type = type;
+		m_deviceType = type;
+	}
+
+	return true;
+}
+
+void SimDevice::Close()
+{
+	if (m_deviceOpen && m_config.stats)
+		fprintf(stdout, "Simulated device round trips: %lu\n", m_roundTrips);
+
+	RMIDevice::Close();
+	m_deviceOpen = false;
+	m_registers.clear();
+	m_partitions.clear();
+	m_payload.clear();
+	m_readFifo.clear();
+	m_f54Report.clear();
+	m_attnQueue.clear();
+	m_op = SIM_OP_NONE;
+}
+
+void SimDevice::RebindDriver()
+{
+	if (!m_deviceOpen)
+		return;
+
+	// Whatever the device was doing finishes while the driver is rebound
+	WaitForOperation();
+	m_attnQueue.clear();
+
+	RMIDevice::Close();
+	m_deviceType = m_config.type;
+}
+
+void SimDevice::PrintDeviceInfo()
+{
+	enum RMIDeviceType deviceType = GetDeviceType();
+
+	fprintf(stdout, "Simulated device info:\nBootloader: v%u.%u Block size: %u\n",
+		m_config.blVersion, m_config.blMinor, m_config.blockSize);
+	fprintf(stdout, "Latency: %u us Jitter: %u us Attention delay: %u us\n",
+		m_config.latencyUs, m_config.jitterUs, m_config.attnDelayUs);
+	if (deviceType)
+		fprintf(stdout, "device type: %s\n", deviceType == RMI_DEVICE_TYPE_TOUCHSCREEN ?
+			"touchscreen" : "touchpad");
+}
+
+void SimDevice::SetRegister(unsigned short addr, const unsigned char *data, size_t len)
+{
+	m_registers[addr].assign(data, data + len);
+}
+
+void SimDevice::SetRegisterByte(unsigned short addr, unsigned char value)
+{
+	std::vector<unsigned char> &reg = m_registers[addr];
+
+	if (reg.empty())
+		reg.resize(1);
+	reg[0] = value;
+}
+
+unsigned char SimDevice::GetRegisterByte(unsigned short addr)
+{
+	std::map<unsigned short, std::vector<unsigned char> >::iterator it = m_registers.find(addr);
+
+	return it == m_registers.end() ? 0 : it->second[0];
+}
+
+unsigned short SimDevice::GetRegisterShort(unsigned short addr)
+{
+	std::map<unsigned short, std::vector<unsigned char> >::iterator it = m_registers.find(addr);
+
+	if (it == m_registers.end())
+		return 0;
+	if (it->second.size() < 2)
+		return it->second[0] | (GetRegisterByte(addr + 1) << 8);
+	return it->second[0] | (it->second[1] << 8);
+}
+
+// Registers which power on with fixed values. The flash contents survive
+// a reset.
+void SimDevice::PowerOn(bool resetFlash)
+{
+	unsigned char basicQuery[11] = { 1, SIM_F01_QRY1_HAS_PROPS_2, 1, 0, 0, 24, 1, 1, 0, 0, 0 };
+	unsigned char productID[RMI_PRODUCT_ID_LENGTH] = { 0 };
+	unsigned char packageID[4] = { 0 };
+	unsigned char buildID[3];
+	unsigned char configID[4];
+	unsigned char f54Query[14] = { 0 };
+	unsigned char f55Query[3];
+	std::vector<unsigned char> mapping;
+
+	m_registers.clear();
+	m_payload.clear();
+	m_payloadActive = false;
+	m_payloadExpected = 0;
+	m_readFifo.clear();
+	m_f54Report.clear();
+	m_op = SIM_OP_NONE;
+	m_blMode = false;
+	if (resetFlash)
+		SetupPartitions();
+
+	/* F01 */
+	memcpy(productID, m_config.productID.c_str(), m_config.productID.size());
+	buildID[0] = m_config.buildID & 0xFF;
+	buildID[1] = (m_config.buildID >> 8) & 0xFF;
+	buildID[2] = (m_config.buildID >> 16) & 0xFF;
+	for (unsigned int i = 0; i < sizeof(basicQuery); ++i)
+		SetRegisterByte(SIM_F01_QUERY_BASE + i, basicQuery[i]);
+	SetRegister(SIM_F01_QUERY_BASE + 11, productID, sizeof(productID));
+	SetRegister(SIM_F01_QUERY_BASE + 17, packageID, sizeof(packageID));
+	SetRegister(SIM_F01_QUERY_BASE + 18, buildID, sizeof(buildID));
+	SetRegisterByte(SIM_F01_QUERY_BASE + 21, SIM_F01_QRY42_DS4_QUERIES);
+	SetRegisterByte(SIM_F01_QUERY_BASE + 22, 1);
+	SetRegisterByte(SIM_F01_QUERY_BASE + 23, SIM_F01_QRY43_PACKAGE_BUILD_ID);
+	SetRegisterByte(SIM_F01_CONTROL_BASE, 0);
+	SetRegisterByte(SIM_F01_CONTROL_BASE + 1, 0xFF);
+
+	/* F34 */
+	configID[0] = (m_config.configID >> 24) & 0xFF;
+	configID[1] = (m_config.configID >> 16) & 0xFF;
+	configID[2] = (m_config.configID >> 8) & 0xFF;
+	configID[3] = m_config.configID & 0xFF;
+	SetRegister(SIM_F34_CONTROL_BASE, configID, sizeof(configID));
+	SetupF34Registers();
+
+	/* F54 */
+	f54Query[0] = m_config.rxElectrodes;
+	f54Query[1] = m_config.txElectrodes;
+	f54Query[2] = SIM_F54_HAS_IMAGES;
+	for (unsigned int i = 0; i < sizeof(f54Query); ++i)
+		SetRegisterByte(SIM_F54_QUERY_BASE + i, f54Query[i]);
+
+	/* F55 */
+	f55Query[0] = m_config.rxElectrodes;
+	f55Query[1] = m_config.txElectrodes;
+	f55Query[2] = SIM_F55_HAS_SENSOR_ASSIGNMENT;
+	for (unsigned int i = 0; i < sizeof(f55Query); ++i)
+		SetRegisterByte(SIM_F55_QUERY_BASE + i, f55Query[i]);
+	for (unsigned int i = 0; i < m_config.rxElectrodes; ++i)
+		mapping.push_back(i);
+	SetRegister(SIM_F55_CONTROL_BASE + 1, &mapping[0], mapping.size());
+	mapping.clear();
+	for (unsigned int i = 0; i < m_config.txElectrodes; ++i)
+		mapping.push_back(i);
+	SetRegister(SIM_F55_CONTROL_BASE + 2, &mapping[0], mapping.size());
+
+	SetupPDT();
+}
+
+static void SetPDTEntry(std::map<unsigned short, std::vector<unsigned char> > &registers,
+			unsigned short page, unsigned int index, unsigned short queryBase,
+			unsigned short commandBase, unsigned short controlBase,
+			unsigned short dataBase, unsigned char version,
+			unsigned char interruptCount, unsigned char functionNumber)
+{
+	unsigned short addr = page * SIM_PAGE_SIZE + SIM_PDT_START - index * SIM_PDT_ENTRY_SIZE;
+	const unsigned char entry[SIM_PDT_ENTRY_SIZE] = {
+		(unsigned char)(queryBase & 0xFF),
+		(unsigned char)(commandBase & 0xFF),
+		(unsigned char)(controlBase & 0xFF),
+		(unsigned char)(dataBase & 0xFF),
+		(unsigned char)((version << 5) | interruptCount),
+		functionNumber,
+	};
+
+	for (unsigned int i = 0; i < SIM_PDT_ENTRY_SIZE; ++i)
+		registers[addr + i].assign(1, entry[i]);
+}
+
+// F54 and F55 are not available while in the bootloader
+void SimDevice::SetupPDT()
+{
+	unsigned char f34Version = m_config.blVersion >= 7 ? 2 : m_config.blVersion - 5;
+
+	SetPDTEntry(m_registers, 0, 0, SIM_F01_QUERY_BASE, SIM_F01_COMMAND_BASE,
+			SIM_F01_CONTROL_BASE, SIM_F01_DATA_BASE, 0, 1, 0x01);
+	SetPDTEntry(m_registers, 0, 1, SIM_F34_QUERY_BASE, SIM_F34_COMMAND_BASE,
+			SIM_F34_CONTROL_BASE, SIM_F34_DATA_BASE, f34Version, 1, 0x34);
+	SetPDTEntry(m_registers, 0, 2, 0, 0, 0, 0, 0, 0, 0);
+
+	if (m_blMode) {
+		SetPDTEntry(m_registers, 1, 0, 0, 0, 0, 0, 0, 0, 0);
+	} else {
+		SetPDTEntry(m_registers, 1, 0, SIM_F54_QUERY_BASE, SIM_F54_COMMAND_BASE,
+				SIM_F54_CONTROL_BASE, SIM_F54_DATA_BASE, 0, 1, 0x54);
+		SetPDTEntry(m_registers, 1, 1, SIM_F55_QUERY_BASE, SIM_F55_DATA_BASE,
+				SIM_F55_CONTROL_BASE, SIM_F55_DATA_BASE, 0, 0, 0x55);
+		SetPDTEntry(m_registers, 1, 2, 0, 0, 0, 0, 0, 0, 0);
+	}
+
+	SetRegisterByte(SIM_F01_DATA_BASE, m_blMode ? SIM_F01_STATUS_BOOTLOADER : 0);
+}
+
+void SimDevice::SetupF34Registers()
+{
+	unsigned char bootloaderID[2] = { (unsigned char)m_config.blMinor,
+					(unsigned char)m_config.blVersion };
+	unsigned short blockSize = m_config.blockSize;
+	unsigned char buf[21];
+
+	memset(buf, 0, sizeof(buf));
+
+	if (m_config.blVersion == 5) {
+		buf[0] = SIM_F34_V5_HAS_CONFIG_ID;
+		buf[1] = blockSize & 0xFF;
+		buf[2] = blockSize >> 8;
+		buf[3] = m_config.fwBlocks & 0xFF;
+		buf[4] = m_config.fwBlocks >> 8;
+		buf[5] = m_config.configBlocks & 0xFF;
+		buf[6] = m_config.configBlocks >> 8;
+		SetRegisterByte(SIM_F34_QUERY_BASE, bootloaderID[0]);
+		SetRegisterByte(SIM_F34_QUERY_BASE + 1, bootloaderID[1]);
+		for (unsigned int i = 0; i < 7; ++i)
+			SetRegisterByte(SIM_F34_QUERY_BASE + 2 + i, buf[i]);
+
+		// Block number, block data and then the flash control register
+		m_f34CommandAddr = SIM_F34_DATA_BASE + 2 + blockSize;
+		m_f34PayloadAddr = 0;
+	} else if (m_config.blVersion == 6) {
+		SetRegister(SIM_F34_QUERY_BASE, bootloaderID, sizeof(bootloaderID));
+		SetRegisterByte(SIM_F34_QUERY_BASE + 1, SIM_F34_V5_HAS_CONFIG_ID);
+		buf[0] = blockSize & 0xFF;
+		buf[1] = blockSize >> 8;
+		SetRegister(SIM_F34_QUERY_BASE + 2, buf, 2);
+		buf[0] = m_config.fwBlocks & 0xFF;
+		buf[1] = m_config.fwBlocks >> 8;
+		buf[2] = m_config.configBlocks & 0xFF;
+		buf[3] = m_config.configBlocks >> 8;
+		SetRegister(SIM_F34_QUERY_BASE + 3, buf, 8);
+
+		memset(buf, 0, sizeof(buf));
+		SetRegister(SIM_F34_DATA_BASE, buf, 2);
+		std::vector<unsigned char> blockData(blockSize);
+		SetRegister(SIM_F34_DATA_BASE + 1, &blockData[0], blockData.size());
+		m_f34CommandAddr = SIM_F34_DATA_BASE + 2;
+		m_f34PayloadAddr = 0;
+	} else {
+		unsigned short flashConfigBlocks = m_partitions[SIM_PARTITION_FLASH_CONFIG].size()
+							/ blockSize;
+		unsigned int partitions = SIM_F34_V7_HAS_BOOTLOADER | SIM_F34_V7_HAS_FLASH_CONFIG
+						| SIM_F34_V7_HAS_CORE_CODE | SIM_F34_V7_HAS_CORE_CONFIG;
+
+		if (m_partitions.count(SIM_PARTITION_FLD))
+			partitions |= SIM_F34_V7_HAS_FLD;
+
+		SetRegisterByte(SIM_F34_QUERY_BASE, SIM_F34_V7_HAS_CONFIG_ID);
+		buf[0] = bootloaderID[0];
+		buf[1] = bootloaderID[1];
+		buf[2] = m_config.buildID & 0xFF;
+		buf[3] = (m_config.buildID >> 8) & 0xFF;
+		buf[4] = (m_config.buildID >> 16) & 0xFF;
+		buf[5] = (m_config.buildID >> 24) & 0xFF;
+		buf[6] = 1;
+		buf[7] = blockSize & 0xFF;
+		buf[8] = blockSize >> 8;
+		buf[13] = flashConfigBlocks & 0xFF;
+		buf[14] = flashConfigBlocks >> 8;
+		buf[15] = m_config.payloadBlocks & 0xFF;
+		buf[16] = m_config.payloadBlocks >> 8;
+		buf[17] = partitions & 0xFF;
+		buf[18] = (partitions >> 8) & 0xFF;
+		SetRegister(SIM_F34_QUERY_BASE + 1, buf, sizeof(buf));
+		memset(buf, 0, sizeof(buf));
+		SetRegister(SIM_F34_QUERY_BASE + 9, buf, 2);
+
+		SetRegister(SIM_F34_V7_BLOCK_OFFSET, buf, 2);
+		SetRegister(SIM_F34_V7_TRANSFER_LENGTH, buf, 2);
+		m_f34CommandAddr = SIM_F34_V7_COMMAND;
+		m_f34PayloadAddr = SIM_F34_V7_PAYLOAD;
+	}
+
+	UpdateF34Status(false);
+}
+
+// Flash starts out erased apart from the v7 partition table
+void SimDevice::SetupPartitions()
+{
+	std::vector<std::pair<unsigned short, unsigned int> > table;
+	unsigned int blockSize = m_config.blockSize;
+	unsigned int flashConfigBlocks;
+	unsigned int offset = SIM_PARTITION_TABLE_OFFSET;
+	unsigned int addr = SIM_PARTITION_START_BLOCK;
+
+	m_partitions.clear();
+	m_partitions[SIM_PARTITION_CORE_CODE].assign(m_config.fwBlocks * blockSize, 0xFF);
+	m_partitions[SIM_PARTITION_CORE_CONFIG].assign(m_config.configBlocks * blockSize, 0xFF);
+	if (m_config.blVersion < 7)
+		return;
+
+	if (m_config.blVersion >= 10)
+		m_partitions[SIM_PARTITION_FLD].assign(m_config.fldBlocks * blockSize, 0xFF);
+
+	table.push_back(std::make_pair(SIM_PARTITION_CORE_CODE, m_config.fwBlocks));
+	table.push_back(std::make_pair(SIM_PARTITION_CORE_CONFIG, m_config.configBlocks));
+	if (m_config.blVersion >= 10)
+		table.push_back(std::make_pair(SIM_PARTITION_FLD, m_config.fldBlocks));
+
+	// The table ends with an empty entry
+	flashConfigBlocks = (SIM_PARTITION_TABLE_OFFSET + (table.size() + 2)
+				* SIM_PARTITION_ENTRY_SIZE + blockSize - 1) / blockSize;
+	flashConfigBlocks = std::max(flashConfigBlocks, m_config.flashConfigBlocks);
+	table.push_back(std::make_pair(SIM_PARTITION_FLASH_CONFIG, flashConfigBlocks));
+
+	std::vector<unsigned char> &config = m_partitions[SIM_PARTITION_FLASH_CONFIG];
+	config.assign(flashConfigBlocks * blockSize, 0);
+	for (size_t i = 0; i < table.size(); ++i) {
+		config[offset++] = table[i].first & 0xFF;
+		config[offset++] = table[i].first >> 8;
+		config[offset++] = table[i].second & 0xFF;
+		config[offset++] = table[i].second >> 8;
+		config[offset++] = addr & 0xFF;
+		config[offset++] = (addr >> 8) & 0xFF;
+		offset += 2;
+		addr += table[i].second;
+	}
+}
+
+unsigned short SimDevice::AccessRegisters(unsigned short addr, unsigned char *buf,
+						unsigned short len, bool write)
+{
+	unsigned int reg = addr;
+	unsigned int offset = 0;
+
+	while (offset < len && reg <= 0xFFFF) {
+		std::map<unsigned short, std::vector<unsigned char> >::iterator it;
+		unsigned int count;
+
+		// FIFOs take every remaining byte of the transfer
+		if (m_f34PayloadAddr && reg == m_f34PayloadAddr) {
+			if (write) {
+				m_payload.insert(m_payload.end(), buf + offset, buf + len);
+			} else {
+				count = std::min((size_t)(len - offset), m_readFifo.size());
+				memcpy(buf + offset, &m_readFifo[0], count);
+				memset(buf + offset + count, 0, len - offset - count);
+				m_readFifo.erase(m_readFifo.begin(), m_readFifo.begin() + count);
+			}
+			return reg;
+		}
+
+		if (reg == SIM_F54_REPORT_DATA && !m_blMode) {
+			if (!write)
+				ReadF54Report(buf + offset, len - offset);
+			return reg;
+		}
+
+		it = m_registers.find(reg);
+		if (it == m_registers.end()) {
+			if (write)
+				m_registers[reg].assign(1, buf[offset]);
+			else
+				buf[offset] = 0;
+			count = 1;
+		} else {
+			count = std::min((size_t)(len - offset), it->second.size());
+			if (write)
+				memcpy(&it->second[0], buf + offset, count);
+			else
+				memcpy(buf + offset, &it->second[0], count);
+		}
+
+		offset += count;
+		++reg;
+	}
+
+	if (!write && offset < len)
+		memset(buf + offset, 0, len - offset);
+
+	return reg - 1;
+}
+
+/*
+ * Transactions cost the configured latency, plus jitter, once per round
+ * of pipelined read requests, and the per byte cost of the data.
+ */
+void SimDevice::Delay(unsigned short len, bool read)
+{
+	unsigned long requests = 1;
+	unsigned long rounds;
+	unsigned long us = 0;
+	struct timespec deadline;
+
+	if (read && m_bytesPerReadRequest > 0)
+		requests = (len + m_bytesPerReadRequest - 1) / m_bytesPerReadRequest;
+	rounds = (requests + m_readPipelineDepth - 1) / m_readPipelineDepth;
+	m_roundTrips += rounds;
+
+	for (unsigned long i = 0; i < rounds; ++i) {
+		us += m_config.latencyUs;
+		if (m_config.jitterUs)
+			us += rand_r(&m_seed) % (m_config.jitterUs + 1);
+	}
+	us += (unsigned long)len * m_config.byteNs / 1000;
+
+	if (!us)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	timespec_add_us(&deadline, us);
+	SleepUntil(&deadline);
+}
+
+void SimDevice::SleepUntil(const struct timespec *deadline)
+{
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) == EINTR) {
+		if (m_bCancel)
+			return;
+	}
+}
+
+void SimDevice::StartOperation(enum sim_operation op, unsigned long us)
+{
+	m_op = op;
+	clock_gettime(CLOCK_MONOTONIC, &m_opDeadline);
+	timespec_add_us(&m_opDeadline, us);
+}
+
+void SimDevice::UpdateOperation()
+{
+	struct timespec now;
+	enum sim_operation op = m_op;
+
+	if (op == SIM_OP_NONE)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (timespec_before(&now, &m_opDeadline))
+		return;
+
+	m_op = SIM_OP_NONE;
+	if (op == SIM_OP_F34) {
+		CompleteF34();
+		RaiseInterrupt(SIM_F34_IRQ, &m_opDeadline);
+	} else {
+		CompleteF54();
+		RaiseInterrupt(SIM_F54_IRQ, &m_opDeadline);
+	}
+}
+
+// The device does not take new transfers until the current operation is done
+void SimDevice::WaitForOperation()
+{
+	if (m_op == SIM_OP_NONE)
+		return;
+
+	SleepUntil(&m_opDeadline);
+	UpdateOperation();
+}
+
+void SimDevice::RaiseInterrupt(unsigned char interrupts, const struct timespec *when)
+{
+	struct sim_attention attn;
+
+	SetRegisterByte(SIM_F01_DATA_BASE + 1, GetRegisterByte(SIM_F01_DATA_BASE + 1) | interrupts);
+
+	if (!m_config.attention || !(interrupts & GetRegisterByte(SIM_F01_CONTROL_BASE + 1)))
+		return;
+
+	attn.time = *when;
+	timespec_add_us(&attn.time, m_config.attnDelayUs);
+	attn.interrupts = interrupts;
+	m_attnQueue.push_back(attn);
+}
+
+int SimDevice::Read(unsigned short addr, unsigned char *buf, unsigned short len)
+{
+	unsigned short last;
+
+	if (!m_deviceOpen)
+		return -1;
+
+	if (m_registerCache.Lookup(addr, buf, len))
+		return len;
+
+	Delay(len, true);
+	UpdateOperation();
+
+	last = AccessRegisters(addr, buf, len, false);
+
+	// Reading the interrupt status clears it
+	if (addr <= SIM_F01_DATA_BASE + 1 && SIM_F01_DATA_BASE + 1 <= last)
+		SetRegisterByte(SIM_F01_DATA_BASE + 1, 0);
+
+	if (m_hasDebug) {
+		fprintf(stdout, "R %04x : ", addr);
+		print_buffer(buf, len);
+	}
+
+	m_registerCache.Update(addr, buf, len, false);
+
+	return len;
+}
+
+int SimDevice::Write(unsigned short addr, const unsigned char *buf, unsigned short len)
+{
+	unsigned short last;
+
+	if (!m_deviceOpen)
+		return -1;
+
+	if (m_config.maxWrite && len > m_config.maxWrite)
+		return -1;
+
+	if (m_hasDebug) {
+		fprintf(stdout, "W %04x : ", addr);
+		print_buffer(buf, len);
+	}
+
+	Delay(len, false);
+	WaitForOperation();
+
+	if (!m_payloadActive)
+		m_payload.clear();
+
+	last = AccessRegisters(addr, (unsigned char *)buf, len, true);
+	HandleWrite(addr, last);
+	UpdateOperation();
+
+	m_registerCache.Update(addr, buf, len, true);
+
+	return len;
+}
+
+void SimDevice::HandleWrite(unsigned short first, unsigned short last)
+{
+	if (first <= SIM_F01_COMMAND_BASE && SIM_F01_COMMAND_BASE <= last
+		&& (GetRegisterByte(SIM_F01_COMMAND_BASE) & SIM_F01_CMD_RESET)) {
+		ResetDevice();
+		return;
+	}
+
+	if (first <= m_f34CommandAddr && m_f34CommandAddr <= last) {
+		if (m_config.blVersion >= 7)
+			ExecuteF34V7Command();
+		else
+			ExecuteF34Command();
+	}
+
+	if (!m_blMode && first <= SIM_F54_COMMAND_BASE && SIM_F54_COMMAND_BASE <= last)
+		ExecuteF54Command();
+
+	if (m_payloadActive && m_payload.size() >= m_payloadExpected) {
+		unsigned long blocks = m_payloadExpected / m_config.blockSize;
+
+		m_payloadActive = false;
+		StartOperation(SIM_OP_F34, blocks * m_config.blockUs);
+	}
+}
+
+void SimDevice::ResetDevice()
+{
+	struct timespec now;
+
+	PowerOn(false);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	RaiseInterrupt(SIM_F01_IRQ, &now);
+}
+
+void SimDevice::UpdateF34Status(bool busy)
+{
+	unsigned char command = busy ? m_f34Command : 0;
+	unsigned char status = busy ? 0 : m_f34Result;
+
+	if (m_config.blVersion == 5) {
+		SetRegisterByte(m_f34CommandAddr, (m_blMode ? SIM_F34_V5_ENABLED : 0)
+						| (status << 4) | command);
+	} else if (m_config.blVersion == 6) {
+		SetRegisterByte(m_f34CommandAddr, command);
+		SetRegisterByte(m_f34CommandAddr + 1, (m_blMode ? SIM_F34_V5_ENABLED : 0) | status);
+	} else {
+		SetRegisterByte(SIM_F34_V7_COMMAND, command);
+		SetRegisterByte(SIM_F34_V7_STATUS, (m_blMode ? SIM_F34_V7_IN_BOOTLOADER : 0)
+						| status);
+	}
+}
+
+/* v5 and v6 bootloaders take one block at a time through the data registers */
+void SimDevice::ExecuteF34Command()
+{
+	unsigned short blockData = SIM_F34_DATA_BASE + (m_config.blVersion == 5 ? 2 : 1);
+	unsigned char key[2];
+	unsigned long us = 0;
+
+	m_f34Command = GetRegisterByte(m_f34CommandAddr) & 0x0F;
+	m_f34Result = 0;
+	AccessRegisters(blockData, key, sizeof(key), false);
+
+	switch (m_f34Command) {
+	case SIM_F34_V5_CMD_ENABLE_PROG:
+	case SIM_F34_V5_CMD_ERASE_ALL:
+		if (key[0] != m_config.blMinor || key[1] != m_config.blVersion)
+			m_f34Result = SIM_F34_V5_STATUS_BAD_KEY;
+		else if (m_f34Command == SIM_F34_V5_CMD_ENABLE_PROG)
+			us = m_config.enterBLMs * 1000;
+		else if (!m_blMode)
+			m_f34Result = SIM_F34_V5_STATUS_INVALID_CMD;
+		else
+			us = m_config.eraseMs * 1000;
+		break;
+	case SIM_F34_V5_CMD_WRITE_FW:
+	case SIM_F34_V5_CMD_WRITE_CONFIG:
+	case SIM_F34_V5_CMD_WRITE_LOCKDOWN:
+		if (!m_blMode)
+			m_f34Result = SIM_F34_V5_STATUS_INVALID_CMD;
+		else
+			us = m_config.blockUs;
+		break;
+	default:
+		m_f34Result = SIM_F34_V5_STATUS_INVALID_CMD;
+		break;
+	}
+
+	UpdateF34Status(true);
+	StartOperation(SIM_OP_F34, us);
+}
+
+/*
+ * v7 and later bootloaders transfer whole partitions. The command takes
+ * the partition, block offset and transfer length from the registers
+ * before it, and the payload register is a FIFO.
+ */
+void SimDevice::ExecuteF34V7Command()
+{
+	unsigned char partition = GetRegisterByte(SIM_F34_V7_PARTITION);
+	unsigned int offset = GetRegisterShort(SIM_F34_V7_BLOCK_OFFSET);
+	unsigned int length = GetRegisterShort(SIM_F34_V7_TRANSFER_LENGTH);
+	std::map<unsigned short, std::vector<unsigned char> >::iterator it;
+	unsigned long us = 0;
+
+	m_f34Command = GetRegisterByte(SIM_F34_V7_COMMAND);
+	m_f34Result = SIM_F34_V7_SUCCESS;
+	if (m_f34Command == SIM_F34_V7_CMD_IDLE)
+		return;
+
+	it = m_partitions.find(partition);
+
+	// The partition table can be read before entering the bootloader
+	if (m_f34Command != SIM_F34_V7_CMD_ENTER_BL && !m_blMode
+		&& !(m_f34Command == SIM_F34_V7_CMD_READ && partition == SIM_PARTITION_FLASH_CONFIG)) {
+		m_f34Result = SIM_F34_V7_NOT_IN_BOOTLOADER;
+	} else {
+		switch (m_f34Command) {
+		case SIM_F34_V7_CMD_ENTER_BL:
+		case SIM_F34_V7_CMD_ERASE:
+		case SIM_F34_V7_CMD_ERASE_AP:
+			// The bootloader ID follows the command as the payload
+			if (m_payload.size() < 2 || m_payload[0] != m_config.blMinor
+				|| m_payload[1] != m_config.blVersion)
+				m_f34Result = SIM_F34_V7_BAD_KEY;
+			else if (m_f34Command == SIM_F34_V7_CMD_ENTER_BL)
+				us = m_config.enterBLMs * 1000;
+			else if (it == m_partitions.end())
+				m_f34Result = SIM_F34_V7_INVALID_PARTITION;
+			else
+				us = m_config.eraseMs * 1000;
+			break;
+		case SIM_F34_V7_CMD_WRITE:
+		case SIM_F34_V7_CMD_READ:
+			if (it == m_partitions.end()) {
+				m_f34Result = SIM_F34_V7_INVALID_PARTITION;
+				break;
+			} else if (offset * m_config.blockSize > it->second.size()) {
+				m_f34Result = SIM_F34_V7_INVALID_OFFSET;
+				break;
+			} else if ((offset + length) * m_config.blockSize > it->second.size()) {
+				m_f34Result = SIM_F34_V7_INVALID_TRANSFER;
+				break;
+			} else if (m_f34Command == SIM_F34_V7_CMD_READ) {
+				break;
+			}
+			// fall through
+		case SIM_F34_V7_CMD_SIGNATURE:
+			// Runs once the payload has been written
+			m_payload.clear();
+			m_payloadActive = true;
+			m_payloadExpected = length * m_config.blockSize;
+			UpdateF34Status(true);
+			return;
+		case SIM_F34_V7_CMD_SENSOR_ID:
+			break;
+		default:
+			m_f34Result = SIM_F34_V7_INVALID_COMMAND;
+			break;
+		}
+	}
+
+	UpdateF34Status(true);
+	StartOperation(SIM_OP_F34, us);
+}
+
+void SimDevice::CompleteF34()
+{
+	std::map<unsigned short, std::vector<unsigned char> >::iterator it;
+	unsigned int blockSize = m_config.blockSize;
+
+	if (m_f34Result) {
+		m_payload.clear();
+		UpdateF34Status(false);
+		return;
+	}
+
+	if (m_config.blVersion < 7) {
+		bool v5 = m_config.blVersion == 5;
+		unsigned short blockNumber = GetRegisterShort(SIM_F34_DATA_BASE);
+		unsigned char buf[2] = { 0, 0 };
+		std::vector<unsigned char> block(blockSize);
+
+		switch (m_f34Command) {
+		case SIM_F34_V5_CMD_ENABLE_PROG:
+			m_blMode = true;
+			SetupPDT();
+			break;
+		case SIM_F34_V5_CMD_ERASE_ALL:
+			for (it = m_partitions.begin(); it != m_partitions.end(); ++it)
+				std::fill(it->second.begin(), it->second.end(), 0xFF);
+			break;
+		case SIM_F34_V5_CMD_WRITE_FW:
+		case SIM_F34_V5_CMD_WRITE_CONFIG:
+		case SIM_F34_V5_CMD_WRITE_LOCKDOWN:
+			AccessRegisters(SIM_F34_DATA_BASE + (v5 ? 2 : 1), &block[0], blockSize, false);
+			it = m_partitions.find(m_f34Command == SIM_F34_V5_CMD_WRITE_FW ?
+						SIM_PARTITION_CORE_CODE : SIM_PARTITION_CORE_CONFIG);
+			if (m_f34Command != SIM_F34_V5_CMD_WRITE_LOCKDOWN) {
+				if ((blockNumber + 1) * blockSize > it->second.size()) {
+					m_f34Result = SIM_F34_V5_STATUS_INVALID_BLOCK;
+					break;
+				}
+				std::copy(block.begin(), block.end(),
+					it->second.begin() + blockNumber * blockSize);
+			}
+
+			// The block number advances after each block
+			++blockNumber;
+			buf[0] = blockNumber & 0xFF;
+			buf[1] = blockNumber >> 8;
+			AccessRegisters(SIM_F34_DATA_BASE, buf, sizeof(buf), true);
+			break;
+		}
+	} else {
+		unsigned int offset = GetRegisterShort(SIM_F34_V7_BLOCK_OFFSET);
+		unsigned int length = GetRegisterShort(SIM_F34_V7_TRANSFER_LENGTH);
+		unsigned char buf[2];
+
+		it = m_partitions.find(GetRegisterByte(SIM_F34_V7_PARTITION));
+
+		switch (m_f34Command) {
+		case SIM_F34_V7_CMD_ENTER_BL:
+			m_blMode = true;
+			SetupPDT();
+			break;
+		case SIM_F34_V7_CMD_ERASE_AP:
+			std::fill(m_partitions[SIM_PARTITION_CORE_CODE].begin(),
+				m_partitions[SIM_PARTITION_CORE_CODE].end(), 0xFF);
+			std::fill(m_partitions[SIM_PARTITION_CORE_CONFIG].begin(),
+				m_partitions[SIM_PARTITION_CORE_CONFIG].end(), 0xFF);
+			break;
+		case SIM_F34_V7_CMD_ERASE:
+			std::fill(it->second.begin(), it->second.end(), 0xFF);
+			break;
+		case SIM_F34_V7_CMD_WRITE:
+		case SIM_F34_V7_CMD_READ:
+			if (m_f34Command == SIM_F34_V7_CMD_WRITE)
+				std::copy(m_payload.begin(), m_payload.begin() + length * blockSize,
+					it->second.begin() + offset * blockSize);
+			else
+				m_readFifo.assign(it->second.begin() + offset * blockSize,
+					it->second.begin() + (offset + length) * blockSize);
+
+			// The block offset advances after each transfer
+			offset += length;
+			buf[0] = offset & 0xFF;
+			buf[1] = offset >> 8;
+			SetRegister(SIM_F34_V7_BLOCK_OFFSET, buf, sizeof(buf));
+			break;
+		}
+	}
+
+	m_payload.clear();
+	UpdateF34Status(false);
+}
+
+void SimDevice::ExecuteF54Command()
+{
+	m_f54Command = GetRegisterByte(SIM_F54_COMMAND_BASE);
+	if (!m_f54Command)
+		return;
+
+	StartOperation(SIM_OP_F54, m_config.frameMs * 1000UL);
+}
+
+// The command register reads back non zero until the command completes
+void SimDevice::CompleteF54()
+{
+	if (m_f54Command & SIM_F54_CMD_GET_REPORT)
+		GenerateF54Report(GetRegisterByte(SIM_F54_DATA_BASE));
+	SetRegisterByte(SIM_F54_COMMAND_BASE, 0);
+}
+
+void SimDevice::GenerateF54Report(unsigned char reportType)
+{
+	unsigned int pixels = m_config.txElectrodes * m_config.rxElectrodes;
+	int value;
+
+	m_f54Report.clear();
+
+	switch (reportType) {
+	case 1:		/* 8 bit image */
+		for (unsigned int i = 0; i < pixels; ++i)
+			m_f54Report.push_back(rand_r(&m_seed) % SIM_F54_NOISE);
+		break;
+	case 2:		/* 16 bit delta image */
+	case 3:		/* raw 16 bit image */
+	case 9:		/* true baseline */
+	case 19:	/* full raw capacitance */
+	case 20:
+	case 22:	/* sensor speed */
+	case 23:	/* ADC range */
+		for (unsigned int i = 0; i < pixels; ++i) {
+			value = rand_r(&m_seed) % (2 * SIM_F54_NOISE + 1) - SIM_F54_NOISE;
+			if (reportType != 2)
+				value += SIM_F54_BASELINE;
+			m_f54Report.push_back(value & 0xFF);
+			m_f54Report.push_back((value >> 8) & 0xFF);
+		}
+		break;
+	case 38:	/* absolute raw capacitance */
+	case 40:	/* absolute delta capacitance */
+		for (unsigned int i = 0; i < m_config.txElectrodes + m_config.rxElectrodes; ++i) {
+			value = rand_r(&m_seed) % (2 * SIM_F54_NOISE + 1) - SIM_F54_NOISE;
+			if (reportType == 38)
+				value += SIM_F54_BASELINE;
+			for (unsigned int j = 0; j < 4; ++j)
+				m_f54Report.push_back((value >> (8 * j)) & 0xFF);
+		}
+		break;
+	default:
+		/* Test reports are all zeros, meaning no faults */
+		break;
+	}
+}
+
+// Reads from the report index, which advances past the bytes read
+void SimDevice::ReadF54Report(unsigned char *buf, unsigned short len)
+{
+	unsigned int index = GetRegisterByte(SIM_F54_REPORT_INDEX)
+				| (GetRegisterByte(SIM_F54_REPORT_INDEX + 1) << 8);
+
+	for (unsigned short i = 0; i < len; ++i, ++index)
+		buf[i] = index < m_f54Report.size() ? m_f54Report[index] : 0;
+
+	SetRegisterByte(SIM_F54_REPORT_INDEX, index & 0xFF);
+	SetRegisterByte(SIM_F54_REPORT_INDEX + 1, (index >> 8) & 0xFF);
+}
+
+int SimDevice::WaitForAttention(struct timeval * timeout, unsigned int source_mask)
+{
+	return GetAttentionReport(timeout, source_mask, NULL, NULL);
+}
+
+int SimDevice::GetAttentionReport(struct timeval * timeout, unsigned int source_mask,
+					unsigned char *buf, unsigned int *len)
+{
+	struct timespec deadline;
+	struct timespec now;
+	struct timespec next;
+
+	if (!m_deviceOpen)
+		return -1;
+
+	if (timeout)
+		deadline_from_timeval(timeout, &deadline);
+
+	for (;;) {
+		bool haveNext = false;
+
+		if (m_bCancel)
+			return -ECANCELED;
+
+		UpdateOperation();
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		while (!m_attnQueue.empty() && !timespec_before(&now, &m_attnQueue.front().time)) {
+			struct sim_attention attn = m_attnQueue.front();
+
+			m_attnQueue.pop_front();
+			if (!(attn.interrupts & source_mask))
+				continue;
+
+			if (buf && len) {
+				if (*len >= SIM_INPUT_REPORT_SIZE) {
+					*len = SIM_INPUT_REPORT_SIZE;
+					memset(buf, 0, SIM_INPUT_REPORT_SIZE);
+					buf[0] = SIM_ATTN_REPORT_ID;
+					buf[1] = attn.interrupts;
+					buf[2] = GetRegisterByte(SIM_F01_DATA_BASE);
+				} else {
+					*len = 0;
+				}
+			}
+			if (timeout)
+				deadline_remaining(&deadline, timeout);
+			return SIM_INPUT_REPORT_SIZE;
+		}
+
+		if (!m_attnQueue.empty()) {
+			next = m_attnQueue.front().time;
+			haveNext = true;
+		} else if (m_op != SIM_OP_NONE) {
+			next = m_opDeadline;
+			haveNext = true;
+		}
+
+		if (timeout) {
+			if (!timespec_before(&now, &deadline)) {
+				deadline_remaining(&deadline, timeout);
+				return -ETIMEDOUT;
+			}
+			if (!haveNext || timespec_before(&deadline, &next)) {
+				next = deadline;
+				haveNext = true;
+			}
+		}
+
+		// Nothing is going to happen, only wake up to check for Cancel()
+		if (!haveNext) {
+			next = now;
+			timespec_add_us(&next, SIM_IDLE_WAIT_MS * 1000);
+		}
+
+		SleepUntil(&next);
+	}
+}
@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SIMDEVICE_H_
+#define _SIMDEVICE_H_
+
+#include <time.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "rmidevice.h"
+
+struct sim_device_config {
+	unsigned int blVersion;		// 5, 6, 7, 8 or 10
+	unsigned int blMinor;
+	enum RMIDeviceType type;
+	std::string productID;
+	unsigned int buildID;
+	unsigned int configID;
+	unsigned int blockSize;
+	unsigned int fwBlocks;
+	unsigned int configBlocks;
+	unsigned int flashConfigBlocks;
+	unsigned int fldBlocks;
+	unsigned int payloadBlocks;
+	unsigned int txElectrodes;
+	unsigned int rxElectrodes;
+	unsigned int latencyUs;		// Cost of each transaction
+	unsigned int jitterUs;		// Random extra cost of each transaction
+	unsigned int byteNs;		// Cost of each byte transferred
+	unsigned int maxWrite;		// Largest write, 0 for no limit
+	unsigned int attention;		// Send attention reports
+	unsigned int attnDelayUs;	// From completing an operation to its attention report
+	unsigned int enterBLMs;
+	unsigned int eraseMs;
+	unsigned int blockUs;		// Time to program one flash block
+	unsigned int frameMs;		// Time to acquire one F54 report
+	unsigned int seed;
+	unsigned int stats;		// Print the number of round trips on close
+};
+
+struct sim_attention {
+	struct timespec time;
+	unsigned char interrupts;
+};
+
+enum sim_operation {
+	SIM_OP_NONE = 0,
+	SIM_OP_F34,
+	SIM_OP_F54,
+};
+
+/*
+ * RMI4 device emulated in memory for testing the tools without hardware.
+ * It has F01 and F34 on page 0 and F54 and F55 on page 1. F34 implements
+ * the v5/v6 block based bootloaders or the v7, v8 and v10 partition based
+ * ones. Flash and F54 commands complete after a configurable time, and a
+ * configurable latency is added to each transaction.
+ *
+ * Open() takes a comma separated list of key=value options in place of a
+ * device file, for example "bl=6,latency_us=200,erase_ms=1500". See
+ * README for the list of options.
+ */
+class SimDevice : public RMIDevice
+{
+public:
+	SimDevice() : RMIDevice(), m_deviceOpen(false), m_blMode(false), m_f34CommandAddr(0),
+		      m_f34PayloadAddr(0), m_op(SIM_OP_NONE), m_f34Command(0), m_f34Result(0),
+		      m_f54Command(0), m_payloadActive(false), m_payloadExpected(0), m_seed(0),
+		      m_roundTrips(0)
+	{ m_opDeadline.tv_sec = 0; m_opDeadline.tv_nsec = 0; }
+	virtual int Open(const char * filename);
+	virtual int Read(unsigned short addr, unsigned char *buf,
+				unsigned short len);
+	virtual int Write(unsigned short addr, const unsigned char *buf,
+				 unsigned short len);
+	virtual int ToggleInterruptMask(bool enable) { return 0; }
+	virtual int WaitForAttention(struct timeval * timeout = NULL,
+					unsigned int source_mask = RMI_INTERUPT_SOURCES_ALL_MASK);
+	virtual int GetAttentionReport(struct timeval * timeout, unsigned int source_mask,
+					unsigned char *buf, unsigned int *len);
+	virtual void Close();
+	virtual void RebindDriver();
+	virtual bool CheckABSEvent() { return m_deviceOpen; }
+	virtual unsigned short GetMaxWriteSize() { return m_config.maxWrite; }
+	~SimDevice() { Close(); }
+
+	virtual void PrintDeviceInfo();
+
+	// Opens a device with the default options and the requested type
+	virtual bool FindDevice(enum RMIDeviceType type = RMI_DEVICE_TYPE_ANY);
+
+private:
+	bool m_deviceOpen;
+	struct sim_device_config m_config;
+
+	// Registers are one byte wide unless set wider with SetRegister()
+	std::map<unsigned short, std::vector<unsigned char> > m_registers;
+	std::map<unsigned short, std::vector<unsigned char> > m_partitions;
+	bool m_blMode;
+	unsigned short m_f34CommandAddr;
+	unsigned short m_f34PayloadAddr;
+
+	enum sim_operation m_op;
+	struct timespec m_opDeadline;
+	unsigned char m_f34Command;
+	unsigned char m_f34Result;
+	unsigned char m_f54Command;
+
+	std::vector<unsigned char> m_payload;
+	bool m_payloadActive;
+	size_t m_payloadExpected;
+	std::vector<unsigned char> m_readFifo;
+	std::vector<unsigned char> m_f54Report;
+
+	std::deque<struct sim_attention> m_attnQueue;
+	unsigned int m_seed;
+	unsigned long m_roundTrips;
+
+	static void SetDefaultConfig(struct sim_device_config &config);
+	static int ParseSpec(const char *spec, struct sim_device_config &config);
+
+	void PowerOn(bool resetFlash);
+	void SetupPDT();
+	void SetupF34Registers();
+	void SetupPartitions();
+	void SetRegister(unsigned short addr, const unsigned char *data, size_t len);
+	void SetRegisterByte(unsigned short addr, unsigned char value);
+	unsigned char GetRegisterByte(unsigned short addr);
+	unsigned short GetRegisterShort(unsigned short addr);
+	unsigned short AccessRegisters(unsigned short addr, unsigned char *buf, unsigned short len,
+					bool write);
+
+	void Delay(unsigned short len, bool read);
+	void SleepUntil(const struct timespec *deadline);
+	void StartOperation(enum sim_operation op, unsigned long us);
+	void UpdateOperation();
+	void WaitForOperation();
+	void RaiseInterrupt(unsigned char interrupts, const struct timespec *when);
+
+	void HandleWrite(unsigned short first, unsigned short last);
+	void ResetDevice();
+	void ExecuteF34Command();
+	void ExecuteF34V7Command();
+	void CompleteF34();
+	void UpdateF34Status(bool busy);
+	void ExecuteF54Command();
+	void CompleteF54();
+	void GenerateF54Report(unsigned char reportType);
+	void ReadF54Report(unsigned char *buf, unsigned short len);
+};
+
+#endif /* _SIMDEVICE_H_ */
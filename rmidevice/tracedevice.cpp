@@ -0,0 +1,355 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "tracedevice.h"
+
+static void put_short(unsigned char *buf, unsigned short value)
+{
+	buf[0] = value & 0xFF;
+	buf[1] = (value >> 8) & 0xFF;
+}
+
+static void put_long(unsigned char *buf, unsigned long value)
+{
+	put_short(buf, value & 0xFFFF);
+	put_short(buf + 2, (value >> 16) & 0xFFFF);
+}
+
+int trace_write_record(FILE *fp, const struct trace_record *record, const unsigned char *data)
+{
+	unsigned char buf[TRACE_RECORD_SIZE];
+
+	buf[0] = record->type;
+	buf[1] = 0;
+	put_short(&buf[2], record->arg);
+	put_long(&buf[4], record->start);
+	put_long(&buf[8], record->duration);
+	put_long(&buf[12], (unsigned long)record->rc);
+	put_short(&buf[16], record->len);
+
+	if (fwrite(buf, sizeof(buf), 1, fp) != 1)
+		return -1;
+	if (record->len && fwrite(data, record->len, 1, fp) != 1)
+		return -1;
+
+	return 0;
+}
+
+int trace_read_record(FILE *fp, struct trace_record *record, unsigned char *data,
+			unsigned short size)
+{
+	unsigned char buf[TRACE_RECORD_SIZE];
+
+	if (fread(buf, sizeof(buf), 1, fp) != 1)
+		return 0;
+
+	record->type = buf[0];
+	record->reserved = buf[1];
+	record->arg = extract_short(&buf[2]);
+	record->start = extract_long(&buf[4]);
+	record->duration = extract_long(&buf[8]);
+	record->rc = (int)extract_long(&buf[12]);
+	record->len = extract_short(&buf[16]);
+
+	if (record->len > size)
+		return -EINVAL;
+	if (record->len && fread(data, record->len, 1, fp) != 1)
+		return -EINVAL;
+
+	return 1;
+}
+
+int TraceDevice::StartTrace(const char *filename)
+{
+	StopTrace();
+
+	m_fp = fopen(filename, "wb");
+	if (!m_fp)
+		return -1;
+
+	if (fwrite(TRACE_MAGIC, TRACE_MAGIC_SIZE, 1, m_fp) != 1) {
+		StopTrace();
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &m_startTime);
+
+	return 0;
+}
+
+void TraceDevice::StopTrace()
+{
+	if (!m_fp)
+		return;
+
+	if (fclose(m_fp))
+		fprintf(stderr, "Failed to write the trace: %s\n", strerror(errno));
+	m_fp = NULL;
+}
+
+void TraceDevice::Count(enum trace_event_type type, long rc, unsigned short len)
+{
+	switch (type) {
+		case TRACE_EVENT_READ:
+			++m_counters.reads;
+			if (rc > 0)
+				m_counters.readBytes += rc;
+			break;
+		case TRACE_EVENT_WRITE:
+			++m_counters.writes;
+			if (rc > 0)
+				m_counters.writeBytes += rc;
+			break;
+		case TRACE_EVENT_ATTENTION:
+			++m_counters.attentionWaits;
+			if (rc == -ETIMEDOUT)
+				++m_counters.attentionTimeouts;
+			return;
+		default:
+			return;
+	}
+
+	if (rc != len)
+		++m_counters.errors;
+}
+
+void TraceDevice::Record(enum trace_event_type type, unsigned short arg,
+			const struct timespec *start, long rc, const unsigned char *data,
+			unsigned short len)
+{
+	struct trace_record record;
+	struct timespec end;
+
+	Count(type, rc, len);
+	if (!m_fp)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	record.type = type;
+	record.reserved = 0;
+	record.arg = arg;
+	record.start = diff_time(&m_startTime, (struct timespec *)start);
+	record.duration = diff_time((struct timespec *)start, &end);
+	record.rc = rc;
+	record.len = ((rc > 0 || type == TRACE_EVENT_OPEN) && data) ? len : 0;
+
+	if (trace_write_record(m_fp, &record, data) < 0) {
+		fprintf(stderr, "Failed to write the trace, stopping it\n");
+		StopTrace();
+	}
+}
+
+// Replaying has to split writes the way the traced device did
+void TraceDevice::RecordOpen(const struct timespec *start, long rc)
+{
+	unsigned char maxWrite[2];
+
+	put_short(maxWrite, m_device.GetMaxWriteSize());
+	Record(TRACE_EVENT_OPEN, m_deviceType, start, rc, maxWrite, sizeof(maxWrite));
+}
+
+int TraceDevice::Open(const char * filename)
+{
+	struct timespec start;
+	int rc;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	m_device.m_hasDebug = m_hasDebug;
+	rc = m_device.Open(filename);
+	m_deviceType = m_device.GetDeviceType();
+	RecordOpen(&start, rc);
+
+	return rc;
+}
+
+bool TraceDevice::FindDevice(enum RMIDeviceType type)
+{
+	struct timespec start;
+	bool found;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	m_device.m_hasDebug = m_hasDebug;
+	found = m_device.FindDevice(type);
+	m_deviceType = m_device.GetDeviceType();
+	RecordOpen(&start, found ? 0 : -1);
+
+	return found;
+}
+
+void TraceDevice::Close()
+{
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	m_device.Close();
+	RMIDevice::Close();
+	Record(TRACE_EVENT_CLOSE, 0, &start, 0);
+}
+
+int TraceDevice::Read(unsigned short addr, unsigned char *buf, unsigned short len)
+{
+	struct timespec start;
+	int rc;
+
+	if (m_registerCache.Lookup(addr, buf, len))
+		return len;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	m_device.m_hasDebug = m_hasDebug;
+	rc = m_device.Read(addr, buf, len);
+	Record(TRACE_EVENT_READ, addr, &start, rc, buf, len);
+
+	if (rc == len)
+		m_registerCache.Update(addr, buf, len, false);
+
+	return rc;
+}
+
+int TraceDevice::ReadFifo(unsigned short addr, unsigned char *buf, unsigned short len)
+{
+	struct timespec start;
+	int rc;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	m_device.m_hasDebug = m_hasDebug;
+	rc = m_device.ReadFifo(addr, buf, len);
+	Record(TRACE_EVENT_READ, addr, &start, rc, buf, len);
+
+	return rc;
+}
+
+int TraceDevice::Write(unsigned short addr, const unsigned char *buf, unsigned short len)
+{
+	struct timespec start;
+	int rc;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	m_device.m_hasDebug = m_hasDebug;
+	rc = m_device.Write(addr, buf, len);
+	Record(TRACE_EVENT_WRITE, addr, &start, rc, buf, len);
+
+	if (rc == len)
+		m_registerCache.Update(addr, buf, len, true);
+
+	return rc;
+}
+
+int TraceDevice::SetMode(int mode)
+{
+	struct timespec start;
+	int rc;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rc = m_device.SetMode(mode);
+	Record(TRACE_EVENT_SET_MODE, mode, &start, rc);
+	m_registerCache.Flush();
+
+	return rc;
+}
+
+int TraceDevice::ToggleInterruptMask(bool enable)
+{
+	struct timespec start;
+	int rc;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rc = m_device.ToggleInterruptMask(enable);
+	Record(TRACE_EVENT_TOGGLE_INTERRUPT, enable, &start, rc);
+
+	return rc;
+}
+
+int TraceDevice::WaitForAttention(struct timeval * timeout, unsigned int source_mask)
+{
+	return GetAttentionReport(timeout, source_mask, NULL, NULL);
+}
+
+int TraceDevice::GetAttentionReport(struct timeval * timeout, unsigned int source_mask,
+					unsigned char *buf, unsigned int *len)
+{
+	struct timespec start;
+	int rc;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (buf)
+		rc = m_device.GetAttentionReport(timeout, source_mask, buf, len);
+	else
+		rc = m_device.WaitForAttention(timeout, source_mask);
+	Record(TRACE_EVENT_ATTENTION, source_mask, &start, rc, buf, len ? *len : 0);
+
+	return rc;
+}
+
+int TraceDevice::EndWriteBatch()
+{
+	struct timespec start;
+	int rc;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rc = m_device.EndWriteBatch();
+	Record(TRACE_EVENT_END_BATCH, 0, &start, rc);
+	if (rc < 0)
+		m_registerCache.Flush();
+
+	return rc;
+}
+
+void TraceDevice::RebindDriver()
+{
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	m_device.RebindDriver();
+	RMIDevice::Close();
+	m_deviceType = m_device.GetDeviceType();
+	Record(TRACE_EVENT_REBIND, m_deviceType, &start, 0);
+}
+
+// Recorded as a rebind and a check, which is how it is replayed
+bool TraceDevice::Reenumerate(int timeout_ms)
+{
+	struct timespec start;
+	bool found;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	found = m_device.Reenumerate(timeout_ms);
+	RMIDevice::Close();
+	m_deviceType = m_device.GetDeviceType();
+	Record(TRACE_EVENT_REBIND, m_deviceType, &start, 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	Record(TRACE_EVENT_CHECK_ABS, 0, &start, found);
+
+	return found;
+}
+
+bool TraceDevice::CheckABSEvent()
+{
+	struct timespec start;
+	bool rc;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rc = m_device.CheckABSEvent();
+	Record(TRACE_EVENT_CHECK_ABS, 0, &start, rc);
+
+	return rc;
+}
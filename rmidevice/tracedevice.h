@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TRACEDEVICE_H_
+#define _TRACEDEVICE_H_
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "rmidevice.h"
+
+/*
+ * A trace file starts with TRACE_MAGIC followed by one record per call
+ * made on the device. Each record is a struct trace_record, in little
+ * endian, followed by len bytes of data.
+ */
+#define TRACE_MAGIC			"RMI4TRC1"
+#define TRACE_MAGIC_SIZE		8
+#define TRACE_RECORD_SIZE		18
+
+enum trace_event_type {
+	TRACE_EVENT_OPEN = 1,		// arg: device type, data: largest write
+	TRACE_EVENT_CLOSE,
+	TRACE_EVENT_READ,		// arg: address, data: registers read
+	TRACE_EVENT_WRITE,		// arg: address, data: registers written
+	TRACE_EVENT_SET_MODE,		// arg: mode
+	TRACE_EVENT_TOGGLE_INTERRUPT,	// arg: enable
+	TRACE_EVENT_ATTENTION,		// arg: source mask, data: attention report
+	TRACE_EVENT_END_BATCH,
+	TRACE_EVENT_REBIND,		// arg: device type after rebinding
+	TRACE_EVENT_CHECK_ABS,
+};
+
+struct trace_record {
+	unsigned char type;
+	unsigned char reserved;
+	unsigned short arg;
+	unsigned long start;		// us since the trace started
+	unsigned long duration;		// us spent in the call
+	long rc;
+	unsigned short len;
+};
+
+// Totals of the calls which reached the wrapped device
+struct trace_counters {
+	unsigned long reads;
+	unsigned long long readBytes;
+	unsigned long writes;
+	unsigned long long writeBytes;
+	unsigned long attentionWaits;
+	unsigned long attentionTimeouts;
+	unsigned long errors;
+};
+
+int trace_write_record(FILE *fp, const struct trace_record *record, const unsigned char *data);
+// Returns 1 when a record was read, 0 at the end of the file
+int trace_read_record(FILE *fp, struct trace_record *record, unsigned char *data,
+			unsigned short size);
+
+/*
+ * Passes every call through to another device and records it to a trace
+ * file, which ReplayDevice can play back. Enable the register cache on
+ * the TraceDevice rather than on the wrapped device so the trace only
+ * holds the transfers which reach the transport. The calls are counted
+ * whether or not a trace is being recorded.
+ */
+class TraceDevice : public RMIDevice
+{
+public:
+	TraceDevice(RMIDevice &device) : RMIDevice(), m_device(device), m_fp(NULL)
+	{
+		m_startTime.tv_sec = 0; m_startTime.tv_nsec = 0;
+		memset(&m_counters, 0, sizeof(m_counters));
+	}
+	int StartTrace(const char *filename);
+	void StopTrace();
+	const struct trace_counters &GetCounters() { return m_counters; }
+
+	virtual int Open(const char * filename);
+	virtual int Read(unsigned short addr, unsigned char *buf,
+				unsigned short len);
+	virtual int ReadFifo(unsigned short addr, unsigned char *buf,
+				unsigned short len);
+	virtual int Write(unsigned short addr, const unsigned char *buf,
+				 unsigned short len);
+	virtual int SetMode(int mode);
+	virtual int ToggleInterruptMask(bool enable);
+	virtual int WaitForAttention(struct timeval * timeout = NULL,
+					unsigned int source_mask = RMI_INTERUPT_SOURCES_ALL_MASK);
+	virtual int GetAttentionReport(struct timeval * timeout, unsigned int source_mask,
+					unsigned char *buf, unsigned int *len);
+	virtual void Close();
+	virtual void Cancel() { m_bCancel = true; m_device.Cancel(); }
+	virtual void BeginWriteBatch() { m_device.BeginWriteBatch(); }
+	virtual int EndWriteBatch();
+	virtual unsigned short GetMaxWriteSize() { return m_device.GetMaxWriteSize(); }
+	virtual void SetBytesPerReadRequest(int bytes)
+	{
+		RMIDevice::SetBytesPerReadRequest(bytes);
+		m_device.SetBytesPerReadRequest(bytes);
+	}
+	virtual void SetReadPipelineDepth(int depth)
+	{
+		RMIDevice::SetReadPipelineDepth(depth);
+		m_device.SetReadPipelineDepth(depth);
+	}
+	virtual void RebindDriver();
+	virtual bool CheckABSEvent();
+	virtual bool Reenumerate(int timeout_ms);
+	~TraceDevice() { Close(); StopTrace(); }
+
+	virtual void PrintDeviceInfo() { m_device.PrintDeviceInfo(); }
+
+	virtual bool FindDevice(enum RMIDeviceType type = RMI_DEVICE_TYPE_ANY);
+
+private:
+	RMIDevice &m_device;
+	FILE *m_fp;
+	struct timespec m_startTime;
+	struct trace_counters m_counters;
+
+	void Count(enum trace_event_type type, long rc, unsigned short len);
+	void Record(enum trace_event_type type, unsigned short arg, const struct timespec *start,
+			long rc, const unsigned char *data = NULL, unsigned short len = 0);
+	void RecordOpen(const struct timespec *start, long rc);
+};
+
+#endif /* _TRACEDEVICE_H_ */
@@ -0,0 +1,476 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#include "uringtransport.h"
+
+#if defined(IORING_OFF_SQ_RING) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING
+#endif
+
+#define URING_ENTRIES			64
+
+// The upper half of user_data says which kind of buffer a completion is for
+#define URING_TAG_READ			(1ULL << 32)
+#define URING_TAG_WRITE			(2ULL << 32)
+#define URING_TAG_CANCEL		(3ULL << 32)
+#define URING_TAG_MASK			(~0ULL << 32)
+
+UringTransport::UringTransport() : m_fd(-1), m_ringFd(-1),
+	m_sqRing(MAP_FAILED), m_cqRing(MAP_FAILED), m_sqRingSize(0), m_cqRingSize(0),
+	m_sqes(MAP_FAILED), m_sqesSize(0),
+	m_sqHead(NULL), m_sqTail(NULL), m_sqMask(NULL), m_sqArray(NULL), m_sqEntries(0),
+	m_cqHead(NULL), m_cqTail(NULL), m_cqMask(NULL), m_cqes(NULL),
+	m_buffers(NULL), m_inputReportSize(0), m_outputReportSize(0),
+	m_readyHead(0), m_readyCount(0), m_repostReads(0), m_postedReads(0), m_readError(0),
+	m_busyWrites(0), m_queuedWrites(0), m_inflightWrites(0), m_writeError(0)
+{}
+
+unsigned char *UringTransport::ReadBuffer(unsigned int slot)
+{
+	return m_buffers + slot * m_inputReportSize;
+}
+
+unsigned char *UringTransport::WriteBuffer(unsigned int slot)
+{
+	return m_buffers + URING_READ_SLOTS * m_inputReportSize + slot * m_outputReportSize;
+}
+
+#ifdef HAVE_IO_URING
+
+int UringTransport::Open(int fd, size_t inputReportSize, size_t outputReportSize)
+{
+	struct io_uring_params params;
+	struct iovec iov[URING_READ_SLOTS + URING_WRITE_SLOTS];
+	unsigned char *sq;
+	unsigned char *cq;
+	int err;
+
+	if (IsOpen())
+		return 0;
+
+	memset(&params, 0, sizeof(params));
+	m_ringFd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (m_ringFd < 0)
+		return -errno;
+
+	m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (m_cqRingSize > m_sqRingSize)
+			m_sqRingSize = m_cqRingSize;
+		m_cqRingSize = m_sqRingSize;
+	}
+
+	m_sqRing = mmap(NULL, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			m_ringFd, IORING_OFF_SQ_RING);
+	if (m_sqRing == MAP_FAILED)
+		goto error;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		m_cqRing = m_sqRing;
+	} else {
+		m_cqRing = mmap(NULL, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				m_ringFd, IORING_OFF_CQ_RING);
+		if (m_cqRing == MAP_FAILED)
+			goto error;
+	}
+
+	m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	m_sqes = mmap(NULL, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			m_ringFd, IORING_OFF_SQES);
+	if (m_sqes == MAP_FAILED)
+		goto error;
+
+	sq = (unsigned char *)m_sqRing;
+	m_sqHead = (unsigned int *)(sq + params.sq_off.head);
+	m_sqTail = (unsigned int *)(sq + params.sq_off.tail);
+	m_sqMask = (unsigned int *)(sq + params.sq_off.ring_mask);
+	m_sqArray = (unsigned int *)(sq + params.sq_off.array);
+	m_sqEntries = params.sq_entries;
+
+	cq = (unsigned char *)m_cqRing;
+	m_cqHead = (unsigned int *)(cq + params.cq_off.head);
+	m_cqTail = (unsigned int *)(cq + params.cq_off.tail);
+	m_cqMask = (unsigned int *)(cq + params.cq_off.ring_mask);
+	m_cqes = cq + params.cq_off.cqes;
+
+	m_inputReportSize = inputReportSize;
+	m_outputReportSize = outputReportSize;
+	m_buffers = new unsigned char[URING_READ_SLOTS * inputReportSize
+					+ URING_WRITE_SLOTS * outputReportSize]();
+
+	for (unsigned int i = 0; i < URING_READ_SLOTS; ++i) {
+		iov[i].iov_base = ReadBuffer(i);
+		iov[i].iov_len = m_inputReportSize;
+	}
+	for (unsigned int i = 0; i < URING_WRITE_SLOTS; ++i) {
+		iov[URING_READ_SLOTS + i].iov_base = WriteBuffer(i);
+		iov[URING_READ_SLOTS + i].iov_len = m_outputReportSize;
+	}
+
+	if (syscall(__NR_io_uring_register, m_ringFd, IORING_REGISTER_BUFFERS, iov,
+			URING_READ_SLOTS + URING_WRITE_SLOTS) < 0)
+		goto error;
+
+	m_fd = fd;
+	m_readyHead = 0;
+	m_readyCount = 0;
+	m_postedReads = 0;
+	m_readError = 0;
+	m_busyWrites = 0;
+	m_queuedWrites = 0;
+	m_inflightWrites = 0;
+	m_writeError = 0;
+
+	// Post every read slot on the first submit
+	m_repostReads = (1U << URING_READ_SLOTS) - 1;
+	err = Submit(false);
+	if (err) {
+		errno = -err;
+		goto error;
+	}
+
+	return 0;
+
+error:
+	err = errno;
+	Close();
+	return -err;
+}
+
+/*
+ * Cancels the reads which are still posted and reaps them along with the
+ * writes in flight, so the kernel is done with the registered buffers.
+ * Returns false if the ring failed before that could be confirmed.
+ */
+bool UringTransport::CancelReads()
+{
+	struct io_uring_sqe *sqes = (struct io_uring_sqe *)m_sqes;
+	struct io_uring_sqe *sqe;
+	unsigned int tail = *m_sqTail;
+	// Entries left over from a failed submit go in with the cancels
+	unsigned int toSubmit = tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+
+	Reap();
+
+	for (unsigned int slot = 0; slot < URING_READ_SLOTS; ++slot) {
+		unsigned int index = tail & *m_sqMask;
+
+		if (!(m_postedReads & (1U << slot)))
+			continue;
+
+		sqe = &sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = URING_TAG_READ | slot;
+		sqe->user_data = URING_TAG_CANCEL | slot;
+		m_sqArray[index] = index;
+		++tail;
+		++toSubmit;
+	}
+
+	if (toSubmit) {
+		__atomic_store_n(m_sqTail, tail, __ATOMIC_RELEASE);
+		if (Enter(toSubmit, 0))
+			return false;
+	}
+
+	// A read which already finished or cannot be cancelled still completes
+	Reap();
+	while (m_postedReads || m_inflightWrites) {
+		if (Enter(0, 1))
+			return false;
+		Reap();
+	}
+
+	return true;
+}
+
+void UringTransport::Close()
+{
+	bool buffersIdle = true;
+
+	if (m_sqes != MAP_FAILED && m_cqRing != MAP_FAILED && m_fd >= 0)
+		buffersIdle = CancelReads();
+
+	if (m_ringFd >= 0 && m_buffers && buffersIdle)
+		syscall(__NR_io_uring_register, m_ringFd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+
+	if (m_sqes != MAP_FAILED)
+		munmap(m_sqes, m_sqesSize);
+	if (m_cqRing != MAP_FAILED && m_cqRing != m_sqRing)
+		munmap(m_cqRing, m_cqRingSize);
+	if (m_sqRing != MAP_FAILED)
+		munmap(m_sqRing, m_sqRingSize);
+	if (m_ringFd >= 0)
+		close(m_ringFd);
+
+	m_sqes = MAP_FAILED;
+	m_cqRing = MAP_FAILED;
+	m_sqRing = MAP_FAILED;
+	m_ringFd = -1;
+	m_fd = -1;
+	m_postedReads = 0;
+	m_inflightWrites = 0;
+
+	// If the kernel may still write to the buffers, leak them rather
+	// than free memory a read could land in
+	if (buffersIdle)
+		delete[] m_buffers;
+	m_buffers = NULL;
+}
+
+int UringTransport::QueueWrite(const unsigned char *report, size_t len)
+{
+	unsigned int slot;
+	int rc;
+
+	if (!IsOpen() || len > m_outputReportSize)
+		return -EINVAL;
+
+	if (m_busyWrites == ~0U) {
+		rc = Submit(true);
+		if (rc)
+			return rc;
+	}
+
+	for (slot = 0; m_busyWrites & (1U << slot); ++slot)
+		;
+
+	memcpy(WriteBuffer(slot), report, len);
+	m_busyWrites |= 1U << slot;
+	m_pendingWrites[m_queuedWrites] = slot;
+	m_pendingWriteLen[m_queuedWrites] = len;
+	++m_queuedWrites;
+
+	return 0;
+}
+
+int UringTransport::Enter(unsigned int toSubmit, unsigned int minComplete)
+{
+	int rc;
+
+	for (;;) {
+		rc = syscall(__NR_io_uring_enter, m_ringFd, toSubmit, minComplete,
+				minComplete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if ((unsigned int)rc < toSubmit)
+			return -EIO;
+		return 0;
+	}
+}
+
+int UringTransport::Submit(bool wait)
+{
+	struct io_uring_sqe *sqes = (struct io_uring_sqe *)m_sqes;
+	struct io_uring_sqe *sqe;
+	unsigned int tail = *m_sqTail;
+	unsigned int toSubmit = 0;
+	int rc;
+
+	if (!IsOpen())
+		return -EINVAL;
+
+	// Writes go first as a single chain so that a read posted in between
+	// does not split it. A failed write cancels the rest of the chain.
+	for (unsigned int i = 0; i < m_queuedWrites; ++i) {
+		unsigned int slot = m_pendingWrites[i];
+		unsigned int index = tail & *m_sqMask;
+
+		sqe = &sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_WRITE_FIXED;
+		sqe->fd = m_fd;
+		sqe->addr = (uintptr_t)WriteBuffer(slot);
+		sqe->len = m_pendingWriteLen[i];
+		sqe->off = (uint64_t)-1;
+		sqe->buf_index = URING_READ_SLOTS + slot;
+		sqe->user_data = URING_TAG_WRITE | slot;
+		if (i + 1 < m_queuedWrites)
+			sqe->flags = IOSQE_IO_LINK;
+		m_sqArray[index] = index;
+		++tail;
+		++toSubmit;
+	}
+	m_inflightWrites += m_queuedWrites;
+	m_queuedWrites = 0;
+
+	for (unsigned int slot = 0; slot < URING_READ_SLOTS; ++slot) {
+		unsigned int index = tail & *m_sqMask;
+
+		if (!(m_repostReads & (1U << slot)))
+			continue;
+
+		sqe = &sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->fd = m_fd;
+		sqe->addr = (uintptr_t)ReadBuffer(slot);
+		sqe->len = m_inputReportSize;
+		sqe->off = (uint64_t)-1;
+		sqe->buf_index = slot;
+		sqe->user_data = URING_TAG_READ | slot;
+		m_sqArray[index] = index;
+		++tail;
+		++toSubmit;
+	}
+	m_postedReads |= m_repostReads;
+	m_repostReads = 0;
+
+	if (toSubmit) {
+		__atomic_store_n(m_sqTail, tail, __ATOMIC_RELEASE);
+		rc = Enter(toSubmit, wait && m_inflightWrites ? 1 : 0);
+		if (rc)
+			return rc;
+	}
+
+	Reap();
+	while (wait && m_inflightWrites) {
+		rc = Enter(0, 1);
+		if (rc)
+			return rc;
+		Reap();
+	}
+
+	rc = m_writeError;
+	m_writeError = 0;
+
+	return rc;
+}
+
+void UringTransport::Reap()
+{
+	struct io_uring_cqe *cqes = (struct io_uring_cqe *)m_cqes;
+	unsigned int head = *m_cqHead;
+	unsigned int tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; ++head) {
+		struct io_uring_cqe *cqe = &cqes[head & *m_cqMask];
+		unsigned int slot = cqe->user_data & ~URING_TAG_MASK;
+
+		if ((cqe->user_data & URING_TAG_MASK) == URING_TAG_CANCEL)
+			continue;
+
+		if ((cqe->user_data & URING_TAG_MASK) == URING_TAG_READ)
+			m_postedReads &= ~(1U << slot);
+		if ((cqe->user_data & URING_TAG_MASK) == URING_TAG_WRITE) {
+			m_busyWrites &= ~(1U << slot);
+			--m_inflightWrites;
+			// Keep the first error, the rest of the chain is cancelled
+			if (cqe->res < 0 && !m_writeError)
+				m_writeError = cqe->res;
+		} else if (cqe->res > 0) {
+			unsigned int last = (m_readyHead + m_readyCount) % URING_READ_SLOTS;
+
+			m_readyReads[last] = slot;
+			m_readyLen[last] = cqe->res;
+			++m_readyCount;
+		} else if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+			m_repostReads |= 1U << slot;
+		} else if (!m_readError) {
+			m_readError = cqe->res ? cqe->res : -EIO;
+		}
+	}
+
+	__atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+}
+
+int UringTransport::PopReport(unsigned char *report, size_t len)
+{
+	unsigned int slot;
+	int count;
+
+	if (!IsOpen())
+		return -EINVAL;
+
+	Reap();
+
+	if (!m_readyCount)
+		return m_readError;
+
+	slot = m_readyReads[m_readyHead];
+	count = m_readyLen[m_readyHead];
+	if ((size_t)count > len)
+		count = len;
+	memcpy(report, ReadBuffer(slot), count);
+
+	m_readyHead = (m_readyHead + 1) % URING_READ_SLOTS;
+	--m_readyCount;
+	m_repostReads |= 1U << slot;
+
+	return count;
+}
+
+#else
+
+int UringTransport::Open(int fd, size_t inputReportSize, size_t outputReportSize)
+{
+	return -ENOSYS;
+}
+
+void UringTransport::Close()
+{
+}
+
+int UringTransport::QueueWrite(const unsigned char *report, size_t len)
+{
+	return -ENOSYS;
+}
+
+int UringTransport::Submit(bool wait)
+{
+	return -ENOSYS;
+}
+
+int UringTransport::PopReport(unsigned char *report, size_t len)
+{
+	return -ENOSYS;
+}
+
+int UringTransport::Enter(unsigned int toSubmit, unsigned int minComplete)
+{
+	return -ENOSYS;
+}
+
+void UringTransport::Reap()
+{
+}
+
+bool UringTransport::CancelReads()
+{
+	return true;
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _URINGTRANSPORT_H_
+#define _URINGTRANSPORT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define URING_READ_SLOTS		8
+#define URING_WRITE_SLOTS		32
+
+/*
+ * Moves hidraw reports through an io_uring instead of one read() or write()
+ * syscall per report. Report buffers are registered with the kernel once.
+ * A fixed number of reads are kept posted on the device so input reports
+ * are collected without a syscall each. Output reports are queued and
+ * submitted together as one linked chain, which keeps them in order.
+ *
+ * The ring file descriptor becomes readable when completions are pending so
+ * it can be waited on with a WaitEngine in place of the hidraw descriptor.
+ * Open() fails with -ENOSYS when the kernel or build does not support
+ * io_uring and the caller should fall back to read() and write().
+ */
+class UringTransport
+{
+public:
+	UringTransport();
+	~UringTransport() { Close(); }
+
+	int Open(int fd, size_t inputReportSize, size_t outputReportSize);
+	void Close();
+	bool IsOpen() { return m_ringFd >= 0; }
+	int GetFd() { return m_ringFd; }
+
+	// Copy an output report into a registered buffer. It is not sent
+	// until Submit() is called.
+	int QueueWrite(const unsigned char *report, size_t len);
+
+	// Submit the queued output reports and post reads which have been
+	// consumed again. If wait is true, return once all output reports
+	// have completed. Returns a negative errno if a write failed.
+	int Submit(bool wait);
+
+	// Copy out the oldest input report. Returns the report length, 0 if
+	// no report has arrived or a negative errno if the reads failed.
+	int PopReport(unsigned char *report, size_t len);
+
+private:
+	int m_fd;
+	int m_ringFd;
+
+	void *m_sqRing;
+	void *m_cqRing;
+	size_t m_sqRingSize;
+	size_t m_cqRingSize;
+	void *m_sqes;
+	size_t m_sqesSize;
+
+	unsigned int *m_sqHead;
+	unsigned int *m_sqTail;
+	unsigned int *m_sqMask;
+	unsigned int *m_sqArray;
+	unsigned int m_sqEntries;
+	unsigned int *m_cqHead;
+	unsigned int *m_cqTail;
+	unsigned int *m_cqMask;
+	void *m_cqes;
+
+	unsigned char *m_buffers;
+	size_t m_inputReportSize;
+	size_t m_outputReportSize;
+
+	// Completed reads in the order the reports arrived
+	unsigned int m_readyReads[URING_READ_SLOTS];
+	int m_readyLen[URING_READ_SLOTS];
+	unsigned int m_readyHead;
+	unsigned int m_readyCount;
+	uint32_t m_repostReads;
+	uint32_t m_postedReads;
+	int m_readError;
+
+	uint32_t m_busyWrites;
+	unsigned int m_pendingWrites[URING_WRITE_SLOTS];
+	size_t m_pendingWriteLen[URING_WRITE_SLOTS];
+	unsigned int m_queuedWrites;
+	unsigned int m_inflightWrites;
+	int m_writeError;
+
+	unsigned char *ReadBuffer(unsigned int slot);
+	unsigned char *WriteBuffer(unsigned int slot);
+	int Enter(unsigned int toSubmit, unsigned int minComplete);
+	void Reap();
+	bool CancelReads();
+};
+
+#endif /* _URINGTRANSPORT_H_ */
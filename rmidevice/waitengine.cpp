@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "waitengine.h"
+
+#define WAIT_ENGINE_MAX_EVENTS		16
+
+int WaitEngine::Open()
+{
+	if (IsOpen())
+		return 0;
+
+	m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (m_epollFd < 0)
+		goto error;
+
+	m_cancelFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_cancelFd < 0)
+		goto error;
+
+	m_timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (m_timerFd < 0)
+		goto error;
+
+	if (AddFd(m_cancelFd) || AddFd(m_timerFd))
+		goto error;
+
+	return 0;
+
+error:
+	int err = errno;
+	Close();
+	return -err;
+}
+
+void WaitEngine::Close()
+{
+	if (m_timerFd >= 0)
+		close(m_timerFd);
+	if (m_cancelFd >= 0)
+		close(m_cancelFd);
+	if (m_epollFd >= 0)
+		close(m_epollFd);
+	m_timerFd = -1;
+	m_cancelFd = -1;
+	m_epollFd = -1;
+}
+
+int WaitEngine::AddFd(int fd)
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+
+	if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &event) < 0)
+		return -errno;
+
+	return 0;
+}
+
+int WaitEngine::RemoveFd(int fd)
+{
+	struct epoll_event event;
+
+	// Kernels before 2.6.9 require a non NULL event for EPOLL_CTL_DEL.
+	memset(&event, 0, sizeof(event));
+	if (epoll_ctl(m_epollFd, EPOLL_CTL_DEL, fd, &event) < 0)
+		return -errno;
+
+	return 0;
+}
+
+// The eventfd is deliberately not drained until a Wait() reports it
+void WaitEngine::Cancel()
+{
+	uint64_t val = 1;
+	ssize_t rc;
+
+	if (m_cancelFd < 0)
+		return;
+
+	rc = write(m_cancelFd, &val, sizeof(val));
+	(void)rc;
+}
+
+int WaitEngine::Wait(const struct timespec *deadline, int *readyFds, int maxReadyFds)
+{
+	struct epoll_event events[WAIT_ENGINE_MAX_EVENTS];
+	struct itimerspec timer;
+	uint64_t val;
+	int count;
+	int readyCount;
+	bool timedOut;
+	bool cancelled;
+	int i;
+
+	if (!IsOpen())
+		return -EBADF;
+
+	memset(&timer, 0, sizeof(timer));
+	if (deadline) {
+		timer.it_value = *deadline;
+		// A zero it_value disarms the timer instead of expiring at once.
+		if (!timer.it_value.tv_sec && !timer.it_value.tv_nsec)
+			timer.it_value.tv_nsec = 1;
+	}
+	if (timerfd_settime(m_timerFd, TFD_TIMER_ABSTIME, &timer, NULL) < 0)
+		return -errno;
+
+	for (;;) {
+		count = epoll_wait(m_epollFd, events, WAIT_ENGINE_MAX_EVENTS, -1);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		readyCount = 0;
+		timedOut = false;
+		cancelled = false;
+
+		for (i = 0; i < count; ++i) {
+			if (events[i].data.fd == m_cancelFd) {
+				if (read(m_cancelFd, &val, sizeof(val)) >= 0)
+					cancelled = true;
+			} else if (events[i].data.fd == m_timerFd) {
+				if (read(m_timerFd, &val, sizeof(val)) >= 0)
+					timedOut = true;
+			} else if (readyCount < maxReadyFds) {
+				readyFds[readyCount++] = events[i].data.fd;
+			}
+		}
+
+		if (cancelled)
+			return -ECANCELED;
+		if (readyCount)
+			return readyCount;
+		if (timedOut)
+			return -ETIMEDOUT;
+	}
+}
+
+void deadline_from_timeval(const struct timeval *timeout, struct timespec *deadline)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += timeout->tv_sec + timeout->tv_usec / 1000000;
+	deadline->tv_nsec += (timeout->tv_usec % 1000000) * 1000;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+void deadline_from_ms(int timeout_ms, struct timespec *deadline)
+{
+	struct timeval timeout;
+
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_usec = (timeout_ms % 1000) * 1000;
+	deadline_from_timeval(&timeout, deadline);
+}
+
+void deadline_remaining(const struct timespec *deadline, struct timeval *remaining)
+{
+	struct timespec now;
+	long long remaining_us;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	remaining_us = (deadline->tv_sec - now.tv_sec) * 1000000LL
+			+ (deadline->tv_nsec - now.tv_nsec) / 1000;
+	if (remaining_us < 0)
+		remaining_us = 0;
+
+	remaining->tv_sec = remaining_us / 1000000;
+	remaining->tv_usec = remaining_us % 1000000;
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2014 Andrew Duggan
+ * Copyright (C) 2014 Synaptics Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _WAITENGINE_H_
+#define _WAITENGINE_H_
+
+#include <time.h>
+#include <sys/time.h>
+
+/*
+ * Waits for any of a set of file descriptors to become readable using epoll.
+ * Deadlines are absolute CLOCK_MONOTONIC times enforced with a timerfd and
+ * Cancel() wakes the waiting thread through an eventfd. Cancel() is safe to
+ * call from a signal handler or another thread.
+ *
+ * A cancel is sticky: if no thread is waiting, the next Wait() returns
+ * -ECANCELED at once. This way a signal which arrives between two waits, or
+ * a reader thread which is stopped before it first waits, is not missed.
+ * The Wait() which returns -ECANCELED consumes every Cancel() made before
+ * it, and the one after that waits normally. Open() starts with no cancel
+ * pending.
+ */
+class WaitEngine
+{
+public:
+	WaitEngine() : m_epollFd(-1), m_cancelFd(-1), m_timerFd(-1) {}
+	~WaitEngine() { Close(); }
+
+	int Open();
+	void Close();
+	bool IsOpen() { return m_epollFd >= 0; }
+
+	int AddFd(int fd);
+	int RemoveFd(int fd);
+
+	/*
+	 * Returns the number of ready file descriptors stored in readyFds,
+	 * -ETIMEDOUT once the deadline passes, or -ECANCELED if Cancel() was
+	 * called since the last Wait() which returned it. A NULL deadline waits
+	 * forever.
+	 */
+	int Wait(const struct timespec *deadline, int *readyFds, int maxReadyFds);
+	void Cancel();
+
+private:
+	int m_epollFd;
+	int m_cancelFd;
+	int m_timerFd;
+};
+
+/* Deadline Functions */
+void deadline_from_timeval(const struct timeval *timeout, struct timespec *deadline);
+void deadline_from_ms(int timeout_ms, struct timespec *deadline);
+void deadline_remaining(const struct timespec *deadline, struct timeval *remaining);
+
+#endif /* _WAITENGINE_H_ */
@@ -34,6 +34,7 @@
 #include <stdlib.h>
 
 #include "hiddevice.h"
+#include "simdevice.h"
 
 #define RMI4UPDATE_GETOPTS      "hp:ir:w:foambd:ecnt:"
 
@@ -60,6 +61,7 @@ void print_help(const char *prog_name)
 	fprintf(stdout, "\t-h, --help\t\t\t\tPrint this message\n");
 	fprintf(stdout, "\t-d, --device\t\t\t\thidraw device file associated with the device.\n");
 	fprintf(stdout, "\t-p, --protocol [protocol]\t\tSet which transport prototocl to use.\n");
+	fprintf(stdout, "\t\t\t\t\t\t[hid or sim]. With sim, the device is a list of options.\n");
 	fprintf(stdout, "\t-i, --interactive\t\t\tRun in interactive mode.\n");
 	fprintf(stdout, "\t-r, --read [address] [length]\t\tRead registers starting at the address.\n");
 	fprintf(stdout, "\t-w, --write [address] [length] [data]\tWrite registers starting at the address.\n");
@@ -309,6 +311,8 @@ int main(int argc, char ** argv)
 
 	if (!strncasecmp("hid", protocol, 3)) {
 		device = new HIDDevice();
+	} else if (!strncasecmp("sim", protocol, 3)) {
+		device = new SimDevice();
 	} else {
 		fprintf(stderr, "Invalid Protocol: %s\n", protocol);
 		return -1;